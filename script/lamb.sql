@@ -119,3 +119,28 @@ CREATE TABLE taskqueue (
     argv varchar(255) NOT NULL,
     create_time timestamp without time zone NOT NULL
 );
+
+CREATE TABLE blacklist (
+    phone bigint NOT NULL
+);
+
+CREATE TABLE blacklist_log (
+    id bigserial PRIMARY KEY NOT NULL,
+    phone bigint NOT NULL,
+    op smallint NOT NULL,
+    create_time timestamp without time zone NOT NULL default now()::timestamp(0) without time zone
+);
+
+CREATE OR REPLACE FUNCTION blacklist_changelog() RETURNS trigger AS $$
+BEGIN
+    IF TG_OP = 'DELETE' THEN
+        INSERT INTO blacklist_log(phone, op) VALUES(OLD.phone, 0);
+        RETURN OLD;
+    END IF;
+    INSERT INTO blacklist_log(phone, op) VALUES(NEW.phone, 1);
+    RETURN NEW;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER blacklist_changelog AFTER INSERT OR DELETE ON blacklist
+    FOR EACH ROW EXECUTE PROCEDURE blacklist_changelog();
@@ -0,0 +1,72 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+/*
+ * A per thread bump allocator for unpacking protobuf messages. Memory
+ * is given back all at once when the last allocation is freed, which
+ * happens in free_unpacked. What doesn't fit the buffer comes from
+ * malloc. A message must be freed by the thread that unpacked it.
+ */
+
+static __thread lamb_arena_t arena;
+
+static void *lamb_arena_alloc(void *data, size_t size);
+static void lamb_arena_free(void *data, void *ptr);
+
+/* The functions work on the arena of the calling thread */
+static ProtobufCAllocator allocator = {
+    .alloc = lamb_arena_alloc,
+    .free = lamb_arena_free,
+    .allocator_data = NULL,
+};
+
+ProtobufCAllocator *lamb_arena(void) {
+    return &allocator;
+}
+
+static void *lamb_arena_alloc(void *data, size_t size) {
+    void *ptr;
+    lamb_arena_t *self;
+
+    self = &arena;
+
+    /* Keep every block aligned for any field type */
+    size = (size + sizeof(void *) * 2 - 1) & ~(sizeof(void *) * 2 - 1);
+
+    if (size == 0) {
+        size = sizeof(void *) * 2;
+    }
+
+    if (size > LAMB_ARENA_SIZE - self->used) {
+        return malloc(size);
+    }
+
+    ptr = self->data.buf + self->used;
+    self->used += size;
+    self->live++;
+
+    return ptr;
+}
+
+static void lamb_arena_free(void *data, void *ptr) {
+    lamb_arena_t *self;
+
+    self = &arena;
+
+    if ((uintptr_t)ptr < (uintptr_t)self->data.buf || (uintptr_t)ptr >= (uintptr_t)(self->data.buf + LAMB_ARENA_SIZE)) {
+        free(ptr);
+        return;
+    }
+
+    if (--self->live == 0) {
+        self->used = 0;
+    }
+
+    return;
+}
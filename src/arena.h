@@ -0,0 +1,30 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_ARENA_H
+#define _LAMB_ARENA_H
+
+#include <stddef.h>
+#include <protobuf-c/protobuf-c.h>
+
+#define LAMB_ARENA_SIZE 4096
+
+/* The union aligns the buffer for any field type a block may hold */
+typedef union {
+    char buf[LAMB_ARENA_SIZE];
+    long double ld;
+    long long ll;
+    void *ptr;
+} lamb_arena_buf_t;
+
+typedef struct {
+    size_t used;
+    int live;
+    lamb_arena_buf_t data;
+} lamb_arena_t;
+
+ProtobufCAllocator *lamb_arena(void);
+
+#endif
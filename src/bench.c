@@ -0,0 +1,432 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "common.h"
+#include "bench.h"
+
+/*
+ * Microbenchmarks of the hot path data structures. Each case prints
+ * its own table, run with -t to pick one, all cases run by default.
+ */
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int port = 5432;
+    char *test = NULL;
+    char *host = "127.0.0.1";
+    char *user = "postgres";
+    char *password = "";
+    char *dbname = "lamb";
+    char *file = "/tmp/lamb-bench.bitmap";
+    lamb_db_t db;
+
+    while ((opt = getopt(argc, argv, "t:h:p:u:w:d:f:")) != -1) {
+        switch (opt) {
+        case 't':
+            test = optarg;
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            user = optarg;
+            break;
+        case 'w':
+            password = optarg;
+            break;
+        case 'd':
+            dbname = optarg;
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t ring|template|keyword|bitmap|store] [-h host] [-p port] "
+                    "[-u user] [-w password] [-d dbname] [-f bitmap]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!test || strcmp(test, "ring") == 0) {
+        lamb_bench_ring();
+    }
+
+    if (!test || strcmp(test, "template") == 0) {
+        lamb_bench_template();
+    }
+
+    if (!test || strcmp(test, "keyword") == 0) {
+        lamb_bench_keyword();
+    }
+
+    if (!test || strcmp(test, "bitmap") == 0) {
+        lamb_bench_bitmap(file);
+    }
+
+    /* Writes to the message table, only run when asked for */
+    if (test && strcmp(test, "store") == 0) {
+        lamb_db_init(&db);
+        if (lamb_db_connect(&db, host, port, user, password, dbname) != 0) {
+            fprintf(stderr, "can't connect to database %s\n", host);
+            return 1;
+        }
+        lamb_bench_store(&db);
+        lamb_db_close(&db);
+    }
+
+    return 0;
+}
+
+/* Ring against the mutex list it replaced, one consumer drains both */
+void lamb_bench_ring(void) {
+    double ring, list;
+    lamb_bench_queue_t queue;
+
+    printf("%-10s %16s %16s %8s\n", "producers", "ring (op/s)", "list (op/s)", "ratio");
+
+    for (int producers = 1; producers <= LAMB_BENCH_PRODUCERS; producers <<= 1) {
+        memset(&queue, 0, sizeof(queue));
+        queue.count = LAMB_BENCH_ITEMS / producers;
+
+        queue.ring = lamb_ring_new(65536);
+        ring = lamb_bench_run(lamb_ring_producer, &queue, producers);
+        lamb_ring_destroy(queue.ring);
+        queue.ring = NULL;
+
+        queue.list = lamb_list_new();
+        list = lamb_bench_run(lamb_list_producer, &queue, producers);
+        lamb_list_destroy(queue.list);
+        queue.list = NULL;
+
+        printf("%-10d %16.0f %16.0f %8.2f\n", producers, ring, list, ring / list);
+    }
+
+    return;
+}
+
+void *lamb_ring_producer(void *arg) {
+    lamb_bench_queue_t *queue;
+
+    queue = (lamb_bench_queue_t *)arg;
+
+    for (long i = 1; i <= queue->count; i++) {
+        while (lamb_ring_push(queue->ring, (void *)i) != 0) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+void *lamb_list_producer(void *arg) {
+    lamb_bench_queue_t *queue;
+
+    queue = (lamb_bench_queue_t *)arg;
+
+    for (long i = 1; i <= queue->count; i++) {
+        lamb_list_rpush(queue->list, lamb_node_new((void *)i));
+    }
+
+    return NULL;
+}
+
+/* Returns the messages per second moved from producers to the consumer */
+double lamb_bench_run(void *(*producer)(void *), lamb_bench_queue_t *queue, int producers) {
+    long total, received;
+    lamb_node_t *node;
+    pthread_t tids[LAMB_BENCH_PRODUCERS];
+    unsigned long long start, end;
+
+    received = 0;
+    total = (long)queue->count * producers;
+    start = lamb_now_microsecond();
+
+    for (int i = 0; i < producers; i++) {
+        pthread_create(&tids[i], NULL, producer, queue);
+    }
+
+    while (received < total) {
+        if (queue->ring) {
+            if (lamb_ring_pop(queue->ring)) {
+                received++;
+            }
+            continue;
+        }
+
+        node = lamb_list_lpop(queue->list);
+        if (node) {
+            free(node);
+            received++;
+        }
+    }
+
+    end = lamb_now_microsecond();
+
+    for (int i = 0; i < producers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    return (double)total * 1000000.0 / (double)(end - start);
+}
+
+/*
+ * Signature index against compiling every template of the account for
+ * every message, the message matches the last template added.
+ */
+
+void lamb_bench_template(void) {
+    int len;
+    char pattern[640];
+    char content[256];
+    double indexed, linear;
+    lamb_template_t *t;
+    lamb_templates_t *templates;
+    unsigned long long start;
+    int sizes[] = {10, 100, 500};
+
+    printf("%-10s %16s %16s %8s\n", "templates", "index (msg/s)", "linear (msg/s)", "ratio");
+
+    for (int n = 0; n < sizeof(sizes) / sizeof(int); n++) {
+        templates = lamb_templates_new();
+        for (int i = 0; i < sizes[n]; i++) {
+            t = (lamb_template_t *)calloc(1, sizeof(lamb_template_t));
+            t->id = i;
+            snprintf(t->name, sizeof(t->name), "sign%d", i);
+            snprintf(t->content, sizeof(t->content), "your code is [0-9]{6}, valid for %d minutes", i);
+            lamb_templates_add(templates, t);
+        }
+
+        len = snprintf(content, sizeof(content), "【sign%d】your code is 123456, valid for %d minutes",
+                       sizes[n] - 1, sizes[n] - 1);
+
+        start = lamb_now_microsecond();
+        for (int i = 0; i < LAMB_BENCH_MESSAGES; i++) {
+            lamb_templates_match(templates, content, len);
+        }
+        indexed = LAMB_BENCH_MESSAGES * 1000000.0 / (lamb_now_microsecond() - start);
+
+        start = lamb_now_microsecond();
+        for (int i = 0; i < LAMB_BENCH_MESSAGES / 100; i++) {
+            for (int j = 0; j < sizes[n]; j++) {
+                snprintf(pattern, sizeof(pattern), "^【sign%d】your code is [0-9]{6}, valid for %d minutes$", j, j);
+                if (lamb_pcre_regular(pattern, content, len)) {
+                    break;
+                }
+            }
+        }
+        linear = LAMB_BENCH_MESSAGES / 100 * 1000000.0 / (lamb_now_microsecond() - start);
+
+        printf("%-10d %16.0f %16.0f %8.2f\n", sizes[n], indexed, linear, indexed / linear);
+        lamb_templates_destroy(templates);
+    }
+
+    return;
+}
+
+/*
+ * Automaton against a strstr per keyword. The message contains none of
+ * the keywords, which is the common case and the one where every
+ * keyword has to be tried.
+ */
+
+void lamb_bench_keyword(void) {
+    int len;
+    double automaton, linear;
+    char word[32];
+    char *content;
+    lamb_list_t *keys;
+    lamb_node_t *node;
+    lamb_keyword_t *key;
+    lamb_keywords_t *keywords;
+    unsigned long long start;
+    int sizes[] = {1000, 10000, 50000};
+    const char *syllables[] = {"\xe4\xbb\xa3", "\xe5\x8a\x9e", "\xe5\x8f\x91", "\xe7\xa5\xa8",
+                               "\xe8\xb4\xb7", "\xe6\xac\xbe", "vip", "xx"};
+
+    content = "\xe3\x80\x90\xe6\x9f\x90\xe9\x93\xb6\xe8\xa1\x8c\xe3\x80\x91"
+        "your verification code is 204816, it is valid for 5 minutes, do not tell it to anyone. "
+        "reply TD to unsubscribe";
+    len = strlen(content);
+
+    printf("%-10s %18s %16s %8s\n", "keywords", "automaton (msg/s)", "strstr (msg/s)", "ratio");
+
+    for (int n = 0; n < sizeof(sizes) / sizeof(int); n++) {
+        srand(n + 1);
+        keys = lamb_list_new();
+
+        for (int i = 0; i < sizes[n]; i++) {
+            word[0] = '\0';
+            for (int j = 2 + rand() % 3; j > 0; j--) {
+                strcat(word, syllables[rand() % (sizeof(syllables) / sizeof(char *))]);
+            }
+
+            key = (lamb_keyword_t *)malloc(sizeof(lamb_keyword_t));
+            key->id = i;
+            key->val = lamb_strdup(word);
+            lamb_list_rpush(keys, lamb_node_new(key));
+        }
+
+        keywords = lamb_keywords_new(keys);
+
+        start = lamb_now_microsecond();
+        for (int i = 0; i < LAMB_BENCH_MESSAGES; i++) {
+            lamb_keywords_match(keywords, content, len);
+        }
+        automaton = LAMB_BENCH_MESSAGES * 1000000.0 / (lamb_now_microsecond() - start);
+
+        start = lamb_now_microsecond();
+        for (int i = 0; i < LAMB_BENCH_MESSAGES / 100; i++) {
+            for (node = keys->head; node; node = node->next) {
+                if (strstr(content, ((lamb_keyword_t *)node->val)->val)) {
+                    break;
+                }
+            }
+        }
+        linear = LAMB_BENCH_MESSAGES / 100 * 1000000.0 / (lamb_now_microsecond() - start);
+
+        printf("%-10d %18.0f %16.0f %8.2f\n", sizes[n], automaton, linear, automaton / linear);
+
+        for (node = keys->head; node; node = node->next) {
+            free(((lamb_keyword_t *)node->val)->val);
+            free(node->val);
+        }
+
+        lamb_list_destroy(keys);
+        lamb_keywords_destroy(keywords);
+    }
+
+    return;
+}
+
+/*
+ * COPY batches against one INSERT per row, the old write path. The
+ * rows get ids above any real message and are deleted afterwards, run
+ * it against a scratch database all the same.
+ */
+
+void lamb_bench_store(lamb_db_t *db) {
+    char sql[512];
+    double copy, insert;
+    lamb_submit_t *messages;
+    unsigned long long base, start;
+    void *items[LAMB_STORE_BATCH];
+    PGresult *res;
+
+    messages = (lamb_submit_t *)calloc(LAMB_BENCH_ROWS * 2, sizeof(lamb_submit_t));
+    if (!messages) {
+        return;
+    }
+
+    base = 9000000000000000000ULL;
+
+    for (int i = 0; i < LAMB_BENCH_ROWS * 2; i++) {
+        messages[i].type = LAMB_SUBMIT;
+        messages[i].id = base + i;
+        messages[i].account = 1;
+        messages[i].company = 1;
+        strcpy(messages[i].spid, "901234");
+        strcpy(messages[i].spcode, "10690001");
+        snprintf(messages[i].phone, sizeof(messages[i].phone), "138%08d", i);
+        messages[i].length = snprintf(messages[i].content, sizeof(messages[i].content),
+                                      "your verification code is %06d", i);
+    }
+
+    start = lamb_now_microsecond();
+    for (int i = 0; i < LAMB_BENCH_ROWS; i += LAMB_STORE_BATCH) {
+        int n = (LAMB_BENCH_ROWS - i < LAMB_STORE_BATCH) ? LAMB_BENCH_ROWS - i : LAMB_STORE_BATCH;
+        for (int j = 0; j < n; j++) {
+            items[j] = &messages[i + j];
+        }
+        lamb_store_write(db, LAMB_SUBMIT, items, n);
+    }
+    copy = LAMB_BENCH_ROWS * 1000000.0 / (lamb_now_microsecond() - start);
+
+    start = lamb_now_microsecond();
+    for (int i = LAMB_BENCH_ROWS; i < LAMB_BENCH_ROWS * 2; i++) {
+        snprintf(sql, sizeof(sql), "INSERT INTO message(id, spid, spcode, phone, content, status, account, company) "
+                 "VALUES(%lld, '%s', '%s', '%s', '%s', %d, %d, %d)", (long long)messages[i].id, messages[i].spid,
+                 messages[i].spcode, messages[i].phone, messages[i].content, 0, messages[i].account,
+                 messages[i].company);
+        res = PQexec(db->conn, sql);
+        PQclear(res);
+    }
+    insert = LAMB_BENCH_ROWS * 1000000.0 / (lamb_now_microsecond() - start);
+
+    printf("%-10s %16s %16s %8s\n", "rows", "copy (row/s)", "insert (row/s)", "ratio");
+    printf("%-10d %16.0f %16.0f %8.2f\n", LAMB_BENCH_ROWS, copy, insert, copy / insert);
+
+    snprintf(sql, sizeof(sql), "DELETE FROM message WHERE id >= %lld", (long long)base);
+    res = PQexec(db->conn, sql);
+    PQclear(res);
+
+    free(messages);
+
+    return;
+}
+
+/*
+ * Blacklist lookups from a read only mapping, as the servers see it.
+ * The file is sparse, only the pages of the numbers set are written.
+ */
+
+void lamb_bench_bitmap(const char *file) {
+    int hits;
+    double set, test;
+    unsigned long long phone;
+    unsigned long long start;
+    lamb_bitmap_t *bitmap;
+
+    unlink(file);
+
+    bitmap = lamb_bitmap_open(file, true);
+    if (!bitmap) {
+        fprintf(stderr, "can't create bitmap %s\n", file);
+        return;
+    }
+
+    srand(1);
+    start = lamb_now_microsecond();
+    for (int i = 0; i < LAMB_BENCH_PHONES; i++) {
+        phone = 13000000000ULL + ((unsigned long long)rand() * 7919) % 1000000000ULL;
+        lamb_bitmap_set(bitmap, phone);
+    }
+    set = LAMB_BENCH_PHONES * 1000000.0 / (lamb_now_microsecond() - start);
+    lamb_bitmap_loaded(bitmap, 0);
+    lamb_bitmap_close(bitmap);
+
+    bitmap = lamb_bitmap_open(file, false);
+    if (!bitmap) {
+        fprintf(stderr, "can't open bitmap %s\n", file);
+        unlink(file);
+        return;
+    }
+
+    hits = 0;
+    start = lamb_now_microsecond();
+    for (int i = 0; i < LAMB_BENCH_PROBES; i++) {
+        phone = 13000000000ULL + ((unsigned long long)rand() * 7919) % 1000000000ULL;
+        hits += lamb_bitmap_test(bitmap, phone);
+    }
+    test = LAMB_BENCH_PROBES * 1000000.0 / (lamb_now_microsecond() - start);
+
+    printf("%-10s %16s %16s %8s\n", "numbers", "set (op/s)", "test (op/s)", "hits");
+    printf("%-10d %16.0f %16.0f %8d\n", LAMB_BENCH_PHONES, set, test, hits);
+
+    lamb_bitmap_close(bitmap);
+    unlink(file);
+
+    return;
+}
@@ -0,0 +1,38 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_BENCH_H
+#define _LAMB_BENCH_H
+
+#include "ring.h"
+#include "list.h"
+#include "template.h"
+#include "keyword.h"
+#include "storage.h"
+#include "bitmap.h"
+
+#define LAMB_BENCH_ITEMS     4000000
+#define LAMB_BENCH_PRODUCERS 16
+#define LAMB_BENCH_MESSAGES  20000
+#define LAMB_BENCH_ROWS      20000
+#define LAMB_BENCH_PHONES    1000000
+#define LAMB_BENCH_PROBES    20000000
+
+typedef struct {
+    int count;
+    lamb_ring_t *ring;
+    lamb_list_t *list;
+} lamb_bench_queue_t;
+
+void lamb_bench_ring(void);
+void *lamb_ring_producer(void *arg);
+void *lamb_list_producer(void *arg);
+double lamb_bench_run(void *(*producer)(void *), lamb_bench_queue_t *queue, int producers);
+void lamb_bench_template(void);
+void lamb_bench_keyword(void);
+void lamb_bench_store(lamb_db_t *db);
+void lamb_bench_bitmap(const char *file);
+
+#endif
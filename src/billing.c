@@ -0,0 +1,388 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include "billing.h"
+
+/*
+ * Move up to ARGV[1] units from the company balance into the lease of
+ * this server, or give units back when ARGV[1] is negative. ARGV[2] is
+ * the intent sequence, a replayed intent returns its original result.
+ */
+
+#define LAMB_LEASE_SCRIPT "local s = tonumber(redis.call('HGET', KEYS[2], 'seq') or '0') " \
+    "if s >= tonumber(ARGV[2]) then return tonumber(redis.call('HGET', KEYS[2], 'granted') or '0') end " \
+    "local n = tonumber(ARGV[1]) " \
+    "if n > 0 then local m = tonumber(redis.call('HGET', KEYS[1], 'money') or '0') " \
+    "if n > m then n = math.max(m, 0) end end " \
+    "redis.call('HINCRBY', KEYS[1], 'money', -n) " \
+    "redis.call('HMSET', KEYS[2], 'seq', ARGV[2], 'granted', n) return n"
+
+static unsigned int lamb_intent_checksum(lamb_intent_t *intent);
+static int lamb_intent_write(lamb_billing_t *billing);
+static int lamb_intent_settle(lamb_billing_t *billing, lamb_cache_t *cache);
+static int lamb_lease_exec(lamb_billing_t *billing, lamb_cache_t *cache, long long amount);
+static int lamb_lease_eval(lamb_billing_t *billing, lamb_cache_t *cache, long long *granted);
+static void lamb_lease_apply(lamb_billing_t *billing, long long granted);
+static int lamb_lease_return(lamb_billing_t *billing, lamb_cache_t *cache);
+
+/*
+ * Open the intent log. The floor recorded by the last run is credit that
+ * was certainly not spent, it is carried over as local credit. A lease
+ * operation left pending is replayed by the first renew.
+ */
+
+lamb_billing_t *lamb_billing_open(const char *file, int id, long long size) {
+    ssize_t n;
+    lamb_billing_t *self;
+
+    if (size < 1) {
+        return NULL;
+    }
+
+    self = (lamb_billing_t *)calloc(1, sizeof(lamb_billing_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (self->fd == -1) {
+        free(self);
+        return NULL;
+    }
+
+    n = pread(self->fd, &self->intent, sizeof(lamb_intent_t), 0);
+
+    if (n != sizeof(lamb_intent_t) || self->intent.magic != LAMB_BILLING_MAGIC ||
+        self->intent.floor < 0 || self->intent.checksum != lamb_intent_checksum(&self->intent)) {
+        memset(&self->intent, 0, sizeof(lamb_intent_t));
+    }
+
+    self->id = id;
+    self->size = size;
+    self->company = self->intent.company;
+    self->credit = self->intent.floor;
+    self->floor = self->intent.floor;
+    self->doubt = true;
+
+    return self;
+}
+
+/* Take units from the local credit, -1 when the lease is exhausted */
+int lamb_billing_spend(lamb_billing_t *billing, long long units) {
+    long long credit;
+
+    credit = __atomic_load_n(&billing->credit, __ATOMIC_ACQUIRE);
+
+    do {
+        /* Never spend below the floor recorded on disk */
+        if (credit - units < __atomic_load_n(&billing->floor, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&billing->credit, &credit, credit - units, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return 0;
+}
+
+void lamb_billing_refund(lamb_billing_t *billing, long long units) {
+    __atomic_add_fetch(&billing->credit, units, __ATOMIC_ACQ_REL);
+    return;
+}
+
+long long lamb_billing_credit(lamb_billing_t *billing) {
+    return __atomic_load_n(&billing->credit, __ATOMIC_ACQUIRE);
+}
+
+/* True when the lease or the spendable part above the floor runs low */
+bool lamb_billing_low(lamb_billing_t *billing) {
+    long long credit, floor;
+
+    credit = __atomic_load_n(&billing->credit, __ATOMIC_ACQUIRE);
+    floor = __atomic_load_n(&billing->floor, __ATOMIC_ACQUIRE);
+
+    if (credit < billing->size / 2) {
+        return true;
+    }
+
+    return floor > 0 && (credit - floor) < (billing->size / 4);
+}
+
+/*
+ * Top the lease up to its size and lower the floor so that spending can
+ * continue. Credit leased for another company is returned first. Only
+ * one thread at a time may renew or release, serialized by cache->lock.
+ */
+
+int lamb_billing_renew(lamb_billing_t *billing, lamb_cache_t *cache, int company) {
+    long long credit, floor, chunk;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (lamb_intent_settle(billing, cache) != 0) {
+        goto error;
+    }
+
+    if (billing->company != company) {
+        if (lamb_lease_return(billing, cache) != 0) {
+            goto error;
+        }
+        billing->company = company;
+    }
+
+    /* Lower the floor one chunk at a time, on disk before in memory */
+    chunk = (billing->size / 4 > 0) ? billing->size / 4 : 1;
+    credit = __atomic_load_n(&billing->credit, __ATOMIC_ACQUIRE);
+    floor = billing->floor;
+
+    if (floor > 0 && (credit - floor) < chunk) {
+        floor = (credit - chunk > 0) ? credit - chunk : 0;
+        billing->intent.floor = floor;
+
+        if (lamb_intent_write(billing) != 0) {
+            syslog(LOG_ERR, "can't write billing intent log");
+            goto error;
+        }
+
+        __atomic_store_n(&billing->floor, floor, __ATOMIC_RELEASE);
+    }
+
+    credit = __atomic_load_n(&billing->credit, __ATOMIC_ACQUIRE);
+
+    if (credit < billing->size / 2) {
+        if (lamb_lease_exec(billing, cache, billing->size - credit) != 0) {
+            goto error;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+
+error:
+    if (cache->handle->err) {
+        redisReconnect(cache->handle);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return -1;
+}
+
+/* Give the unspent credit back to the company balance */
+int lamb_billing_release(lamb_billing_t *billing, lamb_cache_t *cache) {
+    int err;
+
+    pthread_mutex_lock(&cache->lock);
+
+    err = lamb_intent_settle(billing, cache);
+
+    if (err == 0) {
+        err = lamb_lease_return(billing, cache);
+    }
+
+    if (err && cache->handle->err) {
+        redisReconnect(cache->handle);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return err;
+}
+
+void lamb_billing_close(lamb_billing_t *billing) {
+    if (billing) {
+        close(billing->fd);
+        free(billing);
+    }
+
+    return;
+}
+
+static unsigned int lamb_intent_checksum(lamb_intent_t *intent) {
+    unsigned int hash = 2166136261U;
+    unsigned long long vals[5];
+
+    vals[0] = (unsigned long long)intent->company;
+    vals[1] = (unsigned long long)intent->pending;
+    vals[2] = intent->sequence;
+    vals[3] = (unsigned long long)intent->amount;
+    vals[4] = (unsigned long long)intent->floor;
+
+    for (size_t i = 0; i < sizeof(vals); i++) {
+        hash ^= ((unsigned char *)vals)[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static int lamb_intent_write(lamb_billing_t *billing) {
+    billing->intent.magic = LAMB_BILLING_MAGIC;
+    billing->intent.checksum = lamb_intent_checksum(&billing->intent);
+
+    if (pwrite(billing->fd, &billing->intent, sizeof(lamb_intent_t), 0) != sizeof(lamb_intent_t)) {
+        return -1;
+    }
+
+    if (fdatasync(billing->fd) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve a lease operation whose outcome is unknown, after a crash or
+ * a lost reply. The script returns the original result of a sequence it
+ * has already seen, so replaying the intent applies it exactly once.
+ * Without a pending intent the sequence is synced with redis instead.
+ */
+
+static int lamb_intent_settle(lamb_billing_t *billing, lamb_cache_t *cache) {
+    long long granted;
+    unsigned long long sequence;
+    redisReply *reply = NULL;
+
+    if (!billing->doubt) {
+        return 0;
+    }
+
+    if (billing->intent.pending) {
+        if (lamb_lease_eval(billing, cache, &granted) != 0) {
+            return -1;
+        }
+
+        lamb_lease_apply(billing, granted);
+        billing->doubt = false;
+
+        return 0;
+    }
+
+    reply = redisCommand(cache->handle, "HGET lease.%d seq", billing->id);
+
+    if (!reply) {
+        return -1;
+    }
+
+    if (reply->type == REDIS_REPLY_STRING) {
+        sequence = strtoull(reply->str, NULL, 10);
+    } else if (reply->type == REDIS_REPLY_NIL) {
+        sequence = 0;
+    } else {
+        freeReplyObject(reply);
+        return -1;
+    }
+
+    freeReplyObject(reply);
+
+    if (sequence > billing->intent.sequence) {
+        billing->intent.sequence = sequence;
+    }
+
+    billing->doubt = false;
+
+    return 0;
+}
+
+static int lamb_lease_exec(lamb_billing_t *billing, lamb_cache_t *cache, long long amount) {
+    long long granted;
+    lamb_intent_t saved;
+
+    saved = billing->intent;
+    billing->intent.company = billing->company;
+    billing->intent.pending = 1;
+    billing->intent.sequence++;
+    billing->intent.amount = amount;
+    billing->intent.floor = billing->floor;
+
+    if (lamb_intent_write(billing) != 0) {
+        syslog(LOG_ERR, "can't write billing intent log");
+        billing->intent = saved;
+        return -1;
+    }
+
+    billing->doubt = true;
+
+    if (lamb_lease_eval(billing, cache, &granted) != 0) {
+        return -1;
+    }
+
+    lamb_lease_apply(billing, granted);
+    billing->doubt = false;
+
+    return 0;
+}
+
+static int lamb_lease_eval(lamb_billing_t *billing, lamb_cache_t *cache, long long *granted) {
+    redisReply *reply = NULL;
+
+    reply = redisCommand(cache->handle, "EVAL %s 2 company.%d lease.%d %lld %llu", LAMB_LEASE_SCRIPT,
+                         billing->intent.company, billing->id, billing->intent.amount,
+                         billing->intent.sequence);
+
+    if (!reply) {
+        return -1;
+    }
+
+    if (reply->type != REDIS_REPLY_INTEGER) {
+        freeReplyObject(reply);
+        return -1;
+    }
+
+    *granted = reply->integer;
+    freeReplyObject(reply);
+
+    return 0;
+}
+
+/* Account a completed lease operation and record it as done */
+static void lamb_lease_apply(lamb_billing_t *billing, long long granted) {
+    if (billing->intent.amount > 0 && granted > 0) {
+        __atomic_add_fetch(&billing->credit, granted, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&billing->floor, granted, __ATOMIC_ACQ_REL);
+    }
+
+    billing->intent.pending = 0;
+    billing->intent.floor = billing->floor;
+
+    if (lamb_intent_write(billing) != 0) {
+        syslog(LOG_ERR, "can't write billing intent log");
+    }
+
+    return;
+}
+
+/*
+ * Stop spending by taking the whole credit, then return it. When the
+ * return fails the intent stays pending and is settled by the next call.
+ */
+
+static int lamb_lease_return(lamb_billing_t *billing, lamb_cache_t *cache) {
+    long long credit;
+
+    credit = __atomic_exchange_n(&billing->credit, 0, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&billing->floor, 0, __ATOMIC_RELEASE);
+
+    if (credit < 1) {
+        return 0;
+    }
+
+    if (lamb_lease_exec(billing, cache, -credit) != 0) {
+        /* Nothing was sent, keep spending under the floor on disk */
+        if (!billing->doubt) {
+            __atomic_store_n(&billing->floor, billing->intent.floor, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&billing->credit, credit, __ATOMIC_ACQ_REL);
+        }
+        return -1;
+    }
+
+    return 0;
+}
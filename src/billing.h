@@ -0,0 +1,44 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_BILLING_H
+#define _LAMB_BILLING_H
+
+#include <stdbool.h>
+#include "cache.h"
+
+#define LAMB_BILLING_MAGIC 0x4c424c4c
+
+typedef struct {
+    unsigned int magic;
+    int company;
+    int pending;
+    unsigned long long sequence;
+    long long amount;
+    long long floor;
+    unsigned int checksum;
+} lamb_intent_t;
+
+typedef struct {
+    int id;
+    int fd;
+    int company;
+    long long size;
+    long long credit;
+    long long floor;
+    bool doubt;
+    lamb_intent_t intent;
+} lamb_billing_t;
+
+lamb_billing_t *lamb_billing_open(const char *file, int id, long long size);
+int lamb_billing_spend(lamb_billing_t *billing, long long units);
+void lamb_billing_refund(lamb_billing_t *billing, long long units);
+long long lamb_billing_credit(lamb_billing_t *billing);
+bool lamb_billing_low(lamb_billing_t *billing);
+int lamb_billing_renew(lamb_billing_t *billing, lamb_cache_t *cache, int company);
+int lamb_billing_release(lamb_billing_t *billing, lamb_cache_t *cache);
+void lamb_billing_close(lamb_billing_t *billing);
+
+#endif
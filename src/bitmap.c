@@ -0,0 +1,171 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bitmap.h"
+
+/* Open or, for the writer, create the bitmap file */
+lamb_bitmap_t *lamb_bitmap_open(const char *file, bool writable) {
+    void *addr;
+    struct stat st;
+    lamb_bitmap_t *self;
+
+    self = (lamb_bitmap_t *)calloc(1, sizeof(lamb_bitmap_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->writable = writable;
+    self->size = LAMB_BITMAP_HEAD + (LAMB_BITMAP_MAX - LAMB_BITMAP_MIN) / 8 + 1;
+    self->fd = open(file, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+
+    if (self->fd == -1) {
+        free(self);
+        return NULL;
+    }
+
+    if (fstat(self->fd, &st) == -1) {
+        goto error;
+    }
+
+    if (st.st_size != self->size) {
+        /* A new file is sparse, unused prefixes never reach the disk */
+        if (!writable || st.st_size != 0 || ftruncate(self->fd, self->size) == -1) {
+            goto error;
+        }
+    }
+
+    addr = mmap(NULL, self->size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                MAP_SHARED, self->fd, 0);
+
+    if (addr == MAP_FAILED) {
+        goto error;
+    }
+
+    self->head = (lamb_bitmap_head_t *)addr;
+    self->bits = (unsigned char *)addr + LAMB_BITMAP_HEAD;
+
+    if (self->head->magic != LAMB_BITMAP_MAGIC) {
+        if (!writable || st.st_size != 0) {
+            munmap(addr, self->size);
+            goto error;
+        }
+        self->head->magic = LAMB_BITMAP_MAGIC;
+    }
+
+    /* A bitmap still being loaded would let blacklisted numbers through */
+    if (!writable && !__atomic_load_n(&self->head->loaded, __ATOMIC_ACQUIRE)) {
+        munmap(addr, self->size);
+        goto error;
+    }
+
+    return self;
+
+error:
+    close(self->fd);
+    free(self);
+    return NULL;
+}
+
+bool lamb_bitmap_test(lamb_bitmap_t *bitmap, unsigned long long phone) {
+    unsigned long long bit;
+
+    if (phone < LAMB_BITMAP_MIN || phone > LAMB_BITMAP_MAX) {
+        return false;
+    }
+
+    bit = phone - LAMB_BITMAP_MIN;
+
+    return (__atomic_load_n(&bitmap->bits[bit >> 3], __ATOMIC_RELAXED) >> (bit & 7)) & 1;
+}
+
+int lamb_bitmap_set(lamb_bitmap_t *bitmap, unsigned long long phone) {
+    unsigned char mask, old;
+    unsigned long long bit;
+
+    if (!bitmap->writable || phone < LAMB_BITMAP_MIN || phone > LAMB_BITMAP_MAX) {
+        return -1;
+    }
+
+    bit = phone - LAMB_BITMAP_MIN;
+    mask = 1 << (bit & 7);
+    old = __atomic_fetch_or(&bitmap->bits[bit >> 3], mask, __ATOMIC_RELAXED);
+
+    if (!(old & mask)) {
+        __atomic_add_fetch(&bitmap->head->count, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+int lamb_bitmap_clear(lamb_bitmap_t *bitmap, unsigned long long phone) {
+    unsigned char mask, old;
+    unsigned long long bit;
+
+    if (!bitmap->writable || phone < LAMB_BITMAP_MIN || phone > LAMB_BITMAP_MAX) {
+        return -1;
+    }
+
+    bit = phone - LAMB_BITMAP_MIN;
+    mask = 1 << (bit & 7);
+    old = __atomic_fetch_and(&bitmap->bits[bit >> 3], (unsigned char)~mask, __ATOMIC_RELAXED);
+
+    if (old & mask) {
+        __atomic_sub_fetch(&bitmap->head->count, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+/* Clear every bit before a full load, the file becomes sparse again */
+int lamb_bitmap_reset(lamb_bitmap_t *bitmap) {
+    if (!bitmap->writable) {
+        return -1;
+    }
+
+    if (ftruncate(bitmap->fd, LAMB_BITMAP_HEAD) == -1 || ftruncate(bitmap->fd, bitmap->size) == -1) {
+        return -1;
+    }
+
+    bitmap->head->sequence = 0;
+    bitmap->head->count = 0;
+
+    return 0;
+}
+
+/* A full copy is in, readers may open the bitmap from now on */
+void lamb_bitmap_loaded(lamb_bitmap_t *bitmap, unsigned long long sequence) {
+    bitmap->head->sequence = sequence;
+    msync(bitmap->head, bitmap->size, MS_SYNC);
+    __atomic_store_n(&bitmap->head->loaded, 1, __ATOMIC_RELEASE);
+    msync(bitmap->head, LAMB_BITMAP_HEAD, MS_SYNC);
+
+    return;
+}
+
+/* Flush dirty pages so a restarted writer resumes from sequence */
+void lamb_bitmap_sync(lamb_bitmap_t *bitmap) {
+    if (bitmap->writable) {
+        msync(bitmap->head, bitmap->size, MS_ASYNC);
+    }
+
+    return;
+}
+
+void lamb_bitmap_close(lamb_bitmap_t *bitmap) {
+    if (bitmap) {
+        munmap(bitmap->head, bitmap->size);
+        close(bitmap->fd);
+        free(bitmap);
+    }
+
+    return;
+}
@@ -0,0 +1,49 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_BITMAP_H
+#define _LAMB_BITMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LAMB_BITMAP_MAGIC 0x31504d424d414cULL
+#define LAMB_BITMAP_HEAD  4096
+#define LAMB_BITMAP_MIN   10000000000ULL
+#define LAMB_BITMAP_MAX   19999999999ULL
+
+typedef struct {
+    unsigned long long magic;
+    unsigned long long sequence;
+    unsigned long long count;
+    unsigned long long loaded;
+} lamb_bitmap_head_t;
+
+/*
+ * One bit per mainland mobile number, 1XXXXXXXXXX, kept in a sparse
+ * file shared between processes. Only the pages of the prefixes in
+ * use take disk and memory. The writer records in sequence the last
+ * changelog entry applied. Readers only open a bitmap marked loaded,
+ * which the writer does once a full copy of the table is in.
+ */
+
+typedef struct {
+    int fd;
+    bool writable;
+    size_t size;
+    lamb_bitmap_head_t *head;
+    unsigned char *bits;
+} lamb_bitmap_t;
+
+lamb_bitmap_t *lamb_bitmap_open(const char *file, bool writable);
+bool lamb_bitmap_test(lamb_bitmap_t *bitmap, unsigned long long phone);
+int lamb_bitmap_set(lamb_bitmap_t *bitmap, unsigned long long phone);
+int lamb_bitmap_clear(lamb_bitmap_t *bitmap, unsigned long long phone);
+int lamb_bitmap_reset(lamb_bitmap_t *bitmap);
+void lamb_bitmap_loaded(lamb_bitmap_t *bitmap, unsigned long long sequence);
+void lamb_bitmap_sync(lamb_bitmap_t *bitmap);
+void lamb_bitmap_close(lamb_bitmap_t *bitmap);
+
+#endif
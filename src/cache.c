@@ -171,3 +171,126 @@ int lamb_nodes_connect(lamb_caches_t *cache, int len, char *nodes[], int size, i
 
     return 0;
 }
+
+/*
+ * Send count formatted commands, command i to node keys[i] % len, and
+ * store their integer replies in results, -1 when there is none.
+ */
+
+void lamb_nodes_pipeline(lamb_caches_t *cache, int count, unsigned long *keys, char **cmds,
+                         int *lens, long long *results) {
+    redisReply **replies;
+
+    for (int i = 0; i < count; i++) {
+        results[i] = -1;
+    }
+
+    if (count < 1) {
+        return;
+    }
+
+    replies = (redisReply **)calloc(count, sizeof(redisReply *));
+    if (!replies) {
+        return;
+    }
+
+    lamb_nodes_replies(cache, count, keys, cmds, lens, replies);
+
+    for (int i = 0; i < count; i++) {
+        if (replies[i]) {
+            if (replies[i]->type == REDIS_REPLY_INTEGER) {
+                results[i] = replies[i]->integer;
+            }
+            freeReplyObject(replies[i]);
+        }
+    }
+
+    free(replies);
+
+    return;
+}
+
+/*
+ * Send count formatted commands, command i to node keys[i] % len, and
+ * store their replies in replies, NULL when there is none. The caller
+ * frees them. All commands are written before any reply is read so the
+ * nodes work in parallel. Node locks are taken in index order.
+ */
+
+void lamb_nodes_replies(lamb_caches_t *cache, int count, unsigned long *keys, char **cmds,
+                        int *lens, redisReply **replies) {
+    int n, done;
+    redisContext *c;
+    redisReply *reply;
+    bool used[LAMB_MAX_CACHE];
+    bool broken[LAMB_MAX_CACHE];
+
+    for (int i = 0; i < count; i++) {
+        replies[i] = NULL;
+    }
+
+    if (count < 1 || cache->len < 1) {
+        return;
+    }
+
+    memset(used, 0, sizeof(used));
+    memset(broken, 0, sizeof(broken));
+
+    for (int i = 0; i < count; i++) {
+        used[keys[i] % cache->len] = true;
+    }
+
+    for (int i = 0; i < cache->len; i++) {
+        if (used[i]) {
+            pthread_mutex_lock(&cache->nodes[i]->lock);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        n = keys[i] % cache->len;
+        c = cache->nodes[n]->handle;
+        if (redisAppendFormattedCommand(c, cmds[i], lens[i]) != REDIS_OK) {
+            broken[n] = true;
+        }
+    }
+
+    for (int i = 0; i < cache->len; i++) {
+        if (!used[i] || broken[i]) {
+            continue;
+        }
+
+        done = 0;
+        c = cache->nodes[i]->handle;
+
+        while (!done) {
+            if (redisBufferWrite(c, &done) == REDIS_ERR) {
+                broken[i] = true;
+                break;
+            }
+        }
+    }
+
+    /* Replies of one node come back in the order the commands were sent */
+    for (int i = 0; i < count; i++) {
+        n = keys[i] % cache->len;
+        if (broken[n]) {
+            continue;
+        }
+
+        c = cache->nodes[n]->handle;
+        if (redisGetReply(c, (void **)&reply) != REDIS_OK || !reply) {
+            broken[n] = true;
+            continue;
+        }
+
+        replies[i] = reply;
+    }
+
+    for (int i = 0; i < cache->len; i++) {
+        if (used[i]) {
+            pthread_mutex_unlock(&cache->nodes[i]->lock);
+        }
+    }
+
+    return;
+}
@@ -30,5 +30,9 @@ bool lamb_cache_has(lamb_cache_t *cache, char *key);
 int lamb_cache_get(lamb_cache_t *cache, char *key, char *buff, size_t len);
 int lamb_cache_hget(lamb_cache_t *cache, char *key, char *field, char *buff, size_t len);
 int lamb_nodes_connect(lamb_caches_t *cache, int len, char *nodes[], int size, int db);
+void lamb_nodes_pipeline(lamb_caches_t *cache, int count, unsigned long *keys, char **cmds,
+                         int *lens, long long *results);
+void lamb_nodes_replies(lamb_caches_t *cache, int count, unsigned long *keys, char **cmds,
+                        int *lens, redisReply **replies);
 
 #endif
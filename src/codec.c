@@ -0,0 +1,459 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <iconv.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "codec.h"
+
+typedef struct {
+    char from[LAMB_CODEC_NAME];
+    char to[LAMB_CODEC_NAME];
+    iconv_t cd;
+} lamb_descriptor_t;
+
+typedef struct {
+    int count;
+    int next;
+    lamb_descriptor_t items[LAMB_CODEC_CACHE];
+} lamb_descriptors_t;
+
+static pthread_key_t descriptors;
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+
+static void lamb_descriptors_free(void *data) {
+    lamb_descriptors_t *cache = (lamb_descriptors_t *)data;
+
+    for (int i = 0; i < cache->count; i++) {
+        iconv_close(cache->items[i].cd);
+    }
+
+    free(cache);
+
+    return;
+}
+
+static void lamb_descriptors_init(void) {
+    pthread_key_create(&descriptors, lamb_descriptors_free);
+    return;
+}
+
+/*
+ * Return the calling thread's descriptor for the (from, to) pair,
+ * opening it on first use. Descriptors are closed on thread exit.
+ */
+
+static iconv_t lamb_descriptor_get(const char *from, const char *to) {
+    iconv_t cd;
+    lamb_descriptor_t *item;
+    lamb_descriptors_t *cache;
+
+    if (strlen(from) >= LAMB_CODEC_NAME || strlen(to) >= LAMB_CODEC_NAME) {
+        return (iconv_t)-1;
+    }
+
+    pthread_once(&initialized, lamb_descriptors_init);
+
+    cache = (lamb_descriptors_t *)pthread_getspecific(descriptors);
+
+    if (!cache) {
+        cache = (lamb_descriptors_t *)calloc(1, sizeof(lamb_descriptors_t));
+        if (!cache) {
+            return (iconv_t)-1;
+        }
+        pthread_setspecific(descriptors, cache);
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        item = &cache->items[i];
+        if (strcmp(item->from, from) == 0 && strcmp(item->to, to) == 0) {
+            /* Reset the shift state left by a previous failure */
+            iconv(item->cd, NULL, NULL, NULL, NULL);
+            return item->cd;
+        }
+    }
+
+    cd = iconv_open(to, from);
+
+    if (cd == (iconv_t)-1) {
+        return cd;
+    }
+
+    /* Evict round robin once the cache is full */
+    if (cache->count < LAMB_CODEC_CACHE) {
+        item = &cache->items[cache->count++];
+    } else {
+        item = &cache->items[cache->next];
+        cache->next = (cache->next + 1) % LAMB_CODEC_CACHE;
+        iconv_close(item->cd);
+    }
+
+    strcpy(item->from, from);
+    strcpy(item->to, to);
+    item->cd = cd;
+
+    return cd;
+}
+
+/* Length of the leading run of 7-bit bytes */
+static size_t lamb_ascii_span(const unsigned char *src, size_t len) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    int mask;
+    __m128i v;
+
+    while (i + 16 <= len) {
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        mask = _mm_movemask_epi8(v);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#else
+    uint64_t w;
+
+    while (i + 8 <= len) {
+        memcpy(&w, src + i, 8);
+        if (w & 0x8080808080808080ULL) {
+            break;
+        }
+        i += 8;
+    }
+#endif
+
+    while (i < len && src[i] < 0x80) {
+        i++;
+    }
+
+    return i;
+}
+
+/* ASCII to ASCII compatible encodings, a checked copy */
+static int lamb_ascii_copy(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen, size_t *length) {
+    if (lamb_ascii_span(src, slen) != slen || slen > dlen) {
+        return -1;
+    }
+
+    memcpy(dst, src, slen);
+    *length = slen;
+
+    return 0;
+}
+
+static int lamb_ucs2_to_utf8(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen, size_t *length) {
+    unsigned int c;
+    size_t i = 0, o = 0;
+
+    if (slen & 1) {
+        return -1;
+    }
+
+    while (i < slen) {
+#ifdef __SSE2__
+        /* Eight characters at a time while they are all below 0x80 */
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i high = _mm_set1_epi16((short)0x80ff);
+        __m128i v;
+
+        while (i + 16 <= slen && o + 8 <= dlen) {
+            v = _mm_loadu_si128((const __m128i *)(src + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, high), zero)) != 0xffff) {
+                break;
+            }
+            _mm_storel_epi64((__m128i *)(dst + o), _mm_packus_epi16(_mm_srli_epi16(v, 8), zero));
+            i += 16;
+            o += 8;
+        }
+
+        if (i >= slen) {
+            break;
+        }
+#endif
+        c = (src[i] << 8) | src[i + 1];
+        i += 2;
+
+        if (c < 0x80) {
+            if (o + 1 > dlen) {
+                return -1;
+            }
+            dst[o++] = c;
+        } else if (c < 0x800) {
+            if (o + 2 > dlen) {
+                return -1;
+            }
+            dst[o++] = 0xc0 | (c >> 6);
+            dst[o++] = 0x80 | (c & 0x3f);
+        } else {
+            /* Surrogates are not characters in UCS-2 */
+            if (c >= 0xd800 && c <= 0xdfff) {
+                return -1;
+            }
+            if (o + 3 > dlen) {
+                return -1;
+            }
+            dst[o++] = 0xe0 | (c >> 12);
+            dst[o++] = 0x80 | ((c >> 6) & 0x3f);
+            dst[o++] = 0x80 | (c & 0x3f);
+        }
+    }
+
+    *length = o;
+
+    return 0;
+}
+
+static int lamb_utf8_to_ucs2(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen, size_t *length) {
+    unsigned int c;
+    size_t i = 0, o = 0;
+
+    while (i < slen) {
+#ifdef __SSE2__
+        /* Sixteen ASCII bytes widen to big endian pairs */
+        const __m128i zero = _mm_setzero_si128();
+        __m128i v;
+
+        while (i + 16 <= slen && o + 32 <= dlen) {
+            v = _mm_loadu_si128((const __m128i *)(src + i));
+            if (_mm_movemask_epi8(v) != 0) {
+                break;
+            }
+            _mm_storeu_si128((__m128i *)(dst + o), _mm_unpacklo_epi8(zero, v));
+            _mm_storeu_si128((__m128i *)(dst + o + 16), _mm_unpackhi_epi8(zero, v));
+            i += 16;
+            o += 32;
+        }
+
+        if (i >= slen) {
+            break;
+        }
+#endif
+        c = src[i];
+
+        if (c < 0x80) {
+            i += 1;
+        } else if (c >= 0xc2 && c <= 0xdf) {
+            if (i + 2 > slen || (src[i + 1] & 0xc0) != 0x80) {
+                return -1;
+            }
+            c = ((c & 0x1f) << 6) | (src[i + 1] & 0x3f);
+            i += 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            if (i + 3 > slen || (src[i + 1] & 0xc0) != 0x80 || (src[i + 2] & 0xc0) != 0x80) {
+                return -1;
+            }
+            c = ((c & 0x0f) << 12) | ((src[i + 1] & 0x3f) << 6) | (src[i + 2] & 0x3f);
+            if (c < 0x800 || (c >= 0xd800 && c <= 0xdfff)) {
+                return -1;
+            }
+            i += 3;
+        } else {
+            /* Invalid lead byte or a character beyond the BMP */
+            return -1;
+        }
+
+        if (o + 2 > dlen) {
+            return -1;
+        }
+
+        dst[o++] = c >> 8;
+        dst[o++] = c & 0xff;
+    }
+
+    *length = o;
+
+    return 0;
+}
+
+static int lamb_iconv_run(iconv_t cd, const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen, size_t *length) {
+    char *inbuf = (char *)src;
+    char *outbuf = (char *)dst;
+    size_t inleft = slen;
+    size_t outleft = dlen;
+
+    if (iconv(cd, &inbuf, &inleft, &outbuf, &outleft) == (size_t)-1 || inleft != 0) {
+        return -1;
+    }
+
+    *length = dlen - outleft;
+
+    return 0;
+}
+
+/*
+ * GBK and UTF-8 share the ASCII range, so ASCII runs are copied directly
+ * and only the runs of multibyte characters go through iconv.
+ */
+
+static int lamb_gbk_to_utf8(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen, size_t *length) {
+    size_t i = 0, o = 0;
+    size_t n, end, len;
+    iconv_t cd = (iconv_t)-1;
+
+    while (i < slen) {
+        n = lamb_ascii_span(src + i, slen - i);
+        if (o + n > dlen) {
+            return -1;
+        }
+
+        memcpy(dst + o, src + i, n);
+        i += n;
+        o += n;
+
+        if (i >= slen) {
+            break;
+        }
+
+        /* A trail byte may fall in the ASCII range, walk in pairs */
+        end = i;
+        while (end < slen && src[end] >= 0x80) {
+            /* 0x80 is the single byte euro sign */
+            if (src[end] == 0x80) {
+                end += 1;
+                continue;
+            }
+            if (end + 2 > slen) {
+                return -1;
+            }
+            end += 2;
+        }
+
+        if (cd == (iconv_t)-1) {
+            cd = lamb_descriptor_get("GBK", "UTF-8");
+            if (cd == (iconv_t)-1) {
+                return -1;
+            }
+        }
+
+        if (lamb_iconv_run(cd, src + i, end - i, dst + o, dlen - o, &len) != 0) {
+            return -1;
+        }
+
+        i = end;
+        o += len;
+    }
+
+    *length = o;
+
+    return 0;
+}
+
+static int lamb_utf8_to_gbk(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen, size_t *length) {
+    size_t i = 0, o = 0;
+    size_t n, end, len;
+    iconv_t cd = (iconv_t)-1;
+
+    while (i < slen) {
+        n = lamb_ascii_span(src + i, slen - i);
+        if (o + n > dlen) {
+            return -1;
+        }
+
+        memcpy(dst + o, src + i, n);
+        i += n;
+        o += n;
+
+        if (i >= slen) {
+            break;
+        }
+
+        end = i;
+        while (end < slen && src[end] >= 0x80) {
+            end++;
+        }
+
+        if (cd == (iconv_t)-1) {
+            cd = lamb_descriptor_get("UTF-8", "GBK");
+            if (cd == (iconv_t)-1) {
+                return -1;
+            }
+        }
+
+        if (lamb_iconv_run(cd, src + i, end - i, dst + o, dlen - o, &len) != 0) {
+            return -1;
+        }
+
+        i = end;
+        o += len;
+    }
+
+    *length = o;
+
+    return 0;
+}
+
+int lamb_codec_lookup(const char *name) {
+    if (strcasecmp(name, "UTF-8") == 0 || strcasecmp(name, "UTF8") == 0) {
+        return LAMB_CODEC_UTF8;
+    }
+
+    if (strcasecmp(name, "ASCII") == 0 || strcasecmp(name, "US-ASCII") == 0) {
+        return LAMB_CODEC_ASCII;
+    }
+
+    if (strcasecmp(name, "UCS-2BE") == 0) {
+        return LAMB_CODEC_UCS2;
+    }
+
+    if (strcasecmp(name, "GBK") == 0) {
+        return LAMB_CODEC_GBK;
+    }
+
+    return LAMB_CODEC_OTHER;
+}
+
+/*
+ * Convert slen bytes of src into dst and store the exact number of bytes
+ * written in length. Malformed or truncated input and output that does
+ * not fit in dlen bytes are rejected with -1.
+ */
+
+int lamb_encoded_convert(const char *src, size_t slen, char *dst, size_t dlen, const char* fromcode, const char* tocode, int *length) {
+    int err;
+    int from, to;
+    iconv_t cd;
+    size_t len = 0;
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+
+    from = lamb_codec_lookup(fromcode);
+    to = lamb_codec_lookup(tocode);
+
+    if (from == LAMB_CODEC_ASCII && (to == LAMB_CODEC_ASCII || to == LAMB_CODEC_UTF8 || to == LAMB_CODEC_GBK)) {
+        err = lamb_ascii_copy(in, slen, out, dlen, &len);
+    } else if (to == LAMB_CODEC_ASCII && (from == LAMB_CODEC_UTF8 || from == LAMB_CODEC_GBK)) {
+        err = lamb_ascii_copy(in, slen, out, dlen, &len);
+    } else if (from == LAMB_CODEC_UCS2 && to == LAMB_CODEC_UTF8) {
+        err = lamb_ucs2_to_utf8(in, slen, out, dlen, &len);
+    } else if (from == LAMB_CODEC_UTF8 && to == LAMB_CODEC_UCS2) {
+        err = lamb_utf8_to_ucs2(in, slen, out, dlen, &len);
+    } else if (from == LAMB_CODEC_GBK && to == LAMB_CODEC_UTF8) {
+        err = lamb_gbk_to_utf8(in, slen, out, dlen, &len);
+    } else if (from == LAMB_CODEC_UTF8 && to == LAMB_CODEC_GBK) {
+        err = lamb_utf8_to_gbk(in, slen, out, dlen, &len);
+    } else {
+        cd = lamb_descriptor_get(fromcode, tocode);
+        if (cd == (iconv_t)-1) {
+            return -1;
+        }
+        err = lamb_iconv_run(cd, in, slen, out, dlen, &len);
+    }
+
+    if (err) {
+        return -1;
+    }
+
+    *length = (int)len;
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_CODEC_H
+#define _LAMB_CODEC_H
+
+#include <stddef.h>
+
+#define LAMB_CODEC_CACHE  8
+#define LAMB_CODEC_NAME  32
+
+#define LAMB_CODEC_OTHER 0
+#define LAMB_CODEC_ASCII 1
+#define LAMB_CODEC_UTF8  2
+#define LAMB_CODEC_UCS2  3
+#define LAMB_CODEC_GBK   4
+
+int lamb_codec_lookup(const char *name);
+int lamb_encoded_convert(const char *src, size_t slen, char *dst, size_t dlen, const char* fromcode, const char* tocode, int *length);
+
+#endif
@@ -20,7 +20,6 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
-#include <iconv.h>
 #include <cmpp.h>
 #include "common.h"
 
@@ -135,11 +134,6 @@ unsigned long long lamb_now_microsecond(void) {
     return now;
 }
 
-unsigned short lamb_sequence(void) {
-    static unsigned short seq = 1;
-    return (seq < 0xffff) ? (seq++) : (seq = 1);
-}
-
 char *lamb_strdup(const char *str) {
     size_t len = strlen (str) + 1;
     void *new = malloc (len);
@@ -170,20 +164,6 @@ void lamb_start_thread(void *(*func)(void *), void *arg, int count) {
     return;
 }
 
-unsigned long long lamb_gen_msgid(int gid, unsigned short sequenceId) {
-    time_t rawtime;
-    struct tm *t;
-    unsigned long long msgId;
-
-    time(&rawtime);
-    t = localtime(&rawtime);
-
-    /* Generate Message ID */
-    msgId = cmpp_gen_msgid(t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec, gid, sequenceId);
-
-    return msgId;
-}
-
 void lamb_set_process(char *name) {
     prctl(PR_SET_NAME, name, 0, 0, 0);
     return;
@@ -226,26 +206,6 @@ int lamb_mqd_writable(int fd, long long millisecond) {
     return ret;
 }
 
-int lamb_encoded_convert(const char *src, size_t slen, char *dst, size_t dlen, const char* fromcode, const char* tocode, int *length) {
-    iconv_t cd;
-    size_t len = dlen;
-    char *inbuf = (char *)src;
-    size_t *inbytesleft = &slen;
-    char *outbuf = dst;
-    size_t *outbytesleft = &dlen;
-
-
-    cd = iconv_open(tocode, fromcode);
-    if (cd != (iconv_t)-1) {
-        iconv(cd, &inbuf, inbytesleft, &outbuf, outbytesleft);
-        *length = len - *outbytesleft;
-        iconv_close(cd);
-        return 0;
-    }
-
-    return -1;
-}
-
 size_t lamb_ucs2_strlen(const char *str) {
     int i = 0;
 
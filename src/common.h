@@ -31,6 +31,7 @@
 #define LAMB_REPORT  3
 #define LAMB_UPDATE  4
 #define LAMB_MESSAGE 5
+#define LAMB_ACK     6
 
 #define CHECK_TYPE(val) *((int *)(val))
 
@@ -105,14 +106,11 @@ void lamb_daemon(void);
 void lamb_sleep(unsigned long long milliseconds);
 void lamb_msleep(unsigned long long microsecond);
 unsigned long long lamb_now_microsecond(void);
-unsigned short lamb_sequence(void);
 char *lamb_strdup(const char *str);
 void lamb_start_thread(void *(*func)(void *), void *arg, int count);
-unsigned long long lamb_gen_msgid(int gid, unsigned short sequenceId);
 void lamb_set_process(char *name);
 bool lamb_pcre_regular(char *pattern, char *message, int len);
 int lamb_mqd_writable(int fd, long long millisecond);
-int lamb_encoded_convert(const char *src, size_t slen, char *dst, size_t dlen, const char* fromcode, const char* tocode, int *length);
 size_t lamb_ucs2_strlen(const char *str);
 size_t lamb_gbk_strlen(const char *str);
 bool lamb_check_format(int coded, int list[], size_t len);
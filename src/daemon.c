@@ -18,6 +18,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
 #include "daemon.h"
 #include "common.h"
 #include "log.h"
@@ -104,6 +105,9 @@ void lamb_event_loop(void) {
         return;
     }
 
+    /* Start blacklist bitmap thread */
+    lamb_start_thread(lamb_blacklist_loop, NULL, 1);
+
     /* Master control loop*/
     while (true) {
         memset(task, 0, sizeof(lamb_task_t));
@@ -180,6 +184,186 @@ void lamb_start_program(lamb_task_t *task) {
     return;
 }
 
+/*
+ * Keep the blacklist bitmap in step with the database. Triggers on
+ * the blacklist table append every insert and delete to blacklist_log,
+ * the entries are replayed in id order and the last applied id saved
+ * in the bitmap header. Replaying an entry twice is harmless. Until a
+ * full copy of the table made it into the bitmap the servers use redis,
+ * a failed copy is started over.
+ */
+
+void *lamb_blacklist_loop(void *arg) {
+    int err;
+    lamb_db_t bdb;
+    lamb_bitmap_t *bitmap;
+
+    bitmap = lamb_bitmap_open(config->blacklist, true);
+    if (!bitmap) {
+        syslog(LOG_ERR, "can't open blacklist bitmap %s", config->blacklist);
+        pthread_exit(NULL);
+    }
+
+    lamb_db_init(&bdb);
+
+    while (lamb_db_connect(&bdb, config->db_host, config->db_port, config->db_user,
+                           config->db_password, config->db_name) != 0) {
+        syslog(LOG_ERR, "can't connect to postgresql database %s", config->db_host);
+        PQfinish(bdb.conn);
+        lamb_sleep(5000);
+    }
+
+    /* A new or partly loaded bitmap starts from a full copy of the table */
+    while (!bitmap->head->loaded) {
+        if (lamb_blacklist_load(&bdb, bitmap) == 0) {
+            syslog(LOG_INFO, "blacklist of %llu numbers loaded into bitmap", bitmap->head->count);
+            break;
+        }
+
+        syslog(LOG_ERR, "can't load blacklist into bitmap, trying again");
+
+        if (!lamb_db_check_status(&bdb)) {
+            PQreset(bdb.conn);
+        }
+
+        lamb_sleep(5000);
+    }
+
+    while (true) {
+        err = lamb_blacklist_apply(&bdb, bitmap);
+
+        if (err < 0 && !lamb_db_check_status(&bdb)) {
+            PQreset(bdb.conn);
+        }
+
+        if (err > 0) {
+            lamb_bitmap_sync(bitmap);
+        }
+
+        if (err < LAMB_BLACKLIST_BATCH) {
+            lamb_sleep(1000);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Copy the table in one snapshot, the last changelog id of the same
+ * snapshot is where the replay starts.
+ */
+
+int lamb_blacklist_load(lamb_db_t *db, lamb_bitmap_t *bitmap) {
+    int err;
+    unsigned long long sequence;
+    PGresult *res = NULL;
+
+    if (lamb_bitmap_reset(bitmap) != 0) {
+        return -1;
+    }
+
+    res = PQexec(db->conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        PQclear(res);
+        return -1;
+    }
+
+    PQclear(res);
+
+    res = PQexec(db->conn, "SELECT coalesce(max(id), 0) FROM blacklist_log");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1) {
+        PQclear(res);
+        goto error;
+    }
+
+    sequence = strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+    PQclear(res);
+
+    if (!PQsendQuery(db->conn, "SELECT phone FROM blacklist")) {
+        goto error;
+    }
+
+    PQsetSingleRowMode(db->conn);
+    err = 0;
+
+    while ((res = PQgetResult(db->conn)) != NULL) {
+        if (PQresultStatus(res) == PGRES_SINGLE_TUPLE) {
+            lamb_bitmap_set(bitmap, strtoull(PQgetvalue(res, 0, 0), NULL, 10));
+        } else if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            err = -1;
+        }
+        PQclear(res);
+    }
+
+    if (err) {
+        goto error;
+    }
+
+    res = PQexec(db->conn, "COMMIT");
+    PQclear(res);
+
+    lamb_bitmap_loaded(bitmap, sequence);
+
+    return 0;
+
+error:
+    res = PQexec(db->conn, "ROLLBACK");
+    PQclear(res);
+    return -1;
+}
+
+/*
+ * Replay the changelog after sequence, -1 on error. Ids are taken
+ * before commit, an entry may commit below one already applied. The
+ * last LAMB_BLACKLIST_WINDOW ids are read again with the new entries
+ * and all of them applied in id order, which picks up such entries
+ * and keeps the last operation on a number the one that counts.
+ * Returns the number of new entries.
+ */
+
+int lamb_blacklist_apply(lamb_db_t *db, lamb_bitmap_t *bitmap) {
+    int rows, count;
+    char sql[256];
+    unsigned long long id;
+    unsigned long long from;
+    unsigned long long phone;
+    PGresult *res = NULL;
+
+    from = bitmap->head->sequence;
+    from = (from > LAMB_BLACKLIST_WINDOW) ? from - LAMB_BLACKLIST_WINDOW : 0;
+
+    snprintf(sql, sizeof(sql), "SELECT id, phone, op FROM blacklist_log WHERE id > %llu "
+             "ORDER BY id LIMIT %d", from, LAMB_BLACKLIST_WINDOW + LAMB_BLACKLIST_BATCH);
+
+    res = PQexec(db->conn, sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        PQclear(res);
+        return -1;
+    }
+
+    rows = PQntuples(res);
+    count = 0;
+
+    for (int i = 0; i < rows; i++) {
+        id = strtoull(PQgetvalue(res, i, 0), NULL, 10);
+        phone = strtoull(PQgetvalue(res, i, 1), NULL, 10);
+        if (atoi(PQgetvalue(res, i, 2)) == 1) {
+            lamb_bitmap_set(bitmap, phone);
+        } else {
+            lamb_bitmap_clear(bitmap, phone);
+        }
+
+        if (id > bitmap->head->sequence) {
+            bitmap->head->sequence = id;
+            count++;
+        }
+    }
+
+    PQclear(res);
+
+    return count;
+}
+
 int lamb_component_initialization(lamb_config_t *cfg) {
     int err;
 
@@ -274,6 +458,11 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    if (lamb_get_string(&cfg, "Blacklist", conf->blacklist, 254) != 0) {
+        fprintf(stderr, "Can't read config 'Blacklist' parameter\n");
+        goto error;
+    }
+
     lamb_config_destroy(&cfg);
     return 0;
 error:
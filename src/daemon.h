@@ -10,6 +10,10 @@
 #include "db.h"
 #include "common.h"
 #include "config.h"
+#include "bitmap.h"
+
+#define LAMB_BLACKLIST_BATCH 10000
+#define LAMB_BLACKLIST_WINDOW 1000
 
 typedef struct {
     int id;
@@ -23,6 +27,7 @@ typedef struct {
     char db_name[64];
     char module[255];
     char config[255];
+    char blacklist[255];
 } lamb_config_t;
 
 typedef struct {
@@ -37,6 +42,9 @@ void lamb_event_loop(void);
 int lamb_fetch_taskqueue(lamb_db_t *db, lamb_task_t *task);
 int lamb_del_taskqueue(lamb_db_t *db, long long id);
 void lamb_start_program(lamb_task_t *task);
+void *lamb_blacklist_loop(void *arg);
+int lamb_blacklist_load(lamb_db_t *db, lamb_bitmap_t *bitmap);
+int lamb_blacklist_apply(lamb_db_t *db, lamb_bitmap_t *bitmap);
 int lamb_component_initialization(lamb_config_t *cfg);
 int lamb_read_config(lamb_config_t *conf, const char *file);
 
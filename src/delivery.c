@@ -27,21 +27,27 @@
 #include "config.h"
 #include "cache.h"
 #include "socket.h"
+#include "mux.h"
+#include "registry.h"
+#include "slab.h"
+#include "arena.h"
 #include "message.h"
+#include "codec.h"
 #include "delivery.h"
 #include "log.h"
 
 //static int ac;
 static lamb_db_t db;
 static lamb_db_t mdb;
-static lamb_list_t *pool;
+static lamb_registry_t *pool;
+static lamb_slab_t *reports;
+static lamb_slab_t *delivers;
 static lamb_cache_t *rdb;
 static lamb_config_t config;
-static lamb_list_t *storage;
+static lamb_ring_t *storage;
 static lamb_list_t *delivery;
-static pthread_cond_t cond;
-static pthread_mutex_t mutex;
-static Response resp = RESPONSE__INIT;
+static lamb_mux_t *mux;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static volatile bool sleeping = false;
 
 int main(int argc, char *argv[]) {
@@ -104,27 +110,27 @@ int main(int argc, char *argv[]) {
 }
 
 void lamb_event_loop(void) {
-    int fd;
     int err;
-    char addr[128];
-
-    pthread_cond_init(&cond, NULL);
-    pthread_mutex_init(&mutex, NULL);
 
     err = lamb_signal(SIGHUP, lamb_reload);
     lamb_debug("lamb signal initialization %s\n", err ? "failed" : "successfull");
 
     /* Client Queue Pools Initialization */
-    pool = lamb_list_new();
+    pool = lamb_registry_new();
     if (!pool) {
         syslog(LOG_ERR, "queue pool initialization failed");
         return;
     }
 
-    pool->match = lamb_queue_compare;
+    reports = lamb_slab_new(sizeof(lamb_report_t));
+    delivers = lamb_slab_new(sizeof(lamb_deliver_t));
+    if (!reports || !delivers) {
+        syslog(LOG_ERR, "message slab initialization failed");
+        return;
+    }
 
     /* Storage queue initialization */
-    storage = lamb_list_new();
+    storage = lamb_ring_new(LAMB_QUEUE_SIZE);
     if (!storage) {
         syslog(LOG_ERR, "storage queue initialization failed");
         return;
@@ -200,17 +206,10 @@ void lamb_event_loop(void) {
 #endif
 
     /* delivery server Initialization */
-    fd = nn_socket(AF_SP, NN_REP);
-    if (fd < 0) {
-        syslog(LOG_ERR, "socket %s", nn_strerror(nn_errno()));
-        return;
-    }
-
-    snprintf(addr, sizeof(addr), "tcp://%s:%d", config.listen, config.port);
-        
-    if (nn_bind(fd, addr) < 0) {
-        nn_close(fd);
-        syslog(LOG_ERR, "bind %s", nn_strerror(nn_errno()));
+    mux = lamb_mux_new(config.listen, config.port, config.work_threads,
+                       lamb_push_handler, lamb_pull_handler);
+    if (!mux) {
+        syslog(LOG_ERR, "can't listen on %s:%d", config.listen, config.port);
         return;
     }
 
@@ -220,79 +219,10 @@ void lamb_event_loop(void) {
     /* Start Data Acquisition Thread */
     lamb_start_thread(lamb_stat_loop, NULL, 1);
 
-    int rc, len;
-    Request *req;
-    char *buf = NULL;
-
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
-
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
-            continue;
-        }
+    /* Start Worker Threads */
+    lamb_mux_run(mux);
 
-        if (CHECK_COMMAND(buf) != LAMB_REQUEST) {
-            nn_freemsg(buf);
-            syslog(LOG_WARNING, "invalid command %#x request from client", CHECK_COMMAND(buf));
-            continue;
-        }
-
-        req = request__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-        nn_freemsg(buf);
-
-        if (!req) {
-            syslog(LOG_ERR, "can't parse protobuff protocol packets");
-            continue;
-        }
-
-        if (req->id < 1) {
-            syslog(LOG_WARNING, "Incorrect client identity id number");
-            continue;
-        }
-
-        struct timeval now;
-        struct timespec timeout;
-        
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = now.tv_sec;
-        timeout.tv_nsec = now.tv_usec * 1000;
-        timeout.tv_sec += 3;
-
-        pthread_mutex_lock(&mutex);
-
-        if (req->type == LAMB_PULL) {
-            lamb_start_thread(lamb_pull_loop,  (void *)req, 1);
-        } else if (req->type == LAMB_PUSH) {
-            lamb_start_thread(lamb_push_loop,  (void *)req, 1);
-        } else {
-            request__free_unpacked(req, NULL);
-            pthread_mutex_unlock(&mutex);
-            continue;
-        }
-
-        err = pthread_cond_timedwait(&cond, &mutex, &timeout);
-
-        if (err != ETIMEDOUT) {
-            void *pk;
-            len = response__get_packed_size(&resp);
-            pk = malloc(len);
-
-            if (pk) {
-                response__pack(&resp, pk);
-                len = lamb_pack_assembly(&buf, LAMB_RESPONSE, pk, len);
-                if (len > 0) {
-                    nn_send(fd, buf, len, 0);
-                    free(buf);
-                }
-                free(pk);
-            }
-        }
-
-        pthread_mutex_unlock(&mutex);
-    }
+    return;
 }
 
 void lamb_reload(int signum) {
@@ -335,407 +265,257 @@ void lamb_reload(int signum) {
     return;
 }
 
-void *lamb_push_loop(void *arg) {
-    int err;
-    int fd, rc;
-    int timeout;
-    char host[128];
-    Request *client;
-    
-    client = (Request *)arg;
+/* Find the queue of a client, created on first use */
+lamb_queue_t *lamb_pool_queue(int id) {
+    lamb_queue_t *queue;
 
-    syslog(LOG_INFO, "new client from %s connectd\n", client->addr);
+    queue = lamb_registry_get(pool, id);
 
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_PAIR);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+    if (queue) {
+        return queue;
     }
 
     pthread_mutex_lock(&mutex);
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+    queue = lamb_registry_get(pool, id);
+
+    if (!queue) {
+        queue = lamb_queue_new(id);
+        if (queue && lamb_registry_set(pool, id, queue) != 0) {
+            lamb_queue_destroy(queue);
+            free(queue);
+            queue = NULL;
+        }
+    }
 
     pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
+    return queue;
+}
 
-    /* Start event processing */
+int lamb_push_handler(int method, int id, char *pk, size_t len) {
+    Report *r;
+    Deliver *d;
     int account;
-    char *buf = NULL;
     lamb_node_t *node;
     lamb_queue_t *queue;
     lamb_report_t *report;
     lamb_deliver_t *deliver;
 
-    while (true) {
-        if (sleeping) {
-            lamb_sleep(1000);
-            continue;
-        }
+    /* Routing is being reloaded */
+    if (sleeping) {
+        return LAMB_BUSY;
+    }
 
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+    /* Report */
+    if (method == LAMB_REPORT) {
+        r = report__unpack(lamb_arena(), len, (uint8_t *)pk);
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
+        if (!r) {
+            lamb_debug("can't unpack report message packet\n");
+            return LAMB_REJECT;
+        }
 
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
+        queue = lamb_pool_queue(r->account);
+        report = (lamb_report_t *)lamb_slab_alloc(reports);
 
-            continue;
+        if (!queue || !report) {
+            report__free_unpacked(r, lamb_arena());
+            lamb_slab_free(reports, report);
+            return LAMB_BUSY;
         }
 
-        /* Report */
-        if (CHECK_COMMAND(buf) == LAMB_REPORT) {
-            Report *r = report__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
-
-            if (!r) {
-                lamb_debug("can't unpack report message packet\n");
-                continue;
-            }
+        report->type = LAMB_REPORT;
+        report->id = r->id;
+        report->account = r->account;
+        report->company = r->company;
+        strncpy(report->spcode, r->spcode, 20);
+        strncpy(report->phone, r->phone, 11);
+        report->status = r->status;
+        strncpy(report->submittime, r->submittime, 10);
+        strncpy(report->donetime, r->donetime, 10);
+
+        report__free_unpacked(r, lamb_arena());
+
+        /* Queue is full, hold back the producer */
+        if (lamb_queue_push(queue, report) != 0) {
+            lamb_slab_free(reports, report);
+            return LAMB_BUSY;
+        }
 
-            node = lamb_list_find(pool, (void *)(intptr_t)r->account);
+        lamb_mux_wake(mux, queue->id);
 
-            if (node) {
-                queue = (lamb_queue_t *)node->val;
-            } else {
-                queue = lamb_queue_new(r->account);
-                if (queue) {
-                    lamb_list_rpush(pool, lamb_node_new(queue));
-                }
-            }
+        return LAMB_OK;
+    }
 
-            if (queue) {
-                report = (lamb_report_t *)calloc(1, sizeof(lamb_report_t));
-                if (report) {
-                    report->type = LAMB_REPORT;
-                    report->id = r->id;
-                    report->account = r->account;
-                    report->company = r->company;
-                    strncpy(report->spcode, r->spcode, 20);
-                    strncpy(report->phone, r->phone, 11);
-                    report->status = r->status;
-                    strncpy(report->submittime, r->submittime, 10);
-                    strncpy(report->donetime, r->donetime, 10);
-                    lamb_queue_push(queue, report);
-                }
+    /* Delivery */
+    if (method == LAMB_DELIVER) {
+        d = deliver__unpack(lamb_arena(), len, (uint8_t *)pk);
 
-            }
-
-            report__free_unpacked(r, NULL);
-            continue;
+        if (!d) {
+            return LAMB_REJECT;
         }
 
-        /* Delivery */
-        if (CHECK_COMMAND(buf) == LAMB_DELIVER) {
-            Deliver *d = deliver__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
+        deliver = (lamb_deliver_t *)lamb_slab_alloc(delivers);
 
-            if (!d) {
-                continue;
-            }
+        if (!deliver) {
+            deliver__free_unpacked(d, lamb_arena());
+            return LAMB_BUSY;
+        }
 
-            account = 0;
+        account = 0;
+        deliver->type = LAMB_DELIVER;
+        deliver->id = d->id;
+        deliver->account = account;
+        strncpy(deliver->phone, d->phone, 11);
+        strncpy(deliver->spcode, d->spcode, 20);
+        deliver->msgfmt = d->msgfmt;
+        deliver->length = d->length;
+        memcpy(deliver->content, d->content.data, d->content.len);
 
-            deliver = (lamb_deliver_t *)calloc(1, sizeof(lamb_deliver_t));
+        lamb_delivery_t *dt;
+        lamb_list_iterator_t *it = lamb_list_iterator_new(delivery, LIST_HEAD);
 
-            if (!deliver) {
-                continue;
+        while ((node = lamb_list_iterator_next(it))) {
+            dt = (lamb_delivery_t *)node->val;
+            if (lamb_check_delivery(dt, deliver->spcode, strlen(d->spcode))) {
+                account = dt->target;
+                break;
             }
+        }
 
-            deliver->type = LAMB_DELIVER;
-            deliver->id = d->id;
-            deliver->account = account;
-            strncpy(deliver->phone, d->phone, 11);
-            strncpy(deliver->spcode, d->spcode, 20);
-            deliver->msgfmt = d->msgfmt;
-            deliver->length = d->length;
-            memcpy(deliver->content, d->content.data, d->content.len);
-            
-            lamb_delivery_t *dt;
-            lamb_list_iterator_t *it = lamb_list_iterator_new(delivery, LIST_HEAD);
-
-            while ((node = lamb_list_iterator_next(it))) {
-                dt = (lamb_delivery_t *)node->val;
-                if (lamb_check_delivery(dt, deliver->spcode, strlen(d->spcode))) {
-                    account = dt->target;
-                    break;
-                }
-            }
+        lamb_list_iterator_destroy(it);
+        deliver__free_unpacked(d, lamb_arena());
 
-            lamb_list_iterator_destroy(it);
-
-            if (account > 0) {
-                node = lamb_list_find(pool, (void *)(intptr_t)account);
-                if (node) {
-                    queue = (lamb_queue_t *)node->val;
-                } else {
-                    queue = lamb_queue_new(account);
-                    if (queue) {
-                        lamb_list_rpush(pool, lamb_node_new(queue));
-                    }
-                }
-                
-                if (queue) {
-                    lamb_queue_push(queue, deliver);
-                }
-            } else {
-                deliver->account = 0;
-                deliver->company = 0;
-                lamb_list_rpush(storage, lamb_node_new(deliver));
+        if (account < 1) {
+            while (lamb_ring_push(storage, deliver) != 0) {
+                lamb_sleep(10);
             }
-
-            deliver__free_unpacked(d, NULL);
-            continue;
+            return LAMB_OK;
         }
 
-        /* Close */
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
+        queue = lamb_pool_queue(account);
+
+        if (!queue || lamb_queue_push(queue, deliver) != 0) {
+            lamb_slab_free(delivers, deliver);
+            return LAMB_BUSY;
         }
 
-        lamb_debug("receive a invalid command\n");
-        nn_freemsg(buf);
+        lamb_mux_wake(mux, account);
+
+        return LAMB_OK;
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
+    lamb_debug("receive a invalid command\n");
 
-    pthread_exit(NULL);
+    return LAMB_REJECT;
 }
 
-void *lamb_pull_loop(void *arg) {
-    int fd;
-    int err;
-    int timeout;
-    char host[128];
-    Request *client;
-    lamb_node_t *node;
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes) {
+    void *message;
     lamb_queue_t *queue;
-    
-    client = (Request *)arg;
-
-    syslog(LOG_INFO, "new client from %s connectd\n", client->addr);
 
-    /* client queue initialization */
-    node = lamb_list_find(pool, (void *)(intptr_t)client->id);
+    queue = lamb_pool_queue(id);
 
-    if (node) {
-        queue = (lamb_queue_t *)node->val;
-    } else {
-        queue = lamb_queue_new(client->id);
-        if (queue) {
-            lamb_list_rpush(pool, lamb_node_new(queue));
-        }
+    if (!queue) {
+        return 0;
     }
 
-    node = NULL;
+    /* Drain the queue up to the consumer hint */
+    while (batch->count < count && batch->len < bytes) {
+        message = lamb_queue_pop(queue);
 
-    if (!queue) {
-        syslog(LOG_ERR, "can't create queue for client %s", client->addr);
-        request__free_unpacked(client, NULL);
-        pthread_exit(NULL);
-    }
+        if (!message) {
+            break;
+        }
 
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_REP);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+        lamb_pack_message(batch, message);
+        lamb_free_message(message);
     }
 
-    pthread_mutex_lock(&mutex);
+    return batch->count;
+}
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+void lamb_free_message(void *message) {
+    if (CHECK_TYPE(message) == LAMB_REPORT) {
+        lamb_slab_free(reports, message);
+    } else {
+        lamb_slab_free(delivers, message);
+    }
 
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
+    return;
+}
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
-    
-    /* Start event processing */
-    int rc, len;
+int lamb_pack_message(lamb_batch_t *batch, void *message) {
     void *pk;
-    void *message;
-    char *buf = NULL;
+    size_t len;
+    lamb_report_t *r;
+    lamb_deliver_t *d;
     Report report = REPORT__INIT;
     Deliver deliver = DELIVER__INIT;
 
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+    if (CHECK_TYPE(message) == LAMB_REPORT) {
+        r = (lamb_report_t *)message;
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
+        report.id = r->id;
+        report.account = r->account;
+        report.company = r->company;
+        report.spcode = r->spcode;
+        report.phone = r->phone;
+        report.status = r->status;
+        report.submittime = r->submittime;
+        report.donetime = r->donetime;
 
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
+        len = report__get_packed_size(&report);
+        pk = lamb_batch_reserve(batch, LAMB_REPORT, len);
 
-            continue;
+        if (pk) {
+            report__pack(&report, pk);
+            return 0;
         }
-
-        if (CHECK_COMMAND(buf) == LAMB_REQ) {
-            nn_freemsg(buf);
-            node = lamb_queue_pop(queue);
-
-            if (!node) {
-                len = lamb_pack_assembly(&buf, LAMB_EMPTY, NULL, 0);
-                if (len) {
-                    nn_send(fd, buf, len, NN_DONTWAIT);
-                    free(buf);
-                }
-                continue;
-            }
-
-            message = node->val;
-
-            if (CHECK_TYPE(message) == LAMB_REPORT) {
-                lamb_report_t *r = (lamb_report_t *)message;
-                report.id = r->id;
-                report.account = r->account;
-                report.company = r->company;
-                report.spcode = r->spcode;
-                report.phone = r->phone;
-                report.status = r->status;
-                report.submittime = r->submittime;
-                report.donetime = r->donetime;
-
-                len = report__get_packed_size(&report);
-                pk = malloc(len);
-
-                if (pk) {
-                    report__pack(&report, pk);
-                    len = lamb_pack_assembly(&buf, LAMB_REPORT, pk, len);
-                    if (len > 0) {
-                        nn_send(fd, buf, len, NN_DONTWAIT);
-                        free(buf);
-                    }
-                    free(pk);
-                }
-
-            } else if (CHECK_TYPE(message) == LAMB_DELIVER) {
-                lamb_deliver_t *d = (lamb_deliver_t *)message;
-                deliver.id = d->id;
-                deliver.account = d->account;
-                deliver.company = d->company;
-                deliver.phone = d->phone;
-                deliver.spcode = d->spcode;
-                deliver.serviceid = d->serviceid;
-                deliver.msgfmt = d->msgfmt;
-                deliver.length = d->length;
-                deliver.content.len = d->length;
-                deliver.content.data = (uint8_t *)d->content;
-
-                len = deliver__get_packed_size(&deliver);
-                pk = malloc(len);
-
-                if (pk) {
-                    deliver__pack(&deliver, pk);
-                    len = lamb_pack_assembly(&buf, LAMB_DELIVER, pk, len);
-                    if (len > 0) {
-                        nn_send(fd, buf, len, NN_DONTWAIT);
-                        free(buf);
-                    }
-                    free(pk);
-                }
-            }
-
-            free(node);
-            free(message);
-            continue;
-        }
-
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
+    } else if (CHECK_TYPE(message) == LAMB_DELIVER) {
+        d = (lamb_deliver_t *)message;
+
+        deliver.id = d->id;
+        deliver.account = d->account;
+        deliver.company = d->company;
+        deliver.phone = d->phone;
+        deliver.spcode = d->spcode;
+        deliver.serviceid = d->serviceid;
+        deliver.msgfmt = d->msgfmt;
+        deliver.length = d->length;
+        deliver.content.len = d->length;
+        deliver.content.data = (uint8_t *)d->content;
+
+        len = deliver__get_packed_size(&deliver);
+        pk = lamb_batch_reserve(batch, LAMB_DELIVER, len);
+
+        if (pk) {
+            deliver__pack(&deliver, pk);
+            return 0;
         }
-
-        nn_freemsg(buf);
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_ERR, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
-
-    pthread_exit(NULL);
-}
-
-int lamb_child_server(int *sock, const char *listen, unsigned short *port, int protocol) {
-    int fd;
-    char addr[128];
-    
-    fd = nn_socket(AF_SP, protocol);
-    if (fd < 0) {
-        syslog(LOG_ERR, "socket %s", nn_strerror(nn_errno()));
-        return -1;
-    }
-
-    while (true) {
-        snprintf(addr, sizeof(addr), "tcp://%s:%u", listen, *port);
-
-        if (nn_bind(fd, addr) > 0) {
-            break;
-        }
-
-        (*port)++;
-    }
-
-    *sock = fd;
-    
-    return 0;
+    return -1;
 }
 
 void *lamb_store_loop(void *data) {
     void *message;
-    lamb_node_t *node;
 
     while (true) {
-        node = lamb_list_lpop(storage);
+        message = lamb_ring_pop(storage);
 
-        if (!node) {
+        if (!message) {
             lamb_sleep(10);
             continue;
         }
 
-        message = node->val;
-
         if (CHECK_TYPE(message) == LAMB_DELIVER) {
             
             lamb_write_deliver(&mdb, (lamb_deliver_t *)message);
         }
 
-        free(node);
-        free(message);
+        lamb_free_message(message);
     }
 
     pthread_exit(NULL);
@@ -746,20 +526,7 @@ void *lamb_stat_loop(void *arg) {
 
     while (true) {
 #ifdef _DEBUG
-        lamb_node_t *node;
-        lamb_queue_t *queue;
-        long long length = 0;
-        lamb_list_iterator_t *it;
-
-        it = lamb_list_iterator_new(pool, LIST_HEAD);
-
-        while ((node = lamb_list_iterator_next(it))) {
-            queue = (lamb_queue_t *)node->val;
-            length += queue->list->len;
-            lamb_debug("queue: %d, len: %u\n", queue->id, queue->list->len);
-        }
-
-        lamb_list_iterator_destroy(it);
+        lamb_registry_foreach(pool, lamb_debug_queue, NULL);
 #endif
 
         signal = lamb_check_signal(rdb, config.id);
@@ -781,6 +548,11 @@ bool lamb_check_delivery(lamb_delivery_t *d, char *spcode, size_t len) {
     return false;
 }
 
+void lamb_debug_queue(void *queue, void *arg) {
+    lamb_debug("queue: %d, len: %zu\n", ((lamb_queue_t *)queue)->id, lamb_queue_len((lamb_queue_t *)queue));
+    return;
+}
+
 int lamb_get_delivery(lamb_db_t *db, lamb_list_t *deliverys) {
     int rows;
     char sql[128];
@@ -937,6 +709,16 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    if (lamb_get_int(&cfg, "WorkThreads", &conf->work_threads) != 0) {
+        fprintf(stderr, "Can't read config 'WorkThreads' parameter\n");
+        goto error;
+    }
+
+    if (conf->work_threads < 1 || conf->work_threads > LAMB_MAX_THREAD) {
+        fprintf(stderr, "Invalid work threads number\n");
+        goto error;
+    }
+
     if (lamb_get_string(&cfg, "Ac", conf->ac, 128) != 0) {
         fprintf(stderr, "Can't read config 'Ac' parameter\n");
     }
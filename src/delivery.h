@@ -18,6 +18,7 @@ typedef struct {
     char listen[16];
     int port;
     long long timeout;
+    int work_threads;
     char ac[128];
     char redis_host[16];
     int redis_port;
@@ -44,11 +45,14 @@ typedef struct {
 
 void lamb_event_loop(void);
 void lamb_reload(int signum);
-void *lamb_push_loop(void *arg);
-void *lamb_pull_loop(void *arg);
+lamb_queue_t *lamb_pool_queue(int id);
+int lamb_push_handler(int method, int id, char *pk, size_t len);
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes);
+void lamb_free_message(void *message);
+int lamb_pack_message(lamb_batch_t *batch, void *message);
 int lamb_server_init(int *sock, const char *addr, int port);
-int lamb_child_server(int *sock, const char *listen, unsigned short *port, int protocol);
 void *lamb_stat_loop(void *arg);
+void lamb_debug_queue(void *queue, void *arg);
 void *lamb_store_loop(void *data);
 int lamb_get_delivery(lamb_db_t *db, lamb_list_t *deliverys);
 bool lamb_check_delivery(lamb_delivery_t *d, char *spcode, size_t len);
@@ -20,8 +20,10 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <endian.h>
 #include <nanomsg/nn.h>
 #include <nanomsg/pair.h>
 #include <nanomsg/reqrep.h>
@@ -30,19 +32,20 @@
 #include "common.h"
 #include "ismg.h"
 #include "socket.h"
+#include "mux.h"
+#include "arena.h"
+#include "msgid.h"
 #include "config.h"
 #include "message.h"
 #include "log.h"
 
-static int mt, mo;
 static cmpp_ismg_t cmpp;
 static lamb_cache_t *rdb;
 static lamb_config_t config;
-static pthread_cond_t cond;
-static pthread_mutex_t mutex;
-static lamb_status_t status;
-static lamb_confirmed_t confirmed;
-static unsigned long long total = 0;
+static lamb_worker_t *workers;
+static lamb_session_t *requeued;
+static pthread_cond_t requeue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t requeue_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int main(int argc, char *argv[]) {
     bool background = false;
@@ -127,6 +130,33 @@ int main(int argc, char *argv[]) {
     /* Setting process information */
     lamb_set_process("lamb-ismgd");
 
+    /* Message ids carry the node id of this gateway */
+    if (lamb_msgid_init(config.id) != 0) {
+        syslog(LOG_ERR, "invalid gateway node id %d", config.id);
+        return -1;
+    }
+
+    /* Client sessions are served by a fixed pool of workers */
+    workers = (lamb_worker_t *)calloc(config.work_threads, sizeof(lamb_worker_t));
+    if (!workers) {
+        syslog(LOG_ERR, "the kernel can't allocate memory");
+        return -1;
+    }
+
+    for (int i = 0; i < config.work_threads; i++) {
+        if (lamb_worker_init(&workers[i], i) != 0) {
+            syslog(LOG_ERR, "can't connect to mt %s", config.mt);
+            return -1;
+        }
+        lamb_start_thread(lamb_work_loop, &workers[i], 1);
+    }
+
+    /* Closed sessions give their messages back to mo here */
+    lamb_start_thread(lamb_requeue_loop, NULL, 1);
+
+    /* Client Status Update Thread */
+    lamb_start_thread(lamb_stat_loop, NULL, 1);
+
     /* Start Main Event Thread */
     lamb_event_loop(&cmpp);
 
@@ -137,7 +167,9 @@ int main(int argc, char *argv[]) {
 }
 
 void lamb_event_loop(cmpp_ismg_t *cmpp) {
+    int next = 0;
     socklen_t clilen;
+    lamb_session_t *session;
     struct sockaddr_in clientaddr;
     struct epoll_event ev, events[32];
     int i, err, epfd, nfds, confd, sockfd;
@@ -223,21 +255,29 @@ void lamb_event_loop(cmpp_ismg_t *cmpp) {
                     cmpp_pack_get_string(&pack, cmpp_connect_source_addr, username,
                                          sizeof(username), 6);
                     snprintf(key, sizeof(key), "account.%s", username);
-                    
-                    if (!lamb_cache_has(rdb, key)) {
+
+                    pthread_mutex_lock(&rdb->lock);
+                    err = !lamb_cache_has(rdb, key);
+                    pthread_mutex_unlock(&rdb->lock);
+
+                    if (err) {
                         cmpp_connect_resp(&sock, sequenceId, 2);
                         syslog(LOG_WARNING, "incorrect source address from client %s", inet_ntoa(clientaddr.sin_addr));
                         continue;
                     }
 
                     memset(password, 0, sizeof(password));
+                    pthread_mutex_lock(&rdb->lock);
                     lamb_cache_hget(rdb, key, "password", password, sizeof(password));
+                    pthread_mutex_unlock(&rdb->lock);
 
                     /* Check AuthenticatorSource */
                     if (cmpp_check_authentication(&pack, sizeof(cmpp_pack_t), username, password)) {
                         lamb_account_t account;
                         memset(&account, 0, sizeof(account));
+                        pthread_mutex_lock(&rdb->lock);
                         err = lamb_account_get(rdb, username, &account);
+                        pthread_mutex_unlock(&rdb->lock);
                         if (err) {
                             cmpp_connect_resp(&sock, sequenceId, 9);
                             epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
@@ -247,7 +287,11 @@ void lamb_event_loop(cmpp_ismg_t *cmpp) {
                         }
 
                         /* Check Duplicate Logon */
-                        if (lamb_is_login(rdb, account.id)) {
+                        pthread_mutex_lock(&rdb->lock);
+                        err = lamb_is_login(rdb, account.id);
+                        pthread_mutex_unlock(&rdb->lock);
+
+                        if (err) {
                             cmpp_connect_resp(&sock, sequenceId, 10);
                             epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
                             close(sockfd);
@@ -260,26 +304,25 @@ void lamb_event_loop(cmpp_ismg_t *cmpp) {
                         /* Login Successfull */
                         syslog(LOG_INFO, "login successfull from client %s", inet_ntoa(clientaddr.sin_addr));
 
-                        /* Create Work Process */
-                        pid_t pid = fork();
-                        if (pid < 0) {
-                            syslog(LOG_ERR, "unable to fork child process");
-                        } else if (pid == 0) {
-                            close(epfd);
-                            cmpp_ismg_close(cmpp);
-                            lamb_cache_close(rdb);
-                            
-                            lamb_client_t client;
-                            client.sock = &sock;
-                            client.account = &account;
-                            client.addr = lamb_strdup(inet_ntoa(clientaddr.sin_addr));
-
-                            cmpp_connect_resp(&sock, sequenceId, 0);
-                            lamb_work_loop(&client);
-                            exit(EXIT_SUCCESS);
+                        session = lamb_session_new(sockfd, &account, inet_ntoa(clientaddr.sin_addr));
+
+                        if (!session) {
+                            cmpp_connect_resp(&sock, sequenceId, 9);
+                            close(sockfd);
+                            syslog(LOG_ERR, "can't create session for client %s", inet_ntoa(clientaddr.sin_addr));
+                            continue;
                         }
 
-                        cmpp_sock_close(&sock);
+                        /* Mark the account online before the first renewal */
+                        pthread_mutex_lock(&rdb->lock);
+                        lamb_state_renewal(rdb, account.id);
+                        lamb_clear_signal(rdb, account.id);
+                        pthread_mutex_unlock(&rdb->lock);
+
+                        cmpp_connect_resp(&session->sock, sequenceId, 0);
+
+                        /* Hand the client to the next worker */
+                        lamb_session_attach(&workers[next++ % config.work_threads], session);
                     } else {
                         cmpp_connect_resp(&sock, sequenceId, 3);
                         syslog(LOG_WARNING, "login failed form client %s", inet_ntoa(clientaddr.sin_addr));
@@ -294,401 +337,1232 @@ void lamb_event_loop(cmpp_ismg_t *cmpp) {
     return;
 }
 
-void lamb_work_loop(lamb_client_t *client) {
-    int rc;
-    int err, gid;
-    cmpp_pack_t pack;
-    unsigned long long msgId;
+int lamb_worker_init(lamb_worker_t *worker, int id) {
+    struct epoll_event ev;
+    lamb_channel_t *channel;
 
-    gid = getpid();
-    lamb_set_process("lamb-client");
-    pthread_cond_init(&cond, NULL);
-    pthread_mutex_init(&mutex, NULL);
-    memset(&status, 0, sizeof(lamb_status_t));
+    worker->id = id;
+    worker->count = 0;
+    worker->sessions = NULL;
+    pthread_mutex_init(&worker->lock, NULL);
 
-    /* Redis Cache */
-    err = lamb_cache_connect(rdb, "127.0.0.1", 6379, NULL, 0);
-    if (err) {
-        syslog(LOG_ERR, "can't connect to redis %s", "127.0.0.1");
-        return;
+    worker->epfd = epoll_create1(0);
+    if (worker->epfd < 0) {
+        return -1;
     }
 
-    /* Connect to MT server */
-    mt = lamb_nn_pair(config.mt, client->account->id, config.timeout);
-    if (mt < 0) {
-        syslog(LOG_ERR, "can't connect to mt %s", config.mt);
-        return;
-    }
+    /* Every channel is a client of its own, each one takes a batch at a time */
+    for (int i = 0; i < LAMB_ISMG_PIPELINE; i++) {
+        channel = &worker->channels[i];
+        channel->pushing = false;
+        channel->flying = 0;
+        channel->mt = lamb_mux_connect(config.mt, config.timeout);
+
+        /* The batches are sent without waiting, a reply wakes the worker */
+        if (channel->mt < 0 || lamb_mux_pipe(channel->mt) < 0) {
+            if (channel->mt >= 0) {
+                lamb_mux_close(channel->mt);
+            }
+            while (i-- > 0) {
+                lamb_mux_close(worker->channels[i].mt);
+            }
+            close(worker->epfd);
+            return -1;
+        }
 
-    /* Epoll Events */
-    int epfd, nfds;
-    struct epoll_event ev, events[32];
+        channel->local = (lamb_mux_fd(channel->mt) < 0);
+        channel->pipefd = lamb_mux_fd(lamb_mux_pipe(channel->mt));
+        channel->ev.type = LAMB_EVENT_MT;
+        channel->ev.session = NULL;
 
-    epfd = epoll_create1(0);
-    ev.data.fd = client->sock->fd;
-    ev.events = EPOLLIN;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, client->sock->fd, &ev);
+        if (channel->pipefd >= 0) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = &channel->ev;
+            epoll_ctl(worker->epfd, EPOLL_CTL_ADD, channel->pipefd, &ev);
+        }
+    }
 
-    /* Start Client Status Update Thread */
-    lamb_start_thread(lamb_stat_loop, client, 1);
+    return 0;
+}
 
-    /* Client Message Deliver */
-    lamb_start_thread(lamb_deliver_loop, client, 1);
+/*
+ * A worker waits on the CMPP sockets and the mo streams of its sessions
+ * and on the replies of mt. Packets to a client are buffered and written
+ * as the socket takes them, the submits of all sessions go to mt in a
+ * few batches at a time, so a slow client or a slow mt never blocks the
+ * other sessions. A reply on the ring wakes nobody, it is polled more
+ * often while a batch is there. The tick redelivers the messages whose
+ * confirmation timed out, polls the streams that have no descriptor and
+ * drops the closed sessions.
+ */
 
-    /* On line signal state synchronization */
-    lamb_start_thread(lamb_online_loop, client, 1);
+void *lamb_work_loop(void *arg) {
+    int nfds;
+    int timeout;
+    cmpp_pack_t pack;
+    lamb_event_t *event;
+    lamb_worker_t *worker;
+    unsigned long long now;
+    lamb_session_t *session, *next;
+    struct epoll_event events[64];
 
-    int len;
-    char *pk, *buf;
-    char phone[21] = {0};
-    char spcode[21] = {0};
-    int msgFmt = 0;
-    int length = 0;
-    char content[160] = {0};
-    Submit message = SUBMIT__INIT;
+    worker = (lamb_worker_t *)arg;
 
     while (true) {
-        nfds = epoll_wait(epfd, events, 32, -1);
+        timeout = LAMB_ISMG_TICK;
 
-        if (nfds > 0) {
-            /* Waiting for receive request */
-            err = cmpp_recv(client->sock, &pack, sizeof(pack));
-            if (err) {
-                if (err == -1) {
-                    syslog(LOG_INFO, "connection closed by client %s\n", client->addr);
-                    break;
-                }
+        for (int i = 0; i < LAMB_ISMG_PIPELINE; i++) {
+            if (worker->channels[i].pushing && worker->channels[i].local) {
+                timeout = LAMB_ISMG_POLL;
+            }
+        }
+
+        nfds = epoll_wait(worker->epfd, events, 64, timeout);
+
+        for (int i = 0; i < nfds; i++) {
+            event = (lamb_event_t *)events[i].data.ptr;
+
+            /* The replies of mt are taken below */
+            if (event->type == LAMB_EVENT_MT) {
                 continue;
             }
 
-            /* Analytic data packet header */
-            unsigned char result;
-            cmpp_head_t *chp = (cmpp_head_t *)&pack;
-            unsigned int commandId = ntohl(chp->commandId);
-            unsigned int sequenceId = ntohl(chp->sequenceId);
+            session = event->session;
 
-            /* Check protocol command */
-            switch (commandId) {
-            case CMPP_ACTIVE_TEST:
-                cmpp_active_test_resp(client->sock, sequenceId);
-                break;
-            case CMPP_SUBMIT:;
-                result = 0;
-                total++;
-                status.recv++;
-                
-                /* Generate Message ID */
-                msgId = lamb_gen_msgid(gid, lamb_sequence());
-                cmpp_pack_set_integer(&pack, cmpp_submit_msg_id, msgId, 8);
-
-                /* Message Resolution */
-                message.id = msgId;
-                message.account = client->account->id;
-                message.company = client->account->company;
-                message.spid = client->account->username;
-                cmpp_pack_get_string(&pack, cmpp_submit_dest_terminal_id, phone, 21, 20);
-                message.phone = phone;
-                cmpp_pack_get_string(&pack, cmpp_submit_src_id, spcode, 21, 20);
-                message.spcode = spcode;
-                cmpp_pack_get_integer(&pack, cmpp_submit_msg_fmt, &msgFmt, 1);
-
-                /* Check Message Encoded */
-                int codeds[] = {0, 8, 11, 15};
-                if (!lamb_check_format(msgFmt, codeds, sizeof(codeds) / sizeof(int))) {
-                    result = 11;
-                    status.fmt++;
-                    goto response;
+            /* Closed sessions are only released by the tick */
+            if (__atomic_load_n(&session->closing, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+
+            if (event->type == LAMB_EVENT_CMPP) {
+                if (events[i].events & EPOLLOUT) {
+                    lamb_session_drain(worker, session);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    lamb_session_read(worker, session, &pack);
                 }
+            } else {
+                lamb_session_push(session);
+            }
+        }
 
-                message.msgfmt = msgFmt;
+        lamb_worker_answer(worker);
 
-                cmpp_pack_get_integer(&pack, cmpp_submit_msg_length, &length, 1);
-                
-                /* Check Message Length */
-                if (length > 159 || length < 1) {
-                    result = 4;
-                    status.len++;
-                    goto response;
-                }
+        now = lamb_now_microsecond();
 
-                message.length = length;
+        pthread_mutex_lock(&worker->lock);
 
-                cmpp_pack_get_string(&pack, cmpp_submit_msg_content, content, 160, length);
-                message.content.len = length;
-                message.content.data = (uint8_t *)content;
+        for (session = worker->sessions; session; session = next) {
+            next = session->next;
 
-                len = submit__get_packed_size(&message);
-                pk = (char *)malloc(len);
+            if (__atomic_load_n(&session->closing, __ATOMIC_ACQUIRE)) {
+                lamb_session_close(worker, session);
+                continue;
+            }
 
-                if (!pk) {
-                    result = 12;
-                    goto response;
-                }
+            lamb_session_expire(worker, session, now);
 
-                submit__pack(&message, (uint8_t *)pk);
+            if (session->olen > 0) {
+                lamb_session_drain(worker, session);
+            }
+        }
 
-                len = lamb_pack_assembly(&buf, LAMB_SUBMIT, pk, len);
+        lamb_worker_flush(worker);
 
-                /* Write Message to MT Server */
-                rc = nn_send(mt, buf, len, NN_DONTWAIT);
+        pthread_mutex_unlock(&worker->lock);
+    }
 
-                if (rc != len) {
-                    result = 13;
-                    status.err++;
-                } else {
-                    status.store++;
+    pthread_exit(NULL);
+}
+
+/*
+ * Send the waiting submits of the sessions on the idle channels. Every
+ * session gets an equal share of a batch, so a single busy client can't
+ * crowd out the others. The submits of a session are only in one batch
+ * at a time, which keeps the replies to the client in order.
+ */
+
+void lamb_worker_flush(lamb_worker_t *worker) {
+    int share;
+    lamb_batch_t batch;
+    lamb_channel_t *channel;
+    lamb_session_t *session;
+    lamb_pending_t *pending;
+
+    if (worker->count < 1) {
+        return;
+    }
+
+    share = LAMB_MAX_BATCH / worker->count;
+    share = (share > 0) ? share : 1;
+
+    for (int c = 0; c < LAMB_ISMG_PIPELINE; c++) {
+        channel = &worker->channels[c];
+
+        if (channel->pushing) {
+            continue;
+        }
+
+        batch.buf = NULL;
+
+        for (session = worker->sessions; session && channel->flying < LAMB_MAX_BATCH; session = session->next) {
+            if (__atomic_load_n(&session->closing, __ATOMIC_ACQUIRE) || session->sent > 0) {
+                continue;
+            }
+
+            for (int i = 0; i < share && session->sent < session->count && channel->flying < LAMB_MAX_BATCH; i++) {
+                if (!batch.buf && lamb_batch_init(&batch, LAMB_ISMG_BUFFER) != 0) {
+                    lamb_channel_reset(channel);
+                    return;
                 }
 
-                free(pk);
-                free(buf);
+                pending = &session->backlog[(session->head + session->sent) % config.window];
 
-                /* Submit Response */
-            response:
-                cmpp_submit_resp(client->sock, sequenceId, msgId, result);
-                break;
-            case CMPP_DELIVER_RESP:;
-                result = 0;
-                status.ack++;
-
-                cmpp_pack_get_integer(&pack, cmpp_deliver_resp_result, &result, 1);
-                cmpp_pack_get_integer(&pack, cmpp_deliver_resp_msg_id, &msgId, 8);
-                
-                if ((confirmed.sequenceId == sequenceId) && (confirmed.msgId == msgId) && (result == 0)) {
-                    pthread_cond_signal(&cond);
+                if (lamb_session_submit(&batch, session, pending) != 0) {
+                    break;
                 }
-                
-                break;
-            case CMPP_TERMINATE:
-                cmpp_terminate_resp(client->sock, sequenceId);
-                goto exit;
+
+                session->sent++;
+                channel->flight[channel->flying++] = session;
             }
         }
+
+        /* Nothing is left for the other channels either */
+        if (channel->flying == 0) {
+            lamb_batch_free(&batch);
+            return;
+        }
+
+        /* mt is not reachable, the tick tries again */
+        if (lamb_mux_push(channel->mt, &batch) != 0) {
+            lamb_channel_reset(channel);
+            return;
+        }
+
+        channel->pushing = true;
+        channel->deadline = lamb_now_microsecond() + config.timeout * 1000ULL;
     }
 
-exit:
-    close(epfd);
-    lamb_nn_close(mt);
-    cmpp_sock_close(client->sock);
-    pthread_cond_destroy(&cond);
-    pthread_mutex_destroy(&mutex);
-    
     return;
 }
 
-void *lamb_deliver_loop(void *data) {
+/* Take the replies that are there, a lost one frees its channel on timeout */
+void lamb_worker_answer(lamb_worker_t *worker) {
+    unsigned long long now;
+    lamb_channel_t *channel;
+
+    now = lamb_now_microsecond();
+
+    for (int i = 0; i < LAMB_ISMG_PIPELINE; i++) {
+        channel = &worker->channels[i];
+
+        if (!channel->pushing) {
+            continue;
+        }
+
+        lamb_channel_answer(worker, channel);
+
+        /* The submits go out again with a later batch */
+        if (channel->pushing && now >= channel->deadline) {
+            syslog(LOG_WARNING, "no reply of mt to a batch of %d submits", channel->flying);
+            lamb_channel_reset(channel);
+        }
+    }
+
+    return;
+}
+
+/*
+ * Take the reply of mt to the batch of the channel, it has a command for
+ * every submit. A batch mt could not take at all is answered with a
+ * single command, which then stands for every submit.
+ */
+
+void lamb_channel_answer(lamb_worker_t *worker, lamb_channel_t *channel) {
+    int rc, len;
+    int count;
     char *buf;
-    int rc, len, err;
-    lamb_client_t *client;
-    unsigned int sequenceId;
-    char *stat;
-    Report *report;
-    Deliver *deliver;
 
-    client = (lamb_client_t *)data;
+    len = lamb_mux_recv(channel->mt, &buf);
+
+    if (len == 0) {
+        return;
+    }
+
+    if (len < 0) {
+        lamb_channel_reset(channel);
+        return;
+    }
+
+    count = 0;
+
+    if (CHECK_COMMAND(buf) == LAMB_PUSH) {
+        count = lamb_batch_count(buf, len);
+        if (count < 0 || HEAD * 2 + count * sizeof(int) > len) {
+            count = 0;
+        }
+    }
+
+    for (int i = 0; i < channel->flying; i++) {
+        if (!channel->flight[i]) {
+            continue;
+        }
+
+        if (CHECK_COMMAND(buf) != LAMB_PUSH) {
+            rc = CHECK_COMMAND(buf);
+        } else {
+            rc = (i < count) ? ntohl(((int *)(buf + HEAD * 2))[i]) : LAMB_BUSY;
+        }
+
+        lamb_session_answer(worker, channel->flight[i], rc);
+    }
+
+    nn_freemsg(buf);
+    lamb_channel_reset(channel);
+
+    return;
+}
+
+/* Forget the batch, its unanswered submits are sent again */
+void lamb_channel_reset(lamb_channel_t *channel) {
+    for (int i = 0; i < channel->flying; i++) {
+        if (channel->flight[i]) {
+            channel->flight[i]->sent = 0;
+        }
+    }
+
+    channel->flying = 0;
+    channel->pushing = false;
+
+    return;
+}
+
+lamb_session_t *lamb_session_new(int fd, lamb_account_t *account, const char *addr) {
+    lamb_session_t *self;
+
+    self = (lamb_session_t *)calloc(1, sizeof(lamb_session_t));
+    if (!self) {
+        return NULL;
+    }
+
+    cmpp_sock_init(&self->sock, fd);
+    cmpp_sock_setting(&self->sock, CMPP_SOCK_SENDTIMEOUT, config.send_timeout);
+    cmpp_sock_setting(&self->sock, CMPP_SOCK_RECVTIMEOUT, config.recv_timeout);
+
+    self->backlog = (lamb_pending_t *)calloc(config.window, sizeof(lamb_pending_t));
+    self->inflight = (lamb_inflight_t *)calloc(config.deliver_window, sizeof(lamb_inflight_t));
+    if (!self->backlog || !self->inflight) {
+        free(self->backlog);
+        free(self->inflight);
+        free(self);
+        return NULL;
+    }
+
+    memcpy(&self->account, account, sizeof(lamb_account_t));
+    strncpy(self->addr, addr, sizeof(self->addr) - 1);
 
     /* Connect to MO server */
-    mo = lamb_nn_reqrep(config.mo, client->account->id, config.timeout);
-    if (mo < 0) {
+    self->mo = lamb_mux_connect(config.mo, config.timeout);
+    if (self->mo < 0) {
         syslog(LOG_ERR, "can't connect to mo %s", config.mo);
-        pthread_exit(NULL);
+        free(self->backlog);
+        free(self->inflight);
+        free(self);
+        return NULL;
     }
 
-    char *req;
-    len = lamb_pack_assembly(&req, LAMB_REQ, NULL, 0);
+    /* A worker never blocks on mo, a batch is taken once it is there */
+    lamb_mux_timeout(self->mo, 0);
+    self->mofd = lamb_mux_fd(self->mo);
 
-    while (true) {
-        rc = nn_send(mo, req, len, NN_DONTWAIT);
+    self->cmpp_ev.type = LAMB_EVENT_CMPP;
+    self->cmpp_ev.session = self;
+    self->mo_ev.type = LAMB_EVENT_MO;
+    self->mo_ev.session = self;
+    self->events = EPOLLIN;
 
-        if (rc != len) {
-            lamb_sleep(1000);
-            continue;
+    return self;
+}
+
+void lamb_session_attach(lamb_worker_t *worker, lamb_session_t *session) {
+    struct epoll_event ev;
+
+    pthread_mutex_lock(&worker->lock);
+
+    session->next = worker->sessions;
+    if (worker->sessions) {
+        worker->sessions->prev = session;
+    }
+    worker->sessions = session;
+    worker->count++;
+
+    /* Ask for the first batch, the reply wakes the worker */
+    lamb_session_push(session);
+
+    pthread_mutex_unlock(&worker->lock);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &session->cmpp_ev;
+    epoll_ctl(worker->epfd, EPOLL_CTL_ADD, session->sock.fd, &ev);
+
+    if (session->mofd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &session->mo_ev;
+        epoll_ctl(worker->epfd, EPOLL_CTL_ADD, session->mofd, &ev);
+    }
+
+    return;
+}
+
+void lamb_session_read(lamb_worker_t *worker, lamb_session_t *session, cmpp_pack_t *pack) {
+    int err;
+    int msgFmt = 0;
+    int length = 0;
+    unsigned char result;
+    unsigned long long msgId;
+    lamb_pending_t *pending;
+
+    /* Waiting for receive request */
+    err = cmpp_recv(&session->sock, pack, sizeof(cmpp_pack_t));
+    if (err) {
+        if (err == -1) {
+            syslog(LOG_INFO, "connection closed by client %s\n", session->addr);
+            __atomic_store_n(&session->closing, true, __ATOMIC_RELEASE);
+        }
+        return;
+    }
+
+    /* Analytic data packet header */
+    cmpp_head_t *chp = (cmpp_head_t *)pack;
+    unsigned int commandId = ntohl(chp->commandId);
+    unsigned int sequenceId = ntohl(chp->sequenceId);
+
+    /* Check protocol command */
+    switch (commandId) {
+    case CMPP_ACTIVE_TEST:
+        lamb_session_packet(session, CMPP_ACTIVE_TEST_RESP, sequenceId, 1);
+        break;
+    case CMPP_SUBMIT:;
+        result = 0;
+        __atomic_fetch_add(&session->total, 1, __ATOMIC_RELAXED);
+        session->status.recv++;
+
+        /* Generate Message ID */
+        msgId = lamb_session_msgid();
+        cmpp_pack_set_integer(pack, cmpp_submit_msg_id, msgId, 8);
+
+        /* The submit takes the next window slot, reading stops while it is full */
+        pending = &session->backlog[(session->head + session->count) % config.window];
+        memset(pending, 0, sizeof(lamb_pending_t));
+        pending->sequenceId = sequenceId;
+
+        /* Message Resolution */
+        pending->message.id = msgId;
+        pending->message.account = session->account.id;
+        pending->message.company = session->account.company;
+        strncpy(pending->message.spid, session->account.username, sizeof(pending->message.spid) - 1);
+        cmpp_pack_get_string(pack, cmpp_submit_dest_terminal_id, pending->message.phone, 21, 20);
+        cmpp_pack_get_string(pack, cmpp_submit_src_id, pending->message.spcode, 21, 20);
+        cmpp_pack_get_integer(pack, cmpp_submit_msg_fmt, &msgFmt, 1);
+
+        /* Check Message Encoded */
+        int codeds[] = {0, 8, 11, 15};
+        if (!lamb_check_format(msgFmt, codeds, sizeof(codeds) / sizeof(int))) {
+            result = 11;
+            session->status.fmt++;
+            goto response;
         }
 
-        rc = nn_recv(mo, &buf, NN_MSG, 0);
+        pending->message.msgfmt = msgFmt;
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
-            lamb_sleep(100);
-            continue;
+        cmpp_pack_get_integer(pack, cmpp_submit_msg_length, &length, 1);
+
+        /* Check Message Length */
+        if (length > 159 || length < 1) {
+            result = 4;
+            session->status.len++;
+            goto response;
         }
 
-        /* No available messages */
-        if (CHECK_COMMAND(buf) == LAMB_EMPTY) {
-            nn_freemsg(buf);
-            lamb_sleep(200);
-            continue;
+        pending->message.length = length;
+        cmpp_pack_get_string(pack, cmpp_submit_msg_content, pending->message.content, 160, length);
+
+        /* Submits are answered in order once mt accepts them */
+        session->count++;
+
+        if (session->count >= config.window) {
+            lamb_session_pause(worker, session, true);
         }
 
-        /* State report message */
-        if (CHECK_COMMAND(buf) == LAMB_REPORT) {
-            report = report__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
+        break;
+
+        /* Submit Response */
+    response:
+        lamb_session_submit_resp(session, sequenceId, msgId, result);
+        break;
+    case CMPP_DELIVER_RESP:;
+        result = 0;
+        session->status.ack++;
+
+        cmpp_pack_get_integer(pack, cmpp_deliver_resp_result, &result, 1);
+        cmpp_pack_get_integer(pack, cmpp_deliver_resp_msg_id, &msgId, 8);
+
+        /* A rejected record stays in flight and is sent again on timeout */
+        if (result == 0) {
+            lamb_session_confirm(session, sequenceId, be64toh(msgId));
+        }
 
-            if (!report) {
-                nn_freemsg(buf);
+        break;
+    case CMPP_TERMINATE:
+        lamb_session_packet(session, CMPP_TERMINATE_RESP, sequenceId, 0);
+        __atomic_store_n(&session->closing, true, __ATOMIC_RELEASE);
+        break;
+    }
+
+    return;
+}
+
+/* Add a submit to the batch for mt */
+int lamb_session_submit(lamb_batch_t *batch, lamb_session_t *session, lamb_pending_t *pending) {
+    char *pk;
+    size_t len;
+    Submit message = SUBMIT__INIT;
+
+    message.id = pending->message.id;
+    message.account = pending->message.account;
+    message.company = pending->message.company;
+    message.spid = pending->message.spid;
+    message.phone = pending->message.phone;
+    message.spcode = pending->message.spcode;
+    message.msgfmt = pending->message.msgfmt;
+    message.length = pending->message.length;
+    message.content.len = pending->message.length;
+    message.content.data = (uint8_t *)pending->message.content;
+
+    len = submit__get_packed_size(&message);
+    pk = lamb_mux_record(batch, LAMB_SUBMIT, session->account.id, len);
+
+    if (!pk) {
+        return -1;
+    }
+
+    submit__pack(&message, (uint8_t *)pk);
+
+    return 0;
+}
+
+/*
+ * The reply of mt to the oldest submit of the session in the batch. A
+ * busy or unreachable mt keeps it and the rest of the window for the
+ * next batch, so a slow queue slows the client down instead of failing
+ * its submits. Only a submit mt rejects is answered with an error.
+ */
+
+void lamb_session_answer(lamb_worker_t *worker, lamb_session_t *session, int rc) {
+    unsigned char result;
+    lamb_pending_t *pending;
+
+    /* The submits after a busy one are sent again as well */
+    if (session->sent < 1) {
+        return;
+    }
+
+    if (rc == LAMB_OK) {
+        result = 0;
+        session->status.store++;
+    } else if (rc == LAMB_REJECT) {
+        result = 13;
+        session->status.err++;
+    } else {
+        session->sent = 0;
+        return;
+    }
+
+    pending = &session->backlog[session->head];
+    lamb_session_submit_resp(session, pending->sequenceId, pending->message.id, result);
+
+    session->head = (session->head + 1) % config.window;
+    session->count--;
+    session->sent--;
+
+    if (session->paused && session->count < config.window) {
+        lamb_session_pause(worker, session, false);
+    }
+
+    return;
+}
+
+/* Stop or resume reading the client, TCP holds the client back meanwhile */
+void lamb_session_pause(lamb_worker_t *worker, lamb_session_t *session, bool paused) {
+    session->paused = paused;
+    lamb_session_watch(worker, session);
+
+    return;
+}
+
+/* Read while the window and the output have room, write while output is left */
+void lamb_session_watch(lamb_worker_t *worker, lamb_session_t *session) {
+    unsigned int events;
+    struct epoll_event ev;
+
+    events = 0;
+
+    if (!session->paused && session->olen - session->osent < LAMB_ISMG_OUTPUT) {
+        events |= EPOLLIN;
+    }
+
+    if (session->osent < session->olen) {
+        events |= EPOLLOUT;
+    }
+
+    if (events == session->events) {
+        return;
+    }
+
+    ev.events = events;
+    ev.data.ptr = &session->cmpp_ev;
+
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_MOD, session->sock.fd, &ev) == 0) {
+        session->events = events;
+    }
+
+    return;
+}
+
+/* Append a CMPP packet to the output of the session, returns its zeroed body */
+char *lamb_session_packet(lamb_session_t *session, unsigned int command, unsigned int sequenceId, size_t len) {
+    char *buf;
+    size_t size;
+    unsigned int head[3];
+
+    if (session->olen + sizeof(head) + len > session->osize) {
+        /* Drop what the socket has taken before growing the buffer */
+        if (session->osent > 0) {
+            memmove(session->out, session->out + session->osent, session->olen - session->osent);
+            session->olen -= session->osent;
+            session->osent = 0;
+        }
+
+        size = (session->osize > 0) ? session->osize : LAMB_ISMG_BUFFER;
+
+        while (session->olen + sizeof(head) + len > size) {
+            size *= 2;
+        }
+
+        if (size != session->osize) {
+            buf = (char *)realloc(session->out, size);
+            if (!buf) {
+                syslog(LOG_ERR, "the kernel can't allocate memory");
+                return NULL;
+            }
+            session->out = buf;
+            session->osize = size;
+        }
+    }
+
+    head[0] = htonl(sizeof(head) + len);
+    head[1] = htonl(command);
+    head[2] = htonl(sequenceId);
+
+    buf = session->out + session->olen;
+    memcpy(buf, head, sizeof(head));
+    memset(buf + sizeof(head), 0, len);
+    session->olen += sizeof(head) + len;
+
+    return buf + sizeof(head);
+}
+
+void lamb_session_submit_resp(lamb_session_t *session, unsigned int sequenceId, unsigned long long msgId, unsigned char result) {
+    lamb_cmpp_submit_resp_t *resp;
+
+    resp = (lamb_cmpp_submit_resp_t *)lamb_session_packet(session, CMPP_SUBMIT_RESP, sequenceId,
+                                                           sizeof(lamb_cmpp_submit_resp_t));
+
+    if (!resp) {
+        session->status.err++;
+        return;
+    }
+
+    resp->msgId = htobe64(msgId);
+    resp->result = result;
+
+    return;
+}
+
+/* Write the buffered packets as far as the socket takes them */
+void lamb_session_drain(lamb_worker_t *worker, lamb_session_t *session) {
+    ssize_t rc;
+
+    while (session->osent < session->olen) {
+        rc = send(session->sock.fd, session->out + session->osent, session->olen - session->osent,
+                  MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
                 continue;
             }
 
-            sequenceId = confirmed.sequenceId = cmpp_sequence();
-            confirmed.msgId = report->id;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                syslog(LOG_INFO, "can't write to client %s, connection closed", session->addr);
+                __atomic_store_n(&session->closing, true, __ATOMIC_RELEASE);
+                return;
+            }
 
-            /* State report type */
-            switch (report->status) {
-            case 1:
-                stat = "DELIVRD";
-                break;
-            case 2:
-                stat = "EXPIRED";
-                break;
-            case 3:
-                stat = "DELETED";
-                break;
-            case 4:
-                stat = "UNDELIV";
-                break;
-            case 5:
-                stat = "ACCEPTD";
-                break;
-            case 6:
-                stat = "UNKNOWN";
-                break;
-            case 7:
-                stat = "REJECTD";
-                break;
-            default:
-                stat = "UNKNOWN";
-                break;
+            break;
+        }
+
+        session->osent += rc;
+    }
+
+    if (session->osent == session->olen) {
+        session->osent = session->olen = 0;
+
+        /* A batch held back by a full output goes on */
+        if (session->batch) {
+            lamb_session_push(session);
+        }
+    }
+
+    lamb_session_watch(worker, session);
+
+    return;
+}
+
+/*
+ * Keep up to DeliverWindow reports and delivers in flight, so the
+ * stream is bound by the client's link rather than its round trip.
+ */
+
+void lamb_session_push(lamb_session_t *session) {
+    int i, rc;
+    int count;
+    char *buf;
+    bool asked;
+    lamb_inflight_t *entry;
+
+    asked = false;
+
+    while (session->sending < config.deliver_window) {
+        /* The client reads slower than messages come, they wait in the batch */
+        if (session->olen - session->osent >= LAMB_ISMG_OUTPUT) {
+            return;
+        }
+
+        if (!session->batch || lamb_batch_next(session->batch, session->blen, &session->offset,
+                                               &session->method, &session->payload, &session->plen) != 0) {
+            if (session->batch) {
+                lamb_mux_release(session->mo, session->batch);
+                session->batch = NULL;
             }
 
-        report:
-            err = cmpp_report(client->sock, sequenceId, report->id, report->spcode, stat,
-                              report->submittime, report->donetime, report->phone, 0);
-            if (err) {
-                status.err++;
-                syslog(LOG_WARNING, "sending report packet to client %s failed", client->addr);
+            /*
+             * An empty queue holds the request until messages arrive. Only
+             * the free slots are asked for, a batch never outlives the window.
+             */
+            count = config.deliver_window - session->sending;
+            count = (count < LAMB_MAX_BATCH) ? count : LAMB_MAX_BATCH;
+            rc = lamb_mux_fetch(session->mo, session->account.id, count, LAMB_MAX_BYTES,
+                                &session->pending, &buf);
+
+            if (rc < 0) {
+                session->retry = lamb_now_microsecond() + 1000000ULL;
+                return;
             }
-        } else if (CHECK_COMMAND(buf) == LAMB_DELIVER) {
-            /* User message delivery */
-            deliver = deliver__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
 
-            if (!deliver) {
-                nn_freemsg(buf);
+            if (rc == 0) {
+                /* The queue stayed empty, ask once more and wait for the reply */
+                if (session->pending || asked) {
+                    return;
+                }
+                asked = true;
                 continue;
             }
 
-            sequenceId = confirmed.sequenceId = cmpp_sequence();
-            confirmed.msgId = deliver->id;
+            session->batch = buf;
+            session->blen = rc;
+            session->offset = 0;
+            continue;
+        }
 
-        deliver:
-            err = cmpp_deliver(client->sock, sequenceId, deliver->id, deliver->spcode, deliver->phone,
-                               (char *)deliver->content.data, deliver->content.len, deliver->msgfmt);
-            if (err) {
-                status.err++;
-                syslog(LOG_WARNING, "sending deliver packet to client %s failed", client->addr);
-            }
+        if (session->method != LAMB_REPORT && session->method != LAMB_DELIVER) {
+            continue;
         }
 
-        /* Waiting for ACK message confirmation */
-        err = lamb_wait_confirmation(&cond, &mutex, config.acknowledge_timeout);
+        if (session->plen > LAMB_ISMG_FRAME) {
+            session->status.err++;
+            syslog(LOG_WARNING, "oversized message of %zu bytes for client %s dropped", session->plen, session->addr);
+            continue;
+        }
 
-        if (err == ETIMEDOUT) {
-            status.timeo++;
-            if (CHECK_COMMAND(buf) == LAMB_REPORT) {
-                goto report;
-            } else if (CHECK_COMMAND(buf) == LAMB_DELIVER) {
-                goto deliver;
+        /* The batch is released before the client confirms, keep a copy for redelivery */
+        for (i = 0, entry = NULL; i < config.deliver_window; i++) {
+            if (!session->inflight[i].used) {
+                entry = &session->inflight[i];
+                break;
             }
         }
 
-        if (CHECK_COMMAND(buf) == LAMB_REPORT) {
-            report__free_unpacked(report, NULL);
-        } else if (CHECK_COMMAND(buf) == LAMB_DELIVER) {
-            deliver__free_unpacked(deliver, NULL);
+        entry->used = true;
+        entry->method = session->method;
+        entry->len = session->plen;
+        entry->sequenceId = cmpp_sequence();
+        memcpy(entry->payload, session->payload, session->plen);
+        session->sending++;
+
+        if (lamb_session_send(session, entry) != 0) {
+            entry->used = false;
+            session->sending--;
         }
+    }
+
+    return;
+}
 
-        status.rep++;        
-        nn_freemsg(buf);
+/* Buffer a record of the in flight table and restart its timer */
+int lamb_session_send(lamb_session_t *session, lamb_inflight_t *entry) {
+    char *stat;
+    char *content;
+    Report *report;
+    Deliver *deliver;
+    lamb_cmpp_report_t *state;
+
+    /* State report message */
+    if (entry->method == LAMB_REPORT) {
+        report = report__unpack(lamb_arena(), entry->len, (uint8_t *)entry->payload);
+
+        if (!report) {
+            return -1;
+        }
+
+        /* State report type */
+        switch (report->status) {
+        case 1:
+            stat = "DELIVRD";
+            break;
+        case 2:
+            stat = "EXPIRED";
+            break;
+        case 3:
+            stat = "DELETED";
+            break;
+        case 4:
+            stat = "UNDELIV";
+            break;
+        case 5:
+            stat = "ACCEPTD";
+            break;
+        case 6:
+            stat = "UNKNOWN";
+            break;
+        case 7:
+            stat = "REJECTD";
+            break;
+        default:
+            stat = "UNKNOWN";
+            break;
+        }
+
+        entry->msgId = report->id;
+        content = lamb_session_deliver(session, entry, report->spcode, report->phone, 0, 1,
+                                       sizeof(lamb_cmpp_report_t));
+
+        if (content) {
+            state = (lamb_cmpp_report_t *)content;
+            state->msgId = htobe64(report->id);
+            strncpy(state->stat, stat, sizeof(state->stat));
+            strncpy(state->submitTime, report->submittime, sizeof(state->submitTime));
+            strncpy(state->doneTime, report->donetime, sizeof(state->doneTime));
+            strncpy(state->destTerminalId, report->phone, sizeof(state->destTerminalId));
+        } else {
+            session->status.err++;
+        }
+
+        report__free_unpacked(report, lamb_arena());
+    } else {
+        /* User message delivery */
+        deliver = deliver__unpack(lamb_arena(), entry->len, (uint8_t *)entry->payload);
+
+        if (!deliver) {
+            return -1;
+        }
+
+        /* The length of the content has a single byte */
+        if (deliver->content.len > 255) {
+            deliver__free_unpacked(deliver, lamb_arena());
+            return -1;
+        }
+
+        entry->msgId = deliver->id;
+        content = lamb_session_deliver(session, entry, deliver->spcode, deliver->phone, deliver->msgfmt, 0,
+                                       deliver->content.len);
+
+        if (content) {
+            memcpy(content, deliver->content.data, deliver->content.len);
+        } else {
+            session->status.err++;
+        }
+
+        deliver__free_unpacked(deliver, lamb_arena());
     }
 
-    pthread_exit(NULL);
+    /* A packet that can't be buffered is retried with the timeouts */
+    entry->deadline = lamb_now_microsecond() + config.acknowledge_timeout * 1000ULL;
+
+    return 0;
 }
 
-void *lamb_stat_loop(void *data) {
-    int signal;
-    lamb_client_t *client;
-    unsigned long long speed;
-    unsigned long long error;
-    time_t last_time;
-    int interval;
+/* Append the CMPP_DELIVER of an entry, returns where its length bytes of content go */
+char *lamb_session_deliver(lamb_session_t *session, lamb_inflight_t *entry, char *spcode, char *phone,
+                           int msgFmt, int registered, size_t length) {
+    lamb_cmpp_deliver_t *deliver;
 
-    redisReply *reply = NULL;
-    last_time = time(NULL);
-    client = (lamb_client_t *)data;
+    /* The content is followed by 8 reserved bytes */
+    deliver = (lamb_cmpp_deliver_t *)lamb_session_packet(session, CMPP_DELIVER, entry->sequenceId,
+                                                         sizeof(lamb_cmpp_deliver_t) + length + 8);
+
+    if (!deliver) {
+        return NULL;
+    }
 
-    pthread_mutex_lock(&rdb->lock);
-    lamb_clear_signal(rdb, client->account->id);
-    pthread_mutex_unlock(&rdb->lock);
+    deliver->msgId = htobe64(entry->msgId);
+    strncpy(deliver->destId, spcode, sizeof(deliver->destId));
+    strncpy(deliver->srcTerminalId, phone, sizeof(deliver->srcTerminalId));
+    deliver->msgFmt = msgFmt;
+    deliver->registeredDelivery = registered;
+    deliver->msgLength = length;
+
+    return (char *)deliver + sizeof(lamb_cmpp_deliver_t);
+}
+
+/* Free the slot of a confirmed record and fill the window again */
+void lamb_session_confirm(lamb_session_t *session, unsigned int sequenceId, unsigned long long msgId) {
+    int i;
+    lamb_inflight_t *entry;
+
+    for (i = 0; i < config.deliver_window; i++) {
+        entry = &session->inflight[i];
+        if (entry->used && entry->sequenceId == sequenceId && entry->msgId == msgId) {
+            entry->used = false;
+            session->sending--;
+            session->status.rep++;
+            lamb_session_push(session);
+            break;
+        }
+    }
+
+    return;
+}
+
+void lamb_session_expire(lamb_worker_t *worker, lamb_session_t *session, unsigned long long now) {
+    int i;
+    lamb_inflight_t *entry;
+
+    /* Records the client has not confirmed in time are sent again */
+    if (session->sending > 0) {
+        for (i = 0; i < config.deliver_window; i++) {
+            entry = &session->inflight[i];
+
+            if (session->olen - session->osent >= LAMB_ISMG_OUTPUT) {
+                break;
+            }
+
+            if (entry->used && now >= entry->deadline) {
+                session->status.timeo++;
+                if (lamb_session_send(session, entry) != 0) {
+                    entry->used = false;
+                    session->sending--;
+                }
+            }
+        }
+    }
+
+    /* Streams without a descriptor and failed fetches are retried here */
+    if (session->mofd < 0 || (session->retry > 0 && now >= session->retry)) {
+        session->retry = 0;
+        lamb_session_push(session);
+    }
+
+    return;
+}
+
+/* Take a session off its worker, the worker lock must be held */
+void lamb_session_close(lamb_worker_t *worker, lamb_session_t *session) {
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, session->sock.fd, NULL);
+
+    if (session->mofd >= 0) {
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, session->mofd, NULL);
+    }
+
+    /* The reply to its submits in a batch is not wanted anymore */
+    for (int c = 0; c < LAMB_ISMG_PIPELINE; c++) {
+        for (int i = 0; i < worker->channels[c].flying; i++) {
+            if (worker->channels[c].flight[i] == session) {
+                worker->channels[c].flight[i] = NULL;
+            }
+        }
+    }
+
+    /* Last chance for what is buffered, the terminate response above all */
+    if (session->osent < session->olen) {
+        send(session->sock.fd, session->out + session->osent, session->olen - session->osent,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    cmpp_sock_close(&session->sock);
+
+    /* Submits mt never accepted were not answered, the client sends them again */
+    free(session->backlog);
+    free(session->out);
+    session->backlog = NULL;
+    session->out = NULL;
+
+    if (session->prev) {
+        session->prev->next = session->next;
+    } else {
+        worker->sessions = session->next;
+    }
+
+    if (session->next) {
+        session->next->prev = session->prev;
+    }
+
+    worker->count--;
+
+    syslog(LOG_INFO, "session of client %s closed", session->addr);
+
+    /* mo may be slow, the worker hands the rest to the requeue thread */
+    pthread_mutex_lock(&requeue_lock);
+    session->prev = NULL;
+    session->next = requeued;
+    requeued = session;
+    pthread_cond_signal(&requeue_cond);
+    pthread_mutex_unlock(&requeue_lock);
+
+    return;
+}
+
+/*
+ * Return the messages of closed sessions to mo and release them. The
+ * round trips may take seconds while mo is busy, no worker waits on them.
+ */
+
+void *lamb_requeue_loop(void *arg) {
+    lamb_session_t *session, *next;
 
     while (true) {
-        interval = time(NULL) - last_time;
+        pthread_mutex_lock(&requeue_lock);
 
-        if (interval > 0) {
-            speed = total / interval;
+        while (!requeued) {
+            pthread_cond_wait(&requeue_cond, &requeue_lock);
         }
 
-        total = 0;
-        last_time = time(NULL);
+        session = requeued;
+        requeued = NULL;
+
+        pthread_mutex_unlock(&requeue_lock);
+
+        for (; session; session = next) {
+            next = session->next;
+
+            lamb_session_requeue(session);
+            lamb_mux_close(session->mo);
+
+            free(session->inflight);
+            free(session);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Give the reports and delivers the client has not confirmed back to mo,
+ * the next session of the account gets them again. A fetch still waiting
+ * is answered within the park time of mo, its batch goes back as well.
+ */
+
+void lamb_session_requeue(lamb_session_t *session) {
+    int rc;
+    char *buf;
+    int returned, lost;
+    lamb_inflight_t *entry;
+
+    returned = lost = 0;
+
+    if (session->pending) {
+        lamb_mux_timeout(session->mo, config.timeout);
+        rc = lamb_mux_fetch(session->mo, session->account.id, 0, 0, &session->pending, &buf);
+
+        if (rc > 0) {
+            if (session->batch) {
+                lamb_mux_release(session->mo, session->batch);
+            }
+            session->batch = buf;
+            session->blen = rc;
+            session->offset = 0;
+        }
+    }
 
-        error = status.timeo + status.fmt + status.len + status.err;
+    for (int i = 0; i < config.deliver_window; i++) {
+        entry = &session->inflight[i];
 
-        pthread_mutex_lock(&rdb->lock);
-        reply = redisCommand(rdb->handle, "HMSET client.%d pid %u addr %s speed %llu error %llu",
-                             client->account->id, getpid(), client->addr, speed, error);
-        pthread_mutex_unlock(&rdb->lock);
+        if (!entry->used) {
+            continue;
+        }
 
-        if (reply != NULL) {
-            freeReplyObject(reply);
-            reply = NULL;
+        /* Once mo fails the rest is not waited for */
+        if (lost == 0 && lamb_session_return(session, entry->method, entry->payload, entry->len) == 0) {
+            returned++;
         } else {
-            syslog(LOG_ERR, "lamb exec redis command error");
+            lost++;
         }
+    }
 
-#ifdef _DEBUG
-        printf("-[ %s ]-> recv: %llu, store: %llu, rep: %llu, delv: %llu, ack: %llu, "
-               "timeo: %llu, fmt: %llu, len: %llu, err: %llu\n",
-               client->account->username, status.recv, status.store, status.rep,
-               status.delv, status.ack, status.timeo, status.fmt, status.len, status.err);
-#endif
+    if (session->batch) {
+        while (lamb_batch_next(session->batch, session->blen, &session->offset, &session->method,
+                               &session->payload, &session->plen) == 0) {
+            if (session->method != LAMB_REPORT && session->method != LAMB_DELIVER) {
+                continue;
+            }
 
-        pthread_mutex_lock(&rdb->lock);
-        signal = lamb_check_signal(rdb, client->account->id);
-        pthread_mutex_unlock(&rdb->lock);
+            if (lost == 0 && lamb_session_return(session, session->method, session->payload, session->plen) == 0) {
+                returned++;
+            } else {
+                lost++;
+            }
+        }
 
-        if (signal == 9) {
-            lamb_nn_close(mt);
-            lamb_nn_close(mo);
-            lamb_sleep(1000);
-            syslog(LOG_ERR, "receiving the shutdown signal, the service process exitd");
-            exit(EXIT_SUCCESS);
+        lamb_mux_release(session->mo, session->batch);
+        session->batch = NULL;
+    }
+
+    if (returned > 0) {
+        syslog(LOG_INFO, "%d messages of client %s returned to mo", returned, session->addr);
+    }
+
+    if (lost > 0) {
+        syslog(LOG_ERR, "%d messages of client %s can't be returned to mo", lost, session->addr);
+    }
+
+    return;
+}
+
+/* Push one record to the queue of the account, a busy mo is waited for */
+int lamb_session_return(lamb_session_t *session, int method, char *payload, size_t len) {
+    int rc;
+
+    for (int i = 0; i < 100; i++) {
+        rc = lamb_mux_request(session->mo, method, session->account.id, payload, len);
+
+        if (rc == LAMB_OK) {
+            return 0;
         }
-        
-        lamb_sleep(5000);
+
+        if (rc != LAMB_BUSY) {
+            return -1;
+        }
+
+        lamb_sleep(10);
     }
 
-    pthread_exit(NULL);
+    return -1;
+}
+
+/* Close the sessions of account, used for the shutdown signal */
+void lamb_session_kick(lamb_worker_t *worker, int account) {
+    lamb_session_t *session;
+
+    pthread_mutex_lock(&worker->lock);
+
+    for (session = worker->sessions; session; session = session->next) {
+        if (session->account.id == account) {
+            __atomic_store_n(&session->closing, true, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+
+    return;
 }
 
-void *lamb_online_loop(void *arg) {
-    lamb_client_t *client;
+unsigned long long lamb_session_msgid(void) {
+    /* Lock free, every worker takes ids from the same sequence */
+    return lamb_msgid();
+}
 
-    client = (lamb_client_t *)arg;
+/*
+ * Publish the state of every session and take the shutdown signals.
+ * The sessions are copied under the worker lock, so that the redis
+ * round trips don't hold up the worker.
+ */
+
+void *lamb_stat_loop(void *data) {
+    int count;
+    int signal;
+    int interval;
+    time_t last_time;
+    lamb_worker_t *worker;
+    lamb_session_t *session;
+    lamb_snapshot_t *snapshot;
+    redisReply *reply = NULL;
+
+    last_time = time(NULL);
 
     while (true) {
-        pthread_mutex_lock(&rdb->lock);
-        lamb_state_renewal(rdb, client->account->id);
-        pthread_mutex_unlock(&rdb->lock);
         lamb_sleep(3000);
+
+        interval = time(NULL) - last_time;
+        interval = (interval > 0) ? interval : 1;
+        last_time = time(NULL);
+
+        for (int i = 0; i < config.work_threads; i++) {
+            worker = &workers[i];
+
+            pthread_mutex_lock(&worker->lock);
+
+            snapshot = (lamb_snapshot_t *)malloc(sizeof(lamb_snapshot_t) * (worker->count + 1));
+
+            if (!snapshot) {
+                pthread_mutex_unlock(&worker->lock);
+                continue;
+            }
+
+            count = 0;
+
+            for (session = worker->sessions; session; session = session->next) {
+                snapshot[count].id = session->account.id;
+                memcpy(snapshot[count].addr, session->addr, sizeof(session->addr));
+                snapshot[count].speed = __atomic_exchange_n(&session->total, 0, __ATOMIC_RELAXED) / interval;
+                snapshot[count].error = session->status.timeo + session->status.fmt +
+                                        session->status.len + session->status.err;
+                count++;
+            }
+
+            pthread_mutex_unlock(&worker->lock);
+
+            for (int j = 0; j < count; j++) {
+                pthread_mutex_lock(&rdb->lock);
+                lamb_state_renewal(rdb, snapshot[j].id);
+                reply = redisCommand(rdb->handle, "HMSET client.%d pid %u addr %s speed %llu error %llu",
+                                     snapshot[j].id, getpid(), snapshot[j].addr, snapshot[j].speed,
+                                     snapshot[j].error);
+                if (reply != NULL) {
+                    freeReplyObject(reply);
+                    reply = NULL;
+                } else {
+                    syslog(LOG_ERR, "lamb exec redis command error");
+                }
+                signal = lamb_check_signal(rdb, snapshot[j].id);
+                pthread_mutex_unlock(&rdb->lock);
+
+                if (signal == 9) {
+                    syslog(LOG_NOTICE, "receiving the shutdown signal of client %d", snapshot[j].id);
+                    lamb_session_kick(worker, snapshot[j].id);
+                }
+            }
+
+            free(snapshot);
+        }
     }
 
     pthread_exit(NULL);
@@ -773,6 +1647,12 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         fprintf(stderr, "Can't read config 'Id' parameter\n");
         goto error;
     }
+
+    /* The node id has 10 bits of the message id */
+    if (conf->id < 0 || conf->id >= LAMB_MSGID_NODES) {
+        fprintf(stderr, "Invalid gateway node id\n");
+        goto error;
+    }
     
     if (lamb_get_bool(&cfg, "Debug", &conf->debug) != 0) {
         fprintf(stderr, "Can't read config 'Debug' parameter\n");
@@ -799,6 +1679,37 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    if (lamb_get_int(&cfg, "WorkThreads", &conf->work_threads) != 0) {
+        fprintf(stderr, "Can't read config 'WorkThreads' parameter\n");
+        goto error;
+    }
+
+    /* Check work threads validity */
+    if (conf->work_threads < 1 || conf->work_threads > LAMB_MAX_THREAD) {
+        fprintf(stderr, "Invalid work threads number\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "Window", &conf->window) != 0) {
+        fprintf(stderr, "Can't read config 'Window' parameter\n");
+        goto error;
+    }
+
+    if (conf->window < 1 || conf->window > 1024) {
+        fprintf(stderr, "Invalid submit window size\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "DeliverWindow", &conf->deliver_window) != 0) {
+        fprintf(stderr, "Can't read config 'DeliverWindow' parameter\n");
+        goto error;
+    }
+
+    if (conf->deliver_window < 1 || conf->deliver_window > 1024) {
+        fprintf(stderr, "Invalid deliver window size\n");
+        goto error;
+    }
+
     if (lamb_get_int(&cfg, "Timeout", (int *)&conf->timeout) != 0) {
         fprintf(stderr, "Can't read config 'Timeout' parameter\n");
         goto error;
@@ -8,19 +8,35 @@
 #define _LAMB_ISMG_H
 
 #include <stdbool.h>
+#include <pthread.h>
 #include <cmpp.h>
 #include "cache.h"
+#include "common.h"
+#include "socket.h"
 #include "account.h"
 
 #define LAMB_SUBMIT 1
 #define LAMB_DELIVER 2
 #define LAMB_REPORT 3
 
+#define LAMB_ISMG_TICK  10
+#define LAMB_ISMG_POLL  1
+#define LAMB_ISMG_PIPELINE 4
+#define LAMB_EVENT_CMPP 1
+#define LAMB_EVENT_MO   2
+#define LAMB_EVENT_MT   3
+#define LAMB_ISMG_FRAME 512
+#define LAMB_ISMG_BUFFER 4096
+#define LAMB_ISMG_OUTPUT (64 * 1024)
+
 typedef struct {
     int id;
     char listen[16];
     int port;
     int connections;
+    int work_threads;
+    int window;
+    int deliver_window;
     long timeout;
     long send_timeout;
     long recv_timeout;
@@ -34,16 +50,49 @@ typedef struct {
     bool daemon;
 } lamb_config_t;
 
+#pragma pack(1)
+
+/* CMPP 2.0 bodies of the packets a worker writes itself */
+typedef struct {
+    unsigned long long msgId;
+    unsigned char result;
+} lamb_cmpp_submit_resp_t;
+
+/* Followed by the content and 8 reserved bytes */
+typedef struct {
+    unsigned long long msgId;
+    char destId[21];
+    char serviceId[10];
+    unsigned char tpPid;
+    unsigned char tpUdhi;
+    unsigned char msgFmt;
+    char srcTerminalId[21];
+    unsigned char registeredDelivery;
+    unsigned char msgLength;
+} lamb_cmpp_deliver_t;
+
+/* The content of a deliver that is a state report */
 typedef struct {
-    unsigned int sequenceId;
     unsigned long long msgId;
-} lamb_confirmed_t;
+    char stat[7];
+    char submitTime[10];
+    char doneTime[10];
+    char destTerminalId[21];
+    unsigned int smscSequence;
+} lamb_cmpp_report_t;
 
+#pragma pack()
+
+/* A report or deliver sent to the client and not confirmed yet */
 typedef struct {
-    cmpp_sock_t *sock;
-    lamb_account_t *account;
-    char *addr;
-} lamb_client_t;
+    bool used;
+    unsigned int sequenceId;
+    unsigned long long msgId;
+    unsigned long long deadline;
+    int method;
+    size_t len;
+    char payload[LAMB_ISMG_FRAME];
+} lamb_inflight_t;
 
 typedef struct {
     unsigned long long recv;
@@ -57,12 +106,114 @@ typedef struct {
     unsigned long long err;
 } lamb_status_t;
 
+/* A submit that mt has not accepted yet, it is answered once it has */
+typedef struct {
+    unsigned int sequenceId;
+    lamb_submit_t message;
+} lamb_pending_t;
+
+struct lamb_session;
+
+typedef struct {
+    int type;
+    struct lamb_session *session;
+} lamb_event_t;
+
+/* A logged in client, only the worker it was handed to touches it */
+typedef struct lamb_session {
+    cmpp_sock_t sock;
+    lamb_account_t account;
+    char addr[16];
+    int mo;
+    int mofd;
+    bool pending;
+    bool closing;
+    bool paused;
+    lamb_pending_t *backlog;
+    int head;
+    int count;
+    int sent;
+    char *batch;
+    int blen;
+    size_t offset;
+    int method;
+    char *payload;
+    size_t plen;
+    lamb_inflight_t *inflight;
+    int sending;
+    unsigned long long retry;
+    unsigned long long total;
+    char *out;
+    size_t olen;
+    size_t osent;
+    size_t osize;
+    unsigned int events;
+    lamb_status_t status;
+    lamb_event_t cmpp_ev;
+    lamb_event_t mo_ev;
+    struct lamb_session *prev;
+    struct lamb_session *next;
+} lamb_session_t;
+
+/* A connection to mt and the batch in flight on it */
+typedef struct {
+    int mt;
+    int pipefd;
+    bool local;
+    bool pushing;
+    int flying;
+    unsigned long long deadline;
+    lamb_session_t *flight[LAMB_MAX_BATCH];
+    lamb_event_t ev;
+} lamb_channel_t;
+
+/* The submits of all sessions go to mt in a few batches at a time */
+typedef struct {
+    int id;
+    int epfd;
+    int count;
+    lamb_channel_t channels[LAMB_ISMG_PIPELINE];
+    lamb_session_t *sessions;
+    pthread_mutex_t lock;
+} lamb_worker_t;
+
+typedef struct {
+    int id;
+    char addr[16];
+    unsigned long long speed;
+    unsigned long long error;
+} lamb_snapshot_t;
+
 void lamb_event_loop(cmpp_ismg_t *cmpp);
-void lamb_work_loop(lamb_client_t *client);
-void *lamb_deliver_loop(void *data);
-int lamb_mt_connect(int *sock, lamb_client_t *client, lamb_config_t *cfg);
+int lamb_worker_init(lamb_worker_t *worker, int id);
+void *lamb_work_loop(void *arg);
+void lamb_worker_flush(lamb_worker_t *worker);
+void lamb_worker_answer(lamb_worker_t *worker);
+void lamb_channel_answer(lamb_worker_t *worker, lamb_channel_t *channel);
+void lamb_channel_reset(lamb_channel_t *channel);
+lamb_session_t *lamb_session_new(int fd, lamb_account_t *account, const char *addr);
+void lamb_session_attach(lamb_worker_t *worker, lamb_session_t *session);
+void lamb_session_read(lamb_worker_t *worker, lamb_session_t *session, cmpp_pack_t *pack);
+void lamb_session_push(lamb_session_t *session);
+int lamb_session_send(lamb_session_t *session, lamb_inflight_t *entry);
+char *lamb_session_deliver(lamb_session_t *session, lamb_inflight_t *entry, char *spcode, char *phone,
+                           int msgFmt, int registered, size_t length);
+void lamb_session_confirm(lamb_session_t *session, unsigned int sequenceId, unsigned long long msgId);
+int lamb_session_submit(lamb_batch_t *batch, lamb_session_t *session, lamb_pending_t *pending);
+void lamb_session_answer(lamb_worker_t *worker, lamb_session_t *session, int rc);
+void lamb_session_pause(lamb_worker_t *worker, lamb_session_t *session, bool paused);
+void lamb_session_watch(lamb_worker_t *worker, lamb_session_t *session);
+char *lamb_session_packet(lamb_session_t *session, unsigned int command, unsigned int sequenceId, size_t len);
+void lamb_session_submit_resp(lamb_session_t *session, unsigned int sequenceId, unsigned long long msgId, unsigned char result);
+void lamb_session_drain(lamb_worker_t *worker, lamb_session_t *session);
+void lamb_session_expire(lamb_worker_t *worker, lamb_session_t *session, unsigned long long now);
+void lamb_session_close(lamb_worker_t *worker, lamb_session_t *session);
+void *lamb_requeue_loop(void *arg);
+void lamb_session_requeue(lamb_session_t *session);
+int lamb_session_return(lamb_session_t *session, int method, char *payload, size_t len);
+void lamb_session_kick(lamb_worker_t *worker, int account);
+unsigned long long lamb_session_msgid(void);
 void *lamb_stat_loop(void *data);
-void *lamb_online_loop(void *arg);
 int lamb_state_renewal(lamb_cache_t *cache, int id);
 bool lamb_is_login(lamb_cache_t *cache, int account);
 int lamb_check_signal(lamb_cache_t *cache, int id);
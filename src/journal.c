@@ -0,0 +1,579 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "journal.h"
+
+/*
+ * Records are appended to the tail segment, a file preallocated to its
+ * full size and mapped shared, so an appended record survives a crash
+ * of the process as soon as it is copied. The journal thread msyncs the
+ * new part of the tail every interval milliseconds, a machine crash
+ * loses at most that much. A segment whose records all precede the
+ * checkpoint is deleted by the same thread. The thread also prepares
+ * the next segment as a spare file, a rollover only renames it.
+ */
+
+#define LAMB_RECORD_SIZE(len) (((sizeof(lamb_record_t) + (len)) + LAMB_JOURNAL_ALIGN - 1) & ~(size_t)(LAMB_JOURNAL_ALIGN - 1))
+
+static int lamb_segment_compare(const void *a, const void *b);
+static lamb_segment_t *lamb_segment_open(lamb_journal_t *journal, unsigned long long first);
+static lamb_segment_t *lamb_segment_new(lamb_journal_t *journal, unsigned long long first);
+static lamb_segment_t *lamb_segment_create(lamb_journal_t *journal, const char *file);
+static int lamb_segment_rename(lamb_journal_t *journal, lamb_segment_t *segment, unsigned long long first);
+static void lamb_journal_prepare(lamb_journal_t *journal);
+static void lamb_journal_fsync(lamb_journal_t *journal);
+static size_t lamb_segment_walk(lamb_segment_t *segment, unsigned long long *sequence, lamb_journal_func func, void *arg);
+static void lamb_segment_free(lamb_journal_t *journal, lamb_segment_t *segment, bool remove);
+static unsigned int lamb_record_checksum(lamb_record_t *record, void *payload);
+static void lamb_journal_sync(lamb_journal_t *journal);
+static void lamb_journal_release(lamb_journal_t *journal);
+
+/* Open the segments left by the last run and start a new tail segment */
+lamb_journal_t *lamb_journal_open(const char *dir, size_t size, int interval) {
+    int count = 0;
+    DIR *dp;
+    struct dirent *ent;
+    unsigned long long first;
+    unsigned long long firsts[1024];
+    lamb_journal_t *self;
+    lamb_segment_t *segment;
+
+    if (size < LAMB_RECORD_SIZE(0) || interval < 1) {
+        return NULL;
+    }
+
+    self = (lamb_journal_t *)calloc(1, sizeof(lamb_journal_t));
+    if (!self) {
+        return NULL;
+    }
+
+    snprintf(self->dir, sizeof(self->dir), "%s", dir);
+    self->size = size;
+    self->interval = interval;
+    pthread_mutex_init(&self->lock, NULL);
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        goto error;
+    }
+
+    dp = opendir(dir);
+    if (!dp) {
+        goto error;
+    }
+
+    while ((ent = readdir(dp)) != NULL && count < 1024) {
+        if (sscanf(ent->d_name, "%llu.log", &first) == 1 && first > 0) {
+            firsts[count++] = first;
+        }
+    }
+
+    closedir(dp);
+
+    qsort(firsts, count, sizeof(unsigned long long), lamb_segment_compare);
+
+    for (int i = 0; i < count; i++) {
+        segment = lamb_segment_open(self, firsts[i]);
+
+        if (!segment) {
+            goto error;
+        }
+
+        segment->offset = segment->synced = lamb_segment_walk(segment, &self->sequence, NULL, NULL);
+
+        /* Only the last tail can be empty */
+        if (segment->offset == 0) {
+            lamb_segment_free(self, segment, true);
+            continue;
+        }
+
+        if (self->tail) {
+            self->tail->next = segment;
+        } else {
+            self->head = segment;
+        }
+
+        self->tail = segment;
+    }
+
+    segment = lamb_segment_new(self, self->sequence + 1);
+
+    if (!segment) {
+        goto error;
+    }
+
+    if (self->tail) {
+        self->tail->next = segment;
+    } else {
+        self->head = segment;
+    }
+
+    self->tail = segment;
+    self->checkpoint = self->head->first;
+
+    /* The first rollover finds its segment ready as well */
+    lamb_journal_prepare(self);
+
+    return self;
+
+error:
+    while (self->head) {
+        segment = self->head;
+        self->head = segment->next;
+        lamb_segment_free(self, segment, false);
+    }
+
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+
+    return NULL;
+}
+
+/* Call func for every record kept in the journal, before the first append */
+int lamb_journal_replay(lamb_journal_t *journal, lamb_journal_func func, void *arg) {
+    unsigned long long sequence = 0;
+    lamb_segment_t *segment;
+
+    for (segment = journal->head; segment != journal->tail; segment = segment->next) {
+        if (lamb_segment_walk(segment, &sequence, func, arg) != segment->offset) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns the sequence of the record, 0 when it can't be written */
+unsigned long long lamb_journal_append(lamb_journal_t *journal, int type, int id, void *payload, size_t len) {
+    size_t total;
+    unsigned long long sequence;
+    lamb_record_t *record;
+    lamb_segment_t *segment;
+
+    total = LAMB_RECORD_SIZE(len);
+
+    if (total > journal->size) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+
+    if (journal->tail->offset + total > journal->tail->size) {
+        segment = journal->spare;
+        journal->spare = NULL;
+
+        /* The journal thread has not prepared the next segment yet */
+        if (!segment) {
+            pthread_mutex_unlock(&journal->lock);
+            return 0;
+        }
+
+        if (lamb_segment_rename(journal, segment, journal->sequence + 1) != 0) {
+            pthread_mutex_unlock(&journal->lock);
+            lamb_segment_free(journal, segment, false);
+            return 0;
+        }
+
+        journal->renamed = true;
+        __atomic_store_n(&journal->tail->sealed, true, __ATOMIC_RELEASE);
+        journal->tail->next = segment;
+        journal->tail = segment;
+    }
+
+    record = (lamb_record_t *)(journal->tail->map + journal->tail->offset);
+    sequence = __atomic_add_fetch(&journal->sequence, 1, __ATOMIC_ACQ_REL);
+    record->sequence = sequence;
+    record->id = id;
+    record->type = type;
+    record->len = len;
+    memcpy((char *)record + sizeof(lamb_record_t), payload, len);
+    record->checksum = lamb_record_checksum(record, (char *)record + sizeof(lamb_record_t));
+
+    __atomic_store_n(&journal->tail->offset, journal->tail->offset + total, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&journal->lock);
+
+    return sequence;
+}
+
+/* The sequence the next record will get */
+unsigned long long lamb_journal_sequence(lamb_journal_t *journal) {
+    return __atomic_load_n(&journal->sequence, __ATOMIC_ACQUIRE) + 1;
+}
+
+/* Records below sequence are no longer needed */
+void lamb_journal_checkpoint(lamb_journal_t *journal, unsigned long long sequence) {
+    unsigned long long checkpoint;
+
+    checkpoint = __atomic_load_n(&journal->checkpoint, __ATOMIC_ACQUIRE);
+
+    while (sequence > checkpoint) {
+        if (__atomic_compare_exchange_n(&journal->checkpoint, &checkpoint, sequence, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    return;
+}
+
+void *lamb_journal_loop(void *arg) {
+    lamb_journal_t *journal;
+
+    journal = (lamb_journal_t *)arg;
+
+    while (true) {
+        lamb_msleep(journal->interval * 1000);
+        lamb_journal_fsync(journal);
+        lamb_journal_sync(journal);
+        lamb_journal_release(journal);
+        lamb_journal_prepare(journal);
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Sync what was appended since the last pass. Segments are only
+ * unmapped and freed by this thread, the lock is held just to read the
+ * tail, a sealed segment is complete once the next tail is linked.
+ */
+
+static void lamb_journal_sync(lamb_journal_t *journal) {
+    size_t start, offset;
+    long page;
+    lamb_segment_t *tail;
+    lamb_segment_t *segment;
+
+    page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&journal->lock);
+    tail = journal->tail;
+    pthread_mutex_unlock(&journal->lock);
+
+    for (segment = journal->head; segment; segment = segment->next) {
+        if (segment != tail) {
+            offset = segment->offset;
+        } else {
+            offset = __atomic_load_n(&tail->offset, __ATOMIC_ACQUIRE);
+        }
+
+        if (segment->synced < offset && segment->map) {
+            start = segment->synced & ~((size_t)page - 1);
+
+            if (msync(segment->map + start, offset - start, MS_SYNC) != 0) {
+                syslog(LOG_ERR, "can't sync journal segment %llu", segment->first);
+                break;
+            }
+
+            segment->synced = offset;
+        }
+
+        if (__atomic_load_n(&segment->sealed, __ATOMIC_ACQUIRE) && segment->map &&
+            segment->synced == segment->offset) {
+            munmap(segment->map, segment->size);
+            segment->map = NULL;
+        }
+
+        if (segment == tail) {
+            break;
+        }
+    }
+
+    return;
+}
+
+/* A renamed segment must keep its name in a machine crash, like its records */
+static void lamb_journal_fsync(lamb_journal_t *journal) {
+    int dfd;
+    bool renamed;
+
+    pthread_mutex_lock(&journal->lock);
+    renamed = journal->renamed;
+    journal->renamed = false;
+    pthread_mutex_unlock(&journal->lock);
+
+    if (!renamed) {
+        return;
+    }
+
+    dfd = open(journal->dir, O_RDONLY | O_DIRECTORY);
+
+    if (dfd == -1 || fsync(dfd) != 0) {
+        syslog(LOG_ERR, "can't sync journal directory %s", journal->dir);
+    }
+
+    if (dfd != -1) {
+        close(dfd);
+    }
+
+    return;
+}
+
+/* Allocate the spare segment outside the lock, appends never wait for the disk */
+static void lamb_journal_prepare(lamb_journal_t *journal) {
+    char file[192];
+    bool ready;
+    lamb_segment_t *segment;
+
+    pthread_mutex_lock(&journal->lock);
+    ready = (journal->spare != NULL);
+    pthread_mutex_unlock(&journal->lock);
+
+    if (ready) {
+        return;
+    }
+
+    snprintf(file, sizeof(file), "%s/spare", journal->dir);
+
+    segment = lamb_segment_create(journal, file);
+
+    if (!segment) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    journal->spare = segment;
+    pthread_mutex_unlock(&journal->lock);
+
+    return;
+}
+
+static void lamb_journal_release(lamb_journal_t *journal) {
+    unsigned long long checkpoint;
+    lamb_segment_t *segment;
+
+    checkpoint = __atomic_load_n(&journal->checkpoint, __ATOMIC_ACQUIRE);
+
+    while (true) {
+        pthread_mutex_lock(&journal->lock);
+
+        segment = journal->head;
+
+        /* Every record of the head precedes the first of the next segment */
+        if (segment == journal->tail || segment->next->first > checkpoint || segment->map) {
+            pthread_mutex_unlock(&journal->lock);
+            break;
+        }
+
+        journal->head = segment->next;
+
+        pthread_mutex_unlock(&journal->lock);
+
+        lamb_segment_free(journal, segment, true);
+    }
+
+    return;
+}
+
+static int lamb_segment_compare(const void *a, const void *b) {
+    unsigned long long x, y;
+
+    x = *(const unsigned long long *)a;
+    y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static lamb_segment_t *lamb_segment_open(lamb_journal_t *journal, unsigned long long first) {
+    char file[192];
+    struct stat st;
+    lamb_segment_t *self;
+
+    self = (lamb_segment_t *)calloc(1, sizeof(lamb_segment_t));
+    if (!self) {
+        return NULL;
+    }
+
+    snprintf(file, sizeof(file), "%s/%020llu.log", journal->dir, first);
+
+    self->fd = open(file, O_RDWR);
+    if (self->fd == -1 || fstat(self->fd, &st) != 0) {
+        syslog(LOG_ERR, "can't open journal segment %s", file);
+        if (self->fd != -1) {
+            close(self->fd);
+        }
+        free(self);
+        return NULL;
+    }
+
+    self->first = first;
+    self->size = st.st_size;
+    self->sealed = true;
+
+    return self;
+}
+
+/* Create a segment preallocated to the journal size and map it */
+static lamb_segment_t *lamb_segment_new(lamb_journal_t *journal, unsigned long long first) {
+    int dfd;
+    char file[192];
+    lamb_segment_t *self;
+
+    snprintf(file, sizeof(file), "%s/%020llu.log", journal->dir, first);
+
+    self = lamb_segment_create(journal, file);
+
+    if (!self) {
+        return NULL;
+    }
+
+    /* The new name must survive a crash as well */
+    dfd = open(journal->dir, O_RDONLY | O_DIRECTORY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+
+    self->first = first;
+
+    return self;
+}
+
+static lamb_segment_t *lamb_segment_create(lamb_journal_t *journal, const char *file) {
+    lamb_segment_t *self;
+
+    self = (lamb_segment_t *)calloc(1, sizeof(lamb_segment_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (self->fd == -1) {
+        syslog(LOG_ERR, "can't create journal segment %s", file);
+        free(self);
+        return NULL;
+    }
+
+    if (posix_fallocate(self->fd, 0, journal->size) != 0) {
+        syslog(LOG_ERR, "can't allocate journal segment %s", file);
+        goto error;
+    }
+
+    self->map = mmap(NULL, journal->size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (self->map == MAP_FAILED) {
+        self->map = NULL;
+        goto error;
+    }
+
+    self->size = journal->size;
+
+    return self;
+
+error:
+    close(self->fd);
+    unlink(file);
+    free(self);
+
+    return NULL;
+}
+
+/* Give the spare segment the name of its first record, the lock is held */
+static int lamb_segment_rename(lamb_journal_t *journal, lamb_segment_t *segment, unsigned long long first) {
+    char spare[192];
+    char file[192];
+
+    snprintf(spare, sizeof(spare), "%s/spare", journal->dir);
+    snprintf(file, sizeof(file), "%s/%020llu.log", journal->dir, first);
+
+    if (rename(spare, file) != 0) {
+        syslog(LOG_ERR, "can't rename journal segment %s", file);
+        return -1;
+    }
+
+    segment->first = first;
+
+    return 0;
+}
+
+/* Walk the valid records, returns the offset of the first invalid one */
+static size_t lamb_segment_walk(lamb_segment_t *segment, unsigned long long *sequence, lamb_journal_func func, void *arg) {
+    char *map;
+    size_t offset = 0;
+    lamb_record_t *record;
+
+    if (segment->size < sizeof(lamb_record_t)) {
+        return 0;
+    }
+
+    map = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    while (offset + sizeof(lamb_record_t) <= segment->size) {
+        record = (lamb_record_t *)(map + offset);
+
+        if (record->sequence <= *sequence || offset + LAMB_RECORD_SIZE(record->len) > segment->size) {
+            break;
+        }
+
+        if (record->checksum != lamb_record_checksum(record, map + offset + sizeof(lamb_record_t))) {
+            break;
+        }
+
+        if (func) {
+            func(record, map + offset + sizeof(lamb_record_t), arg);
+        }
+
+        *sequence = record->sequence;
+        offset += LAMB_RECORD_SIZE(record->len);
+    }
+
+    munmap(map, segment->size);
+
+    return offset;
+}
+
+static void lamb_segment_free(lamb_journal_t *journal, lamb_segment_t *segment, bool remove) {
+    char file[192];
+
+    if (segment->map) {
+        munmap(segment->map, segment->size);
+    }
+
+    close(segment->fd);
+
+    if (remove) {
+        snprintf(file, sizeof(file), "%s/%020llu.log", journal->dir, segment->first);
+        unlink(file);
+    }
+
+    free(segment);
+
+    return;
+}
+
+static unsigned int lamb_record_checksum(lamb_record_t *record, void *payload) {
+    unsigned int hash = 2166136261U;
+    unsigned char *p;
+
+    p = (unsigned char *)&record->sequence;
+    for (size_t i = 0; i < sizeof(lamb_record_t) - offsetof(lamb_record_t, sequence); i++) {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+
+    p = (unsigned char *)payload;
+    for (size_t i = 0; i < record->len; i++) {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+
+    hash ^= record->len;
+
+    /* A zeroed record never validates */
+    return hash ? hash : 1;
+}
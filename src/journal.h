@@ -0,0 +1,57 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_JOURNAL_H
+#define _LAMB_JOURNAL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define LAMB_JOURNAL_ALIGN 8
+
+typedef struct {
+    unsigned int len;
+    unsigned int checksum;
+    unsigned long long sequence;
+    int id;
+    int type;
+} lamb_record_t;
+
+typedef struct lamb_segment {
+    unsigned long long first;
+    int fd;
+    char *map;
+    size_t size;
+    size_t offset;
+    size_t synced;
+    bool sealed;
+    struct lamb_segment *next;
+} lamb_segment_t;
+
+/* Append only log of mmap'd segment files, synced by a background thread */
+typedef struct {
+    char dir[128];
+    size_t size;
+    int interval;
+    unsigned long long sequence;
+    unsigned long long checkpoint;
+    lamb_segment_t *head;
+    lamb_segment_t *tail;
+    lamb_segment_t *spare;
+    bool renamed;
+    pthread_mutex_t lock;
+} lamb_journal_t;
+
+typedef void (*lamb_journal_func)(lamb_record_t *record, void *payload, void *arg);
+
+lamb_journal_t *lamb_journal_open(const char *dir, size_t size, int interval);
+int lamb_journal_replay(lamb_journal_t *journal, lamb_journal_func func, void *arg);
+unsigned long long lamb_journal_append(lamb_journal_t *journal, int type, int id, void *payload, size_t len);
+unsigned long long lamb_journal_sequence(lamb_journal_t *journal);
+void lamb_journal_checkpoint(lamb_journal_t *journal, unsigned long long sequence);
+void *lamb_journal_loop(void *arg);
+
+#endif
@@ -4,11 +4,22 @@
  * Copyright (C) 2017 typefo <typefo@qq.com>
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
 #include "keyword.h"
 
+typedef struct {
+    int from;
+    int to;
+    unsigned char label;
+} lamb_edge_t;
+
+static void lamb_keyword_free(void *key);
+static int lamb_edge_compare(const void *a, const void *b);
+static int lamb_keywords_goto(lamb_keywords_t *keywords, int state, unsigned char c);
+
 int lamb_keyword_get_all(lamb_db_t *db, lamb_list_t *keys) {
     int rows;
     char *column;
@@ -38,3 +49,277 @@ int lamb_keyword_get_all(lamb_db_t *db, lamb_list_t *keys) {
     return 0;
 }
 
+
+/*
+ * Build the automaton from a list of lamb_keyword_t. The trie is
+ * first grown with a temporary edge array, then the edges are sorted
+ * by state and label into the compact layout and the failure links
+ * are resolved breadth first. Empty keywords are ignored.
+ */
+
+lamb_keywords_t *lamb_keywords_new(lamb_list_t *keys) {
+    int i, n, state, found, total;
+    int head, tail, *queue;
+    int *first, *link;
+    unsigned char *p;
+    lamb_node_t *node;
+    lamb_keyword_t *key;
+    lamb_edge_t *edges;
+    lamb_keywords_t *self;
+
+    total = 1;
+
+    for (node = keys->head; node; node = node->next) {
+        key = (lamb_keyword_t *)node->val;
+        if (key->val) {
+            total += strlen(key->val);
+        }
+    }
+
+    self = (lamb_keywords_t *)calloc(1, sizeof(lamb_keywords_t));
+    edges = (lamb_edge_t *)calloc(total, sizeof(lamb_edge_t));
+    first = (int *)malloc(sizeof(int) * total);
+    link = (int *)malloc(sizeof(int) * total);
+    queue = NULL;
+
+    if (!self || !edges || !first || !link) {
+        goto error;
+    }
+
+    self->output = (bool *)calloc(total, sizeof(bool));
+    if (!self->output) {
+        goto error;
+    }
+
+    /* first[s] heads the list of edges leaving s while the trie grows */
+    for (i = 0; i < total; i++) {
+        first[i] = -1;
+    }
+
+    n = 0;
+    self->states = 1;
+
+    for (node = keys->head; node; node = node->next) {
+        key = (lamb_keyword_t *)node->val;
+        if (!key->val || key->val[0] == '\0') {
+            continue;
+        }
+
+        state = 0;
+
+        for (p = (unsigned char *)key->val; *p; p++) {
+            found = 0;
+
+            if (state == 0) {
+                found = self->root[*p];
+            } else {
+                for (i = first[state]; i != -1; i = link[i]) {
+                    if (edges[i].label == *p) {
+                        found = edges[i].to;
+                        break;
+                    }
+                }
+            }
+
+            if (!found) {
+                found = self->states++;
+                edges[n].from = state;
+                edges[n].to = found;
+                edges[n].label = *p;
+                link[n] = first[state];
+                first[state] = n;
+                if (state == 0) {
+                    self->root[*p] = found;
+                }
+                n++;
+            }
+
+            state = found;
+        }
+
+        self->output[state] = true;
+        self->count++;
+    }
+
+    free(first);
+    free(link);
+    first = link = NULL;
+
+    /* Compact layout */
+    qsort(edges, n, sizeof(lamb_edge_t), lamb_edge_compare);
+
+    self->base = (int *)calloc(self->states + 1, sizeof(int));
+    self->label = (unsigned char *)malloc(n > 0 ? n : 1);
+    self->next = (int *)malloc(sizeof(int) * (n > 0 ? n : 1));
+    self->fail = (int *)calloc(self->states, sizeof(int));
+    queue = (int *)malloc(sizeof(int) * self->states);
+
+    if (!self->base || !self->label || !self->next || !self->fail || !queue) {
+        goto error;
+    }
+
+    for (i = 0; i < n; i++) {
+        self->base[edges[i].from + 1]++;
+        self->label[i] = edges[i].label;
+        self->next[i] = edges[i].to;
+    }
+
+    for (i = 0; i < self->states; i++) {
+        self->base[i + 1] += self->base[i];
+    }
+
+    free(edges);
+    edges = NULL;
+
+    /* Failure links, breadth first from the root */
+    head = tail = 0;
+
+    for (i = 0; i < 256; i++) {
+        if (self->root[i]) {
+            self->fail[self->root[i]] = 0;
+            queue[tail++] = self->root[i];
+        }
+    }
+
+    while (head < tail) {
+        state = queue[head++];
+
+        for (i = self->base[state]; i < self->base[state + 1]; i++) {
+            int child = self->next[i];
+            int f = self->fail[state];
+
+            while (f && !lamb_keywords_goto(self, f, self->label[i])) {
+                f = self->fail[f];
+            }
+
+            found = lamb_keywords_goto(self, f, self->label[i]);
+            self->fail[child] = (found != child) ? found : 0;
+
+            if (self->output[self->fail[child]]) {
+                self->output[child] = true;
+            }
+
+            queue[tail++] = child;
+        }
+    }
+
+    free(queue);
+
+    return self;
+
+error:
+    free(queue);
+    free(first);
+    free(link);
+    free(edges);
+    lamb_keywords_destroy(self);
+    return NULL;
+}
+
+/* Build the automaton straight from the keyword table */
+lamb_keywords_t *lamb_keywords_fetch(lamb_db_t *db) {
+    lamb_list_t *keys;
+    lamb_keywords_t *keywords;
+
+    keys = lamb_list_new();
+    if (!keys) {
+        return NULL;
+    }
+
+    keys->free = lamb_keyword_free;
+    keywords = NULL;
+
+    if (lamb_keyword_get_all(db, keys) == 0) {
+        keywords = lamb_keywords_new(keys);
+    }
+
+    lamb_list_destroy(keys);
+
+    return keywords;
+}
+
+/* True when any keyword occurs in the first len bytes of content */
+bool lamb_keywords_match(lamb_keywords_t *keywords, const char *content, int len) {
+    int state, next = 0;
+    unsigned char c;
+
+    if (!keywords || keywords->count < 1) {
+        return false;
+    }
+
+    state = 0;
+
+    for (int i = 0; i < len; i++) {
+        c = (unsigned char)content[i];
+
+        while (state && !(next = lamb_keywords_goto(keywords, state, c))) {
+            state = keywords->fail[state];
+        }
+
+        state = state ? next : keywords->root[c];
+
+        if (keywords->output[state]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void lamb_keywords_destroy(lamb_keywords_t *keywords) {
+    if (keywords) {
+        free(keywords->base);
+        free(keywords->label);
+        free(keywords->next);
+        free(keywords->fail);
+        free(keywords->output);
+        free(keywords);
+    }
+
+    return;
+}
+
+static void lamb_keyword_free(void *key) {
+    if (key) {
+        free(((lamb_keyword_t *)key)->val);
+        free(key);
+    }
+
+    return;
+}
+
+static int lamb_edge_compare(const void *a, const void *b) {
+    const lamb_edge_t *x = (const lamb_edge_t *)a;
+    const lamb_edge_t *y = (const lamb_edge_t *)b;
+
+    if (x->from != y->from) {
+        return x->from < y->from ? -1 : 1;
+    }
+
+    return (int)x->label - (int)y->label;
+}
+
+/* Transition from state on c, 0 when there is none */
+static int lamb_keywords_goto(lamb_keywords_t *keywords, int state, unsigned char c) {
+    int low, high, mid;
+
+    if (state == 0) {
+        return keywords->root[c];
+    }
+
+    low = keywords->base[state];
+    high = keywords->base[state + 1] - 1;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if (keywords->label[mid] == c) {
+            return keywords->next[mid];
+        } else if (keywords->label[mid] < c) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return 0;
+}
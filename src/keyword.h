@@ -7,6 +7,7 @@
 #ifndef _LAMB_KEYWORD_H
 #define _LAMB_KEYWORD_H
 
+#include <stdbool.h>
 #include "db.h"
 #include "list.h"
 
@@ -15,6 +16,28 @@ typedef struct {
     char *val;
 } lamb_keyword_t;
 
+/*
+ * Aho-Corasick automaton over the UTF-8 bytes of the keywords.
+ * The edges of state s are label[base[s]] .. label[base[s + 1] - 1],
+ * sorted, with their targets in next[]. The root keeps a dense
+ * table since almost every byte leaves it.
+ */
+
+typedef struct {
+    int count;
+    int states;
+    int *base;
+    unsigned char *label;
+    int *next;
+    int *fail;
+    bool *output;
+    int root[256];
+} lamb_keywords_t;
+
 int lamb_keyword_get_all(lamb_db_t *db, lamb_list_t *keys);
+lamb_keywords_t *lamb_keywords_new(lamb_list_t *keys);
+lamb_keywords_t *lamb_keywords_fetch(lamb_db_t *db);
+bool lamb_keywords_match(lamb_keywords_t *keywords, const char *content, int len);
+void lamb_keywords_destroy(lamb_keywords_t *keywords);
 
 #endif
@@ -0,0 +1,270 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "limiter.h"
+
+static unsigned long long lamb_limiter_hash(unsigned long long key);
+static lamb_counter_t *lamb_shard_find(lamb_shard_t *shard, unsigned long long key, unsigned int epoch);
+static void lamb_shard_compact(lamb_shard_t *shard, unsigned int epoch);
+static void lamb_counter_advance(lamb_counter_t *counter, unsigned int epoch);
+static int lamb_counter_sum(lamb_counter_t *counter);
+
+/*
+ * Create a table holding at most capacity keys. Keys that have not been
+ * hit within the window are reclaimed, a full table lets new keys pass.
+ */
+
+lamb_limiter_t *lamb_limiter_new(unsigned int capacity, int limit, int window) {
+    unsigned int size;
+    lamb_limiter_t *self;
+
+    self = (lamb_limiter_t *)calloc(1, sizeof(lamb_limiter_t));
+    if (!self) {
+        return NULL;
+    }
+
+    /* Power of two slots per shard, kept at most 3/4 full */
+    size = 16;
+    while (size * 3 / 4 < capacity / LAMB_LIMITER_SHARDS) {
+        size <<= 1;
+    }
+
+    for (int i = 0; i < LAMB_LIMITER_SHARDS; i++) {
+        self->shards[i].size = size;
+        self->shards[i].used = 0;
+        self->shards[i].slots = (lamb_counter_t *)calloc(size, sizeof(lamb_counter_t));
+        if (!self->shards[i].slots) {
+            lamb_limiter_destroy(self);
+            return NULL;
+        }
+        pthread_mutex_init(&self->shards[i].lock, NULL);
+    }
+
+    lamb_limiter_set(self, limit, window);
+
+    return self;
+}
+
+void lamb_limiter_set(lamb_limiter_t *limiter, int limit, int window) {
+    int width;
+
+    width = (window + LAMB_LIMITER_BUCKETS - 1) / LAMB_LIMITER_BUCKETS;
+
+    __atomic_store_n(&limiter->limit, limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&limiter->window, window, __ATOMIC_RELAXED);
+    __atomic_store_n(&limiter->width, (width > 0) ? width : 1, __ATOMIC_RELAXED);
+
+    return;
+}
+
+/* Count one send for key, false when it would exceed the limit */
+bool lamb_limiter_hit(lamb_limiter_t *limiter, unsigned long long key, time_t now) {
+    bool allowed;
+    unsigned int epoch;
+    lamb_shard_t *shard;
+    lamb_counter_t *counter;
+
+    epoch = now / __atomic_load_n(&limiter->width, __ATOMIC_RELAXED);
+    shard = &limiter->shards[lamb_limiter_hash(key) % LAMB_LIMITER_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    counter = lamb_shard_find(shard, key, epoch);
+
+    if (!counter) {
+        pthread_mutex_unlock(&shard->lock);
+        return true;
+    }
+
+    lamb_counter_advance(counter, epoch);
+    allowed = lamb_counter_sum(counter) < __atomic_load_n(&limiter->limit, __ATOMIC_RELAXED);
+
+    if (allowed && counter->counts[epoch % LAMB_LIMITER_BUCKETS] < 0xffff) {
+        counter->counts[epoch % LAMB_LIMITER_BUCKETS]++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return allowed;
+}
+
+/* Raise the local count of key to a total seen by other processes */
+void lamb_limiter_merge(lamb_limiter_t *limiter, unsigned long long key, int total, time_t now) {
+    int sum, count;
+    unsigned int epoch;
+    lamb_shard_t *shard;
+    lamb_counter_t *counter;
+
+    epoch = now / __atomic_load_n(&limiter->width, __ATOMIC_RELAXED);
+    shard = &limiter->shards[lamb_limiter_hash(key) % LAMB_LIMITER_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    counter = lamb_shard_find(shard, key, epoch);
+
+    if (counter) {
+        lamb_counter_advance(counter, epoch);
+        sum = lamb_counter_sum(counter);
+
+        if (total > sum) {
+            count = counter->counts[epoch % LAMB_LIMITER_BUCKETS] + (total - sum);
+            counter->counts[epoch % LAMB_LIMITER_BUCKETS] = (count < 0xffff) ? count : 0xffff;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return;
+}
+
+void lamb_limiter_destroy(lamb_limiter_t *limiter) {
+    if (limiter) {
+        for (int i = 0; i < LAMB_LIMITER_SHARDS; i++) {
+            if (limiter->shards[i].slots) {
+                free(limiter->shards[i].slots);
+                pthread_mutex_destroy(&limiter->shards[i].lock);
+            }
+        }
+        free(limiter);
+    }
+
+    return;
+}
+
+static unsigned long long lamb_limiter_hash(unsigned long long key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return key;
+}
+
+static bool lamb_counter_expired(lamb_counter_t *counter, unsigned int epoch) {
+    return (epoch - counter->epoch) >= LAMB_LIMITER_BUCKETS;
+}
+
+/*
+ * Find the counter of key or claim a slot for it, linear probing. The
+ * first expired slot on the way is reused, a full shard is compacted.
+ */
+
+static lamb_counter_t *lamb_shard_find(lamb_shard_t *shard, unsigned long long key, unsigned int epoch) {
+    unsigned int mask, i;
+    lamb_counter_t *slot, *reuse;
+
+    mask = shard->size - 1;
+
+    for (int pass = 0; pass < 2; pass++) {
+        reuse = NULL;
+        i = (lamb_limiter_hash(key) >> 6) & mask;
+
+        for (unsigned int n = 0; n < shard->size; n++, i = (i + 1) & mask) {
+            slot = &shard->slots[i];
+
+            if (slot->key == key) {
+                return slot;
+            }
+
+            if (slot->key == 0) {
+                break;
+            }
+
+            if (!reuse && lamb_counter_expired(slot, epoch)) {
+                reuse = slot;
+            }
+        }
+
+        if (reuse) {
+            memset(reuse, 0, sizeof(lamb_counter_t));
+            reuse->key = key;
+            reuse->epoch = epoch;
+            return reuse;
+        }
+
+        if (shard->used < shard->size * 3 / 4) {
+            shard->used++;
+            slot->key = key;
+            slot->epoch = epoch;
+            return slot;
+        }
+
+        lamb_shard_compact(shard, epoch);
+    }
+
+    return NULL;
+}
+
+/* Drop expired counters and reinsert the live ones */
+static void lamb_shard_compact(lamb_shard_t *shard, unsigned int epoch) {
+    unsigned int i, mask, used;
+    lamb_counter_t *slots, *old;
+
+    slots = (lamb_counter_t *)calloc(shard->size, sizeof(lamb_counter_t));
+    if (!slots) {
+        return;
+    }
+
+    old = shard->slots;
+    mask = shard->size - 1;
+    used = 0;
+
+    for (unsigned int n = 0; n < shard->size; n++) {
+        if (old[n].key == 0 || lamb_counter_expired(&old[n], epoch)) {
+            continue;
+        }
+
+        i = (lamb_limiter_hash(old[n].key) >> 6) & mask;
+        while (slots[i].key != 0) {
+            i = (i + 1) & mask;
+        }
+
+        slots[i] = old[n];
+        used++;
+    }
+
+    shard->slots = slots;
+    shard->used = used;
+    free(old);
+
+    return;
+}
+
+/* Zero the buckets that slid out of the window since the last hit */
+static void lamb_counter_advance(lamb_counter_t *counter, unsigned int epoch) {
+    unsigned int gap;
+
+    gap = epoch - counter->epoch;
+
+    if (gap == 0) {
+        return;
+    }
+
+    if (gap >= LAMB_LIMITER_BUCKETS) {
+        memset(counter->counts, 0, sizeof(counter->counts));
+    } else {
+        for (unsigned int e = counter->epoch + 1; e <= epoch; e++) {
+            counter->counts[e % LAMB_LIMITER_BUCKETS] = 0;
+        }
+    }
+
+    counter->epoch = epoch;
+
+    return;
+}
+
+static int lamb_counter_sum(lamb_counter_t *counter) {
+    int sum = 0;
+
+    for (int i = 0; i < LAMB_LIMITER_BUCKETS; i++) {
+        sum += counter->counts[i];
+    }
+
+    return sum;
+}
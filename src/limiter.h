@@ -0,0 +1,43 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_LIMITER_H
+#define _LAMB_LIMITER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LAMB_LIMITER_SHARDS  64
+#define LAMB_LIMITER_BUCKETS 8
+
+typedef struct {
+    unsigned long long key;
+    unsigned int epoch;
+    unsigned short counts[LAMB_LIMITER_BUCKETS];
+} lamb_counter_t;
+
+typedef struct {
+    unsigned int size;
+    unsigned int used;
+    lamb_counter_t *slots;
+    pthread_mutex_t lock;
+} lamb_shard_t;
+
+/* Sliding window counters, approximated by LAMB_LIMITER_BUCKETS buckets */
+typedef struct {
+    int limit;
+    int window;
+    int width;
+    lamb_shard_t shards[LAMB_LIMITER_SHARDS];
+} lamb_limiter_t;
+
+lamb_limiter_t *lamb_limiter_new(unsigned int capacity, int limit, int window);
+void lamb_limiter_set(lamb_limiter_t *limiter, int limit, int window);
+bool lamb_limiter_hit(lamb_limiter_t *limiter, unsigned long long key, time_t now);
+void lamb_limiter_merge(lamb_limiter_t *limiter, unsigned long long key, int total, time_t now);
+void lamb_limiter_destroy(lamb_limiter_t *limiter);
+
+#endif
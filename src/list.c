@@ -147,11 +147,12 @@ lamb_node_t *lamb_list_rpush(lamb_list_t *self, lamb_node_t *node) {
  */
 
 lamb_node_t *lamb_list_rpop(lamb_list_t *self) {
+    pthread_mutex_lock(&self->lock);
     if (!self->len) {
+        pthread_mutex_unlock(&self->lock);
         return NULL;
     }
 
-    pthread_mutex_lock(&self->lock);
     lamb_node_t *node = self->tail;
 
     if (--self->len) {
@@ -0,0 +1,183 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lru.h"
+
+/*
+ * Nodes come from one pool allocated up front, chained in a hash table
+ * of twice the capacity and kept on a list from the most to the least
+ * recently used. A put on a full map reuses the least recently used
+ * node, nothing is allocated after lamb_lru_new.
+ */
+
+#define LAMB_LRU_NODE(lru, i) ((lamb_lru_node_t *)((lru)->pool + (i) * (sizeof(lamb_lru_node_t) + (lru)->size)))
+
+static lamb_lru_node_t **lamb_lru_slot(lamb_lru_t *lru, unsigned long long key);
+static void lamb_lru_unlink(lamb_lru_t *lru, lamb_lru_node_t *node);
+static void lamb_lru_front(lamb_lru_t *lru, lamb_lru_node_t *node);
+
+lamb_lru_t *lamb_lru_new(int capacity, size_t size) {
+    unsigned int buckets;
+    lamb_lru_t *self;
+
+    if (capacity < 1) {
+        return NULL;
+    }
+
+    self = (lamb_lru_t *)calloc(1, sizeof(lamb_lru_t));
+    if (!self) {
+        return NULL;
+    }
+
+    /* Keep every value aligned for any field type */
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    for (buckets = 1; buckets < (unsigned int)capacity * 2; buckets <<= 1);
+
+    self->capacity = capacity;
+    self->size = size;
+    self->mask = buckets - 1;
+    self->table = (lamb_lru_node_t **)calloc(buckets, sizeof(lamb_lru_node_t *));
+    self->pool = (char *)calloc(capacity, sizeof(lamb_lru_node_t) + size);
+
+    if (!self->table || !self->pool) {
+        free(self->table);
+        free(self->pool);
+        free(self);
+        return NULL;
+    }
+
+    for (int i = capacity - 1; i >= 0; i--) {
+        LAMB_LRU_NODE(self, i)->next = self->free;
+        self->free = LAMB_LRU_NODE(self, i);
+    }
+
+    return self;
+}
+
+void *lamb_lru_get(lamb_lru_t *lru, unsigned long long key) {
+    lamb_lru_node_t *node;
+
+    node = *lamb_lru_slot(lru, key);
+
+    if (!node) {
+        return NULL;
+    }
+
+    lamb_lru_unlink(lru, node);
+    lamb_lru_front(lru, node);
+
+    return node->val;
+}
+
+void *lamb_lru_put(lamb_lru_t *lru, unsigned long long key) {
+    lamb_lru_node_t *node;
+
+    node = *lamb_lru_slot(lru, key);
+
+    if (node) {
+        lamb_lru_unlink(lru, node);
+        lamb_lru_front(lru, node);
+        return node->val;
+    }
+
+    /* A full map gives up its least recently used key */
+    if (lru->free) {
+        node = lru->free;
+        lru->free = node->next;
+        lru->count++;
+    } else {
+        node = lru->tail;
+        *lamb_lru_slot(lru, node->key) = node->hnext;
+        lamb_lru_unlink(lru, node);
+    }
+
+    memset(node->val, 0, lru->size);
+    node->key = key;
+    node->hnext = lru->table[key & lru->mask];
+    lru->table[key & lru->mask] = node;
+    lamb_lru_front(lru, node);
+
+    return node->val;
+}
+
+int lamb_lru_del(lamb_lru_t *lru, unsigned long long key) {
+    lamb_lru_node_t **slot;
+    lamb_lru_node_t *node;
+
+    slot = lamb_lru_slot(lru, key);
+    node = *slot;
+
+    if (!node) {
+        return -1;
+    }
+
+    *slot = node->hnext;
+    lamb_lru_unlink(lru, node);
+
+    node->next = lru->free;
+    lru->free = node;
+    lru->count--;
+
+    return 0;
+}
+
+void lamb_lru_destroy(lamb_lru_t *lru) {
+    if (lru) {
+        free(lru->table);
+        free(lru->pool);
+        free(lru);
+    }
+
+    return;
+}
+
+/* Returns the link pointing at the node of the key, or at the end of its chain */
+static lamb_lru_node_t **lamb_lru_slot(lamb_lru_t *lru, unsigned long long key) {
+    lamb_lru_node_t **slot;
+
+    slot = &lru->table[key & lru->mask];
+
+    while (*slot && (*slot)->key != key) {
+        slot = &(*slot)->hnext;
+    }
+
+    return slot;
+}
+
+static void lamb_lru_unlink(lamb_lru_t *lru, lamb_lru_node_t *node) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        lru->head = node->next;
+    }
+
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        lru->tail = node->prev;
+    }
+
+    node->prev = node->next = NULL;
+
+    return;
+}
+
+static void lamb_lru_front(lamb_lru_t *lru, lamb_lru_node_t *node) {
+    node->prev = NULL;
+    node->next = lru->head;
+
+    if (lru->head) {
+        lru->head->prev = node;
+    } else {
+        lru->tail = node;
+    }
+
+    lru->head = node;
+
+    return;
+}
@@ -0,0 +1,38 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_LRU_H
+#define _LAMB_LRU_H
+
+#include <stddef.h>
+
+typedef struct lamb_lru_node {
+    unsigned long long key;
+    struct lamb_lru_node *hnext;
+    struct lamb_lru_node *prev;
+    struct lamb_lru_node *next;
+    char val[];
+} lamb_lru_node_t;
+
+/* Fixed size least recently used map, used by one thread only */
+typedef struct {
+    int capacity;
+    int count;
+    size_t size;
+    unsigned int mask;
+    lamb_lru_node_t **table;
+    lamb_lru_node_t *head;
+    lamb_lru_node_t *tail;
+    lamb_lru_node_t *free;
+    char *pool;
+} lamb_lru_t;
+
+lamb_lru_t *lamb_lru_new(int capacity, size_t size);
+void *lamb_lru_get(lamb_lru_t *lru, unsigned long long key);
+void *lamb_lru_put(lamb_lru_t *lru, unsigned long long key);
+int lamb_lru_del(lamb_lru_t *lru, unsigned long long key);
+void lamb_lru_destroy(lamb_lru_t *lru);
+
+#endif
@@ -28,16 +28,21 @@
 #include "config.h"
 #include "cache.h"
 #include "socket.h"
+#include "mux.h"
+#include "registry.h"
+#include "slab.h"
+#include "arena.h"
 #include "message.h"
 #include "log.h"
 #include "mo.h"
 
 static lamb_cache_t *rdb;
-static lamb_list_t *pool;
+static lamb_registry_t *pool;
+static lamb_slab_t *reports;
+static lamb_slab_t *delivers;
+static lamb_mux_t *mux;
 static lamb_config_t config;
-static pthread_cond_t cond;
-static pthread_mutex_t mutex;
-static Response resp = RESPONSE__INIT;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int main(int argc, char *argv[]) {
     char *file = "mo.conf";
@@ -100,21 +105,21 @@ int main(int argc, char *argv[]) {
 }
 
 void lamb_event_loop(void) {
-    int fd;
     int err;
-    char addr[128];
 
-    pthread_cond_init(&cond, NULL);
-    pthread_mutex_init(&mutex, NULL);
-    
     /* Client Queue Pools Initialization */
-    pool = lamb_list_new();
+    pool = lamb_registry_new();
     if (!pool) {
         syslog(LOG_ERR, "queue pool initialization failed");
         return;
     }
 
-    pool->match = lamb_queue_compare;
+    reports = lamb_slab_new(sizeof(lamb_report_t));
+    delivers = lamb_slab_new(sizeof(lamb_deliver_t));
+    if (!reports || !delivers) {
+        syslog(LOG_ERR, "message slab initialization failed");
+        return;
+    }
 
     /* Redis Initialization */
     rdb = (lamb_cache_t *)malloc(sizeof(lamb_cache_t));
@@ -133,417 +138,219 @@ void lamb_event_loop(void) {
     }
 
     /* Server Initialization */
-    fd = nn_socket(AF_SP, NN_REP);
-    if (fd < 0) {
-        syslog(LOG_ERR, "socket %s", nn_strerror(nn_errno()));
-        return;
-    }
-
-    snprintf(addr, sizeof(addr), "tcp://%s:%d", config.listen, config.port);
-
-    if (nn_bind(fd, addr) < 0) {
-        nn_close(fd);
-        syslog(LOG_ERR, "bind %s", nn_strerror(nn_errno()));
+    mux = lamb_mux_new(config.listen, config.port, config.work_threads,
+                       lamb_push_handler, lamb_pull_handler);
+    if (!mux) {
+        syslog(LOG_ERR, "can't listen on %s:%d", config.listen, config.port);
         return;
     }
 
     /* Start Data Acquisition Thread */
     lamb_start_thread(lamb_stat_loop, NULL, 1);
 
-    int rc, len;
-    
-    while (true) {
-        char *buf = NULL;
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
-
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
-            continue;
-        }
-
-        if (CHECK_COMMAND(buf) != LAMB_REQUEST) {
-            nn_freemsg(buf);
-            syslog(LOG_ERR, "Invalid command request from client");
-            continue;
-        }
-
-        Request *req;
-        req = request__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-        nn_freemsg(buf);
-
-        if (!req) {
-            syslog(LOG_ERR, "can't parse protobuff protocol packets");
-            continue;
-        }
+    /* Start Worker Threads */
+    lamb_mux_run(mux);
 
-        if (req->id < 1) {
-            request__free_unpacked(req, NULL);
-            syslog(LOG_ERR, "Invalid client identity id number");
-            continue;
-        }
-
-        struct timeval now;
-        struct timespec timeout;
-        
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = now.tv_sec;
-        timeout.tv_nsec = now.tv_usec * 1000;
-        timeout.tv_sec += 3;
-
-        pthread_mutex_lock(&mutex);
-
-        if (req->type == LAMB_PULL) {
-            lamb_start_thread(lamb_pull_loop,  (void *)req, 1);
-        } else if (req->type == LAMB_PUSH) {
-            lamb_start_thread(lamb_push_loop,  (void *)req, 1);
-        } else {
-            pthread_mutex_unlock(&mutex);
-            continue;
-        }
-
-        err = pthread_cond_timedwait(&cond, &mutex, &timeout);
-
-        if (err != ETIMEDOUT) {
-            void *pk;
-            len = response__get_packed_size(&resp);
-            pk = malloc(len);
-
-            if (pk) {
-                response__pack(&resp, pk);
-                len = lamb_pack_assembly(&buf, LAMB_RESPONSE, pk, len);
-                if (len > 0) {
-                    nn_send(fd, buf, len, 0);
-                    free(buf);
-                }
-                free(pk);
-            }
-        }
-
-        pthread_mutex_unlock(&mutex);
-    }
+    return;
 }
 
-void *lamb_push_loop(void *arg) {
-    int fd;
-    int err;
-    int timeout;
-    char host[64];
-    Request *client;
-    lamb_node_t *node;
+/* Find the queue of a client, created on first use */
+lamb_queue_t *lamb_pool_queue(int id) {
     lamb_queue_t *queue;
-    
-    client = (Request *)arg;
 
-    syslog(LOG_INFO, "new client from %s connectd\n", client->addr);
+    queue = lamb_registry_get(pool, id);
 
-    /* Client queue initialization */
-    node = lamb_list_find(pool, (void *)(intptr_t)client->id);
-
-    if (node) {
-        queue = (lamb_queue_t *)node->val;
-    } else {
-        queue = lamb_queue_new(client->id);
-        if (queue) {
-            lamb_list_rpush(pool, lamb_node_new(queue));
-        }
-    }
-
-    if (!queue) {
-        syslog(LOG_ERR, "can't create queue for client %s", client->addr);
-        request__free_unpacked(client, NULL);
-        pthread_exit(NULL);
-    }
-
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_PAIR);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+    if (queue) {
+        return queue;
     }
 
     pthread_mutex_lock(&mutex);
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+    queue = lamb_registry_get(pool, id);
+
+    if (!queue) {
+        queue = lamb_queue_new(id);
+        if (queue && lamb_registry_set(pool, id, queue) != 0) {
+            lamb_queue_destroy(queue);
+            free(queue);
+            queue = NULL;
+        }
+    }
 
     pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
-    
-    /* Start event processing */
-    int rc;
+    return queue;
+}
+
+int lamb_push_handler(int method, int id, char *pk, size_t len) {
+    void *message;
     Report *rpack;
     Deliver *dpack;
     lamb_report_t *r;
     lamb_deliver_t *d;
-    char *buf = NULL;
+    lamb_queue_t *queue;
 
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
-        
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
-
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
-
-            continue;
+    queue = lamb_pool_queue(id);
+
+    if (!queue) {
+        syslog(LOG_ERR, "can't create queue for client %d", id);
+        return LAMB_BUSY;
+    }
+
+    if (method == LAMB_REPORT) {
+        rpack = report__unpack(lamb_arena(), len, (uint8_t *)pk);
+
+        if (!rpack) {
+            return LAMB_REJECT;
         }
 
-        if (CHECK_COMMAND(buf) == LAMB_REPORT) {
-            rpack = report__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
-
-            if (!rpack) {
-                continue;
-            }
-
-            r = (lamb_report_t *)calloc(1, sizeof(lamb_report_t));
-
-            if (r) {
-                r->type = LAMB_REPORT;
-                r->id = rpack->id;
-                r->account = rpack->account;
-                r->company = rpack->company;
-                strncpy(r->spcode, rpack->spcode, 20);
-                strncpy(r->phone, rpack->phone, 11);
-                r->status = rpack->status;
-                strncpy(r->submittime, rpack->submittime, 10);
-                strncpy(r->donetime, rpack->donetime, 10);
-                lamb_queue_push(queue, r);
-            }
-
-            report__free_unpacked(rpack, NULL);
-            continue;
+        r = (lamb_report_t *)lamb_slab_alloc(reports);
+
+        if (!r) {
+            report__free_unpacked(rpack, lamb_arena());
+            return LAMB_BUSY;
         }
 
-        if (CHECK_COMMAND(buf) == LAMB_DELIVER) {
-            dpack = deliver__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
-
-            if (!dpack) {
-                continue;
-            }
-
-            d = (lamb_deliver_t *)calloc(1, sizeof(lamb_deliver_t));
-
-            if (d) {
-                d->type = LAMB_DELIVER;
-                d->id = dpack->id;
-                d->account = dpack->account;
-                d->company = dpack->company;
-                strncpy(d->phone, dpack->phone, 11);
-                strncpy(d->spcode, dpack->spcode, 20);
-                strncpy(d->serviceid, dpack->serviceid, 10);
-                d->msgfmt = dpack->msgfmt;
-                d->length = dpack->length;
-                memcpy(d->content, dpack->content.data, dpack->content.len);
-                lamb_queue_push(queue, d);
-            }
-
-            deliver__free_unpacked(dpack, NULL);
-            continue;
+        r->type = LAMB_REPORT;
+        r->id = rpack->id;
+        r->account = rpack->account;
+        r->company = rpack->company;
+        strncpy(r->spcode, rpack->spcode, 20);
+        strncpy(r->phone, rpack->phone, 11);
+        r->status = rpack->status;
+        strncpy(r->submittime, rpack->submittime, 10);
+        strncpy(r->donetime, rpack->donetime, 10);
+
+        report__free_unpacked(rpack, lamb_arena());
+        message = r;
+    } else if (method == LAMB_DELIVER) {
+        dpack = deliver__unpack(lamb_arena(), len, (uint8_t *)pk);
+
+        if (!dpack) {
+            return LAMB_REJECT;
         }
 
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
+        d = (lamb_deliver_t *)lamb_slab_alloc(delivers);
+
+        if (!d) {
+            deliver__free_unpacked(dpack, lamb_arena());
+            return LAMB_BUSY;
         }
 
-        nn_freemsg(buf);
+        d->type = LAMB_DELIVER;
+        d->id = dpack->id;
+        d->account = dpack->account;
+        d->company = dpack->company;
+        strncpy(d->phone, dpack->phone, 11);
+        strncpy(d->spcode, dpack->spcode, 20);
+        strncpy(d->serviceid, dpack->serviceid, 10);
+        d->msgfmt = dpack->msgfmt;
+        d->length = dpack->length;
+        memcpy(d->content, dpack->content.data, dpack->content.len);
+
+        deliver__free_unpacked(dpack, lamb_arena());
+        message = d;
+    } else {
+        return LAMB_REJECT;
     }
 
-    nn_close(fd);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    lamb_debug("connection closed from %s\n", client->addr);
-    request__free_unpacked(client, NULL);
+    /* Queue is full, hold back the producer */
+    if (lamb_queue_push(queue, message) != 0) {
+        lamb_free_message(message);
+        return LAMB_BUSY;
+    }
 
-    pthread_exit(NULL);
+    lamb_mux_wake(mux, id);
+
+    return LAMB_OK;
 }
 
-void *lamb_pull_loop(void *arg) {
-    int fd;
-    int err;
-    int timeout;
-    char host[64];
-    lamb_node_t *node;
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes) {
+    void *message;
     lamb_queue_t *queue;
-    Request *client;
-    
-    client = (Request *)arg;
 
-    lamb_debug("new client from %s connectd\n", client->addr);
+    queue = lamb_pool_queue(id);
 
-    /* Client queue initialization */
-    node = lamb_list_find(pool, (void *)(intptr_t)client->id);
+    if (!queue) {
+        return 0;
+    }
 
-    if (node) {
-        queue = (lamb_queue_t *)node->val;
-    } else {
-        queue = lamb_queue_new(client->id);
-        if (queue) {
-            lamb_list_rpush(pool, lamb_node_new(queue));
+    /* Drain the queue up to the consumer hint */
+    while (batch->count < count && batch->len < bytes) {
+        message = lamb_queue_pop(queue);
+
+        if (!message) {
+            break;
         }
-    }
 
-    if (!queue) {
-        syslog(LOG_ERR, "can't create queue for client %s", client->addr);
-        request__free_unpacked(client, NULL);
-        pthread_exit(NULL);
-    }
-    
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_REP);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+        lamb_pack_message(batch, message);
+        lamb_free_message(message);
     }
 
-    pthread_mutex_lock(&mutex);
+    return batch->count;
+}
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+void lamb_free_message(void *message) {
+    if (CHECK_TYPE(message) == LAMB_REPORT) {
+        lamb_slab_free(reports, message);
+    } else {
+        lamb_slab_free(delivers, message);
+    }
 
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
+    return;
+}
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
-    
-    /* Start event processing */
+int lamb_pack_message(lamb_batch_t *batch, void *message) {
     void *pk;
-    int rc, len;
-    void *message;
+    size_t len;
     lamb_report_t *report;
     lamb_deliver_t *deliver;
     Report rpack = REPORT__INIT;
     Deliver dpack = DELIVER__INIT;
 
-    while (true) {
-        char *buf = NULL;
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
-        
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
-
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
-
-            continue;
-        }
+    if (CHECK_TYPE(message) == LAMB_REPORT) {
+        report = (lamb_report_t *)message;
 
-        if (CHECK_COMMAND(buf) == LAMB_REQ) {
-            nn_freemsg(buf);
-            node = lamb_queue_pop(queue);
-
-            if (!node) {
-                len = lamb_pack_assembly(&buf, LAMB_EMPTY, NULL, 0);
-                nn_send(fd, buf, len, NN_DONTWAIT);
-
-                if (len > 0) {
-                    free(buf);
-                }
-
-                continue;
-            }
-
-            message = node->val;
-
-            if (CHECK_TYPE(message) == LAMB_REPORT) {
-                report = (lamb_report_t *)message;
-
-                rpack.id = report->id;
-                rpack.account = report->account;
-                rpack.company = report->company;
-                rpack.spcode = report->spcode;
-                rpack.phone = report->phone;
-                rpack.status = report->status;
-                rpack.submittime = report->submittime;
-                rpack.donetime = report->donetime;
-
-                len = report__get_packed_size(&rpack);
-                pk = malloc(len);
-
-                if (pk) {
-                    report__pack(&rpack, pk);
-                    len = lamb_pack_assembly(&buf, LAMB_REPORT, pk, len);
-                    if (len > 0) {
-                        nn_send(fd, buf, len, NN_DONTWAIT);
-                        free(buf);
-                    }
-                    free(pk);
-                }
-            } else if (CHECK_TYPE(message) == LAMB_DELIVER) {
-                deliver = (lamb_deliver_t *)message;
-
-                dpack.id = deliver->id;
-                dpack.account = deliver->account;
-                dpack.company = deliver->company;
-                dpack.phone = deliver->phone;
-                dpack.spcode = deliver->spcode;
-                dpack.serviceid = deliver->serviceid;
-                dpack.msgfmt = deliver->msgfmt;
-                dpack.length = deliver->length;
-                dpack.content.len = deliver->length;
-                dpack.content.data = (uint8_t *)deliver->content;
-
-                len = deliver__get_packed_size(&dpack);
-                pk = malloc(len);
-
-                if (pk) {
-                    deliver__pack(&dpack, pk);
-                    len = lamb_pack_assembly(&buf, LAMB_DELIVER, pk, len);
-                    if (len > 0) {
-                        nn_send(fd, buf, len, NN_DONTWAIT);
-                        free(buf);
-                    }
-                    free(pk);
-                }
-            }
-
-            free(message);
-            free(node);
-            continue;
-        }
+        rpack.id = report->id;
+        rpack.account = report->account;
+        rpack.company = report->company;
+        rpack.spcode = report->spcode;
+        rpack.phone = report->phone;
+        rpack.status = report->status;
+        rpack.submittime = report->submittime;
+        rpack.donetime = report->donetime;
 
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
-        }
+        len = report__get_packed_size(&rpack);
+        pk = lamb_batch_reserve(batch, LAMB_REPORT, len);
 
-        nn_freemsg(buf);
+        if (pk) {
+            report__pack(&rpack, pk);
+            return 0;
+        }
+    } else if (CHECK_TYPE(message) == LAMB_DELIVER) {
+        deliver = (lamb_deliver_t *)message;
+
+        dpack.id = deliver->id;
+        dpack.account = deliver->account;
+        dpack.company = deliver->company;
+        dpack.phone = deliver->phone;
+        dpack.spcode = deliver->spcode;
+        dpack.serviceid = deliver->serviceid;
+        dpack.msgfmt = deliver->msgfmt;
+        dpack.length = deliver->length;
+        dpack.content.len = deliver->length;
+        dpack.content.data = (uint8_t *)deliver->content;
+
+        len = deliver__get_packed_size(&dpack);
+        pk = lamb_batch_reserve(batch, LAMB_DELIVER, len);
+
+        if (pk) {
+            deliver__pack(&dpack, pk);
+            return 0;
+        }
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
-
-    pthread_exit(NULL);
+    return -1;
 }
 
 int lamb_server_init(int *sock, const char *listen, int port) {
@@ -569,40 +376,24 @@ int lamb_server_init(int *sock, const char *listen, int port) {
     return 0;
 }
 
-int lamb_child_server(int *sock, const char *host, unsigned short *port, int protocol) {
-    while (true) {
-        if (!lamb_nn_server(sock, host, *port, protocol)) {
-            break;
-        }
-        (*port)++;
-    }
-
-    return 0;
-}
-
 void *lamb_stat_loop(void *arg) {
-    lamb_node_t *node;
-    lamb_queue_t *queue;
-
     /* Reset mt queue */
     lamb_reset_queues(rdb);
     
     while (true) {
-        lamb_list_iterator_t *it;
-        it = lamb_list_iterator_new(pool, LIST_HEAD);
-        
-        while ((node = lamb_list_iterator_next(it))) {
-            queue = (lamb_queue_t *)node->val;
-            lamb_sync_update(rdb, queue->id, queue->list->len);
-        }
-
-        lamb_list_iterator_destroy(it);
+        lamb_registry_foreach(pool, lamb_sync_queue, rdb);
         lamb_sleep(3000);
     }
 
     pthread_exit(NULL);
 }
 
+void lamb_sync_queue(void *queue, void *cache) {
+    lamb_sync_update((lamb_cache_t *)cache, ((lamb_queue_t *)queue)->id,
+                     lamb_queue_len((lamb_queue_t *)queue));
+    return;
+}
+
 int lamb_sync_update(lamb_cache_t *cache, int id, unsigned int num) {
     redisReply *reply = NULL;
 
@@ -708,6 +499,18 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    /* Work threads */
+    if (lamb_get_int(&cfg, "WorkThreads", &conf->work_threads) != 0) {
+        fprintf(stderr, "Can't read config 'WorkThreads' parameter\n");
+        goto error;
+    }
+
+    /* Check work threads validity */
+    if (conf->work_threads < 1 || conf->work_threads > LAMB_MAX_THREAD) {
+        fprintf(stderr, "Invalid work threads number\n");
+        goto error;
+    }
+
     /* Ac */
     if (lamb_get_string(&cfg, "Ac", conf->ac, 128) != 0) {
         fprintf(stderr, "Can't read config 'Ac' parameter\n");
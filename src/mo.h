@@ -17,6 +17,7 @@ typedef struct {
     char listen[16];
     int port;
     long long timeout;
+    int work_threads;
     char ac[128];
     char redis_host[16];
     int redis_port;
@@ -31,11 +32,14 @@ typedef struct {
 } lamb_element;
 
 void lamb_event_loop(void);
-void *lamb_push_loop(void *arg);
-void *lamb_pull_loop(void *arg);
+lamb_queue_t *lamb_pool_queue(int id);
+int lamb_push_handler(int method, int id, char *pk, size_t len);
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes);
+void lamb_free_message(void *message);
+int lamb_pack_message(lamb_batch_t *batch, void *message);
 int lamb_server_init(int *sock, const char *listen, int port);
-int lamb_child_server(int *sock, const char *host, unsigned short *port, int protocol);
 void *lamb_stat_loop(void *arg);
+void lamb_sync_queue(void *queue, void *cache);
 int lamb_sync_update(lamb_cache_t *cache, int id, unsigned int num);
 void lamb_reset_queues(lamb_cache_t *cache);
 int lamb_read_config(lamb_config_t *conf, const char *file);
@@ -0,0 +1,110 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "common.h"
+#include "msgid.h"
+
+/*
+ * CMPP Msg_Id is month, day, hour, minute and second in 26 bits, a 22
+ * bit gateway code and a 16 bit sequence. The gateway code holds the
+ * node id in its upper 10 bits, the lower 12 bits extend the sequence,
+ * so each node hands out 2^28 ids per second. A timer thread keeps the
+ * current second and its packed stamp in one word, the second and the
+ * sequence of the last id are another word advanced by compare and
+ * swap. When the sequence runs out the next second is borrowed, and a
+ * clock going back keeps counting, so an id is never handed out twice.
+ */
+
+#define LAMB_MSGID_MASK ((1ULL << LAMB_MSGID_SEQUENCE) - 1)
+
+static int node = 0;
+static unsigned long long clock_word = 0;
+static unsigned long long last = 0;
+
+static unsigned long long lamb_msgid_stamp(time_t sec);
+static void *lamb_msgid_clock(void *arg);
+
+int lamb_msgid_init(int id) {
+    time_t now;
+
+    if (id < 0 || id >= LAMB_MSGID_NODES) {
+        return -1;
+    }
+
+    node = id;
+    now = time(NULL);
+    clock_word = ((unsigned long long)now << LAMB_MSGID_STAMP) | lamb_msgid_stamp(now);
+
+    lamb_start_thread(lamb_msgid_clock, NULL, 1);
+
+    return 0;
+}
+
+unsigned long long lamb_msgid(void) {
+    unsigned long long now, sec, seq;
+    unsigned long long clock, stamp, cur, next;
+
+    clock = __atomic_load_n(&clock_word, __ATOMIC_ACQUIRE);
+    now = clock >> LAMB_MSGID_STAMP;
+    cur = __atomic_load_n(&last, __ATOMIC_RELAXED);
+
+    do {
+        sec = cur >> LAMB_MSGID_SEQUENCE;
+        if (now > sec) {
+            next = now << LAMB_MSGID_SEQUENCE;
+        } else if ((cur & LAMB_MSGID_MASK) < LAMB_MSGID_MASK) {
+            next = cur + 1;
+        } else {
+            next = (sec + 1) << LAMB_MSGID_SEQUENCE;
+        }
+    } while (!__atomic_compare_exchange_n(&last, &cur, next, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    sec = next >> LAMB_MSGID_SEQUENCE;
+    seq = next & LAMB_MSGID_MASK;
+
+    /* Only a borrowed second or a clock going back needs the slow path */
+    if (sec == now) {
+        stamp = clock & ((1ULL << LAMB_MSGID_STAMP) - 1);
+    } else {
+        stamp = lamb_msgid_stamp((time_t)sec);
+    }
+
+    return (stamp << 38) | ((unsigned long long)node << 28) | ((seq >> 16) << 16) | (seq & 0xffff);
+}
+
+static unsigned long long lamb_msgid_stamp(time_t sec) {
+    struct tm t;
+
+    localtime_r(&sec, &t);
+
+    return ((unsigned long long)(t.tm_mon + 1) << 22) | ((unsigned long long)t.tm_mday << 17) |
+        ((unsigned long long)t.tm_hour << 12) | ((unsigned long long)t.tm_min << 6) | (unsigned long long)t.tm_sec;
+}
+
+static void *lamb_msgid_clock(void *arg) {
+    time_t now, sec;
+    struct timespec ts;
+
+    sec = 0;
+
+    while (true) {
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        now = ts.tv_sec;
+
+        /* The conversion is done once a second, not once per id */
+        if (now != sec) {
+            __atomic_store_n(&clock_word, ((unsigned long long)now << LAMB_MSGID_STAMP) | lamb_msgid_stamp(now),
+                             __ATOMIC_RELEASE);
+            sec = now;
+        }
+
+        lamb_sleep(LAMB_MSGID_TICK);
+    }
+
+    pthread_exit(NULL);
+}
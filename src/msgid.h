@@ -0,0 +1,17 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_MSGID_H
+#define _LAMB_MSGID_H
+
+#define LAMB_MSGID_NODES    1024
+#define LAMB_MSGID_SEQUENCE 28
+#define LAMB_MSGID_STAMP    26
+#define LAMB_MSGID_TICK     10
+
+int lamb_msgid_init(int node);
+unsigned long long lamb_msgid(void);
+
+#endif
@@ -9,22 +9,29 @@
 #include <string.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <endian.h>
 #include "common.h"
 #include "config.h"
 #include "cache.h"
 #include "socket.h"
+#include "mux.h"
 #include "queue.h"
+#include "registry.h"
+#include "journal.h"
+#include "slab.h"
+#include "arena.h"
 #include "command.h"
 #include "message.h"
 #include "log.h"
 #include "mt.h"
 
 static lamb_cache_t *rdb;
-static lamb_list_t *pool;
+static lamb_registry_t *pool;
+static lamb_mux_t *mux;
+static lamb_journal_t *journal;
+static lamb_slab_t *items;
 static lamb_config_t config;
-static pthread_cond_t cond;
-static pthread_mutex_t mutex;
-static Response resp = RESPONSE__INIT;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int main(int argc, char *argv[]) {
     char *file = "mt.conf";
@@ -87,21 +94,20 @@ int main(int argc, char *argv[]) {
 }
 
 void lamb_event_loop(void) {
-    int fd;
     int err;
-    char addr[128];
 
-    pthread_cond_init(&cond, NULL);
-    pthread_mutex_init(&mutex, NULL);
-    
     /* Client Queue Pools Initialization */
-    pool = lamb_list_new();
+    pool = lamb_registry_new();
     if (!pool) {
         syslog(LOG_ERR, "queue pool initialization failed");
         return;
     }
 
-    pool->match = lamb_queue_compare;
+    items = lamb_slab_new(sizeof(lamb_item_t));
+    if (!items) {
+        syslog(LOG_ERR, "message slab initialization failed");
+        return;
+    }
 
     /* Redis Initialization */
     rdb = (lamb_cache_t *)malloc(sizeof(lamb_cache_t));
@@ -117,398 +123,511 @@ void lamb_event_loop(void) {
         syslog(LOG_ERR, "can't connect to redis database");
         return;
     }
-    
-    /* Server Initialization */
-    fd = nn_socket(AF_SP, NN_REP);
-    if (fd < 0) {
-        syslog(LOG_ERR, "socket %s", nn_strerror(nn_errno()));
+
+    /* Journal Initialization */
+    journal = lamb_journal_open(config.journal_dir, (size_t)config.journal_size * 1024 * 1024,
+                                config.journal_sync);
+    if (!journal) {
+        syslog(LOG_ERR, "can't open journal %s", config.journal_dir);
         return;
     }
 
-    snprintf(addr, sizeof(addr), "tcp://%s:%d", config.listen, config.port);
+    /* Acknowledgements first, then rebuild the queues with what is left */
+    if (lamb_journal_replay(journal, lamb_replay_ack, NULL) != 0 ||
+        lamb_journal_replay(journal, lamb_replay_submit, NULL) != 0) {
+        syslog(LOG_ERR, "can't replay journal %s", config.journal_dir);
+        return;
+    }
 
-    if (nn_bind(fd, addr) < 0) {
-        nn_close(fd);
-        syslog(LOG_ERR, "bind %s", nn_strerror(nn_errno()));
+    lamb_start_thread(lamb_journal_loop, journal, 1);
+    
+    /* Server Initialization */
+    mux = lamb_mux_new(config.listen, config.port, config.work_threads,
+                       lamb_push_handler, lamb_pull_handler);
+    if (!mux) {
+        syslog(LOG_ERR, "can't listen on %s:%d", config.listen, config.port);
         return;
     }
 
     /* Start Data Acquisition Thread */
     lamb_start_thread(lamb_stat_loop, NULL, 1);
 
-    int rc, len;
-    Request *req;
-    char *buf = NULL;
+    /* Start Worker Threads */
+    lamb_mux_run(mux);
 
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+    return;
+}
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
-            continue;
-        }
+/* Find the stream of a client, created on first use */
+lamb_stream_t *lamb_pool_stream(int id) {
+    lamb_stream_t *stream;
 
-        if (CHECK_COMMAND(buf) != LAMB_REQUEST) {
-            nn_freemsg(buf);
-            syslog(LOG_WARNING, "Invalid command request from client");
-            continue;
-        }
+    stream = lamb_registry_get(pool, id);
 
-        req = request__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-        nn_freemsg(buf);
+    if (stream) {
+        return stream;
+    }
 
-        if (!req) {
-            syslog(LOG_WARNING, "can't parse protobuff protocol packets");
-            continue;
-        }
+    pthread_mutex_lock(&mutex);
 
-        if (req->id < 1) {
-            request__free_unpacked(req, NULL);
-            syslog(LOG_WARNING, "Invalid client identity id number");
-            continue;
-        }
+    stream = lamb_registry_get(pool, id);
 
-        struct timeval now;
-        struct timespec timeout;
-        
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = now.tv_sec;
-        timeout.tv_nsec = now.tv_usec * 1000;
-        timeout.tv_sec += 3;
-
-        pthread_mutex_lock(&mutex);
-
-        if (req->type == LAMB_PULL) {
-            lamb_start_thread(lamb_pull_loop,  (void *)req, 1);
-        } else if (req->type == LAMB_PUSH) {
-            lamb_start_thread(lamb_push_loop,  (void *)req, 1);
-        } else {
-            request__free_unpacked(req, NULL);
-            pthread_mutex_unlock(&mutex);
-            continue;
+    if (!stream) {
+        stream = lamb_stream_new(id);
+        if (stream && lamb_registry_set(pool, id, stream) != 0) {
+            lamb_queue_destroy(stream->queue);
+            free(stream->queue);
+            free(stream);
+            stream = NULL;
         }
+    }
 
-        err = pthread_cond_timedwait(&cond, &mutex, &timeout);
-
-        if (err != ETIMEDOUT) {
-            void *pk;
-            len = response__get_packed_size(&resp);
-            pk = malloc(len);
-
-            if (pk) {
-                response__pack(&resp, pk);
-                len = lamb_pack_assembly(&buf, LAMB_RESPONSE, pk, len);
-                if (len > 0) {
-                    nn_send(fd, buf, len, 0);
-                    free(buf);
-                }
-                free(pk);
-            }
-        }
+    pthread_mutex_unlock(&mutex);
+
+    return stream;
+}
 
-        pthread_mutex_unlock(&mutex);
+lamb_stream_t *lamb_stream_new(int id) {
+    lamb_stream_t *self;
+
+    self = (lamb_stream_t *)calloc(1, sizeof(lamb_stream_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->queue = lamb_queue_new(id);
+    if (!self->queue) {
+        free(self);
+        return NULL;
     }
+
+    self->id = id;
+    pthread_mutex_init(&self->lock, NULL);
+
+    return self;
 }
 
-void *lamb_push_loop(void *arg) {
-    int fd;
-    int err;
-    int timeout;
-    char host[64];
-    Request *client;
-    lamb_node_t *node;
-    lamb_queue_t *queue;
+/*
+ * A submit is accepted once it is in the journal. The stream lock keeps
+ * the journal order and the queue order of a client the same, so the
+ * queue can't fill up between the check and the push either.
+ */
 
-    client = (Request *)arg;
+int lamb_push_handler(int method, int id, char *pk, size_t len) {
+    lamb_item_t *item;
+    lamb_stream_t *stream;
 
-    syslog(LOG_INFO, "new client from %s connectd", client->addr);
+    if (method == LAMB_ACK) {
+        return lamb_ack_handler(id, pk, len);
+    }
+
+    if (method != LAMB_SUBMIT) {
+        lamb_debug("invalid request command\n");
+        return LAMB_REJECT;
+    }
 
-    /* Client queue initialization */
-    node = lamb_list_find(pool, (void *)(intptr_t)client->id);
+    stream = lamb_pool_stream(id);
 
-    if (node) {
-        queue = (lamb_queue_t *)node->val;
-    } else {
-        queue = lamb_queue_new(client->id);
-        if (queue) {
-            lamb_list_rpush(pool, lamb_node_new(queue));
-        }
+    if (!stream) {
+        syslog(LOG_ERR, "can't create queue for client %d", id);
+        return LAMB_BUSY;
     }
-    
-    if (!queue) {
-        syslog(LOG_ERR, "can't create queue for client %s", client->addr);
-        request__free_unpacked(client, NULL);
-        pthread_exit(NULL);
+
+    item = lamb_unpack_submit(pk, len);
+
+    if (!item) {
+        return LAMB_REJECT;
     }
-    
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_PAIR);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+
+    pthread_mutex_lock(&stream->lock);
+
+    /* Sent again after a lost reply, the first copy is journaled already */
+    if (lamb_stream_recent(stream, item->message.id)) {
+        pthread_mutex_unlock(&stream->lock);
+        lamb_slab_free(items, item);
+        return LAMB_OK;
     }
 
-    pthread_mutex_lock(&mutex);
+    /* Queue is full, hold back the producer */
+    if (lamb_queue_len(stream->queue) >= lamb_ring_size(stream->queue->ring)) {
+        pthread_mutex_unlock(&stream->lock);
+        lamb_slab_free(items, item);
+        return LAMB_BUSY;
+    }
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+    item->sequence = lamb_journal_append(journal, LAMB_SUBMIT, id, pk, len);
 
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
+    if (item->sequence == 0) {
+        pthread_mutex_unlock(&stream->lock);
+        syslog(LOG_ERR, "can't write submit of client %d to journal", id);
+        lamb_slab_free(items, item);
+        return LAMB_BUSY;
+    }
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
-    
-    /* Start event processing */
-    int rc;
-    Submit *packet;
-    char *buf = NULL;
-    lamb_submit_t *message;
+    lamb_stream_remember(stream, item->message.id);
+    lamb_queue_push(stream->queue, item);
+    stream->pushed = item->sequence;
 
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+    pthread_mutex_unlock(&stream->lock);
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
+    lamb_mux_wake(mux, id);
 
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
+    return LAMB_OK;
+}
 
-            continue;
-        }
+/*
+ * The recent ids are a direct mapped table, an id only pushes out the
+ * one in its slot. That is plenty for the window of a producer, the
+ * stream lock must be held.
+ */
 
-        if (CHECK_COMMAND(buf) == LAMB_SUBMIT) {
-            packet = submit__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
+bool lamb_stream_recent(lamb_stream_t *stream, unsigned long long id) {
+    unsigned long long slot;
 
-            if (!packet) {
-                continue;
-            }
+    slot = (id * 0x9e3779b97f4a7c15ULL) >> 32;
+
+    return id != 0 && stream->recent[slot % LAMB_MT_RECENT] == id;
+}
+
+void lamb_stream_remember(lamb_stream_t *stream, unsigned long long id) {
+    unsigned long long slot;
+
+    slot = (id * 0x9e3779b97f4a7c15ULL) >> 32;
+    stream->recent[slot % LAMB_MT_RECENT] = id;
+
+    return;
+}
+
+/*
+ * Sent items stay in flight until the consumer acknowledges them, the
+ * last record of a batch is the sequence that acknowledges all of it.
+ */
+
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes) {
+    char *pk;
+    lamb_item_t *item;
+    lamb_stream_t *stream;
+    unsigned long long sequence;
+
+    stream = lamb_pool_stream(id);
+
+    if (!stream) {
+        return 0;
+    }
+
+    sequence = 0;
+
+    pthread_mutex_lock(&stream->lock);
+
+    /* Drain the backlog and then the queue up to the consumer hint */
+    while (batch->count < count && batch->len < bytes) {
+        item = stream->backlog.head;
+
+        if (!item) {
+            item = lamb_queue_pop(stream->queue);
 
-            message = (lamb_submit_t *)calloc(1, sizeof(lamb_submit_t));
-
-            if (message) {
-                message->id = packet->id;
-                message->account = packet->account;
-                message->company = packet->company;
-                strncpy(message->spid, packet->spid, 6);
-                strncpy(message->spcode, packet->spcode, 20);
-                strncpy(message->phone, packet->phone, 11);
-                message->msgfmt = packet->msgfmt;
-                message->length = packet->length;
-                memcpy(message->content, packet->content.data, packet->content.len);
-                lamb_queue_push(queue, message);
+            if (!item) {
+                break;
             }
 
-            submit__free_unpacked(packet, NULL);
-            continue;
+            /* The backlog is empty, a queued item is its oldest one as well */
+            lamb_items_append(&stream->backlog, item);
         }
 
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
+        if (lamb_pack_submit(batch, &item->message) != 0) {
             break;
         }
 
-        nn_freemsg(buf);
+        lamb_items_shift(&stream->backlog);
+        lamb_items_append(&stream->inflight, item);
+
+        if (item->sequence > stream->sent) {
+            stream->sent = item->sequence;
+        }
+
+        sequence = item->sequence;
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
-    
-    pthread_exit(NULL);
+    pthread_mutex_unlock(&stream->lock);
+
+    if (sequence > 0) {
+        pk = lamb_batch_reserve(batch, LAMB_ACK, sizeof(sequence));
+
+        /* Without it the batch is acknowledged along with the next one */
+        if (pk) {
+            sequence = htobe64(sequence);
+            memcpy(pk, &sequence, sizeof(sequence));
+        }
+    }
+
+    return batch->count;
 }
 
-void *lamb_pull_loop(void *arg) {
-    int fd;
-    int err;
-    int timeout;
-    char host[64];
-    lamb_node_t *node;
-    lamb_queue_t *queue;
-    Request *client;
-    
-    client = (Request *)arg;
+/*
+ * A consumer acknowledges the last sequence it has processed and every
+ * item before it. A consumer that starts sends zero, the items in flight
+ * to its earlier run go back ahead of the backlog to be sent again.
+ */
 
-    syslog(LOG_INFO, "new client from %s connectd\n", client->addr);
+int lamb_ack_handler(int id, char *pk, size_t len) {
+    lamb_item_t *item;
+    lamb_stream_t *stream;
+    unsigned long long sequence;
 
-    /* Client queue initialization */
-    node = lamb_list_find(pool, (void *)(intptr_t)client->id);
+    if (len != sizeof(sequence)) {
+        return LAMB_REJECT;
+    }
 
-    if (node) {
-        queue = (lamb_queue_t *)node->val;
-    } else {
-        queue = lamb_queue_new(client->id);
-        if (queue) {
-            lamb_list_rpush(pool, lamb_node_new(queue));
+    memcpy(&sequence, pk, sizeof(sequence));
+    sequence = be64toh(sequence);
+
+    stream = lamb_pool_stream(id);
+
+    if (!stream) {
+        return LAMB_BUSY;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+
+    if (sequence == 0) {
+        if (stream->inflight.head) {
+            stream->inflight.tail->next = stream->backlog.head;
+            if (!stream->backlog.head) {
+                stream->backlog.tail = stream->inflight.tail;
+            }
+            stream->backlog.head = stream->inflight.head;
+            stream->backlog.count += stream->inflight.count;
+            memset(&stream->inflight, 0, sizeof(stream->inflight));
         }
+
+        pthread_mutex_unlock(&stream->lock);
+        lamb_mux_wake(mux, id);
+
+        return LAMB_OK;
     }
 
-    node = NULL;
+    /* Nothing above the last item sent can be acknowledged */
+    if (sequence > stream->sent) {
+        sequence = stream->sent;
+    }
+
+    if (sequence > stream->acked) {
+        if (lamb_journal_append(journal, LAMB_ACK, id, &sequence, sizeof(sequence)) == 0) {
+            pthread_mutex_unlock(&stream->lock);
+            syslog(LOG_ERR, "can't write acknowledgement of client %d to journal", id);
+            return LAMB_BUSY;
+        }
 
-    if (!queue) {
-        syslog(LOG_ERR, "can't create queue for client %s", client->addr);
-        request__free_unpacked(client, NULL);
-        pthread_exit(NULL);
+        stream->acked = sequence;
+
+        while (stream->inflight.head && stream->inflight.head->sequence <= sequence) {
+            item = lamb_items_shift(&stream->inflight);
+            lamb_slab_free(items, item);
+        }
     }
-    
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_REP);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return LAMB_OK;
+}
+
+/* Item lists are only used with the stream lock held */
+void lamb_items_append(lamb_items_t *list, lamb_item_t *item) {
+    item->next = NULL;
+
+    if (list->tail) {
+        list->tail->next = item;
+    } else {
+        list->head = item;
     }
 
-    pthread_mutex_lock(&mutex);
+    list->tail = item;
+    list->count++;
+
+    return;
+}
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+lamb_item_t *lamb_items_shift(lamb_items_t *list) {
+    lamb_item_t *item;
 
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
+    item = list->head;
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
-    
-    /* Start event processing */
-    int rc;
-    int len;
-    char *buf;
+    if (item) {
+        list->head = item->next;
+        if (!list->head) {
+            list->tail = NULL;
+        }
+        list->count--;
+        item->next = NULL;
+    }
+
+    return item;
+}
+
+lamb_item_t *lamb_unpack_submit(char *pk, size_t len) {
+    Submit *packet;
+    lamb_item_t *item;
     lamb_submit_t *message;
-    Submit packet = SUBMIT__INIT;
 
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+    packet = submit__unpack(lamb_arena(), len, (uint8_t *)pk);
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
+    if (!packet) {
+        return NULL;
+    }
 
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
+    item = (lamb_item_t *)lamb_slab_alloc(items);
 
-            continue;
-        }
+    if (!item) {
+        submit__free_unpacked(packet, lamb_arena());
+        return NULL;
+    }
 
-        if (CHECK_COMMAND(buf) == LAMB_REQ) {
-            nn_freemsg(buf);
-            node = lamb_queue_pop(queue);
-
-            if (!node) {
-                len = lamb_pack_assembly(&buf, LAMB_EMPTY, NULL, 0);
-                if (len > 0) {
-                    nn_send(fd, buf, len, NN_DONTWAIT);
-                    free(buf);
-                }
-                continue;
-            }
+    message = &item->message;
+    message->id = packet->id;
+    message->account = packet->account;
+    message->company = packet->company;
+    strncpy(message->spid, packet->spid, 6);
+    strncpy(message->spcode, packet->spcode, 20);
+    strncpy(message->phone, packet->phone, 11);
+    message->msgfmt = packet->msgfmt;
+    message->length = packet->length;
+    memcpy(message->content, packet->content.data, packet->content.len);
 
-            void *pk;
-            message = (lamb_submit_t *)node->val;
-
-            packet.id = message->id;
-            packet.account = message->account;
-            packet.company = message->company;
-            packet.spid = message->spid;
-            packet.spcode = message->spcode;
-            packet.phone = message->phone;
-            packet.msgfmt = message->msgfmt;
-            packet.length = message->length;
-            packet.content.len = message->length;
-            packet.content.data = (uint8_t *)message->content;
-
-            len = submit__get_packed_size(&packet);
-            pk = malloc(len);
-
-            if (pk) {
-                submit__pack(&packet, pk);
-                len = lamb_pack_assembly(&buf, LAMB_SUBMIT, pk, len);
-                if (len > 0) {
-                    nn_send(fd, buf, len, NN_DONTWAIT);
-                    free(buf);
-                }
-                free(pk);
-            }
+    submit__free_unpacked(packet, lamb_arena());
 
-            free(node);
-            free(message);
-            continue;
-        }
+    return item;
+}
 
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
+void lamb_replay_ack(lamb_record_t *record, void *payload, void *arg) {
+    unsigned long long acked;
+    lamb_stream_t *stream;
+
+    if (record->type != LAMB_ACK || record->len != sizeof(acked)) {
+        return;
+    }
+
+    stream = lamb_pool_stream(record->id);
+
+    if (stream) {
+        memcpy(&acked, payload, sizeof(acked));
+        if (acked > stream->acked) {
+            stream->acked = stream->sent = acked;
         }
+    }
 
-        lamb_debug("invalid request command\n");
-        nn_freemsg(buf);
+    return;
+}
+
+void lamb_replay_submit(lamb_record_t *record, void *payload, void *arg) {
+    lamb_item_t *item;
+    lamb_stream_t *stream;
+
+    if (record->type != LAMB_SUBMIT) {
+        return;
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
+    stream = lamb_pool_stream(record->id);
 
-    pthread_exit(NULL);
+    if (!stream || record->sequence <= stream->acked) {
+        return;
+    }
+
+    item = lamb_unpack_submit(payload, record->len);
+
+    if (!item) {
+        syslog(LOG_ERR, "can't restore submit %llu of client %d", record->sequence, record->id);
+        return;
+    }
+
+    /* The backlog has no bound, nothing of the journal is left behind */
+    item->sequence = record->sequence;
+    lamb_stream_remember(stream, item->message.id);
+    lamb_items_append(&stream->backlog, item);
+    stream->pushed = item->sequence;
+
+    return;
 }
 
+int lamb_pack_submit(lamb_batch_t *batch, lamb_submit_t *message) {
+    char *pk;
+    size_t len;
+    Submit packet = SUBMIT__INIT;
 
-int lamb_child_server(int *sock, const char *host, unsigned short *port, int protocol) {
-    while (true) {
-        if (!lamb_nn_server(sock, host, *port, protocol)) {
-            break;
-        }
-        (*port)++;
+    packet.id = message->id;
+    packet.account = message->account;
+    packet.company = message->company;
+    packet.spid = message->spid;
+    packet.spcode = message->spcode;
+    packet.phone = message->phone;
+    packet.msgfmt = message->msgfmt;
+    packet.length = message->length;
+    packet.content.len = message->length;
+    packet.content.data = (uint8_t *)message->content;
+
+    len = submit__get_packed_size(&packet);
+    pk = lamb_batch_reserve(batch, LAMB_SUBMIT, len);
+
+    if (!pk) {
+        return -1;
     }
 
+    submit__pack(&packet, (uint8_t *)pk);
+
     return 0;
 }
 
 void *lamb_stat_loop(void *arg) {
-    lamb_node_t *node;
-    lamb_queue_t *queue;
-    
+    unsigned long long checkpoint;
+
     /* Reset mt queue */
     lamb_reset_queues(rdb);
 
     while (true) {
-        lamb_list_iterator_t *it;
-        it = lamb_list_iterator_new(pool, LIST_HEAD);
-        
-        while ((node = lamb_list_iterator_next(it))) {
-            queue = (lamb_queue_t *)node->val;
-            lamb_sync_update(rdb, queue->id, queue->list->len);
-        }
+        lamb_registry_foreach(pool, lamb_sync_queue, rdb);
+
+        /* Read first, a record appended later is above it anyway */
+        checkpoint = lamb_journal_sequence(journal);
+        lamb_registry_foreach(pool, lamb_oldest_record, &checkpoint);
+        lamb_journal_checkpoint(journal, checkpoint);
 
-        lamb_list_iterator_destroy(it);
         lamb_sleep(3000);
     }
 
     pthread_exit(NULL);
 }
 
+void lamb_sync_queue(void *stream, void *cache) {
+    lamb_stream_t *s;
+    unsigned int len;
+
+    s = (lamb_stream_t *)stream;
+
+    pthread_mutex_lock(&s->lock);
+    len = lamb_queue_len(s->queue) + s->backlog.count;
+    pthread_mutex_unlock(&s->lock);
+
+    lamb_sync_update((lamb_cache_t *)cache, s->id, len);
+
+    return;
+}
+
+void lamb_oldest_record(void *stream, void *checkpoint) {
+    lamb_stream_t *s;
+
+    s = (lamb_stream_t *)stream;
+
+    pthread_mutex_lock(&s->lock);
+
+    /* Every record of the client above the acknowledged one is still needed */
+    if (s->pushed > s->acked && s->acked + 1 < *(unsigned long long *)checkpoint) {
+        *(unsigned long long *)checkpoint = s->acked + 1;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return;
+}
+
 int lamb_sync_update(lamb_cache_t *cache, int id, unsigned int num) {
     redisReply *reply = NULL;
 
@@ -579,6 +698,44 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    /* Work threads */
+    if (lamb_get_int(&cfg, "WorkThreads", &conf->work_threads) != 0) {
+        fprintf(stderr, "Can't read config 'WorkThreads' parameter\n");
+        goto error;
+    }
+
+    /* Check work threads validity */
+    if (conf->work_threads < 1 || conf->work_threads > LAMB_MAX_THREAD) {
+        fprintf(stderr, "Invalid work threads number\n");
+        goto error;
+    }
+
+    /* Journal */
+    if (lamb_get_string(&cfg, "JournalDir", conf->journal_dir, 128) != 0) {
+        fprintf(stderr, "Can't read config 'JournalDir' parameter\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "JournalSize", &conf->journal_size) != 0) {
+        fprintf(stderr, "Can't read config 'JournalSize' parameter\n");
+        goto error;
+    }
+
+    if (conf->journal_size < 1 || conf->journal_size > 1024) {
+        fprintf(stderr, "Invalid journal segment size\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "JournalSync", &conf->journal_sync) != 0) {
+        fprintf(stderr, "Can't read config 'JournalSync' parameter\n");
+        goto error;
+    }
+
+    if (conf->journal_sync < 1) {
+        fprintf(stderr, "Invalid journal sync interval\n");
+        goto error;
+    }
+
     /* Ac */
     if (lamb_get_string(&cfg, "Ac", conf->ac, 128) != 0) {
         fprintf(stderr, "Can't read config 'Ac' parameter\n");
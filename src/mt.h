@@ -23,12 +23,18 @@
 #include <pthread.h>
 #include <syslog.h>
 
+#define LAMB_MT_RECENT 1024
+
 typedef struct {
     int id;
     bool debug;
     char listen[16];
     int port;
     long long timeout;
+    int work_threads;
+    char journal_dir[128];
+    int journal_size;
+    int journal_sync;
     char ac[128];
     char redis_host[16];
     int redis_port;
@@ -37,11 +43,55 @@ typedef struct {
     char logfile[128];
 } lamb_config_t;
 
+typedef struct lamb_item {
+    unsigned long long sequence;
+    struct lamb_item *next;
+    lamb_submit_t message;
+} lamb_item_t;
+
+/* Ordered list of items, linked through the items themselves */
+typedef struct {
+    lamb_item_t *head;
+    lamb_item_t *tail;
+    unsigned int count;
+} lamb_items_t;
+
+/*
+ * Queue of a client with the journal records it holds. The items sent
+ * and not acknowledged are older than the backlog, which is older than
+ * the queue, a consumer is served in that order. The ids of the last
+ * submits are kept to drop a submit the producer sent again.
+ */
+
+typedef struct {
+    int id;
+    lamb_queue_t *queue;
+    lamb_items_t backlog;
+    lamb_items_t inflight;
+    unsigned long long pushed;
+    unsigned long long sent;
+    unsigned long long acked;
+    unsigned long long recent[LAMB_MT_RECENT];
+    pthread_mutex_t lock;
+} lamb_stream_t;
+
 void lamb_event_loop(void);
-void *lamb_push_loop(void *arg);
-void *lamb_pull_loop(void *arg);
-int lamb_child_server(int *sock, const char *listen, unsigned short *port, int protocol);
+lamb_stream_t *lamb_pool_stream(int id);
+lamb_stream_t *lamb_stream_new(int id);
+int lamb_push_handler(int method, int id, char *pk, size_t len);
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes);
+int lamb_ack_handler(int id, char *pk, size_t len);
+bool lamb_stream_recent(lamb_stream_t *stream, unsigned long long id);
+void lamb_stream_remember(lamb_stream_t *stream, unsigned long long id);
+void lamb_items_append(lamb_items_t *list, lamb_item_t *item);
+lamb_item_t *lamb_items_shift(lamb_items_t *list);
+lamb_item_t *lamb_unpack_submit(char *pk, size_t len);
+void lamb_replay_ack(lamb_record_t *record, void *payload, void *arg);
+void lamb_replay_submit(lamb_record_t *record, void *payload, void *arg);
+int lamb_pack_submit(lamb_batch_t *batch, lamb_submit_t *message);
 void *lamb_stat_loop(void *arg);
+void lamb_sync_queue(void *stream, void *cache);
+void lamb_oldest_record(void *stream, void *checkpoint);
 int lamb_sync_update(lamb_cache_t *cache, int id, unsigned int num);
 void lamb_reset_queues(lamb_cache_t *cache);
 int lamb_read_config(lamb_config_t *conf, const char *file);
@@ -0,0 +1,1149 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <nanomsg/nn.h>
+#include <nanomsg/reqrep.h>
+#include "common.h"
+#include "mux.h"
+
+/*
+ * Every client of a daemon talks to a single raw REP socket. A request
+ * is the method, the queue id and the payload, all workers receive from
+ * the socket and reply through the backtrace kept in the control header.
+ * A stream request that finds its queue empty is parked until messages
+ * are pushed to the queue or LAMB_MUX_WAIT expires. Processes on the
+ * same host may use the shared memory region of the daemon instead,
+ * with an shm://port address, the requests and replies are the same.
+ * A message too large for a slot of the region takes a loopback socket
+ * to the same daemon.
+ * A batch that can't be sent is held and goes out with the next request
+ * of its queue ahead of anything newer.
+ * A LAMB_PUSH request carries many messages in the batch layout, each
+ * record starts with its queue id, the reply has one command per record.
+ * A client keeps it in flight without waiting, a local client sends it
+ * through the region when the frame fits a slot.
+ */
+
+static pthread_mutex_t locals_lock = PTHREAD_MUTEX_INITIALIZER;
+static lamb_shm_t *locals[LAMB_MUX_LOCALS];
+static int loopbacks[LAMB_MUX_LOCALS];
+static bool shipped[LAMB_MUX_LOCALS];
+
+static void *lamb_mux_loop(void *arg);
+static void *lamb_mux_local(void *arg);
+static void *lamb_mux_waker(void *arg);
+static void lamb_mux_handle(lamb_mux_t *mux, lamb_mux_peer_t *peer, char *body, int len);
+static int lamb_mux_drain(lamb_mux_t *mux, lamb_mux_peer_t *peer, int id, int count, int bytes);
+static int lamb_mux_park(lamb_mux_t *mux, lamb_mux_peer_t *peer, int id, int count, int bytes);
+static void lamb_mux_unpark(lamb_mux_waiters_t *waiters, lamb_mux_parked_t **list, unsigned long long now);
+static void lamb_mux_expire(void *val, void *arg);
+static void lamb_mux_answer(lamb_mux_t *mux, lamb_mux_parked_t *list, int method);
+static void lamb_mux_pushes(lamb_mux_t *mux, lamb_mux_peer_t *peer, char *body, int len);
+static int lamb_mux_reply(lamb_mux_t *mux, lamb_mux_peer_t *peer, void *buf, size_t len);
+static void lamb_mux_hold(lamb_mux_t *mux, int id, void *buf, size_t len);
+static lamb_mux_held_t *lamb_mux_unhold(lamb_mux_t *mux, int id);
+static void lamb_mux_status(lamb_mux_t *mux, lamb_mux_peer_t *peer, int method);
+static lamb_shm_t *lamb_mux_shm(int sock);
+static int lamb_mux_socket(const char *host, int timeout);
+
+lamb_mux_t *lamb_mux_new(const char *listen, int port, int threads, lamb_mux_push_t push, lamb_mux_pull_t pull) {
+    char addr[128];
+    lamb_mux_t *self;
+
+    if (threads < 1 || threads > LAMB_MAX_THREAD) {
+        return NULL;
+    }
+
+    self = (lamb_mux_t *)calloc(1, sizeof(lamb_mux_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->sock = nn_socket(AF_SP_RAW, NN_REP);
+    if (self->sock < 0) {
+        free(self);
+        return NULL;
+    }
+
+    snprintf(addr, sizeof(addr), "tcp://%s:%d", listen, port);
+
+    if (nn_bind(self->sock, addr) < 0) {
+        syslog(LOG_ERR, "bind %s", nn_strerror(nn_errno()));
+        nn_close(self->sock);
+        free(self);
+        return NULL;
+    }
+
+    self->held = lamb_registry_new();
+    self->waiters = lamb_registry_new();
+
+    if (!self->held || !self->waiters) {
+        lamb_registry_destroy(self->held);
+        lamb_registry_destroy(self->waiters);
+        nn_close(self->sock);
+        free(self);
+        return NULL;
+    }
+
+    self->threads = threads;
+    self->push = push;
+    self->pull = pull;
+    pthread_cond_init(&self->wakeup, NULL);
+    pthread_mutex_init(&self->lock, NULL);
+
+    /* Local clients are optional, the socket still serves everyone */
+    self->shm = lamb_shm_create(port);
+
+    if (!self->shm) {
+        syslog(LOG_WARNING, "can't create local transport of port %d", port);
+    }
+
+    return self;
+}
+
+/* Start the worker pool, the calling thread becomes one of the workers */
+void lamb_mux_run(lamb_mux_t *mux) {
+    lamb_start_thread(lamb_mux_waker, mux, 1);
+
+    if (mux->shm) {
+        lamb_start_thread(lamb_mux_local, mux, mux->threads);
+    }
+
+    if (mux->threads > 1) {
+        lamb_start_thread(lamb_mux_loop, mux, mux->threads - 1);
+    }
+
+    lamb_mux_loop(mux);
+
+    return;
+}
+
+/* Messages were pushed to queue id, the waker answers the streams parked on it */
+void lamb_mux_wake(lamb_mux_t *mux, int id) {
+    lamb_mux_waiters_t *waiters;
+
+    /* Lock free, almost every push finds nobody waiting */
+    waiters = (lamb_mux_waiters_t *)lamb_registry_get(mux->waiters, id);
+
+    if (!waiters || !__atomic_load_n(&waiters->parked, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&mux->lock);
+
+    if (!waiters->woken) {
+        waiters->woken = true;
+        waiters->next = mux->woken;
+        mux->woken = waiters;
+        pthread_cond_signal(&mux->wakeup);
+    }
+
+    pthread_mutex_unlock(&mux->lock);
+
+    return;
+}
+
+static void *lamb_mux_loop(void *arg) {
+    int rc;
+    char *body;
+    void *control;
+    lamb_mux_t *mux;
+    lamb_mux_peer_t peer;
+    struct nn_iovec iov;
+    struct nn_msghdr hdr;
+
+    mux = (lamb_mux_t *)arg;
+
+    while (true) {
+        memset(&hdr, 0, sizeof(hdr));
+        iov.iov_base = &body;
+        iov.iov_len = NN_MSG;
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = &control;
+        hdr.msg_controllen = NN_MSG;
+
+        rc = nn_recvmsg(mux->sock, &hdr, 0);
+
+        if (rc < 0) {
+            continue;
+        }
+
+        if (rc < HEAD * 2) {
+            nn_freemsg(body);
+            nn_freemsg(control);
+            continue;
+        }
+
+        peer.control = control;
+        peer.client = -1;
+        peer.request = 0;
+
+        lamb_mux_handle(mux, &peer, body, rc);
+        nn_freemsg(body);
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Serve the requests of local clients, the frame is read in place */
+static void *lamb_mux_local(void *arg) {
+    lamb_mux_t *mux;
+    lamb_mux_peer_t peer;
+    lamb_shm_slot_t *slot;
+
+    mux = (lamb_mux_t *)arg;
+
+    while (true) {
+        slot = lamb_shm_recv(mux->shm, LAMB_MUX_WAIT);
+
+        if (!slot) {
+            continue;
+        }
+
+        if (slot->len >= HEAD * 2) {
+            peer.control = NULL;
+            peer.client = slot->client;
+            peer.request = slot->request;
+            lamb_mux_handle(mux, &peer, slot->frame, slot->len);
+        }
+
+        lamb_shm_release(mux->shm, slot);
+    }
+
+    pthread_exit(NULL);
+}
+
+static void lamb_mux_handle(lamb_mux_t *mux, lamb_mux_peer_t *peer, char *body, int len) {
+    int id;
+    int method;
+    int count, bytes;
+
+    method = CHECK_COMMAND(body);
+    id = ntohl(*((int *)(body + HEAD)));
+
+    if (method == LAMB_CREDIT || method == LAMB_BATCH) {
+        /* The hint follows the queue id the way it follows the command */
+        lamb_batch_hint(body + HEAD, len - HEAD, &count, &bytes);
+
+        /* Queue is empty, wait for the next push, the client backs off from a busy daemon */
+        if (lamb_mux_drain(mux, peer, id, count, bytes) != 0) {
+            if (lamb_mux_park(mux, peer, id, count, bytes) != 0) {
+                lamb_mux_status(mux, peer, LAMB_BUSY);
+            }
+        }
+
+        return;
+    }
+
+    if (method == LAMB_PUSH) {
+        lamb_mux_pushes(mux, peer, body, len);
+        return;
+    }
+
+    method = mux->push(method, id, body + HEAD * 2, len - HEAD * 2);
+    lamb_mux_status(mux, peer, method);
+
+    return;
+}
+
+/*
+ * Store the records of a LAMB_PUSH request in order. Once a queue is
+ * busy its later records are not stored either and answered busy too,
+ * the client sends them again in the same order.
+ */
+
+static void lamb_mux_pushes(lamb_mux_t *mux, lamb_mux_peer_t *peer, char *body, int len) {
+    char *pk;
+    char *buf;
+    bool busy;
+    size_t size;
+    size_t offset;
+    int id, rc, count;
+    int method, stalls;
+    int stalled[LAMB_MAX_BATCH];
+
+    count = ntohl(*((int *)(body + HEAD)));
+
+    if (count < 1 || count > LAMB_MAX_BATCH) {
+        lamb_mux_status(mux, peer, LAMB_REJECT);
+        return;
+    }
+
+    buf = lamb_frame_alloc(LAMB_PUSH, HEAD * 2, count * sizeof(int));
+
+    if (!buf) {
+        lamb_mux_status(mux, peer, LAMB_BUSY);
+        return;
+    }
+
+    offset = 0;
+    stalls = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (lamb_batch_next(body, len, &offset, &method, &pk, &size) != 0) {
+            count = i;
+            break;
+        }
+
+        rc = LAMB_REJECT;
+
+        if (size >= sizeof(int)) {
+            memcpy(&id, pk, sizeof(int));
+            id = ntohl(id);
+            busy = false;
+
+            for (int j = 0; j < stalls; j++) {
+                if (stalled[j] == id) {
+                    busy = true;
+                    break;
+                }
+            }
+
+            if (busy) {
+                rc = LAMB_BUSY;
+            } else {
+                rc = mux->push(method, id, pk + sizeof(int), size - sizeof(int));
+                if (rc != LAMB_OK && rc != LAMB_REJECT) {
+                    stalled[stalls++] = id;
+                }
+            }
+        }
+
+        ((int *)(buf + HEAD * 2))[i] = htonl(rc);
+    }
+
+    ((int *)buf)[1] = htonl(count);
+
+    if (lamb_mux_reply(mux, peer, buf, HEAD * 2 + count * sizeof(int)) != 0) {
+        nn_freemsg(buf);
+    }
+
+    return;
+}
+
+/*
+ * Answer the streams parked on the queues that were woken. The requests
+ * are drained where they are, so a push meanwhile wakes the queue again,
+ * and unlinked once answered. The tick only expires requests, they are
+ * answered with LAMB_EMPTY so that the client asks again.
+ */
+
+static void *lamb_mux_waker(void *arg) {
+    lamb_mux_t *mux;
+    struct timespec timeout;
+    lamb_mux_parked_t *parked;
+    lamb_mux_waiters_t *waiters;
+    unsigned long long now, tick;
+
+    mux = (lamb_mux_t *)arg;
+    tick = 0;
+
+    while (true) {
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += LAMB_MUX_TICK * 1000000L;
+        timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+        timeout.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&mux->lock);
+
+        if (!mux->woken) {
+            pthread_cond_timedwait(&mux->wakeup, &mux->lock, &timeout);
+        }
+
+        while ((waiters = mux->woken) != NULL) {
+            mux->woken = waiters->next;
+            waiters->woken = false;
+            parked = waiters->parked;
+
+            pthread_mutex_unlock(&mux->lock);
+
+            /* New requests go in front, the ones after the head stay in place */
+            for (; parked; parked = parked->next) {
+                parked->done = (lamb_mux_drain(mux, &parked->peer, waiters->id, parked->count, parked->bytes) == 0);
+            }
+
+            pthread_mutex_lock(&mux->lock);
+            lamb_mux_unpark(waiters, &parked, 0);
+            pthread_mutex_unlock(&mux->lock);
+
+            lamb_mux_answer(mux, parked, -1);
+
+            pthread_mutex_lock(&mux->lock);
+        }
+
+        pthread_mutex_unlock(&mux->lock);
+
+        now = lamb_now_microsecond();
+
+        if (now >= tick) {
+            tick = now + LAMB_MUX_TICK * 1000ULL;
+            lamb_registry_foreach(mux->waiters, lamb_mux_expire, mux);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Answer the expired streams parked on a queue */
+static void lamb_mux_expire(void *val, void *arg) {
+    lamb_mux_t *mux;
+    lamb_mux_parked_t *expired;
+    lamb_mux_waiters_t *waiters;
+
+    mux = (lamb_mux_t *)arg;
+    waiters = (lamb_mux_waiters_t *)val;
+
+    if (!__atomic_load_n(&waiters->parked, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&mux->lock);
+    lamb_mux_unpark(waiters, &expired, lamb_now_microsecond());
+    pthread_mutex_unlock(&mux->lock);
+
+    lamb_mux_answer(mux, expired, LAMB_EMPTY);
+
+    return;
+}
+
+/*
+ * Unlink the requests that are done or, with a time given, expired by
+ * then into a list of their own. The mux lock must be held.
+ */
+
+static void lamb_mux_unpark(lamb_mux_waiters_t *waiters, lamb_mux_parked_t **list, unsigned long long now) {
+    lamb_mux_parked_t *parked;
+    lamb_mux_parked_t **link;
+
+    *list = NULL;
+    link = &waiters->parked;
+
+    while ((parked = *link) != NULL) {
+        if (now > 0 ? now < parked->deadline : !parked->done) {
+            link = &parked->next;
+            continue;
+        }
+
+        __atomic_store_n(link, parked->next, __ATOMIC_RELEASE);
+        parked->next = *list;
+        *list = parked;
+    }
+
+    return;
+}
+
+/* Release unlinked requests, answered with method unless it is -1 */
+static void lamb_mux_answer(lamb_mux_t *mux, lamb_mux_parked_t *list, int method) {
+    lamb_mux_parked_t *next;
+
+    while (list) {
+        next = list->next;
+        if (method != -1) {
+            lamb_mux_status(mux, &list->peer, method);
+        }
+        free(list);
+        list = next;
+    }
+
+    return;
+}
+
+/* Reply with up to count messages, -1 and no reply when the queue is empty */
+static int lamb_mux_drain(lamb_mux_t *mux, lamb_mux_peer_t *peer, int id, int count, int bytes) {
+    void *buf;
+    size_t len;
+    lamb_batch_t batch;
+    lamb_mux_held_t *held;
+
+    /* An undelivered batch is older than everything left in the queue */
+    held = lamb_mux_unhold(mux, id);
+
+    if (held) {
+        buf = held->buf;
+        len = held->len;
+        free(held);
+    } else {
+        if (lamb_batch_init(&batch, bytes) != 0) {
+            return -1;
+        }
+
+        mux->pull(id, &batch, count, bytes);
+
+        if (batch.count < 1) {
+            lamb_batch_free(&batch);
+            return -1;
+        }
+
+        len = lamb_batch_finish(&batch);
+
+        /* Trim the message to the records, the buffer is sent without a copy */
+        buf = nn_reallocmsg(batch.buf, len);
+
+        if (!buf) {
+            lamb_batch_free(&batch);
+            return -1;
+        }
+    }
+
+    if (lamb_mux_reply(mux, peer, buf, len) != 0) {
+        syslog(LOG_WARNING, "can't send a batch of queue %d, holding it", id);
+        lamb_mux_hold(mux, id, buf, len);
+    }
+
+    return 0;
+}
+
+/* Put a batch that failed to send back at the head of its queue */
+static void lamb_mux_hold(lamb_mux_t *mux, int id, void *buf, size_t len) {
+    lamb_mux_held_t *held;
+
+    held = (lamb_mux_held_t *)malloc(sizeof(lamb_mux_held_t));
+
+    if (held) {
+        held->buf = buf;
+        held->len = len;
+
+        pthread_mutex_lock(&mux->lock);
+        held->next = (lamb_mux_held_t *)lamb_registry_get(mux->held, id);
+
+        if (lamb_registry_set(mux->held, id, held) == 0) {
+            pthread_mutex_unlock(&mux->lock);
+            return;
+        }
+
+        pthread_mutex_unlock(&mux->lock);
+        free(held);
+    }
+
+    syslog(LOG_ERR, "can't hold a batch of queue %d, %d messages lost", id, lamb_batch_count(buf, len));
+    nn_freemsg(buf);
+
+    return;
+}
+
+static lamb_mux_held_t *lamb_mux_unhold(lamb_mux_t *mux, int id) {
+    lamb_mux_held_t *held;
+
+    /* The lookup is lock free, nothing is held almost all the time */
+    if (!lamb_registry_get(mux->held, id)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mux->lock);
+
+    held = (lamb_mux_held_t *)lamb_registry_del(mux->held, id);
+
+    if (held && held->next) {
+        lamb_registry_set(mux->held, id, held->next);
+    }
+
+    pthread_mutex_unlock(&mux->lock);
+
+    return held;
+}
+
+/* Wait for a push to queue id, -1 when the request can't be parked */
+static int lamb_mux_park(lamb_mux_t *mux, lamb_mux_peer_t *peer, int id, int count, int bytes) {
+    lamb_mux_parked_t *parked;
+    lamb_mux_waiters_t *waiters;
+
+    parked = (lamb_mux_parked_t *)malloc(sizeof(lamb_mux_parked_t));
+
+    if (!parked) {
+        return -1;
+    }
+
+    parked->count = count;
+    parked->bytes = bytes;
+    parked->done = false;
+    parked->peer = *peer;
+    parked->deadline = lamb_now_microsecond() + LAMB_MUX_WAIT * 1000ULL;
+
+    pthread_mutex_lock(&mux->lock);
+
+    /* The waiters of a queue live as long as the mux, like the queue */
+    waiters = (lamb_mux_waiters_t *)lamb_registry_get(mux->waiters, id);
+
+    if (!waiters) {
+        waiters = (lamb_mux_waiters_t *)calloc(1, sizeof(lamb_mux_waiters_t));
+
+        if (!waiters || lamb_registry_set(mux->waiters, id, waiters) != 0) {
+            pthread_mutex_unlock(&mux->lock);
+            free(waiters);
+            free(parked);
+            return -1;
+        }
+
+        waiters->id = id;
+    }
+
+    parked->next = waiters->parked;
+    __atomic_store_n(&waiters->parked, parked, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&mux->lock);
+
+    /* A push may have happened before the request was visible */
+    lamb_mux_wake(mux, id);
+
+    return 0;
+}
+
+/*
+ * Send a message allocated with nn_allocmsg, it is consumed with the
+ * backtrace. Returns -1 when the reply is not delivered, the backtrace
+ * is released and buf is still owned by the caller.
+ */
+
+static int lamb_mux_reply(lamb_mux_t *mux, lamb_mux_peer_t *peer, void *buf, size_t len) {
+    struct nn_iovec iov;
+    struct nn_msghdr hdr;
+
+    if (!peer->control) {
+        if (lamb_shm_reply(mux->shm, peer->client, peer->request, buf, len) != 0) {
+            return -1;
+        }
+        nn_freemsg(buf);
+        return 0;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_base = &buf;
+    iov.iov_len = NN_MSG;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = &peer->control;
+    hdr.msg_controllen = NN_MSG;
+
+    if (nn_sendmsg(mux->sock, &hdr, 0) < 0) {
+        nn_freemsg(peer->control);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void lamb_mux_status(lamb_mux_t *mux, lamb_mux_peer_t *peer, int method) {
+    int val;
+    char *buf;
+
+    if (!peer->control) {
+        val = htonl(method);
+        lamb_shm_reply(mux->shm, peer->client, peer->request, &val, sizeof(val));
+        return;
+    }
+
+    buf = lamb_frame_alloc(method, HEAD, 0);
+
+    if (!buf) {
+        nn_freemsg(peer->control);
+        return;
+    }
+
+    if (lamb_mux_reply(mux, peer, buf, HEAD) != 0) {
+        nn_freemsg(buf);
+    }
+
+    return;
+}
+
+int lamb_mux_connect(const char *host, int timeout) {
+    int port;
+    char addr[128];
+    lamb_shm_t *shm;
+
+    /* A local address falls back to the loopback socket of the same port */
+    if (strncmp(host, "shm://", 6) == 0) {
+        port = atoi(host + 6);
+        snprintf(addr, sizeof(addr), "tcp://127.0.0.1:%d", port);
+        shm = lamb_shm_attach(port, timeout);
+
+        if (shm) {
+            pthread_mutex_lock(&locals_lock);
+            for (int i = 0; i < LAMB_MUX_LOCALS; i++) {
+                if (!locals[i]) {
+                    locals[i] = shm;
+                    loopbacks[i] = lamb_mux_socket(addr, timeout);
+                    shipped[i] = false;
+                    pthread_mutex_unlock(&locals_lock);
+                    return LAMB_MUX_LOCAL + i;
+                }
+            }
+            pthread_mutex_unlock(&locals_lock);
+            lamb_shm_close(shm);
+        }
+
+        syslog(LOG_WARNING, "can't attach to local transport of port %d", port);
+        host = addr;
+    }
+
+    return lamb_mux_socket(host, timeout);
+}
+
+/*
+ * A request frame is the method and the queue id followed by len bytes
+ * of payload, which the caller writes at LAMB_MUX_PAYLOAD(buf). The
+ * frame is consumed by lamb_mux_post and lamb_mux_call.
+ */
+
+char *lamb_mux_alloc(int method, int id, size_t len) {
+    char *buf;
+
+    buf = lamb_frame_alloc(method, HEAD * 2, len);
+
+    if (buf) {
+        *((int *)(buf + HEAD)) = htonl(id);
+    }
+
+    return buf;
+}
+
+/* Send a request frame, the reply is read by the caller */
+int lamb_mux_post(int sock, char *buf, size_t len) {
+    int rc;
+    lamb_shm_t *shm;
+
+    shm = lamb_mux_shm(sock);
+
+    if (shm) {
+        rc = lamb_shm_send(shm, buf, HEAD * 2 + len);
+        nn_freemsg(buf);
+        return rc;
+    }
+
+    return lamb_frame_send(sock, buf, HEAD * 2 + len, 0);
+}
+
+/* One round trip of a request frame, returns the reply command or -1 */
+int lamb_mux_call(int sock, char *buf, size_t len) {
+    int rc;
+    lamb_shm_t *shm;
+
+    shm = lamb_mux_shm(sock);
+
+    /* A frame too large for a slot takes the loopback socket */
+    if (shm && HEAD * 2 + len > LAMB_SHM_FRAME) {
+        sock = loopbacks[sock - LAMB_MUX_LOCAL];
+        shm = NULL;
+
+        if (sock < 0) {
+            nn_freemsg(buf);
+            return -1;
+        }
+    }
+
+    if (lamb_mux_post(sock, buf, len) != 0) {
+        return -1;
+    }
+
+    if (shm) {
+        rc = lamb_shm_wait(shm, &buf);
+        return (rc >= HEAD) ? CHECK_COMMAND(buf) : -1;
+    }
+
+    rc = nn_recv(sock, &buf, NN_MSG, 0);
+
+    if (rc < HEAD) {
+        if (rc > 0) {
+            nn_freemsg(buf);
+        }
+        return -1;
+    }
+
+    rc = CHECK_COMMAND(buf);
+    nn_freemsg(buf);
+
+    return rc;
+}
+
+/* Pack a protobuf message straight into the frame of one round trip */
+int lamb_mux_message(int sock, int method, int id, const ProtobufCMessage *message) {
+    int rc;
+    char *buf;
+    size_t len;
+    lamb_shm_t *shm;
+    lamb_shm_slot_t *slot;
+
+    len = protobuf_c_message_get_packed_size(message);
+    shm = lamb_mux_shm(sock);
+
+    /* A local request is packed straight into the ring */
+    if (shm && HEAD * 2 + len <= LAMB_SHM_FRAME) {
+        slot = lamb_shm_reserve(shm, HEAD * 2 + len);
+
+        /* The ring is full, the caller backs off as from a busy daemon */
+        if (!slot) {
+            return LAMB_BUSY;
+        }
+
+        *((int *)slot->frame) = htonl(method);
+        *((int *)(slot->frame + HEAD)) = htonl(id);
+        protobuf_c_message_pack(message, (uint8_t *)LAMB_MUX_PAYLOAD(slot->frame));
+        lamb_shm_commit(shm, slot, HEAD * 2 + len);
+
+        rc = lamb_shm_wait(shm, &buf);
+
+        return (rc >= HEAD) ? CHECK_COMMAND(buf) : -1;
+    }
+
+    if (shm) {
+        sock = loopbacks[sock - LAMB_MUX_LOCAL];
+        if (sock < 0) {
+            return -1;
+        }
+    }
+
+    buf = lamb_mux_alloc(method, id, len);
+
+    if (!buf) {
+        return -1;
+    }
+
+    protobuf_c_message_pack(message, (uint8_t *)LAMB_MUX_PAYLOAD(buf));
+
+    return lamb_mux_call(sock, buf, len);
+}
+
+/* Send a request with a copy of pk, for the small control payloads */
+int lamb_mux_send(int sock, int method, int id, void *pk, size_t len) {
+    char *buf;
+
+    buf = lamb_mux_alloc(method, id, len);
+
+    if (!buf) {
+        return -1;
+    }
+
+    if (pk && len > 0) {
+        memcpy(LAMB_MUX_PAYLOAD(buf), pk, len);
+    }
+
+    return lamb_mux_post(sock, buf, len);
+}
+
+/* Ask for up to count messages of queue id, answered by one batch */
+int lamb_mux_credit(int sock, int id, int count, int bytes) {
+    int hint[2];
+
+    hint[0] = htonl(count);
+    hint[1] = htonl(bytes);
+
+    return lamb_mux_send(sock, LAMB_CREDIT, id, hint, sizeof(hint));
+}
+
+/* One round trip, returns the reply command or -1 */
+int lamb_mux_request(int sock, int method, int id, void *pk, size_t len) {
+    char *buf;
+
+    buf = lamb_mux_alloc(method, id, len);
+
+    if (!buf) {
+        return -1;
+    }
+
+    if (pk && len > 0) {
+        memcpy(LAMB_MUX_PAYLOAD(buf), pk, len);
+    }
+
+    return lamb_mux_call(sock, buf, len);
+}
+
+/*
+ * Wait for a batch of queue id. A new request is only sent once the
+ * pending one is answered, a reply to a timed out request would carry
+ * messages that nobody receives. Returns the batch length, 0 when the
+ * queue was empty or the reply is not there yet, -1 on error or when the
+ * daemon is too busy to hold the request, the caller backs off then. A
+ * batch is given back with lamb_mux_release.
+ */
+
+int lamb_mux_fetch(int sock, int id, int count, int bytes, bool *pending, char **buf) {
+    int rc;
+    lamb_shm_t *shm;
+
+    if (!*pending) {
+        if (lamb_mux_credit(sock, id, count, bytes) != 0) {
+            return -1;
+        }
+        *pending = true;
+    }
+
+    shm = lamb_mux_shm(sock);
+
+    if (shm) {
+        rc = lamb_shm_wait(shm, buf);
+
+        if (rc == 0) {
+            return 0;
+        }
+
+        *pending = false;
+
+        if (rc < HEAD || CHECK_COMMAND(*buf) != LAMB_BATCH) {
+            return (rc < 0 || (rc >= HEAD && CHECK_COMMAND(*buf) == LAMB_BUSY)) ? -1 : 0;
+        }
+
+        return rc;
+    }
+
+    rc = nn_recv(sock, buf, NN_MSG, 0);
+
+    if (rc < 0) {
+        if (nn_errno() == ETIMEDOUT) {
+            return 0;
+        }
+        *pending = false;
+        return -1;
+    }
+
+    *pending = false;
+
+    if (rc < HEAD || CHECK_COMMAND(*buf) != LAMB_BATCH) {
+        rc = (rc >= HEAD && CHECK_COMMAND(*buf) == LAMB_BUSY) ? -1 : 0;
+        nn_freemsg(*buf);
+        return rc;
+    }
+
+    return rc;
+}
+
+/* Add a message for queue id to a push batch, returns where its len bytes go */
+char *lamb_mux_record(lamb_batch_t *batch, int method, int id, size_t len) {
+    char *pk;
+
+    pk = lamb_batch_reserve(batch, method, sizeof(int) + len);
+
+    if (!pk) {
+        return NULL;
+    }
+
+    id = htonl(id);
+    memcpy(pk, &id, sizeof(int));
+
+    return pk + sizeof(int);
+}
+
+/*
+ * Send a push batch without waiting, the buffer is consumed. A local
+ * client puts it on the ring when the frame fits a slot and sends it
+ * over the loopback otherwise. The reply is taken with lamb_mux_recv, a
+ * new batch before it cancels the old one.
+ */
+
+int lamb_mux_push(int sock, lamb_batch_t *batch) {
+    int rc;
+    size_t len;
+    char *reply;
+    lamb_shm_t *shm;
+    lamb_shm_slot_t *slot;
+
+    len = lamb_batch_finish(batch);
+    *((int *)batch->buf) = htonl(LAMB_PUSH);
+
+    shm = lamb_mux_shm(sock);
+
+    if (shm) {
+        /* The last batch was given up, the daemon may have been restarted */
+        if (shipped[sock - LAMB_MUX_LOCAL] && lamb_shm_poll(shm, &reply) == 0) {
+            lamb_shm_renew(shm);
+        }
+
+        slot = (len <= LAMB_SHM_FRAME) ? lamb_shm_reserve(shm, len) : NULL;
+        shipped[sock - LAMB_MUX_LOCAL] = (slot != NULL);
+
+        if (slot) {
+            memcpy(slot->frame, batch->buf, len);
+            lamb_shm_commit(shm, slot, len);
+            lamb_batch_free(batch);
+            return 0;
+        }
+
+        sock = loopbacks[sock - LAMB_MUX_LOCAL];
+
+        if (sock < 0) {
+            lamb_batch_free(batch);
+            return -1;
+        }
+    }
+
+    rc = lamb_frame_send(sock, batch->buf, len, NN_DONTWAIT);
+    batch->buf = NULL;
+
+    return rc;
+}
+
+/*
+ * Take the reply to the last push batch, returns its length, 0 when none
+ * is there, -1 on error. The reply is freed with nn_freemsg, one off the
+ * ring is copied out as the next batch reuses the reply buffer.
+ */
+
+int lamb_mux_recv(int sock, char **buf) {
+    int rc;
+    char *reply;
+    lamb_shm_t *shm;
+
+    shm = lamb_mux_shm(sock);
+
+    if (shm && shipped[sock - LAMB_MUX_LOCAL]) {
+        rc = lamb_shm_poll(shm, &reply);
+
+        if (rc == 0) {
+            return 0;
+        }
+
+        if (rc < HEAD) {
+            return -1;
+        }
+
+        *buf = (char *)nn_allocmsg(rc, 0);
+
+        if (!*buf) {
+            return -1;
+        }
+
+        memcpy(*buf, reply, rc);
+
+        return rc;
+    }
+
+    if (shm) {
+        sock = loopbacks[sock - LAMB_MUX_LOCAL];
+        if (sock < 0) {
+            return -1;
+        }
+    }
+
+    rc = nn_recv(sock, buf, NN_MSG, NN_DONTWAIT);
+
+    if (rc < 0) {
+        return (nn_errno() == EAGAIN) ? 0 : -1;
+    }
+
+    if (rc < HEAD) {
+        nn_freemsg(*buf);
+        return -1;
+    }
+
+    return rc;
+}
+
+/* How long a reply is waited for */
+void lamb_mux_timeout(int sock, int timeout) {
+    lamb_shm_t *shm;
+
+    shm = lamb_mux_shm(sock);
+
+    if (shm) {
+        shm->timeout = timeout;
+        sock = loopbacks[sock - LAMB_MUX_LOCAL];
+        if (sock < 0) {
+            return;
+        }
+    }
+
+    nn_setsockopt(sock, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
+
+    return;
+}
+
+/* Descriptor that is readable when a reply is waiting, -1 for a local client */
+int lamb_mux_fd(int sock) {
+    int fd;
+    size_t len;
+
+    if (lamb_mux_shm(sock)) {
+        return -1;
+    }
+
+    len = sizeof(fd);
+
+    if (nn_getsockopt(sock, NN_SOL_SOCKET, NN_RCVFD, &fd, &len) != 0) {
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Socket the replies of push batches arrive on, the loopback of a local client */
+int lamb_mux_pipe(int sock) {
+    if (lamb_mux_shm(sock)) {
+        return loopbacks[sock - LAMB_MUX_LOCAL];
+    }
+
+    return sock;
+}
+
+/* Done with a batch of lamb_mux_fetch */
+void lamb_mux_release(int sock, char *buf) {
+    if (!lamb_mux_shm(sock)) {
+        nn_freemsg(buf);
+    }
+
+    return;
+}
+
+void lamb_mux_close(int sock) {
+    lamb_shm_t *shm;
+
+    shm = lamb_mux_shm(sock);
+
+    if (!shm) {
+        nn_close(sock);
+        return;
+    }
+
+    if (loopbacks[sock - LAMB_MUX_LOCAL] >= 0) {
+        nn_close(loopbacks[sock - LAMB_MUX_LOCAL]);
+    }
+
+    pthread_mutex_lock(&locals_lock);
+    locals[sock - LAMB_MUX_LOCAL] = NULL;
+    pthread_mutex_unlock(&locals_lock);
+
+    lamb_shm_close(shm);
+
+    return;
+}
+
+static lamb_shm_t *lamb_mux_shm(int sock) {
+    if (sock < LAMB_MUX_LOCAL || sock >= LAMB_MUX_LOCAL + LAMB_MUX_LOCALS) {
+        return NULL;
+    }
+
+    return locals[sock - LAMB_MUX_LOCAL];
+}
+
+static int lamb_mux_socket(const char *host, int timeout) {
+    int fd;
+    int ivl;
+
+    fd = nn_socket(AF_SP, NN_REQ);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    nn_setsockopt(fd, NN_SOL_SOCKET, NN_SNDTIMEO, &timeout, sizeof(timeout));
+    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
+
+    /* Resend a request lost with a restarted daemon */
+    ivl = LAMB_MUX_RESEND;
+    nn_setsockopt(fd, NN_REQ, NN_REQ_RESEND_IVL, &ivl, sizeof(ivl));
+
+    if (nn_connect(fd, host) < 0) {
+        nn_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
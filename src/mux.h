@@ -0,0 +1,100 @@
+
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_MUX_H
+#define _LAMB_MUX_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "socket.h"
+#include "shm.h"
+#include "registry.h"
+
+#define LAMB_MUX_WAIT   500
+#define LAMB_MUX_TICK   10
+#define LAMB_MUX_RESEND 10000
+#define LAMB_MAX_THREAD 64
+#define LAMB_MUX_LOCAL  (1 << 24)
+#define LAMB_MUX_LOCALS 1024
+
+#define LAMB_MUX_PAYLOAD(buf) ((char *)(buf) + HEAD * 2)
+
+/*
+ * A push handler stores one message of the queue id and returns the
+ * reply command, a pull handler drains up to count messages into the
+ * batch. Both are called from every worker thread concurrently.
+ */
+
+typedef int (*lamb_mux_push_t)(int method, int id, char *pk, size_t len);
+typedef int (*lamb_mux_pull_t)(int id, lamb_batch_t *batch, int count, int bytes);
+
+/* A reply goes to the backtrace of a socket request or to a local client */
+typedef struct {
+    void *control;
+    int client;
+    unsigned int request;
+} lamb_mux_peer_t;
+
+/* A batch whose reply could not be sent, served again before the queue */
+typedef struct lamb_mux_held {
+    char *buf;
+    size_t len;
+    struct lamb_mux_held *next;
+} lamb_mux_held_t;
+
+/* A stream request waiting for messages of its queue */
+typedef struct lamb_mux_parked {
+    int count;
+    int bytes;
+    bool done;
+    lamb_mux_peer_t peer;
+    unsigned long long deadline;
+    struct lamb_mux_parked *next;
+} lamb_mux_parked_t;
+
+/* The requests parked on a queue, a woken queue is linked for the waker */
+typedef struct lamb_mux_waiters {
+    int id;
+    bool woken;
+    lamb_mux_parked_t *parked;
+    struct lamb_mux_waiters *next;
+} lamb_mux_waiters_t;
+
+typedef struct {
+    int sock;
+    int threads;
+    lamb_mux_push_t push;
+    lamb_mux_pull_t pull;
+    lamb_shm_t *shm;
+    lamb_registry_t *held;
+    lamb_registry_t *waiters;
+    lamb_mux_waiters_t *woken;
+    pthread_cond_t wakeup;
+    pthread_mutex_t lock;
+} lamb_mux_t;
+
+lamb_mux_t *lamb_mux_new(const char *listen, int port, int threads, lamb_mux_push_t push, lamb_mux_pull_t pull);
+void lamb_mux_run(lamb_mux_t *mux);
+void lamb_mux_wake(lamb_mux_t *mux, int id);
+int lamb_mux_connect(const char *host, int timeout);
+char *lamb_mux_alloc(int method, int id, size_t len);
+int lamb_mux_post(int sock, char *buf, size_t len);
+int lamb_mux_call(int sock, char *buf, size_t len);
+int lamb_mux_message(int sock, int method, int id, const ProtobufCMessage *message);
+int lamb_mux_send(int sock, int method, int id, void *pk, size_t len);
+int lamb_mux_credit(int sock, int id, int count, int bytes);
+int lamb_mux_request(int sock, int method, int id, void *pk, size_t len);
+int lamb_mux_fetch(int sock, int id, int count, int bytes, bool *pending, char **buf);
+char *lamb_mux_record(lamb_batch_t *batch, int method, int id, size_t len);
+int lamb_mux_push(int sock, lamb_batch_t *batch);
+int lamb_mux_recv(int sock, char **buf);
+void lamb_mux_timeout(int sock, int timeout);
+int lamb_mux_fd(int sock);
+int lamb_mux_pipe(int sock);
+void lamb_mux_release(int sock, char *buf);
+void lamb_mux_close(int sock);
+
+#endif
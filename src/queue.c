@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
 #include "queue.h"
 
 lamb_queue_t *lamb_queue_new(int id) {
@@ -15,8 +17,11 @@ lamb_queue_t *lamb_queue_new(int id) {
 
     if (self) {
         self->id = id;
-        self->list = lamb_list_new();
-        if (self->list) {
+        self->waiting = 0;
+        self->ring = lamb_ring_new(LAMB_QUEUE_SIZE);
+        if (self->ring) {
+            pthread_cond_init(&self->cond, NULL);
+            pthread_mutex_init(&self->lock, NULL);
             return self;
         }
         free(self);
@@ -25,24 +30,72 @@ lamb_queue_t *lamb_queue_new(int id) {
     return NULL;
 }
 
-lamb_node_t *lamb_queue_push(lamb_queue_t *queue, void *val) {
+/* Push a value, -1 when the queue is full */
+int lamb_queue_push(lamb_queue_t *queue, void *val) {
+    if (!queue || lamb_ring_push(queue->ring, val) != 0) {
+        return -1;
+    }
+
+    /* Wake up the stream consumers */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->waiting, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return 0;
+}
+
+void *lamb_queue_pop(lamb_queue_t *queue) {
     if (queue) {
-        if (queue->list) {
-            return lamb_list_rpush(queue->list, lamb_node_new(val));
-        }
+        return lamb_ring_pop(queue->ring);
     }
 
     return NULL;
 }
 
-lamb_node_t *lamb_queue_pop(lamb_queue_t *queue) {
+size_t lamb_queue_len(lamb_queue_t *queue) {
     if (queue) {
-        if (queue->list) {
-            return lamb_list_lpop(queue->list);
-        }
+        return lamb_ring_len(queue->ring);
     }
 
-    return NULL;
+    return 0;
+}
+
+/* Wait until the queue is not empty, ETIMEDOUT on timeout */
+int lamb_queue_wait(lamb_queue_t *queue, long milliseconds) {
+    int err = 0;
+    struct timeval now;
+    struct timespec timeout;
+
+    if (lamb_ring_len(queue->ring) > 0) {
+        return 0;
+    }
+
+    gettimeofday(&now, NULL);
+    timeout.tv_sec = now.tv_sec + (milliseconds / 1000);
+    timeout.tv_nsec = (now.tv_usec * 1000) + (milliseconds % 1000) * 1000 * 1000;
+    timeout.tv_sec += timeout.tv_nsec / (1000 * 1000 * 1000);
+    timeout.tv_nsec %= 1000 * 1000 * 1000;
+
+    pthread_mutex_lock(&queue->lock);
+    __atomic_fetch_add(&queue->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while (lamb_ring_len(queue->ring) == 0 && err == 0) {
+        err = pthread_cond_timedwait(&queue->cond, &queue->lock, &timeout);
+    }
+
+    if (lamb_ring_len(queue->ring) > 0) {
+        err = 0;
+    }
+
+    __atomic_fetch_sub(&queue->waiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->lock);
+
+    return err;
 }
 
 int lamb_queue_compare(void *id, void *queue) {
@@ -58,7 +111,9 @@ int lamb_queue_compare(void *id, void *queue) {
 void lamb_queue_destroy(lamb_queue_t *queue) {
     if (queue) {
         queue->id = 0;
-        lamb_list_destroy(queue->list);
+        lamb_ring_destroy(queue->ring);
+        pthread_cond_destroy(&queue->cond);
+        pthread_mutex_destroy(&queue->lock);
     }
 
     return;
@@ -6,16 +6,25 @@
 #ifndef _LAMB_QUEUE_H
 #define _LAMB_QUEUE_H
 
+#include <pthread.h>
 #include "list.h"
+#include "ring.h"
+
+#define LAMB_QUEUE_SIZE 65536
 
 typedef struct lamb_queue_t {
     int id;
-    lamb_list_t *list;
+    lamb_ring_t *ring;
+    int waiting;
+    pthread_cond_t cond;
+    pthread_mutex_t lock;
 } lamb_queue_t;
 
 lamb_queue_t *lamb_queue_new(int id);
-lamb_node_t * lamb_queue_push(lamb_queue_t *queue, void *val);
-lamb_node_t *lamb_queue_pop(lamb_queue_t *queue);
+int lamb_queue_push(lamb_queue_t *queue, void *val);
+void *lamb_queue_pop(lamb_queue_t *queue);
+size_t lamb_queue_len(lamb_queue_t *queue);
+int lamb_queue_wait(lamb_queue_t *queue, long milliseconds);
 int lamb_queue_compare(void *queue, void *id);
 void lamb_queue_destroy(lamb_queue_t *queue);
 
@@ -0,0 +1,224 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "registry.h"
+
+/*
+ * Open addressing with linear probing. Id 0 marks a free entry, a
+ * deleted entry keeps its id with a NULL value so that probing goes on
+ * past it. Writers are serialized by the lock and publish an entry by
+ * storing the value before the id. A full table is replaced by a copy
+ * twice the size, the old one is kept until the registry is destroyed
+ * because a reader may still be probing it.
+ */
+
+static lamb_table_t *lamb_table_new(unsigned int size);
+static lamb_entry_t *lamb_table_probe(lamb_table_t *table, int id);
+static int lamb_table_grow(lamb_registry_t *registry);
+
+static inline unsigned int lamb_registry_hash(int id) {
+    return (unsigned int)id * 2654435761U;
+}
+
+lamb_registry_t *lamb_registry_new(void) {
+    lamb_registry_t *self;
+
+    self = (lamb_registry_t *)malloc(sizeof(lamb_registry_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->table = lamb_table_new(LAMB_REGISTRY_SIZE);
+    if (!self->table) {
+        free(self);
+        return NULL;
+    }
+
+    self->used = 0;
+    pthread_mutex_init(&self->lock, NULL);
+
+    return self;
+}
+
+void *lamb_registry_get(lamb_registry_t *registry, int id) {
+    int key;
+    unsigned int pos;
+    lamb_table_t *table;
+    lamb_entry_t *entry;
+
+    table = __atomic_load_n(&registry->table, __ATOMIC_ACQUIRE);
+    pos = lamb_registry_hash(id) & table->mask;
+
+    for (unsigned int i = 0; i <= table->mask; i++) {
+        entry = &table->entries[(pos + i) & table->mask];
+        key = __atomic_load_n(&entry->id, __ATOMIC_ACQUIRE);
+
+        if (key == id) {
+            return __atomic_load_n(&entry->val, __ATOMIC_ACQUIRE);
+        }
+
+        if (key == 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Add or replace the value of id, id 0 is reserved */
+int lamb_registry_set(lamb_registry_t *registry, int id, void *val) {
+    lamb_entry_t *entry;
+
+    if (id == 0 || !val) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+
+    entry = lamb_table_probe(registry->table, id);
+
+    if (entry->id != id) {
+        /* Keep the load factor under one half */
+        if ((registry->used + 1) * 2 > registry->table->mask + 1) {
+            if (lamb_table_grow(registry) != 0) {
+                pthread_mutex_unlock(&registry->lock);
+                return -1;
+            }
+            entry = lamb_table_probe(registry->table, id);
+        }
+
+        registry->used++;
+    }
+
+    __atomic_store_n(&entry->val, val, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->id, id, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&registry->lock);
+
+    return 0;
+}
+
+/* Remove id and return its value, the caller decides when to free it */
+void *lamb_registry_del(lamb_registry_t *registry, int id) {
+    void *val = NULL;
+    lamb_entry_t *entry;
+
+    if (id == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+
+    entry = lamb_table_probe(registry->table, id);
+
+    if (entry->id == id) {
+        val = entry->val;
+        __atomic_store_n(&entry->val, NULL, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&registry->lock);
+
+    return val;
+}
+
+void lamb_registry_foreach(lamb_registry_t *registry, void (*callback)(void *val, void *arg), void *arg) {
+    void *val;
+    lamb_table_t *table;
+
+    table = __atomic_load_n(&registry->table, __ATOMIC_ACQUIRE);
+
+    for (unsigned int i = 0; i <= table->mask; i++) {
+        val = __atomic_load_n(&table->entries[i].val, __ATOMIC_ACQUIRE);
+        if (val) {
+            callback(val, arg);
+        }
+    }
+
+    return;
+}
+
+void lamb_registry_destroy(lamb_registry_t *registry) {
+    lamb_table_t *table, *next;
+
+    if (!registry) {
+        return;
+    }
+
+    table = registry->table;
+
+    while (table) {
+        next = table->retired;
+        free(table);
+        table = next;
+    }
+
+    pthread_mutex_destroy(&registry->lock);
+    free(registry);
+
+    return;
+}
+
+static lamb_table_t *lamb_table_new(unsigned int size) {
+    lamb_table_t *self;
+
+    self = (lamb_table_t *)calloc(1, sizeof(lamb_table_t) + size * sizeof(lamb_entry_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->mask = size - 1;
+    self->retired = NULL;
+
+    return self;
+}
+
+/* The entry of id, or the free entry where it belongs, lock must be held */
+static lamb_entry_t *lamb_table_probe(lamb_table_t *table, int id) {
+    unsigned int pos;
+    lamb_entry_t *entry;
+
+    pos = lamb_registry_hash(id) & table->mask;
+
+    while (true) {
+        entry = &table->entries[pos];
+
+        if (entry->id == id || entry->id == 0) {
+            return entry;
+        }
+
+        pos = (pos + 1) & table->mask;
+    }
+}
+
+/* Copy the live entries to a table twice the size, deleted ids are dropped */
+static int lamb_table_grow(lamb_registry_t *registry) {
+    lamb_table_t *old, *table;
+    lamb_entry_t *entry;
+
+    old = registry->table;
+    table = lamb_table_new((old->mask + 1) * 2);
+
+    if (!table) {
+        return -1;
+    }
+
+    registry->used = 0;
+
+    for (unsigned int i = 0; i <= old->mask; i++) {
+        if (old->entries[i].val) {
+            entry = lamb_table_probe(table, old->entries[i].id);
+            entry->id = old->entries[i].id;
+            entry->val = old->entries[i].val;
+            registry->used++;
+        }
+    }
+
+    table->retired = old;
+    __atomic_store_n(&registry->table, table, __ATOMIC_RELEASE);
+
+    return 0;
+}
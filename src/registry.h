@@ -0,0 +1,38 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_REGISTRY_H
+#define _LAMB_REGISTRY_H
+
+#include <pthread.h>
+
+#define LAMB_REGISTRY_SIZE 256
+
+typedef struct {
+    int id;
+    void *val;
+} lamb_entry_t;
+
+typedef struct lamb_table {
+    unsigned int mask;
+    struct lamb_table *retired;
+    lamb_entry_t entries[];
+} lamb_table_t;
+
+/* Id to value map, lookups never take the lock */
+typedef struct {
+    lamb_table_t *table;
+    unsigned int used;
+    pthread_mutex_t lock;
+} lamb_registry_t;
+
+lamb_registry_t *lamb_registry_new(void);
+void *lamb_registry_get(lamb_registry_t *registry, int id);
+int lamb_registry_set(lamb_registry_t *registry, int id, void *val);
+void *lamb_registry_del(lamb_registry_t *registry, int id);
+void lamb_registry_foreach(lamb_registry_t *registry, void (*callback)(void *val, void *arg), void *arg);
+void lamb_registry_destroy(lamb_registry_t *registry);
+
+#endif
@@ -0,0 +1,169 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "ring.h"
+
+/*
+ * Every cell carries a sequence number. A cell at position pos is free
+ * for a producer when its sequence equals pos, and holds a value for a
+ * consumer when its sequence equals pos + 1. Producers and consumers
+ * claim positions by advancing tail and head with compare-and-swap,
+ * so there is no lock and no allocation on push or pop.
+ */
+
+/* Allocate a ring, size is rounded up to a power of two */
+lamb_ring_t *lamb_ring_new(size_t size) {
+    size_t len;
+    lamb_ring_t *self;
+
+    for (len = 2; len < size; len <<= 1);
+
+    if (posix_memalign((void **)&self, LAMB_CACHELINE, sizeof(lamb_ring_t)) != 0) {
+        return NULL;
+    }
+
+    if (posix_memalign((void **)&self->cells, LAMB_CACHELINE, len * sizeof(lamb_cell_t)) != 0) {
+        free(self);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        self->cells[i].sequence = i;
+        self->cells[i].val = NULL;
+    }
+
+    self->mask = len - 1;
+    self->head = 0;
+    self->tail = 0;
+
+    return self;
+}
+
+/* Push one value, -1 when the ring is full */
+int lamb_ring_push(lamb_ring_t *ring, void *val) {
+    return (lamb_ring_push_bulk(ring, &val, 1) == 1) ? 0 : -1;
+}
+
+/* Pop one value, NULL when the ring is empty */
+void *lamb_ring_pop(lamb_ring_t *ring) {
+    void *val;
+
+    if (lamb_ring_pop_bulk(ring, &val, 1) == 1) {
+        return val;
+    }
+
+    return NULL;
+}
+
+/* Push up to n values with a single claim, returns the number pushed */
+size_t lamb_ring_push_bulk(lamb_ring_t *ring, void **vals, size_t n) {
+    long diff = 0;
+    size_t count;
+    unsigned long pos;
+    lamb_cell_t *cell;
+
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        for (count = 0; count < n; count++) {
+            cell = &ring->cells[(pos + count) & ring->mask];
+            diff = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (pos + count));
+            if (diff != 0) {
+                break;
+            }
+        }
+
+        if (count > 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + count, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            continue;
+        }
+
+        /* Full */
+        if (diff < 0) {
+            return 0;
+        }
+
+        pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        cell = &ring->cells[(pos + i) & ring->mask];
+        cell->val = vals[i];
+        __atomic_store_n(&cell->sequence, pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+/* Pop up to n values with a single claim, returns the number popped */
+size_t lamb_ring_pop_bulk(lamb_ring_t *ring, void **vals, size_t n) {
+    long diff = 0;
+    size_t count;
+    unsigned long pos;
+    lamb_cell_t *cell;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    while (true) {
+        for (count = 0; count < n; count++) {
+            cell = &ring->cells[(pos + count) & ring->mask];
+            diff = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (pos + count + 1));
+            if (diff != 0) {
+                break;
+            }
+        }
+
+        if (count > 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + count, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            continue;
+        }
+
+        /* Empty */
+        if (diff < 0) {
+            return 0;
+        }
+
+        pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        cell = &ring->cells[(pos + i) & ring->mask];
+        vals[i] = cell->val;
+        __atomic_store_n(&cell->sequence, pos + i + ring->mask + 1, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+/* Number of values in the ring, a snapshot under concurrency */
+size_t lamb_ring_len(lamb_ring_t *ring) {
+    unsigned long head, tail;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    return (tail > head) ? (tail - head) : 0;
+}
+
+size_t lamb_ring_size(lamb_ring_t *ring) {
+    return ring->mask + 1;
+}
+
+void lamb_ring_destroy(lamb_ring_t *ring) {
+    if (ring) {
+        free(ring->cells);
+        free(ring);
+    }
+
+    return;
+}
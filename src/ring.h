@@ -0,0 +1,38 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_RING_H
+#define _LAMB_RING_H
+
+#include <stddef.h>
+
+#define LAMB_CACHELINE 64
+
+typedef struct {
+    unsigned long sequence;
+    void *val;
+} lamb_cell_t;
+
+/* Bounded lock-free multi-producer multi-consumer ring */
+typedef struct {
+    unsigned long mask;
+    lamb_cell_t *cells;
+    char pad1[LAMB_CACHELINE - sizeof(unsigned long) - sizeof(lamb_cell_t *)];
+    unsigned long head;
+    char pad2[LAMB_CACHELINE - sizeof(unsigned long)];
+    unsigned long tail;
+    char pad3[LAMB_CACHELINE - sizeof(unsigned long)];
+} lamb_ring_t;
+
+lamb_ring_t *lamb_ring_new(size_t size);
+int lamb_ring_push(lamb_ring_t *ring, void *val);
+void *lamb_ring_pop(lamb_ring_t *ring);
+size_t lamb_ring_push_bulk(lamb_ring_t *ring, void **vals, size_t n);
+size_t lamb_ring_pop_bulk(lamb_ring_t *ring, void **vals, size_t n);
+size_t lamb_ring_len(lamb_ring_t *ring);
+size_t lamb_ring_size(lamb_ring_t *ring);
+void lamb_ring_destroy(lamb_ring_t *ring);
+
+#endif
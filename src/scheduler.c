@@ -27,7 +27,11 @@
 #include "config.h"
 #include "cache.h"
 #include "socket.h"
+#include "mux.h"
 #include "queue.h"
+#include "registry.h"
+#include "slab.h"
+#include "arena.h"
 #include "message.h"
 #include "account.h"
 #include "routing.h"
@@ -37,10 +41,13 @@
 //static int ac;
 static lamb_db_t db;
 static lamb_config_t config;
-static lamb_list_t *gateway;
-static pthread_cond_t cond;
-static pthread_mutex_t mutex;
-static Response resp = RESPONSE__INIT;
+static lamb_mux_t *mux;
+static lamb_registry_t *routes;
+static lamb_registry_t *gateway;
+static lamb_slab_t *messages;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
 
 static char *cmcc[] = {"134", "135", "136", "137", "138", "139", "147", "150",
                        "151", "152", "157", "158", "159", "178", "182", "183",
@@ -109,19 +116,27 @@ int main(int argc, char *argv[]) {
 }
 
 void lamb_event_loop(void) {
-    int fd, err;
+    int err;
 
-    pthread_cond_init(&cond, NULL);
-    pthread_mutex_init(&mutex, NULL);
-    
     /* Client Queue Pools Initialization */
-    gateway = lamb_list_new();
+    gateway = lamb_registry_new();
     if (!gateway) {
         syslog(LOG_ERR, "gateway pool initialization failed");
         return;
     }
 
-    gateway->match = lamb_queue_compare;
+    messages = lamb_slab_new(sizeof(lamb_submit_t));
+    if (!messages) {
+        syslog(LOG_ERR, "message slab initialization failed");
+        return;
+    }
+
+    /* Routing Cache Initialization */
+    routes = lamb_registry_new();
+    if (!routes) {
+        syslog(LOG_ERR, "routing cache initialization failed");
+        return;
+    }
 
     /* Database Initialization */
     err = lamb_db_init(&db);
@@ -138,8 +153,9 @@ void lamb_event_loop(void) {
     }
 
     /* MT Server Initialization */
-    err = lamb_nn_server(&fd, config.listen, config.port, NN_REP);
-    if (err) {
+    mux = lamb_mux_new(config.listen, config.port, config.work_threads,
+                       lamb_push_handler, lamb_pull_handler);
+    if (!mux) {
         syslog(LOG_ERR, "scheduler initialization failed");
         return;
     }
@@ -147,546 +163,369 @@ void lamb_event_loop(void) {
     /* Start Data Acquisition Thread */
     lamb_start_thread(lamb_stat_loop, NULL, 1);
 
-    int rc, len;
-    Request *req;
-    char *buf = NULL;
-
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
-
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
-            continue;
-        }
+    /* Start Worker Threads */
+    lamb_mux_run(mux);
 
-        if (CHECK_COMMAND(buf) != LAMB_REQUEST) {
-            nn_freemsg(buf);
-            syslog(LOG_WARNING, "invalid request from client");
-            continue;
-        }
-
-        req = request__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-        nn_freemsg(buf);
+    return;
+}
 
-        if (!req) {
-            syslog(LOG_ERR, "can't parse protobuff protocol packets");
-            continue;
-        }
+/* Find the queue of a gateway, created when the gateway first pulls */
+lamb_queue_t *lamb_pool_queue(int id) {
+    lamb_queue_t *queue;
 
-        if (req->id < 1) {
-            syslog(LOG_WARNING, "Invalid client identity id number");
-            continue;
-        }
+    queue = lamb_registry_get(gateway, id);
 
-        struct timeval now;
-        struct timespec timeout;
-        
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = now.tv_sec;
-        timeout.tv_nsec = now.tv_usec * 1000;
-        timeout.tv_sec += 3;
-
-        pthread_mutex_lock(&mutex);
-
-        if (req->type == LAMB_TEST) {
-            lamb_start_thread(lamb_test_loop,  (void *)req, 1);
-        } else if (req->type == LAMB_PULL) {
-            lamb_start_thread(lamb_pull_loop,  (void *)req, 1);
-        } else if (req->type == LAMB_PUSH) {
-            lamb_start_thread(lamb_push_loop,  (void *)req, 1);
-        } else {
-            request__free_unpacked(req, NULL);
-            pthread_mutex_unlock(&mutex);
-            continue;
-        }
+    if (queue) {
+        return queue;
+    }
 
-        err = pthread_cond_timedwait(&cond, &mutex, &timeout);
+    pthread_mutex_lock(&mutex);
 
-        if (err != ETIMEDOUT) {
-            void *pk;
-            len = response__get_packed_size(&resp);
-            pk = malloc(len);
+    queue = lamb_registry_get(gateway, id);
 
-            if (pk) {
-                response__pack(&resp, pk);
-                len = lamb_pack_assembly(&buf, LAMB_RESPONSE, pk, len);
-                if (len > 0) {
-                    nn_send(fd, buf, len, 0);
-                    free(buf);
-                }
-                free(pk);
-            }
+    if (!queue) {
+        queue = lamb_queue_new(id);
+        if (queue && lamb_registry_set(gateway, id, queue) != 0) {
+            lamb_queue_destroy(queue);
+            free(queue);
+            queue = NULL;
         }
-        
-        pthread_mutex_unlock(&mutex);
     }
-}
 
-void *lamb_test_loop(void *arg) {
-    int fd;
-    int err;
-    int timeout;
-    char host[128];
-    Request *client;
-
-    client = (Request *)arg;
+    pthread_mutex_unlock(&mutex);
 
-    syslog(LOG_INFO, "new test client from %s connectd\n", client->addr);
+    return queue;
+}
 
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_PAIR);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+int lamb_push_handler(int method, int id, char *pk, size_t len) {
+    if (method == LAMB_SUBMIT) {
+        return lamb_submit_handler(id, pk, len);
     }
 
-    pthread_mutex_lock(&mutex);
+    if (method == LAMB_MESSAGE) {
+        return lamb_message_handler(id, pk, len);
+    }
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+    /* The server reloads, its routing is fetched again */
+    if (method == LAMB_BYE) {
+        lamb_route_drop(id);
+        return LAMB_OK;
+    }
 
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
+    lamb_debug("invalid request data packet\n");
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
+    return LAMB_REJECT;
+}
 
-    /* Start event processing */
-    int rc;
-    int len;
-    char *buf;
-    int channel;
-    Message *msg;
+int lamb_submit_handler(int id, char *pk, size_t len) {
+    int cmd;
+    bool available;
+    bool operator;
+    bool province;
     bool completed;
+    Submit *submit;
     lamb_node_t *node;
+    lamb_route_t *route;
     lamb_queue_t *queue;
+    lamb_channel_t *channel;
     lamb_submit_t *message;
 
+    submit = submit__unpack(lamb_arena(), len, (uint8_t *)pk);
 
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+    if (!submit) {
+        return LAMB_REJECT;
+    }
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
+    message = (lamb_submit_t *)lamb_slab_alloc(messages);
 
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
-            continue;
-        }
+    if (!message) {
+        submit__free_unpacked(submit, lamb_arena());
+        return LAMB_BUSY;
+    }
 
-        /* Submit message */
-        if (CHECK_COMMAND(buf) == LAMB_MESSAGE) {
-            msg = message__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
+    message->id = submit->id;
+    message->account = submit->account;
+    message->company = submit->company;
+    strncpy(message->spid, submit->spid, 6);
+    strncpy(message->spcode, submit->spcode, 20);
+    strncpy(message->phone, submit->phone, 11);
+    message->msgfmt = submit->msgfmt;
+    message->length = submit->length;
+    memcpy(message->content, submit->content.data, submit->content.len);
 
-            if (!msg) {
-                continue;
-            }
+    submit__free_unpacked(submit, lamb_arena());
 
-            message = (lamb_submit_t *)calloc(1, sizeof(lamb_submit_t));
+    pthread_rwlock_rdlock(&rwlock);
 
-            if (!message) {
-                message__free_unpacked(msg, NULL);
-                continue;
-            }
+    route = lamb_route_find(id);
 
-            message->id = msg->id;
-            channel = msg->channel;
-            strncpy(message->spid, msg->spid, 6);
-            strncpy(message->spcode, msg->spcode, 20);
-            strncpy(message->phone, msg->phone, 11);
-            message->msgfmt = msg->msgfmt;
-            message->length = msg->length;
-            memcpy(message->content, msg->content.data, msg->content.len);
-
-            message__free_unpacked(msg, NULL);
-
-            /* Search for gateway channels */
-            completed = false;
-            node = lamb_list_find(gateway, (void *)(intptr_t)channel);
-            if (node) {
-                queue = (lamb_queue_t *)node->val;
-                lamb_queue_push(queue, message);
-                completed = true;
-            }
+    if (!route) {
+        pthread_rwlock_unlock(&rwlock);
 
-            len = lamb_pack_assembly(&buf, completed ? LAMB_OK : LAMB_NOROUTE, NULL, 0);
-            nn_send(fd, buf, len, NN_DONTWAIT);
-            free(buf);
-            continue;
+        if (lamb_route_load(id) != 0) {
+            lamb_slab_free(messages, message);
+            return LAMB_BUSY;
         }
 
-        /* Close */
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
+        pthread_rwlock_rdlock(&rwlock);
+        route = lamb_route_find(id);
+    }
+
+    available = false;
+    operator = false;
+    province = false;
+    completed = false;
+
+    if (route) {
+        /* The channel list is never changed once loaded */
+        for (node = route->channels->head; node; node = node->next) {
+            available = true;
+            channel = (lamb_channel_t *)node->val;
+
+            /* Check operators */
+            if (lamb_check_operator(channel, message->phone)) {
+                operator = true;
+                /* Check province */
+                if (lamb_check_province(channel, message->phone)) {
+                    province = true;
+                    queue = lamb_registry_get(gateway, channel->id);
+
+                    if (queue) {
+                        if (lamb_queue_len(queue) < 128) {
+                            if (lamb_queue_push(queue, message) == 0) {
+                                lamb_mux_wake(mux, queue->id);
+                                completed = true;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
         }
-
-        lamb_debug("invalid request data packet\n");
-        nn_freemsg(buf);
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
-
-    pthread_exit(NULL);
-}
+    pthread_rwlock_unlock(&rwlock);
 
-void *lamb_push_loop(void *arg) {
-    int fd;
-    int err;
-    int timeout;
-    char host[128];
-    Request *client;
-    lamb_list_t *channels;
-    
-    client = (Request *)arg;
+    if (completed) {
+        cmd = LAMB_OK;
+    } else {
+        lamb_slab_free(messages, message);
+        if (!available) {
+            cmd = LAMB_NOROUTE;
+        } else if (!operator || !province) {
+            cmd = LAMB_REJECT;
+        } else {
+            cmd = LAMB_BUSY;
+        }
+    }
 
-    syslog(LOG_INFO, "new client from %s connectd\n", client->addr);
+    return cmd;
+}
 
-    channels = lamb_list_new();
+int lamb_message_handler(int id, char *pk, size_t len) {
+    int channel;
+    Message *msg;
+    lamb_queue_t *queue;
+    lamb_submit_t *message;
 
-    if (channels) {
-        lamb_get_channels(&db, client->id, channels);
-    } else {
-        syslog(LOG_ERR, "create %d routing object failed", client->id);
-        request__free_unpacked(client, NULL);
-        pthread_exit(NULL);
-    }
+    msg = message__unpack(lamb_arena(), len, (uint8_t *)pk);
 
-#ifdef _DEBUG
-    if (channels->len > 0) {
-        lamb_debug("fetch routing channels successfull\n");
-    } else {
-        lamb_debug("no routing channel is available\n");
+    if (!msg) {
+        return LAMB_REJECT;
     }
 
-    lamb_node_t *nd;
-    lamb_channel_t *chan;
-    lamb_list_iterator_t *it = lamb_list_iterator_new(channels, LIST_HEAD);
+    message = (lamb_submit_t *)lamb_slab_alloc(messages);
 
-    while ((nd = lamb_list_iterator_next(it))) {
-        chan = (lamb_channel_t *)nd->val;
-        lamb_debug("-> id: %d, acc: %d, weight: %d\n", chan->id, chan->acc, chan->weight);
+    if (!message) {
+        message__free_unpacked(msg, lamb_arena());
+        return LAMB_BUSY;
     }
 
-    lamb_list_iterator_destroy(it);
-#endif
+    message->id = msg->id;
+    channel = msg->channel;
+    strncpy(message->spid, msg->spid, 6);
+    strncpy(message->spcode, msg->spcode, 20);
+    strncpy(message->phone, msg->phone, 11);
+    message->msgfmt = msg->msgfmt;
+    message->length = msg->length;
+    memcpy(message->content, msg->content.data, msg->content.len);
 
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_PAIR);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
-    }
+    message__free_unpacked(msg, lamb_arena());
 
-    pthread_mutex_lock(&mutex);
+    /* Search for gateway channels */
+    queue = lamb_registry_get(gateway, channel);
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+    if (queue) {
+        if (lamb_queue_push(queue, message) == 0) {
+            lamb_mux_wake(mux, channel);
+            return LAMB_OK;
+        }
+    }
 
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
+    lamb_slab_free(messages, message);
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
+    return LAMB_NOROUTE;
+}
 
-    /* Start event processing */
-    int rc;
-    int len;
-    char *buf = NULL;
-    bool available;
-    bool operator;
-    bool province;
-    bool completed;
-    Submit *submit;
-    lamb_node_t *node;
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes) {
     lamb_queue_t *queue;
-    lamb_channel_t *channel;
     lamb_submit_t *message;
 
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+    queue = lamb_pool_queue(id);
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
+    if (!queue) {
+        return 0;
+    }
 
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
-            continue;
+    /* Drain the queue up to the consumer hint */
+    while (batch->count < count && batch->len < bytes) {
+        message = lamb_queue_pop(queue);
+
+        if (!message) {
+            break;
         }
 
-        /* Submit */
-        if (CHECK_COMMAND(buf) == LAMB_SUBMIT) {
-            submit = submit__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
+        lamb_pack_submit(batch, message);
+        lamb_slab_free(messages, message);
+    }
 
-            if (!submit) {
-                continue;
-            }
+    return batch->count;
+}
 
-            message = (lamb_submit_t *)calloc(1, sizeof(lamb_submit_t));
+/* Look up the cached routing of an account, rwlock must be held */
+lamb_route_t *lamb_route_find(int id) {
+    return (lamb_route_t *)lamb_registry_get(routes, id);
+}
 
-            if (!message) {
-                submit__free_unpacked(submit, NULL);
-                continue;
-            }
+int lamb_route_load(int id) {
+    lamb_route_t *route;
 
-            message->id = submit->id;
-            message->account = submit->account;
-            message->company = submit->company;
-            strncpy(message->spid, submit->spid, 6);
-            strncpy(message->spcode, submit->spcode, 20);
-            strncpy(message->phone, submit->phone, 11);
-            message->msgfmt = submit->msgfmt;
-            message->length = submit->length;
-            memcpy(message->content, submit->content.data, submit->content.len);
-
-            submit__free_unpacked(submit, NULL);
-
-            available = false;
-            operator = false;
-            province = false;
-            completed = false;
-
-            lamb_list_iterator_t *it;
-            it = lamb_list_iterator_new(channels, LIST_HEAD);
-
-            while ((node = lamb_list_iterator_next(it))) {
-                available = true;
-                channel = (lamb_channel_t *)node->val;
-
-                /* Check operators */
-                if (lamb_check_operator(channel, message->phone)) {
-                    operator = true;
-                    /* Check province */
-                    if (lamb_check_province(channel, message->phone)) {
-                        province = true;
-                        node = lamb_list_find(gateway, (void *)(intptr_t)channel->id);
-
-                        if (node) {
-                            queue = (lamb_queue_t *)node->val;
-                            if (queue->list->len < 128) {
-                                completed = true;
-                                lamb_queue_push(queue, message);
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
+    if (lamb_route_find(id)) {
+        return 0;
+    }
 
-            lamb_list_iterator_destroy(it);
-
-            if (completed) {
-                len = lamb_pack_assembly(&buf, LAMB_OK, NULL, 0);
-            } else {
-                if (!available) {
-                    len = lamb_pack_assembly(&buf, LAMB_NOROUTE, NULL, 0);
-                } else if (!operator || !province) {
-                    len = lamb_pack_assembly(&buf, LAMB_REJECT, NULL, 0);
-                } else {
-                    len = lamb_pack_assembly(&buf, LAMB_BUSY, NULL, 0);
-                }
-            }
+    route = (lamb_route_t *)malloc(sizeof(lamb_route_t));
 
-            nn_send(fd, buf, len, NN_DONTWAIT);
-            free(buf);
-            continue;
-        }
+    if (!route) {
+        return -1;
+    }
 
-        /* Close */
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
-        }
+    route->id = id;
+    route->channels = lamb_list_new();
 
-        lamb_debug("invalid request data packet\n");
-        nn_freemsg(buf);
+    if (!route->channels) {
+        free(route);
+        return -1;
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
+    route->channels->free = free;
 
-    pthread_exit(NULL);
-}
+    /* The query runs outside rwlock, routing of other accounts goes on */
+    pthread_mutex_lock(&dblock);
 
-void *lamb_pull_loop(void *arg) {
-    int err;
-    int fd, rc;
-    int timeout;
-    char host[128];
-    Request *client;
-    lamb_node_t *node;
-    lamb_queue_t *queue;
-    
-    client = (Request *)arg;
+    if (lamb_get_channels(&db, id, route->channels) != 0) {
+        pthread_mutex_unlock(&dblock);
+        syslog(LOG_ERR, "fetch %d routing channels failed", id);
+        lamb_list_destroy(route->channels);
+        free(route);
+        return -1;
+    }
 
-    syslog(LOG_INFO, "new client from %s connectd\n", client->addr);
+    pthread_mutex_unlock(&dblock);
 
-    /* client queue initialization */
-    node = lamb_list_find(gateway, (void *)(intptr_t)client->id);
+    pthread_rwlock_wrlock(&rwlock);
 
-    if (node) {
-        queue = (lamb_queue_t *)node->val;
-    } else {
-        queue = lamb_queue_new(client->id);
-        if (queue) {
-            lamb_list_rpush(gateway, lamb_node_new(queue));
+    /* Another thread may have loaded the same account meanwhile */
+    if (!lamb_route_find(id)) {
+        if (lamb_registry_set(routes, id, route) != 0) {
+            pthread_rwlock_unlock(&rwlock);
+            lamb_list_destroy(route->channels);
+            free(route);
+            return -1;
         }
+        route = NULL;
     }
 
-    if (!queue) {
-        syslog(LOG_ERR, "can't create %d queue from %s", client->id, client->addr);
-        request__free_unpacked(client, NULL);
-        pthread_exit(NULL);
-    }
+    pthread_rwlock_unlock(&rwlock);
 
-    /* Client channel initialization */
-    unsigned short port = config.port + 1;
-    err = lamb_child_server(&fd, config.listen, &port, NN_REP);
-    if (err) {
-        pthread_cond_signal(&cond);
-        request__free_unpacked(client, NULL);
-        syslog(LOG_ERR, "There are no ports available for the operating system");
-        pthread_exit(NULL);
+    if (route) {
+        lamb_list_destroy(route->channels);
+        free(route);
     }
 
-    pthread_mutex_lock(&mutex);
+#ifdef _DEBUG
+    lamb_node_t *nd;
+    lamb_channel_t *chan;
 
-    memset(host, 0, sizeof(host));
-    resp.id = client->id;
-    snprintf(host, sizeof(host), "tcp://%s:%d", config.listen, port);
-    resp.host = host;
+    pthread_rwlock_rdlock(&rwlock);
 
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_signal(&cond);
+    route = lamb_route_find(id);
+    if (route) {
+        lamb_list_iterator_t *it = lamb_list_iterator_new(route->channels, LIST_HEAD);
 
-    timeout = config.timeout;
-    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
-    
-    /* Start event processing */
-    int len;
-    char *pk;
-    char *buf = NULL;
-    lamb_submit_t *message;
-    Submit submit = SUBMIT__INIT;
-    
-    while (true) {
-        rc = nn_recv(fd, &buf, NN_MSG, 0);
+        while ((nd = lamb_list_iterator_next(it))) {
+            chan = (lamb_channel_t *)nd->val;
+            lamb_debug("-> id: %d, acc: %d, weight: %d\n", chan->id, chan->acc, chan->weight);
+        }
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
-            }
+        lamb_list_iterator_destroy(it);
+    }
 
-            if (nn_errno() == ETIMEDOUT) {
-                if (!nn_get_statistic(fd, NN_STAT_CURRENT_CONNECTIONS)) {
-                    break;
-                }
-            }
+    pthread_rwlock_unlock(&rwlock);
+#endif
 
-            continue;
-        }
+    return 0;
+}
 
-        if (CHECK_COMMAND(buf) == LAMB_REQ) {
-            nn_freemsg(buf);
-            node = lamb_queue_pop(queue);
+void lamb_route_drop(int id) {
+    lamb_route_t *route;
 
-            if (!node) {
-                len = lamb_pack_assembly(&buf, LAMB_EMPTY, NULL, 0);
-                nn_send(fd, buf, len, NN_DONTWAIT);
-                continue;
-            }
+    pthread_rwlock_wrlock(&rwlock);
 
-            message = (lamb_submit_t *)node->val;
-            submit.id = message->id;
-            submit.account = message->account;
-            submit.company = message->company;
-            submit.spid = message->spid;
-            submit.spcode = message->spcode;
-            submit.phone = message->phone;
-            submit.msgfmt = message->msgfmt;
-            submit.length = message->length;
-            submit.content.len = message->length;
-            submit.content.data = (uint8_t *)message->content;
-
-            len = submit__get_packed_size(&submit);
-            pk = malloc(len);
-
-            if (pk) {
-                submit__pack(&submit, (uint8_t *)pk);
-                len = lamb_pack_assembly(&buf, LAMB_SUBMIT, pk, len);
-                if (len > 0) {
-                    nn_send(fd, buf, len, 0);
-                    free(buf);
-                }
-                free(pk);
-            }
+    route = (lamb_route_t *)lamb_registry_del(routes, id);
 
-            free(message);
-            free(node);
-            continue;
-        }
+    if (route) {
+        lamb_list_destroy(route->channels);
+        free(route);
+    }
 
-        if (CHECK_COMMAND(buf) == LAMB_BYE) {
-            nn_freemsg(buf);
-            break;
-        }
+    pthread_rwlock_unlock(&rwlock);
 
-        nn_freemsg(buf);
+    return;
+}
+
+int lamb_pack_submit(lamb_batch_t *batch, lamb_submit_t *message) {
+    char *pk;
+    size_t len;
+    Submit submit = SUBMIT__INIT;
+
+    submit.id = message->id;
+    submit.account = message->account;
+    submit.company = message->company;
+    submit.spid = message->spid;
+    submit.spcode = message->spcode;
+    submit.phone = message->phone;
+    submit.msgfmt = message->msgfmt;
+    submit.length = message->length;
+    submit.content.len = message->length;
+    submit.content.data = (uint8_t *)message->content;
+
+    len = submit__get_packed_size(&submit);
+    pk = lamb_batch_reserve(batch, LAMB_SUBMIT, len);
+
+    if (!pk) {
+        return -1;
     }
 
-    nn_close(fd);
-    lamb_debug("connection closed from %s\n", client->addr);
-    syslog(LOG_INFO, "connection closed from %s", client->addr);
-    request__free_unpacked(client, NULL);
+    submit__pack(&submit, (uint8_t *)pk);
 
-    pthread_exit(NULL);
+    return 0;
 }
 
 void *lamb_stat_loop(void *arg) {
     while (true) {
 #ifdef _DEBUG
-        lamb_node_t *node;
-        lamb_queue_t *queue;
-        long long length = 0;    
-        lamb_list_iterator_t *it;
-
-        it = lamb_list_iterator_new(gateway, LIST_HEAD);
-
-        while ((node = lamb_list_iterator_next(it))) {
-            queue = (lamb_queue_t *)node->val;
-            length += queue->list->len;
-            lamb_debug("queue: %d, len: %u\n", queue->id, queue->list->len);
-        }
-
-        lamb_list_iterator_destroy(it);
+        lamb_registry_foreach(gateway, lamb_debug_queue, NULL);
 #endif
         lamb_sleep(3000);
     }
@@ -694,15 +533,9 @@ void *lamb_stat_loop(void *arg) {
     pthread_exit(NULL);
 }
 
-int lamb_child_server(int *sock, const char *host, unsigned short *port, int protocol) {
-    while (true) {
-        if (!lamb_nn_server(sock, host, *port, protocol)) {
-            break;
-        }
-        (*port)++;
-    }
-
-    return 0;
+void lamb_debug_queue(void *queue, void *arg) {
+    lamb_debug("queue: %d, len: %zu\n", ((lamb_queue_t *)queue)->id, lamb_queue_len((lamb_queue_t *)queue));
+    return;
 }
 
 bool lamb_check_operator(lamb_channel_t *channel, char *phone) {
@@ -786,6 +619,16 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    if (lamb_get_int(&cfg, "WorkThreads", &conf->work_threads) != 0) {
+        fprintf(stderr, "Can't read config 'WorkThreads' parameter\n");
+        goto error;
+    }
+
+    if (conf->work_threads < 1 || conf->work_threads > LAMB_MAX_THREAD) {
+        fprintf(stderr, "Invalid work threads number\n");
+        goto error;
+    }
+
     if (lamb_get_string(&cfg, "Ac", conf->ac, 128) != 0) {
         fprintf(stderr, "Can't read config 'Ac' parameter\n");
     }
@@ -19,6 +19,7 @@ typedef struct {
     char listen[16];
     int port;
     long long timeout;
+    int work_threads;
     char ac[128];
     char db_host[16];
     int db_port;
@@ -28,13 +29,24 @@ typedef struct {
     char logfile[128];
 } lamb_config_t;
 
+typedef struct {
+    int id;
+    lamb_list_t *channels;
+} lamb_route_t;
+
 void lamb_event_loop(void);
-void *lamb_test_loop(void *arg);
-void *lamb_push_loop(void *arg);
-void *lamb_pull_loop(void *arg);
+lamb_queue_t *lamb_pool_queue(int id);
+int lamb_push_handler(int method, int id, char *pk, size_t len);
+int lamb_submit_handler(int id, char *pk, size_t len);
+int lamb_message_handler(int id, char *pk, size_t len);
+int lamb_pull_handler(int id, lamb_batch_t *batch, int count, int bytes);
+lamb_route_t *lamb_route_find(int id);
+int lamb_route_load(int id);
+void lamb_route_drop(int id);
 int lamb_server_init(int *sock, const char *addr, int port);
-int lamb_child_server(int *sock, const char *listen, unsigned short *port, int protocol);
 void *lamb_stat_loop(void *arg);
+void lamb_debug_queue(void *queue, void *arg);
+int lamb_pack_submit(lamb_batch_t *batch, lamb_submit_t *message);
 bool lamb_check_operator(lamb_channel_t *channel, char *phone);
 bool lamb_check_province(lamb_channel_t *channel, char *phone);
 int lamb_read_config(lamb_config_t *conf, const char *file);
@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <endian.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sched.h>
@@ -26,25 +27,45 @@
 #include <pcre.h>
 #include <cmpp.h>
 #include "socket.h"
+#include "mux.h"
 #include "keyword.h"
 #include "security.h"
 #include "channel.h"
 #include "log.h"
+#include "storage.h"
+#include "bitmap.h"
+#include "queue.h"
+#include "codec.h"
+#include "limiter.h"
+#include "slab.h"
+#include "arena.h"
 #include "server.h"
 
-#define LAMB_LIMIT   3
-#define MAX_LIFETIME 60
 
 static int aid;
 static int mt, mo;
-static int scheduler;
+static int *schedulers;
+static lamb_queue_t *jobs;
+static int returned = 0;
+static pthread_mutex_t finished = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t lease = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t renewed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t starved = PTHREAD_COND_INITIALIZER;
 static int deliverd;
+static pthread_mutex_t mlock = PTHREAD_MUTEX_INITIALIZER;
 static lamb_status_t *status;
 static lamb_config_t *config;
 static lamb_global_t *global;
 static lamb_caches_t *blacklist;
+static lamb_bitmap_t *bitmap;
 static lamb_caches_t *frequency;
+static lamb_limiter_t *limiter;
+static lamb_ring_t *journal;
 static lamb_caches_t *unsubscribe;
+static lamb_slab_t *submit_slab;
+static lamb_slab_t *report_slab;
+static lamb_slab_t *deliver_slab;
 static volatile bool sleeping = false;
 static volatile bool arrears = false;
 static lamb_lock_t lock;
@@ -130,8 +151,13 @@ void lamb_event_loop(void) {
     /* Thread lock initialization */
     pthread_mutex_init(&global->lock, NULL);
 
-    /* Start sender thread */
-    lamb_start_thread(lamb_work_loop, NULL, 1);
+    /* Start fetch thread */
+    lamb_start_thread(lamb_fetch_loop, NULL, 1);
+
+    /* Start filter worker threads */
+    for (int i = 0; i < config->work_threads; i++) {
+        lamb_start_thread(lamb_work_loop, (void *)(intptr_t)i, 1);
+    }
 
     /* Start deliver thread */
     lamb_start_thread(lamb_deliver_loop, NULL, 1);
@@ -145,6 +171,11 @@ void lamb_event_loop(void) {
     /* Start unsubscribe thread */
     lamb_start_thread(lamb_unsubscribe_loop, NULL, 1);
 
+    /* Start frequency sync thread */
+    if (journal) {
+        lamb_start_thread(lamb_frequency_loop, NULL, 1);
+    }
+
     /* Start status thread */
     lamb_start_thread(lamb_stat_loop, NULL, 1);
 
@@ -158,8 +189,6 @@ void lamb_event_loop(void) {
 
 void lamb_reload(int signum) {
     int err;
-    lamb_node_t *node;
-    lamb_list_iterator_t *it;
 
     if (signal(SIGHUP, lamb_reload) == SIG_ERR) {
         syslog(LOG_ERR, "signal setting process failed");
@@ -169,6 +198,12 @@ void lamb_reload(int signum) {
     lamb_sleep(3000);
     syslog(LOG_INFO, "Start heavy load configuration ...");
 
+    /* Return the leased balance, renewed for the new company afterwards */
+    err = lamb_billing_release(global->billing, &global->brdb);
+    if (err) {
+        syslog(LOG_ERR, "can't return the leased balance of company %d", global->company.id);
+    }
+
     /* fetch account information */
     err = lamb_account_fetch(&global->db, aid, &global->account);
     if (err) {
@@ -183,50 +218,44 @@ void lamb_reload(int signum) {
 
     /* fetch template information */
     if (global->account.options & 1) {
-        global->templates->free = free;
-        it = lamb_list_iterator_new(global->templates, LIST_TAIL);
-        while ((node = lamb_list_iterator_next(it))) {
-            lamb_list_remove(global->templates, node);
-        }
-
-        lamb_list_iterator_destroy(it);
-
-        err = lamb_get_template(&global->db, aid, global->templates);
-        if (err) {
-            syslog(LOG_ERR, "can't fetch template information");
+        lamb_templates_t *templates;
+
+        templates = lamb_templates_new();
+        if (templates) {
+            err = lamb_get_template(&global->db, aid, templates);
+            if (err) {
+                syslog(LOG_ERR, "can't fetch template information");
+                lamb_templates_destroy(templates);
+            } else {
+                templates = __atomic_exchange_n(&global->templates, templates, __ATOMIC_ACQ_REL);
+                lamb_templates_destroy(templates);
+            }
         }
     }
 
     /* fetch keyword information */
     if (global->account.options & (1 << 1)) {
-        global->keywords->free = free;
-        it = lamb_list_iterator_new(global->keywords, LIST_TAIL);
-        while ((node = lamb_list_iterator_next(it))) {
-            lamb_list_remove(global->keywords, node);
-        }
-        err = lamb_keyword_get_all(&global->db, global->keywords);
-        if (err) {
+        lamb_keywords_t *keywords;
+
+        keywords = lamb_keywords_fetch(&global->db);
+        if (keywords) {
+            keywords = __atomic_exchange_n(&global->keywords, keywords, __ATOMIC_ACQ_REL);
+            lamb_keywords_destroy(keywords);
+        } else {
             syslog(LOG_ERR, "can't fetch keyword information");
         }
     }
 
-    int len;
-    char *bye;
-    len = lamb_pack_assembly(&bye, LAMB_BYE, NULL, 0);
-    if (len > 0) {
-        nn_send(scheduler, bye, len, 0);
-        nn_close(scheduler);
-
-        /* connect to scheduler server */
-    recont:
-        scheduler = lamb_nn_pair(config->scheduler, aid, config->timeout);
+    /* Let the scheduler fetch the routing again */
+    int sock;
 
-        if (scheduler < 0) {
-            syslog(LOG_ERR, "can't connect to scheduler %s", config->scheduler);
-            goto recont;
-        }
+    sock = lamb_mux_connect(config->scheduler, config->timeout);
+    if (sock < 0 || lamb_mux_request(sock, LAMB_BYE, aid, NULL, 0) != LAMB_OK) {
+        syslog(LOG_ERR, "can't reload routing from scheduler %s", config->scheduler);
+    }
 
-        free(bye);
+    if (sock >= 0) {
+        lamb_mux_close(sock);
     }
     
     sleeping = false;
@@ -236,75 +265,214 @@ void lamb_reload(int signum) {
     return;
 }
 
-void *lamb_work_loop(void *data) {
-    int err;
-    int rc, len;
-    void *pk;
+/*
+ * Fetch batches from mt and hand them to the filter workers. Credits
+ * are only granted back to mt once a worker has finished the messages,
+ * so the number of messages inside the server is bounded. Jobs finish
+ * in any order, mt is acknowledged up to the last batch whose jobs and
+ * all jobs before it are finished.
+ */
+
+void *lamb_fetch_loop(void *data) {
+    int rc;
+    int total, method;
+    int credit, asked;
+    bool pending;
     char *buf;
-    bool success;
-    lamb_bill_t *bill;
-    lamb_node_t *node;
-    Submit *message;
-    lamb_submit_t *storage;
-    lamb_template_t *template;
-    lamb_keyword_t *keyword;
-    Report resp = REPORT__INIT;
+    char *payload;
+    size_t plen, offset;
+    lamb_job_t *job;
+    lamb_job_t *head, *tail;
+    unsigned long long sequence;
+    unsigned long long processed, acked;
 
-    resp.account = global->account.id;
-    resp.company = global->company.id;
+    credit = LAMB_MAX_BATCH * config->work_threads;
+    asked = 0;
+    pending = false;
+    head = tail = NULL;
+    processed = acked = 0;
 
-    lamb_cpu_affinity(pthread_self());
-    
-    int rlen;
-    char *req;
+    /* What mt had sent to an earlier run is sent again */
+    sequence = 0;
 
-    rlen = lamb_pack_assembly(&req, LAMB_REQ, NULL, 0);
+    while (lamb_mux_request(mt, LAMB_ACK, aid, &sequence, sizeof(sequence)) != LAMB_OK) {
+        syslog(LOG_WARNING, "can't reset the stream of mt %s", config->mt);
+        lamb_sleep(1000);
+    }
 
     while (true) {
-        if (sleeping || arrears) {
-            lamb_sleep(1000);
-            continue;
+        /* Every message granted is still in flight, wait for a worker to finish some */
+        pthread_mutex_lock(&finished);
+        while (!pending && credit + returned < 1) {
+            pthread_cond_wait(&drained, &finished);
+        }
+        credit += returned;
+        returned = 0;
+
+        while (head && head->done) {
+            job = head;
+            head = job->next;
+            if (job->sequence > processed) {
+                processed = job->sequence;
+            }
+            free(job);
         }
 
-        /* Request */
-        rc = nn_send(mt, req, rlen, NN_DONTWAIT);
+        if (!head) {
+            tail = NULL;
+        }
 
-        if (rc != rlen) {
-            lamb_sleep(1000);
+        pthread_mutex_unlock(&finished);
+
+        /* The request socket is free between two fetches */
+        if (!pending && processed > acked) {
+            sequence = htobe64(processed);
+            if (lamb_mux_request(mt, LAMB_ACK, aid, &sequence, sizeof(sequence)) == LAMB_OK) {
+                acked = processed;
+            }
+        }
+
+        if (!pending) {
+            asked = (credit < LAMB_MAX_BATCH) ? credit : LAMB_MAX_BATCH;
+            credit -= asked;
+        }
+
+        rc = lamb_mux_fetch(mt, aid, asked, LAMB_MAX_BYTES, &pending, &buf);
+
+        if (pending) {
             continue;
         }
 
-        /* Response */
-        rc = nn_recv(mt, &buf, NN_MSG, 0);
+        /* The part of the grant that was not used comes back */
+        total = (rc > 0) ? lamb_batch_count(buf, rc) : 0;
+        credit += asked - total;
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
+        if (rc < 1) {
+            if (rc < 0) {
+                lamb_sleep(1000);
             }
             continue;
         }
 
-        if (CHECK_COMMAND(buf) == LAMB_EMPTY) {
-            nn_freemsg(buf);
-            lamb_debug("no available messages\n");
-            lamb_sleep(1000);
+        /* A batch that is not processed must not be acknowledged by a later one */
+        while (!(job = (lamb_job_t *)malloc(sizeof(lamb_job_t)))) {
+            lamb_sleep(10);
+        }
+
+        job->count = 0;
+        job->done = false;
+        job->sequence = 0;
+        job->next = NULL;
+        offset = 0;
+
+        while (job->count < LAMB_MAX_BATCH &&
+               lamb_batch_next(buf, rc, &offset, &method, &payload, &plen) == 0) {
+            if (method == LAMB_ACK && plen == sizeof(sequence)) {
+                memcpy(&sequence, payload, sizeof(sequence));
+                job->sequence = be64toh(sequence);
+                continue;
+            }
+
+            if (method != LAMB_SUBMIT) {
+                continue;
+            }
+
+            job->messages[job->count] = submit__unpack(NULL, plen, (uint8_t *)payload);
+            if (job->messages[job->count]) {
+                job->count++;
+            }
+        }
+
+        lamb_mux_release(mt, buf);
+
+        /* Records that were not submits are done already */
+        credit += total - job->count;
+
+        if (job->count < 1) {
+            job->done = true;
+        }
+
+        /* Workers only mark a job done, the list is walked by this thread */
+        pthread_mutex_lock(&finished);
+        if (tail) {
+            tail->next = job;
+        } else {
+            head = job;
+        }
+        tail = job;
+        pthread_mutex_unlock(&finished);
+
+        if (job->done) {
             continue;
         }
 
-        if (CHECK_COMMAND(buf) != LAMB_SUBMIT) {
-            nn_freemsg(buf);
+        while (lamb_queue_push(jobs, job) != 0) {
+            lamb_sleep(10);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+void *lamb_work_loop(void *data) {
+    int err;
+    int rc;
+    int id;
+    bool success;
+    Submit *message;
+    lamb_submit_t *storage;
+    Report resp = REPORT__INIT;
+
+    resp.account = global->account.id;
+    resp.company = global->company.id;
+
+    lamb_cpu_affinity(pthread_self());
+
+    /* Each worker has its own scheduler connection */
+    id = (int)(intptr_t)data;
+
+    int policy;
+    int next = 0;
+    lamb_job_t *job = NULL;
+    int verdicts[LAMB_MAX_BATCH];
+
+    while (true) {
+        if (sleeping || arrears) {
+            lamb_sleep(1000);
             continue;
         }
 
-        message = submit__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
+        /* Take the next job once the current one is drained */
+        if (!job || next >= job->count) {
+            /* The fetch loop frees the job once mt is acknowledged */
+            if (job) {
+                pthread_mutex_lock(&finished);
+                returned += job->count;
+                job->done = true;
+                pthread_cond_signal(&drained);
+                pthread_mutex_unlock(&finished);
+                job = NULL;
+            }
+
+            if (lamb_queue_wait(jobs, 100) != 0) {
+                continue;
+            }
+
+            job = (lamb_job_t *)lamb_queue_pop(jobs);
+            if (!job) {
+                continue;
+            }
 
-        if (!message) {
-            nn_freemsg(buf);
+            lamb_check_policy(job->messages, job->count, verdicts);
+            next = 0;
             continue;
         }
 
-        nn_freemsg(buf);
-        status->toal++;
+        message = job->messages[next];
+        policy = verdicts[next];
+        next++;
+
+        STAT_INC(status->toal);
 
         /* Message Encoded Convert */
         char *content;
@@ -319,42 +487,37 @@ void *lamb_work_loop(void *data) {
         } else if (message->msgfmt == 15) {
             fromcode = "GBK";
         } else {
-            status->fmt++;
-            lamb_direct_response(mo, &resp, message, 7);
+            STAT_INC(status->fmt);
+            lamb_direct_response(&resp, message, 7);
             goto done;
         }
 
         /* Check global blacklist */
-        if (global->account.options & (1 << 4)) {
-            if (lamb_check_blacklist(blacklist, message->phone)) {
-                status->blk++;
-                lamb_direct_response(mo, &resp, message, 7);
-                goto done;
-            }
+        if (policy & LAMB_POLICY_BLACKLIST) {
+            STAT_INC(status->blk);
+            lamb_direct_response(&resp, message, 7);
+            goto done;
         }
+
         /* Check user unsubscribe */
-        if (global->account.options & (1 << 3)) {
-            if (lamb_check_unsubscribe(unsubscribe, aid, message->phone)) {
-                status->usb++;
-                lamb_direct_response(mo, &resp, message, 7);
-                goto done;
-            }
+        if (policy & LAMB_POLICY_UNSUBSCRIBE) {
+            STAT_INC(status->usb);
+            lamb_direct_response(&resp, message, 7);
+            goto done;
         }
 
         /* Check limit frequency */
-        if (global->account.options & (1 << 2)) {
-            if (lamb_check_frequency(frequency, aid, message->phone)) {
-                status->limt++;
-                lamb_direct_response(mo, &resp, message, 7);
-                goto done;
-            }
+        if (policy & LAMB_POLICY_FREQUENCY) {
+            STAT_INC(status->limt);
+            lamb_direct_response(&resp, message, 7);
+            goto done;
         }
 
         if (fromcode != NULL) {
             content = (char *)malloc(512);
 
             if (!content) {
-                lamb_direct_response(mo, &resp, message, 4);
+                lamb_direct_response(&resp, message, 4);
                 goto done;
             }
 
@@ -362,9 +525,9 @@ void *lamb_work_loop(void *data) {
             err = lamb_encoded_convert((char *)message->content.data, message->length, content,
                                        512, fromcode, "UTF-8", &message->length);
             if (err || (message->length < 1)) {
-                status->fmt++;
+                STAT_INC(status->fmt);
                 free(content);
-                lamb_direct_response(mo, &resp, message, 4);
+                lamb_direct_response(&resp, message, 4);
                 goto done;
             }
 
@@ -376,116 +539,78 @@ void *lamb_work_loop(void *data) {
 
         /* Template Processing */
         if (global->account.options & 1) {
-            success = false;
-            lamb_list_iterator_t *ts;
-            ts = lamb_list_iterator_new(global->templates, LIST_HEAD);
-
-            while ((node = lamb_list_iterator_next(ts))) {
-                template = (lamb_template_t *)node->val;
-                if (lamb_check_content(template, (char *)message->content.data, message->content.len)) {
-                    success = true;
-                    break;
-                }
-            }
+            lamb_templates_t *templates;
+            templates = __atomic_load_n(&global->templates, __ATOMIC_ACQUIRE);
+            success = lamb_templates_match(templates, (char *)message->content.data,
+                                           message->content.len);
 
             if (!success) {
-                status->tmp++;
-                lamb_direct_response(mo, &resp, message, 7);
+                STAT_INC(status->tmp);
+                lamb_direct_response(&resp, message, 7);
                 goto done;
             }
         }
 
         /* Keywords Filtration */
         if (global->account.options & (1 << 1)) {
-            success = true;
-            lamb_list_iterator_t *ks;
-            ks = lamb_list_iterator_new(global->keywords, LIST_HEAD);
-            
-            while ((node = lamb_list_iterator_next(ks))) {
-                keyword = (lamb_keyword_t *)node->val;
-                if (lamb_check_keyword(keyword, (char *)message->content.data)) {
-                    success = false;
-                    break;
-                }
-            }
-               
+            lamb_keywords_t *keywords;
+            keywords = __atomic_load_n(&global->keywords, __ATOMIC_ACQUIRE);
+            success = !lamb_keywords_match(keywords, (char *)message->content.data,
+                                           message->content.len);
+
             if (!success) {
-                status->key++;
-                lamb_direct_response(mo, &resp, message, 7);
+                STAT_INC(status->key);
+                lamb_direct_response(&resp, message, 7);
                 goto done;
             }
         }
 
-        len = submit__get_packed_size(message);
-        pk = malloc(len);
-
-        if (!pk) {
-            lamb_direct_response(mo, &resp, message, 4);
-            goto done;
+        /* Reserve one unit of the leased balance, an empty lease waits for the renewal */
+        while (lamb_billing_spend(global->billing, 1) != 0) {
+            lamb_lease_signal(&starved);
+            lamb_lease_wait(&renewed, 1000);
         }
 
-        char *packet;
-        submit__pack(message, pk);
-        len = lamb_pack_assembly(&packet, LAMB_SUBMIT, pk, len);
-        if (len < 1) {
-            lamb_direct_response(mo, &resp, message, 4);
-            goto done;
+        if (lamb_billing_low(global->billing)) {
+            lamb_lease_signal(&starved);
         }
 
         /* Scheduling */
         while (true) {
-            rc = nn_send(scheduler, packet, len, 0);
-            if (rc != len) {
-                lamb_sleep(1000);
-                continue;
-            }
+            /* The message is packed into a new frame on every attempt */
+            rc = lamb_mux_message(schedulers[id], LAMB_SUBMIT, aid, &message->base);
 
-            rc = nn_recv(scheduler, &buf, NN_MSG, 0);
-            if (rc < HEAD) {
-                if (rc > 0) {
-                    nn_freemsg(buf);
-                }
-                lamb_sleep(1000);
-                continue;
-            }
-
-            if (CHECK_COMMAND(buf) == LAMB_OK) {
-                nn_freemsg(buf);
-                status->sub++;
+            if (rc == LAMB_OK) {
+                STAT_INC(status->sub);
                 break;
-            } else if (CHECK_COMMAND(buf) == LAMB_BUSY) {
+            } else if (rc == LAMB_BUSY) {
                 lamb_debug("-> the scheduler is busy!\n");
-            } else if (CHECK_COMMAND(buf) == LAMB_NOROUTE) {
-                nn_freemsg(buf);
-                lamb_direct_response(mo, &resp, message, 4);
+            } else if (rc == LAMB_NOROUTE) {
+                lamb_billing_refund(global->billing, 1);
+                lamb_direct_response(&resp, message, 4);
                 lamb_debug("-> the scheduler is no route!\n");
                 lamb_sleep(1000);
-                goto done;
-            } else if (CHECK_COMMAND(buf) == LAMB_REJECT) {
-                status->rejt++;
-                nn_freemsg(buf);
-                lamb_direct_response(mo, &resp, message, 7);
+                break;
+            } else if (rc == LAMB_REJECT) {
+                STAT_INC(status->rejt);
+                lamb_billing_refund(global->billing, 1);
+                lamb_direct_response(&resp, message, 7);
                 lamb_debug("-> the scheduler is rejected!\n");
-                goto done;
+                break;
+            } else {
+                lamb_sleep(1000);
+                continue;
             }
 
             lamb_sleep(100);
         }
 
-        free(packet);
-        free(pk);
-
-
-        /* Save message to billing queue */
-        bill = (lamb_bill_t *)malloc(sizeof(lamb_bill_t));
-        if (bill) {
-            bill->id = global->company.id;
-            bill->money = -1;
-            lamb_list_rpush(global->billing, lamb_node_new(bill));
+        if (rc != LAMB_OK) {
+            goto done;
         }
 
         /* Save message to storage queue */
-        storage = (lamb_submit_t *)calloc(1, sizeof(lamb_submit_t));
+        storage = (lamb_submit_t *)lamb_slab_alloc(submit_slab);
         if (storage) {
             storage->type = LAMB_SUBMIT;
             storage->id = message->id;
@@ -497,29 +622,32 @@ void *lamb_work_loop(void *data) {
             storage->msgfmt = message->msgfmt;
             storage->length = message->length;
             memcpy(storage->content, message->content.data, message->content.len);
-            lamb_list_rpush(global->storage, lamb_node_new(storage));
+            while (lamb_ring_push(global->storage, storage) != 0) {
+                lamb_sleep(10);
+            }
         }
 
     done:
         submit__free_unpacked(message, NULL);
     }
 
-    free(req);
     pthread_exit(NULL);
 }
 
 void *lamb_deliver_loop(void *data) {
-    void *pk;
+    int rc;
+    int method;
+    bool pending;
+    char *buf;
+    char *payload;
+    char spcode[21];
+    size_t plen, offset;
     Report *rpack;
     Deliver *dpack;
-    char *req, *buf;
-    char spcode[21];
-    lamb_bill_t *bill;
-    int rc, len, rlen;
 
     Report report = REPORT__INIT;
     Deliver deliver = DELIVER__INIT;
-    rlen = lamb_pack_assembly(&req, LAMB_REQ, NULL, 0);
+    pending = false;
 
     while (true) {
         if (sleeping) {
@@ -527,172 +655,178 @@ void *lamb_deliver_loop(void *data) {
             continue;
         }
 
-        rc = nn_send(deliverd, req, rlen, NN_DONTWAIT);
+        /* An empty queue holds the request until messages arrive */
+        rc = lamb_mux_fetch(deliverd, aid, LAMB_MAX_BATCH, LAMB_MAX_BYTES, &pending, &buf);
 
-        if (rc != rlen) {
-            lamb_sleep(1000);
-            continue;
-        }
-
-        rc = nn_recv(deliverd, &buf, NN_MSG, 0);
-
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
+        if (rc < 1) {
+            if (rc < 0) {
+                lamb_sleep(1000);
             }
-            lamb_sleep(1000);
             continue;
         }
 
-        if (CHECK_COMMAND(buf) == LAMB_EMPTY) {
-            nn_freemsg(buf);
-            lamb_sleep(1000);
-            continue;
-        }
+        offset = 0;
 
-        if (CHECK_COMMAND(buf) == LAMB_REPORT) {
-            status->rep++;
-            rpack = report__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
+        while (lamb_batch_next(buf, rc, &offset, &method, &payload, &plen) == 0) {
+            if (method == LAMB_REPORT) {
+                STAT_INC(status->rep);
+                rpack = report__unpack(lamb_arena(), plen, (uint8_t *)payload);
 
-            if (!rpack) {
-                continue;
-            }
+                if (!rpack) {
+                    continue;
+                }
 
-            if (rpack->status != 1) {
-                bill = (lamb_bill_t *)malloc(sizeof(lamb_bill_t));
-                if (bill) {
-                    bill->id = global->company.id;
-                    bill->money = 1;
-                    lamb_list_rpush(global->billing, lamb_node_new(bill));
+                /* Refund the failed message */
+                if (rpack->status != 1) {
+                    lamb_billing_refund(global->billing, 1);
                 }
-            }
-    
-            report.id = rpack->id;
-            report.account = rpack->account;
-            report.company = rpack->company;
-            report.spcode = rpack->spcode;
-            report.phone = rpack->phone;
-            report.status = rpack->status;
-            report.submittime = rpack->submittime;
-            report.donetime = rpack->donetime;
-            len = report__get_packed_size(&report);
-            pk = malloc(len);
-
-            if (pk) {
-                report__pack(&report, pk);
-                len = lamb_pack_assembly(&buf, LAMB_REPORT, pk, len);
-                if (len > 0) {
-                    nn_send(mo, buf, len, 0);
-                    free(buf);
+
+                report.id = rpack->id;
+                report.account = rpack->account;
+                report.company = rpack->company;
+                report.spcode = rpack->spcode;
+                report.phone = rpack->phone;
+                report.status = rpack->status;
+                report.submittime = rpack->submittime;
+                report.donetime = rpack->donetime;
+                lamb_mo_push(LAMB_REPORT, &report.base);
+
+                /* Store report to database */
+                lamb_report_t *r;
+                r = (lamb_report_t *)lamb_slab_alloc(report_slab);
+
+                if (r) {
+                    r->type = LAMB_REPORT;
+                    r->id = report.id;
+                    r->account = report.account;
+                    r->company = report.company;
+                    strncpy(r->phone, report.phone, 11);
+                    strncpy(r->spcode, report.spcode, 20);
+                    r->status = report.status;
+                    strncpy(r->submittime, report.submittime, 10);
+                    strncpy(r->donetime, report.donetime, 10);
+                    while (lamb_ring_push(global->storage, r) != 0) {
+                        lamb_sleep(10);
+                    }
                 }
-                free(pk);
-            }
 
-            /* Store report to database */
-            lamb_report_t *r;
-            r = (lamb_report_t *)calloc(1, sizeof(lamb_report_t));
-
-            if (r) {
-                r->type = LAMB_REPORT;
-                r->id = report.id;
-                r->account = report.account;
-                r->company = report.company;
-                strncpy(r->phone, report.phone, 11);
-                strncpy(r->spcode, report.spcode, 20);
-                r->status = report.status;
-                strncpy(r->submittime, report.submittime, 10);
-                strncpy(r->donetime, report.donetime, 10);
-                lamb_list_rpush(global->storage, lamb_node_new(r));
+                report__free_unpacked(rpack, lamb_arena());
+                continue;
             }
 
-            report__free_unpacked(rpack, NULL);
-            continue;
-        }
-
-        if (CHECK_COMMAND(buf) == LAMB_DELIVER) {
-            status->delv++;
-            dpack = deliver__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-            nn_freemsg(buf);
+            if (method == LAMB_DELIVER) {
+                STAT_INC(status->delv);
+                dpack = deliver__unpack(lamb_arena(), plen, (uint8_t *)payload);
 
-            if (!dpack) {
-                continue;
-            }
+                if (!dpack) {
+                    continue;
+                }
 
-            deliver.id = dpack->id;
-            deliver.account = global->account.id;
-            deliver.company = global->company.id;
-            deliver.phone = dpack->phone;
-            memset(spcode, 0, sizeof(spcode));
-            snprintf(spcode, sizeof(spcode), "%s%s", global->account.spcode, dpack->serviceid);
-            deliver.spcode = spcode;
-            deliver.msgfmt = dpack->msgfmt;
-            deliver.length = dpack->length;
-            deliver.content.len = dpack->content.len;
-            deliver.content.data = dpack->content.data;
-            len = deliver__get_packed_size(&deliver);
-            pk = malloc(len);
-
-            if (pk) {
-                deliver__pack(&deliver, pk);
-                len = lamb_pack_assembly(&buf, LAMB_DELIVER, pk, len);
-                if (len > 0) {
-                    nn_send(mo, buf, len, 0);
-                    free(buf);
+                deliver.id = dpack->id;
+                deliver.account = global->account.id;
+                deliver.company = global->company.id;
+                deliver.phone = dpack->phone;
+                memset(spcode, 0, sizeof(spcode));
+                snprintf(spcode, sizeof(spcode), "%s%s", global->account.spcode, dpack->serviceid);
+                deliver.spcode = spcode;
+                deliver.msgfmt = dpack->msgfmt;
+                deliver.length = dpack->length;
+                deliver.content.len = dpack->content.len;
+                deliver.content.data = dpack->content.data;
+                lamb_mo_push(LAMB_DELIVER, &deliver.base);
+
+                lamb_deliver_t *d;
+                d = (lamb_deliver_t *)lamb_slab_alloc(deliver_slab);
+
+                if (d) {
+                    d->type = LAMB_DELIVER;
+                    d->id = deliver.id;
+                    d->account = global->account.id;
+                    d->company = global->company.id;
+                    strncpy(d->phone, deliver.phone, 11);
+                    strncpy(d->spcode, deliver.spcode, 20);
+                    strncpy(d->serviceid, deliver.serviceid, 10);
+                    d->msgfmt = deliver.msgfmt;
+                    d->length = deliver.length;
+                    memcpy(d->content, deliver.content.data, deliver.content.len);
+                    while (lamb_ring_push(global->storage, d) != 0) {
+                        lamb_sleep(10);
+                    }
                 }
-                free(pk);
-            }
 
-            lamb_deliver_t *d;
-            d = (lamb_deliver_t *)calloc(1, sizeof(lamb_deliver_t));
-
-            if (d) {
-                d->type = LAMB_DELIVER;
-                d->id = deliver.id;
-                d->account = global->account.id;
-                d->company = global->company.id;
-                strncpy(d->phone, deliver.phone, 11);
-                strncpy(d->spcode, deliver.spcode, 20);
-                strncpy(d->serviceid, deliver.serviceid, 10);
-                d->msgfmt = deliver.msgfmt;
-                d->length = deliver.length;
-                memcpy(d->content, deliver.content.data, deliver.content.len);
-                lamb_list_rpush(global->storage, lamb_node_new(d));  
+                deliver__free_unpacked(dpack, lamb_arena());
             }
-
-            deliver__free_unpacked(dpack, NULL);
-            continue;
         }
 
-        nn_freemsg(buf);
+        lamb_mux_release(deliverd, buf);
     }
 
     pthread_exit(NULL);
 }
 
 void *lamb_store_loop(void *data) {
-    int err;
+    int err, count;
+    size_t n;
     void *message;
     char *fromcode;
     char content[512];
-    lamb_node_t *node;
-    lamb_deliver_t *d;    
+    lamb_deliver_t *d;
+    void **messages, **submits, **reports, **delivers;
+    int nsub, nrep, ndel;
+    unsigned long long deadline;
+
+    messages = (void **)calloc(config->store_batch * 4, sizeof(void *));
+    if (!messages) {
+        syslog(LOG_ERR, "storage batch initialization failed");
+        pthread_exit(NULL);
+    }
+
+    submits = messages + config->store_batch;
+    reports = submits + config->store_batch;
+    delivers = reports + config->store_batch;
 
     while (true) {
-        node = lamb_list_lpop(global->storage);
+        /* Collect up to StoreBatch rows or wait StoreInterval milliseconds */
+        count = 0;
+        deadline = lamb_now_microsecond() + config->store_interval * 1000ULL;
 
-        if (!node) {
-            lamb_sleep(10);
+        while (count < config->store_batch) {
+            n = lamb_ring_pop_bulk(global->storage, messages + count, config->store_batch - count);
+            count += n;
+
+            if (count >= config->store_batch || lamb_now_microsecond() >= deadline) {
+                break;
+            }
+
+            if (n == 0) {
+                lamb_sleep(10);
+            }
+        }
+
+        if (count == 0) {
             continue;
         }
 
-        message = node->val;
+        nsub = nrep = ndel = 0;
+
+        for (int i = 0; i < count; i++) {
+            message = messages[i];
+
+            if (CHECK_TYPE(message) == LAMB_SUBMIT) {
+                submits[nsub++] = message;
+                continue;
+            }
+
+            if (CHECK_TYPE(message) == LAMB_REPORT) {
+                reports[nrep++] = message;
+                continue;
+            }
+
+            if (CHECK_TYPE(message) != LAMB_DELIVER) {
+                lamb_free_message(message);
+                continue;
+            }
 
-        if (CHECK_TYPE(message) == LAMB_SUBMIT) {
-            lamb_write_message(&global->mdb, (lamb_submit_t *)message);
-        } else if (CHECK_TYPE(message) == LAMB_REPORT) {
-            lamb_write_report(&global->mdb, (lamb_report_t *)message);
-        } else if (CHECK_TYPE(message) == LAMB_DELIVER) {
             d = (lamb_deliver_t *)message;
             switch (d->msgfmt) {
             case 0:
@@ -712,62 +846,190 @@ void *lamb_store_loop(void *data) {
                 break;
             }
 
-            if (fromcode != NULL) {
-                if (d->msgfmt != 11) {
-                    /* message coding conversion */
-                    memset(content, 0, sizeof(content));
-                    err = lamb_encoded_convert(d->content, d->length, content, sizeof(content),
-                                               fromcode, "UTF-8", &d->length);
-                    if (err || (d->length < 1)) {
-                        goto skip;
-                    }
+            if (fromcode == NULL) {
+                lamb_free_message(message);
+                continue;
+            }
 
-                    memset(d->content, 0, 160);
-                    memcpy(d->content, content, d->length);
+            if (d->msgfmt != 11) {
+                /* message coding conversion */
+                memset(content, 0, sizeof(content));
+                err = lamb_encoded_convert(d->content, d->length, content, sizeof(content),
+                                           fromcode, "UTF-8", &d->length);
+                if (err || (d->length < 1)) {
+                    lamb_free_message(message);
+                    continue;
                 }
 
-                /* check unsubscribe content */
-                if (global->account.options & (1 << 3)) {
-                    if (lamb_check_unsubval(d->content, d->length)) {
-                        lamb_list_rpush(global->unsubscribe, lamb_node_new(lamb_strdup(d->phone)));
-                    }
+                memset(d->content, 0, 160);
+                memcpy(d->content, content, d->length);
+            }
+
+            /* check unsubscribe content */
+            if (global->account.options & (1 << 3)) {
+                if (lamb_check_unsubval(d->content, d->length)) {
+                    lamb_list_rpush(global->unsubscribe, lamb_node_new(lamb_strdup(d->phone)));
                 }
-                /* save to message database */
-                lamb_write_deliver(&global->mdb, d);
             }
+
+            delivers[ndel++] = message;
         }
 
-    skip:
-        free(node);
-        free(message);
+        /* Submits first, so that the reports of this batch find their rows */
+        lamb_store_write(&global->mdb, LAMB_SUBMIT, submits, nsub);
+        lamb_store_write(&global->mdb, LAMB_REPORT, reports, nrep);
+        lamb_store_write(&global->mdb, LAMB_DELIVER, delivers, ndel);
+
+        for (int i = 0; i < nsub; i++) {
+            lamb_free_message(submits[i]);
+        }
+
+        for (int i = 0; i < nrep; i++) {
+            lamb_free_message(reports[i]);
+        }
+
+        for (int i = 0; i < ndel; i++) {
+            lamb_free_message(delivers[i]);
+        }
     }
 
+    free(messages);
     pthread_exit(NULL);
 }
 
+void lamb_free_message(void *message) {
+    switch (CHECK_TYPE(message)) {
+    case LAMB_SUBMIT:
+        lamb_slab_free(submit_slab, message);
+        break;
+    case LAMB_REPORT:
+        lamb_slab_free(report_slab, message);
+        break;
+    case LAMB_DELIVER:
+        lamb_slab_free(deliver_slab, message);
+        break;
+    default:
+        free(message);
+        break;
+    }
+
+    return;
+}
+
 void *lamb_billing_loop(void *data) {
-    int err;
-    lamb_bill_t *bill;
-    lamb_node_t *node;
-    
+    bool empty;
+    unsigned long long deadline = 0;
+
     while (true) {
-        node = lamb_list_lpop(global->billing);
+        /* Renew as soon as the lease runs low, in arrears every BillingInterval */
+        if ((sleeping || arrears || !lamb_billing_low(global->billing)) &&
+            lamb_now_microsecond() < deadline) {
+            lamb_lease_wait(&starved, (deadline - lamb_now_microsecond()) / 1000 + 1);
+            continue;
+        }
 
-        if (!node) {
-            lamb_sleep(10);
+        deadline = lamb_now_microsecond() + config->billing_interval * 1000ULL;
+
+        if (sleeping) {
             continue;
         }
 
-        bill = (lamb_bill_t *)node->val;
-        pthread_mutex_lock(&(global->rdb.lock));
-        err = lamb_company_billing(&global->rdb, bill->id, bill->money);
-        pthread_mutex_unlock(&(global->rdb.lock));
-        if (err) {
-            syslog(LOG_ERR, "Account %d billing money %d failure", bill->id, bill->money);
+        if (lamb_billing_renew(global->billing, &global->brdb, global->company.id) != 0) {
+            syslog(LOG_ERR, "company %d balance lease failure", global->company.id);
         }
 
-        free(bill);
-        free(node);
+        empty = lamb_billing_credit(global->billing) < 1;
+
+        if (empty && !arrears) {
+            syslog(LOG_WARNING, "company %d arrears, service has been temporarily stopped",
+                   global->company.id);
+        }
+
+        arrears = empty;
+
+        /* Workers blocked on an empty lease try again */
+        lamb_lease_signal(&renewed);
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Wait on one of the lease conditions for at most milliseconds */
+void lamb_lease_wait(pthread_cond_t *cond, long milliseconds) {
+    struct timespec timeout;
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += milliseconds / 1000;
+    timeout.tv_nsec += (milliseconds % 1000) * 1000000L;
+    timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+    timeout.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&lease);
+    pthread_cond_timedwait(cond, &lease, &timeout);
+    pthread_mutex_unlock(&lease);
+
+    return;
+}
+
+void lamb_lease_signal(pthread_cond_t *cond) {
+    pthread_mutex_lock(&lease);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&lease);
+
+    return;
+}
+
+/* INCR and set the lifetime of a new counter in one round trip */
+#define LAMB_FREQUENCY_SCRIPT "local n = redis.call('INCR', KEYS[1]) " \
+    "if n == 1 then redis.call('EXPIRE', KEYS[1], ARGV[1]) end return n"
+
+/*
+ * Share the local frequency counts with the other processes. Every send
+ * accepted locally is counted in redis once a second, and the totals
+ * returned are merged back so that sends made elsewhere count here too.
+ */
+
+void *lamb_frequency_loop(void *data) {
+    int n, m, len;
+    time_t now;
+    void *vals[LAMB_MAX_BATCH];
+    int lens[LAMB_MAX_BATCH];
+    char *cmds[LAMB_MAX_BATCH];
+    unsigned long keys[LAMB_MAX_BATCH];
+    long long results[LAMB_MAX_BATCH];
+
+    while (true) {
+        n = lamb_ring_pop_bulk(journal, vals, LAMB_MAX_BATCH);
+
+        if (n == 0) {
+            lamb_sleep(1000);
+            continue;
+        }
+
+        m = 0;
+
+        /* A phone whose command can't be formatted is left out of the round */
+        for (int i = 0; i < n; i++) {
+            keys[m] = (unsigned long)(uintptr_t)vals[i];
+            cmds[m] = NULL;
+            len = redisFormatCommand(&cmds[m], "EVAL %s 1 %d.%lu %d", LAMB_FREQUENCY_SCRIPT,
+                                     aid, keys[m], config->frequency_window);
+            if (len < 1 || !cmds[m]) {
+                continue;
+            }
+            lens[m++] = len;
+        }
+
+        lamb_nodes_pipeline(frequency, m, keys, cmds, lens, results);
+
+        now = time(NULL);
+
+        for (int i = 0; i < m; i++) {
+            if (results[i] > 0) {
+                lamb_limiter_merge(limiter, keys[i], results[i], now);
+            }
+            free(cmds[i]);
+        }
     }
 
     pthread_exit(NULL);
@@ -813,25 +1075,19 @@ void *lamb_unsubscribe_loop(void *arg) {
 
 void *lamb_stat_loop(void *data) {
     int signal;
+    lamb_bitmap_t *map;
 
     while (true) {
-        /* Check the arrears */
-        arrears = lamb_check_arrears(&global->rdb, global->account.company);
-
-        if (arrears) {
-            syslog(LOG_WARNING, "company %d arrears, service has been temporarily stopped",
-                     global->account.company);
-        }
-
         pthread_mutex_lock(&global->rdb.lock);
-        lamb_sync_status(&global->rdb, aid, status, global->storage->len, global->billing->len);
+        lamb_sync_status(&global->rdb, aid, status, lamb_ring_len(global->storage),
+                         lamb_billing_credit(global->billing));
         pthread_mutex_unlock(&global->rdb.lock);
         
 #ifdef _DEBUG
         /* Debug information */
-        printf("store: %u, bill: %u, toal: %lld, sub: %llu, rep: %llu, delv: %llu, "
+        printf("store: %zu, bill: %lld, toal: %lld, sub: %llu, rep: %llu, delv: %llu, "
                "fmt: %llu, blk: %llu, tmp: %llu, key: %llu, usb: %llu, limt: %llu, rejt: %llu\n",
-               global->storage->len, global->billing->len, status->toal, status->sub,
+               lamb_ring_len(global->storage), lamb_billing_credit(global->billing), status->toal, status->sub,
                status->rep, status->delv, status->fmt, status->blk, status->tmp,
                status->key, status->usb, status->limt, status->rejt);
 #endif
@@ -839,6 +1095,15 @@ void *lamb_stat_loop(void *data) {
         pthread_mutex_lock(&global->rdb.lock);
         signal = lamb_check_signal(&global->rdb, aid);
         pthread_mutex_unlock(&global->rdb.lock);
+
+        /* The daemon may create the bitmap after startup, redis serves until then */
+        if (!__atomic_load_n(&bitmap, __ATOMIC_ACQUIRE)) {
+            map = lamb_bitmap_open(config->blacklist, false);
+            if (map) {
+                __atomic_store_n(&bitmap, map, __ATOMIC_RELEASE);
+                syslog(LOG_INFO, "blacklist bitmap %s opened, redis lookups stopped", config->blacklist);
+            }
+        }
         if (!sleeping) {
             switch (signal) {
             case 1:
@@ -858,98 +1123,6 @@ void *lamb_stat_loop(void *data) {
     pthread_exit(NULL);
 }
 
-int lamb_write_report(lamb_db_t *db, lamb_report_t *message) {
-    char sql[512];
-    PGresult *res = NULL;
-
-    if (!message) {
-        return -1;
-    }
-
-    snprintf(sql, sizeof(sql), "UPDATE message SET status = %d WHERE id = %lld",
-             message->status, (long long)message->id);
-
-    res = PQexec(db->conn, sql);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        PQclear(res);
-        return -1;
-    }
-
-    PQclear(res);
-
-    return 0;
-}
-
-int lamb_write_message(lamb_db_t *db, lamb_submit_t *message) {
-    char *column;
-    char sql[512];
-    PGresult *res = NULL;
-
-    if (!message) {
-        return -1;
-    }
-
-    column = "id, spid, spcode, phone, content, status, account, company";
-    snprintf(sql, sizeof(sql), "INSERT INTO message(%s) VALUES(%lld, '%s', '%s', '%s', '%s', %d, %d, %d)",
-             column, (long long int)message->id, message->spid, message->spcode, message->phone,
-             message->content, 0, message->account, message->company);
-
-    res = PQexec(db->conn, sql);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        PQclear(res);
-        return -1;
-    }
-
-    PQclear(res);
-
-    return 0;
-}
-
-int lamb_write_deliver(lamb_db_t *db, lamb_deliver_t *message) {
-    char *column;
-    char sql[512];
-    PGresult *res = NULL;
-
-    if (!message) {
-        return -1;
-    }
-
-    column = "id, spcode, phone, content, account, company";
-    snprintf(sql, sizeof(sql), "INSERT INTO delivery(%s) VALUES(%lld, '%s', '%s', '%s', %d, %d)",
-             column, (long long int)message->id, message->spcode, message->phone,
-             message->content, message->account, message->company);
-
-    res = PQexec(db->conn, sql);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        PQclear(res);
-        return -1;
-    }
-
-    PQclear(res);
-
-    return 0;
-}
-
-bool lamb_check_content(lamb_template_t *template, char *content, int len) {
-    char pattern[512];
-
-    memset(pattern, 0, sizeof(pattern));
-    snprintf(pattern, sizeof(pattern), "^【%s】%s$", template->name, template->content);
-    if (lamb_pcre_regular(pattern, content, len)) {
-        return true;
-    }
-
-    return false;
-}
-
-bool lamb_check_keyword(lamb_keyword_t *key, char *content) {
-    if (strstr(content, key->val)) {
-        return true;
-    }
-
-    return false;
-}
-
 bool lamb_check_unsubval(char *content, int len) {
     if (strstr(content, "t")) {
         return true;
@@ -968,132 +1141,125 @@ bool lamb_check_unsubval(char *content, int len) {
     return false;
 }
 
-bool lamb_check_blacklist(lamb_caches_t *cache, char *number) {
-    int i = -1;
-    bool r = false;
-    unsigned long phone;
-    redisReply *reply = NULL;
+/*
+ * Resolve the blacklist, unsubscribe and frequency checks of a batch.
+ * Redis lookups are pipelined per shard, one round trip for each check
+ * instead of one per message. As with the single message checks, only
+ * messages that pass the blacklist and unsubscribe checks are counted
+ * against the frequency limit.
+ */
 
-    phone = atol(number);
+void lamb_check_policy(Submit **messages, int count, int *verdicts) {
+    int options;
+    lamb_bitmap_t *map;
+    unsigned long phones[LAMB_MAX_BATCH];
 
-    if (phone > 0) {
-        i = (phone % cache->len);
-    }
+    options = global->account.options;
 
-    if (i < 0) {
-        return r;
-    }
+    for (int i = 0; i < count; i++) {
+        verdicts[i] = 0;
+        phones[i] = strtoul(messages[i]->phone, NULL, 10);
 
-    pthread_mutex_lock(&cache->nodes[i]->lock);
-    reply = redisCommand(cache->nodes[i]->handle, "EXISTS %lu", phone);
-    pthread_mutex_unlock(&cache->nodes[i]->lock);
+        /* Rejected by the format check before any policy applies */
+        switch (messages[i]->msgfmt) {
+        case 0:
+        case 8:
+        case 11:
+        case 15:
+            break;
+        default:
+            verdicts[i] = LAMB_POLICY_SKIP;
+            break;
+        }
+    }
 
-    if (reply != NULL) {
-        if (reply->type == REDIS_REPLY_INTEGER) {
-            if (reply->integer == 1) {
-                r = true;
+    if (options & (1 << 4)) {
+        map = __atomic_load_n(&bitmap, __ATOMIC_ACQUIRE);
+        if (map) {
+            for (int i = 0; i < count; i++) {
+                if (!verdicts[i] && lamb_bitmap_test(map, phones[i])) {
+                    verdicts[i] |= LAMB_POLICY_BLACKLIST;
+                }
             }
+        } else {
+            lamb_policy_stage(blacklist, LAMB_POLICY_BLACKLIST, phones, count, verdicts);
         }
-        freeReplyObject(reply);
     }
 
-    return r;
-}
-
-bool lamb_check_unsubscribe(lamb_caches_t *cache, int id, char *number) {
-    int i = -1;
-    bool r = false;
-    unsigned long phone;
-    redisReply *reply = NULL;
-
-    phone = atol(number);
-
-    if (phone > 0) {
-        i = (phone % cache->len);
+    if (options & (1 << 3)) {
+        lamb_policy_stage(unsubscribe, LAMB_POLICY_UNSUBSCRIBE, phones, count, verdicts);
     }
 
-    if (i < 0) {
-        return r;
-    }
+    /* Frequency is counted locally, other processes are merged in by the sync loop */
+    if (options & (1 << 2)) {
+        time_t now = time(NULL);
 
-    pthread_mutex_lock(&cache->nodes[i]->lock);
-    reply = redisCommand(cache->nodes[i]->handle, "EXISTS %d.%lu", id, phone);
-    pthread_mutex_unlock(&cache->nodes[i]->lock);
+        for (int i = 0; i < count; i++) {
+            if (verdicts[i] || phones[i] == 0) {
+                continue;
+            }
 
-    if (reply != NULL) {
-        if (reply->type == REDIS_REPLY_INTEGER) {
-            if (reply->integer == 1) {
-                r = true;
+            if (!lamb_limiter_hit(limiter, phones[i], now)) {
+                verdicts[i] |= LAMB_POLICY_FREQUENCY;
+            } else if (journal) {
+                lamb_ring_push(journal, (void *)(uintptr_t)phones[i]);
             }
         }
-        freeReplyObject(reply);
     }
 
-    return r;
-}
-
-bool lamb_check_frequency(lamb_caches_t *cache, int id, char *number) {
-    int i = -1;
-    bool r = false;
-    unsigned long phone;
-    redisReply *reply = NULL;
+    for (int i = 0; i < count; i++) {
+        verdicts[i] &= ~LAMB_POLICY_SKIP;
+    }
 
-    phone = atol(number);
+    return;
+}
 
-    if (phone > 0) {
-        i = (phone % cache->len);
-    }
+void lamb_policy_stage(lamb_caches_t *cache, int type, unsigned long *phones, int count,
+                       int *verdicts) {
+    int n, len;
+    int index[LAMB_MAX_BATCH];
+    int lens[LAMB_MAX_BATCH];
+    char *cmds[LAMB_MAX_BATCH];
+    unsigned long keys[LAMB_MAX_BATCH];
+    long long results[LAMB_MAX_BATCH];
 
-    if (i < 0) {
-        return r;
-    }
+    n = 0;
 
-    pthread_mutex_lock(&cache->nodes[i]->lock);
-    reply = redisCommand(cache->nodes[i]->handle, "INCRBY %d.%lu 1", id, phone);
-    pthread_mutex_unlock(&cache->nodes[i]->lock);
+    for (int i = 0; i < count; i++) {
+        if (verdicts[i] || phones[i] == 0) {
+            continue;
+        }
 
-    if (reply != NULL) {
-        if (reply->type == REDIS_REPLY_INTEGER) {
-            if (reply->integer == 1) {
-                freeReplyObject(reply);
-                pthread_mutex_lock(&cache->nodes[i]->lock);
-                reply = redisCommand(cache->nodes[i]->handle, "EXPIRE %d.%lu %d", id, phone, MAX_LIFETIME);
-                pthread_mutex_unlock(&cache->nodes[i]->lock);
-            } else if (reply->integer > LAMB_LIMIT) {
-                r = true;
-            }
+        if (type == LAMB_POLICY_BLACKLIST) {
+            len = redisFormatCommand(&cmds[n], "EXISTS %lu", phones[i]);
+        } else {
+            len = redisFormatCommand(&cmds[n], "EXISTS %d.%lu", aid, phones[i]);
         }
-        freeReplyObject(reply);
-    }
 
-    return r;
-}
+        if (len < 1) {
+            continue;
+        }
 
-bool lamb_check_arrears(lamb_cache_t *rdb, int company) {
-    bool arrear = true;
-    redisReply *reply = NULL;
+        lens[n] = len;
+        keys[n] = phones[i];
+        index[n] = i;
+        n++;
+    }
 
-    pthread_mutex_lock(&rdb->lock);
-    reply = redisCommand(rdb->handle, "HGET company.%d money", company);
-    pthread_mutex_unlock(&rdb->lock);
+    lamb_nodes_pipeline(cache, n, keys, cmds, lens, results);
 
-    if (reply != NULL) {
-        if (reply->type == REDIS_REPLY_STRING && reply->len > 0) {
-            if (atoi(reply->str) > 0) {
-                arrear = false;
-            }
+    for (int i = 0; i < n; i++) {
+        if (results[i] == 1) {
+            verdicts[index[i]] |= type;
         }
-        freeReplyObject(reply);
+
+        free(cmds[i]);
     }
 
-    return arrear;
+    return;
 }
 
-void lamb_direct_response(int sock, Report *resp, Submit *message, int cause) {
-    int len;
-    void *pk;
-    char *buf;
-
+void lamb_direct_response(Report *resp, Submit *message, int cause) {
     resp->id = message->id;
     resp->phone = message->phone;
     resp->spcode = message->spcode;
@@ -1101,20 +1267,25 @@ void lamb_direct_response(int sock, Report *resp, Submit *message, int cause) {
     resp->submittime = "";
     resp->donetime = "";
 
-    len = report__get_packed_size(resp);
-    pk = malloc(len);
+    lamb_mo_push(LAMB_REPORT, &resp->base);
 
-    if (pk) {
-        report__pack(resp, pk);
-        len = lamb_pack_assembly(&buf, LAMB_REPORT, pk, len);
-        if (len > 0) {
-            nn_send(sock, buf, len, NN_DONTWAIT);
-            free(buf);
-        }
-        free(pk);
+    return;
+}
+
+/* Push a report or deliver to mo, shared by the workers and the deliver loop */
+int lamb_mo_push(int method, const ProtobufCMessage *message) {
+    int rc;
+
+    pthread_mutex_lock(&mlock);
+
+    /* Queue is full, wait for the client to drain it */
+    while ((rc = lamb_mux_message(mo, method, aid, message)) == LAMB_BUSY) {
+        lamb_sleep(10);
     }
 
-    return;
+    pthread_mutex_unlock(&mlock);
+
+    return (rc == LAMB_OK) ? 0 : -1;
 }
 
 void lamb_sync_status(lamb_cache_t *cache, int id, lamb_status_t *stat, int store, int bill) {
@@ -1133,11 +1304,16 @@ void lamb_sync_status(lamb_cache_t *cache, int id, lamb_status_t *stat, int stor
 }
 
 void lamb_exit_cleanup(void) {
-    lamb_nn_close(mt);
-    lamb_nn_close(mo);
-    lamb_nn_close(scheduler);
-    lamb_nn_close(deliverd);
+    lamb_mux_close(mt);
+    lamb_mux_close(mo);
+    for (int i = 0; i < config->work_threads; i++) {
+        lamb_mux_close(schedulers[i]);
+    }
+    lamb_mux_close(deliverd);
     lamb_db_close(&global->db);
+    lamb_billing_release(global->billing, &global->brdb);
+    lamb_billing_close(global->billing);
+    lamb_cache_close(&global->brdb);
     lamb_cache_close(&global->rdb);
     lamb_lock_release(&lock);
     exit(EXIT_SUCCESS);
@@ -1168,22 +1344,33 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     }
 
     /* Storage Queue Initialization */
-    global->storage = lamb_list_new();
+    global->storage = lamb_ring_new(LAMB_STORAGE_SIZE);
     if (!global->storage) {
         syslog(LOG_ERR, "storage queue initialization failed");
         return -1;
     }
 
     lamb_debug("storage queue initialization successfull\n");
+
+    submit_slab = lamb_slab_new(sizeof(lamb_submit_t));
+    report_slab = lamb_slab_new(sizeof(lamb_report_t));
+    deliver_slab = lamb_slab_new(sizeof(lamb_deliver_t));
+    if (!submit_slab || !report_slab || !deliver_slab) {
+        syslog(LOG_ERR, "message slab initialization failed");
+        return -1;
+    }
     
-    /* Billing Queue Initialization */
-    global->billing = lamb_list_new();
+    /* Billing intent log initialization */
+    char file[192];
+    snprintf(file, sizeof(file), "%s.%d", cfg->billing_log, aid);
+
+    global->billing = lamb_billing_open(file, aid, cfg->billing_lease);
     if (!global->billing) {
-        syslog(LOG_ERR, "billing queue initialization failed");
+        syslog(LOG_ERR, "can't open billing intent log %s", file);
         return -1;
     }
 
-    lamb_debug("billing queue initialization successfull\n");
+    lamb_debug("billing intent log initialization successfull\n");
 
     /* Unsubscribe queue initialization */
     global->unsubscribe = lamb_list_new();
@@ -1204,6 +1391,14 @@ int lamb_component_initialization(lamb_config_t *cfg) {
 
     lamb_debug("connect to redis server %s successfull\n", cfg->redis_host);
 
+    /* Billing has its own connection, away from the status polling */
+    err = lamb_cache_connect(&global->brdb, cfg->redis_host, cfg->redis_port,
+                             NULL, cfg->redis_db);
+    if (err) {
+        syslog(LOG_ERR, "Can't connect to redis server");
+        return -1;
+    }
+
     /* Blacklist database initialization */
     lamb_nodes_connect(blacklist, LAMB_MAX_CACHE, cfg->nodes, 7, 1);
     if (blacklist->len != 7) {
@@ -1213,6 +1408,12 @@ int lamb_component_initialization(lamb_config_t *cfg) {
 
     lamb_debug("connect to blacklist database successfull\n");
 
+    /* Local blacklist bitmap, maintained by the lamb daemon */
+    bitmap = lamb_bitmap_open(cfg->blacklist, false);
+    if (!bitmap) {
+        syslog(LOG_WARNING, "can't open blacklist bitmap %s, using redis lookups until it can be opened", cfg->blacklist);
+    }
+
     lamb_nodes_connect(unsubscribe, LAMB_MAX_CACHE, cfg->nodes, 7, 2);
     if (unsubscribe->len != 7) {
         syslog(LOG_ERR, "connect to unsubscribe database failed");
@@ -1221,13 +1422,29 @@ int lamb_component_initialization(lamb_config_t *cfg) {
 
     lamb_debug("connect to unsubscribe database successfull\n");
 
-    lamb_nodes_connect(frequency, LAMB_MAX_CACHE, cfg->nodes, 7, 3);
-    if (frequency->len != 7) {
-        syslog(LOG_ERR, "connect to frequency database failed %d", frequency->len);
+    /* Local frequency limiter */
+    limiter = lamb_limiter_new(cfg->frequency_capacity, cfg->frequency_limit, cfg->frequency_window);
+    if (!limiter) {
+        syslog(LOG_ERR, "frequency limiter initialization failed");
         return -1;
     }
 
-    lamb_debug("connect to frequency database successfull\n");
+    /* Redis only carries the counts shared with other processes */
+    if (cfg->frequency_sync) {
+        lamb_nodes_connect(frequency, LAMB_MAX_CACHE, cfg->nodes, 7, 3);
+        if (frequency->len != 7) {
+            syslog(LOG_ERR, "connect to frequency database failed %d", frequency->len);
+            return -1;
+        }
+
+        journal = lamb_ring_new(LAMB_STORAGE_SIZE);
+        if (!journal) {
+            syslog(LOG_ERR, "frequency journal initialization failed");
+            return -1;
+        }
+
+        lamb_debug("connect to frequency database successfull\n");
+    }
 
     /* Postgresql Database  */
     err = lamb_db_init(&global->db);
@@ -1269,7 +1486,7 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     lamb_debug("fetch account information successfull\n");
 
     /* Connect to MT server */
-    mt = lamb_nn_reqrep(config->mt, aid, cfg->timeout);
+    mt = lamb_mux_connect(cfg->mt, cfg->timeout);
 
     if (mt < 0) {
         syslog(LOG_ERR, "can't connect to MT %s", cfg->mt);
@@ -1279,7 +1496,7 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     lamb_debug("connect to mt %s successfull\n", cfg->mt);
     
     /* Connect to MO server */
-    mo = lamb_nn_pair(cfg->mo, aid, cfg->timeout);
+    mo = lamb_mux_connect(cfg->mo, cfg->timeout);
 
     if (mo < 0) {
         syslog(LOG_ERR, "can't connect to MO %s", cfg->mo);
@@ -1288,18 +1505,33 @@ int lamb_component_initialization(lamb_config_t *cfg) {
 
     lamb_debug("connect to mo %s successfull\n", cfg->mo);
 
-    /* Connect to Scheduler server */
-    scheduler = lamb_nn_pair(cfg->scheduler, aid, cfg->timeout);
+    /* Connect to Scheduler server, one connection per worker */
+    schedulers = (int *)calloc(cfg->work_threads, sizeof(int));
+    if (!schedulers) {
+        syslog(LOG_ERR, "The kernel can't allocate memory");
+        return -1;
+    }
+
+    for (int i = 0; i < cfg->work_threads; i++) {
+        schedulers[i] = lamb_mux_connect(cfg->scheduler, cfg->timeout);
 
-    if (scheduler < 0) {
-        syslog(LOG_ERR, "can't connect to scheduler %s", cfg->scheduler);
+        if (schedulers[i] < 0) {
+            syslog(LOG_ERR, "can't connect to scheduler %s", cfg->scheduler);
+            return -1;
+        }
+    }
+
+    /* Filter job queue */
+    jobs = lamb_queue_new(aid);
+    if (!jobs) {
+        syslog(LOG_ERR, "job queue initialization failed");
         return -1;
     }
 
     lamb_debug("connect to scheduler %s successfull\n", cfg->scheduler);
     
     /* Connect to Deliver server */
-    deliverd = lamb_nn_reqrep(cfg->deliver, aid, cfg->timeout);
+    deliverd = lamb_mux_connect(cfg->deliver, cfg->timeout);
 
     if (deliverd < 0) {
         syslog(LOG_ERR, "can't connect to deliver %s", cfg->deliver);
@@ -1318,7 +1550,7 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     lamb_debug("fetch company information successfull\n");
     
     /* Template information Initialization */
-    global->templates = lamb_list_new();
+    global->templates = lamb_templates_new();
     if (!global->templates) {
         syslog(LOG_ERR, "template queue initialization failed");
         return -1;
@@ -1334,15 +1566,11 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     }
 
     /* Keyword information Initialization */
-    global->keywords = lamb_list_new();
-    if (!global->keywords) {
-        syslog(LOG_ERR, "keyword queue initialization failed");
-        return -1;
-    }
+    global->keywords = NULL;
 
     if (global->account.options & (1 << 1)) {
-        err = lamb_keyword_get_all(&global->db, global->keywords);
-        if (err) {
+        global->keywords = lamb_keywords_fetch(&global->db);
+        if (!global->keywords) {
             syslog(LOG_ERR, "Can't fetch keyword information");
             return -1;
         }
@@ -1414,6 +1642,12 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         fprintf(stderr, "Can't read config 'WorkThreads' parameter\n");
         goto error;
     }
+
+    /* Check work threads validity */
+    if (conf->work_threads < 1 || conf->work_threads > LAMB_MAX_WORKER) {
+        fprintf(stderr, "Invalid work threads number\n");
+        goto error;
+    }
     
     if (lamb_get_string(&cfg, "LogFile", conf->logfile, 128) != 0) {
         fprintf(stderr, "Can't read config 'LogFile' parameter\n");
@@ -1530,6 +1764,74 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    if (lamb_get_string(&cfg, "Blacklist", conf->blacklist, 128) != 0) {
+        fprintf(stderr, "Can't read config 'Blacklist' parameter\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "StoreBatch", &conf->store_batch) != 0) {
+        fprintf(stderr, "Can't read config 'StoreBatch' parameter\n");
+        goto error;
+    }
+
+    /* Check storage batch validity */
+    if (conf->store_batch < 1 || conf->store_batch > LAMB_STORE_BATCH) {
+        fprintf(stderr, "Invalid storage batch size\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "StoreInterval", &conf->store_interval) != 0) {
+        fprintf(stderr, "Can't read config 'StoreInterval' parameter\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "FrequencyLimit", &conf->frequency_limit) != 0) {
+        fprintf(stderr, "Can't read config 'FrequencyLimit' parameter\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "FrequencyWindow", &conf->frequency_window) != 0) {
+        fprintf(stderr, "Can't read config 'FrequencyWindow' parameter\n");
+        goto error;
+    }
+
+    /* Check frequency window validity */
+    if (conf->frequency_window < 1) {
+        fprintf(stderr, "Invalid frequency window\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "FrequencyCapacity", &conf->frequency_capacity) != 0) {
+        fprintf(stderr, "Can't read config 'FrequencyCapacity' parameter\n");
+        goto error;
+    }
+
+    if (lamb_get_bool(&cfg, "FrequencySync", &conf->frequency_sync) != 0) {
+        fprintf(stderr, "Can't read config 'FrequencySync' parameter\n");
+        goto error;
+    }
+
+    if (lamb_get_string(&cfg, "BillingLog", conf->billing_log, 128) != 0) {
+        fprintf(stderr, "Can't read config 'BillingLog' parameter\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "BillingLease", &conf->billing_lease) != 0) {
+        fprintf(stderr, "Can't read config 'BillingLease' parameter\n");
+        goto error;
+    }
+
+    /* Check billing lease validity */
+    if (conf->billing_lease < 1) {
+        fprintf(stderr, "Invalid billing lease size\n");
+        goto error;
+    }
+
+    if (lamb_get_int(&cfg, "BillingInterval", &conf->billing_interval) != 0) {
+        fprintf(stderr, "Can't read config 'BillingInterval' parameter\n");
+        goto error;
+    }
+
     char node[32];
     memset(node, 0, sizeof(node));
 
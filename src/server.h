@@ -10,6 +10,8 @@
 #include "db.h"
 #include "common.h"
 #include "list.h"
+#include "ring.h"
+#include "billing.h"
 #include "cache.h"
 #include "config.h"
 #include "routing.h"
@@ -19,6 +21,17 @@
 #include "keyword.h"
 #include "message.h"
 
+#define LAMB_STORAGE_SIZE 65536
+
+#define LAMB_POLICY_BLACKLIST   (1 << 0)
+#define LAMB_POLICY_UNSUBSCRIBE (1 << 1)
+#define LAMB_POLICY_FREQUENCY   (1 << 2)
+#define LAMB_POLICY_SKIP        (1 << 3)
+
+#define LAMB_MAX_WORKER 64
+
+#define STAT_INC(val) __atomic_add_fetch(&(val), 1, __ATOMIC_RELAXED)
+
 typedef struct {
     int id;
     bool debug;
@@ -44,6 +57,16 @@ typedef struct {
     char msg_user[64];
     char msg_password[64];
     char msg_name[64];
+    char blacklist[128];
+    int store_batch;
+    int store_interval;
+    int frequency_limit;
+    int frequency_window;
+    int frequency_capacity;
+    bool frequency_sync;
+    char billing_log[128];
+    int billing_lease;
+    int billing_interval;
     char *nodes[7];
 } lamb_config_t;
 
@@ -61,26 +84,31 @@ typedef struct {
     unsigned long long key;
 } lamb_status_t;
 
+/* A batch of mt, done once a worker has finished all of its messages */
+typedef struct lamb_job {
+    int count;
+    bool done;
+    unsigned long long sequence;
+    struct lamb_job *next;
+    Submit *messages[LAMB_MAX_BATCH];
+} lamb_job_t;
+
 typedef struct {
     lamb_db_t db;
     lamb_db_t mdb;
     long long money;
     lamb_cache_t rdb;
-    lamb_list_t *storage;
-    lamb_list_t *billing;
+    lamb_cache_t brdb;
+    lamb_ring_t *storage;
+    lamb_billing_t *billing;
     lamb_list_t *unsubscribe;
     lamb_account_t account;
     lamb_company_t company;
-    lamb_list_t *templates;
-    lamb_list_t *keywords;
+    lamb_templates_t *templates;
+    lamb_keywords_t *keywords;
     pthread_mutex_t lock;
 } lamb_global_t;
     
-typedef struct {
-    int id;
-    int money;
-} lamb_bill_t;
-
 typedef struct {
     int type;
     void *val;
@@ -88,25 +116,24 @@ typedef struct {
 
 void lamb_event_loop(void);
 void lamb_reload(int signum);
+void *lamb_fetch_loop(void *data);
 void *lamb_work_loop(void *data);
 void *lamb_deliver_loop(void *data);
 void *lamb_store_loop(void *data);
 void *lamb_billing_loop(void *data);
+void lamb_lease_wait(pthread_cond_t *cond, long milliseconds);
+void lamb_lease_signal(pthread_cond_t *cond);
 void *lamb_stat_loop(void *data);
+void *lamb_frequency_loop(void *data);
 void *lamb_unsubscribe_loop(void *arg);
-int lamb_write_report(lamb_db_t *db, lamb_report_t *message);
-int lamb_write_message(lamb_db_t *db, lamb_submit_t *message);
-int lamb_write_deliver(lamb_db_t *db, lamb_deliver_t *message);
 void lamb_get_today(const char *pfx, char *val);
 void lamb_new_table(lamb_db_t *db);
-bool lamb_check_content(lamb_template_t *template, char *content, int len);
-bool lamb_check_keyword(lamb_keyword_t *key, char *content);
-bool lamb_check_blacklist(lamb_caches_t *cache, char *number);
-bool lamb_check_unsubscribe(lamb_caches_t *cache, int id, char *number);
-bool lamb_check_frequency(lamb_caches_t *cache, int id, char *number);
+void lamb_check_policy(Submit **messages, int count, int *verdicts);
+void lamb_policy_stage(lamb_caches_t *cache, int type, unsigned long *phones, int count, int *verdicts);
 bool lamb_check_unsubval(char *content, int len);
-bool lamb_check_arrears(lamb_cache_t *rdb, int company);
-void lamb_direct_response(int sock, Report *resp, Submit *message, int cause);
+void lamb_direct_response(Report *resp, Submit *message, int cause);
+int lamb_mo_push(int method, const ProtobufCMessage *message);
+void lamb_free_message(void *message);
 int lamb_component_initialization(lamb_config_t *cfg);
 int lamb_check_signal(lamb_cache_t *cache, int id);
 void lamb_clear_signal(lamb_cache_t *cache, int id);
@@ -0,0 +1,446 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "common.h"
+#include "shm.h"
+
+/*
+ * Local transport between processes of one host. A daemon publishes a
+ * region named after its port, clients write request frames to a ring
+ * shared by all of them and every client owns a reply buffer. The ring
+ * is a bounded MPMC queue, a slot is free for the producer at position
+ * pos when its sequence is pos and ready for a consumer when it is pos
+ * + 1. Waiting is done with futexes on words of the region, so nothing
+ * goes through the kernel while both sides are busy.
+ */
+
+static int lamb_shm_map(lamb_shm_t *shm, int flags);
+static int lamb_shm_claim(lamb_shm_t *shm);
+static int lamb_futex_wait(unsigned int *addr, unsigned int val, int timeout);
+static void lamb_futex_wake(unsigned int *addr, int count);
+
+lamb_shm_t *lamb_shm_create(int port) {
+    char name[32];
+    lamb_shm_t *self;
+    lamb_shm_region_t *region;
+
+    self = (lamb_shm_t *)calloc(1, sizeof(lamb_shm_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->port = port;
+    self->client = -1;
+    pthread_mutex_init(&self->lock, NULL);
+
+    /* Clients of the previous daemon find the old region unlinked */
+    snprintf(name, sizeof(name), "/lamb.%d", port);
+    shm_unlink(name);
+
+    if (lamb_shm_map(self, O_RDWR | O_CREAT | O_EXCL) != 0) {
+        free(self);
+        return NULL;
+    }
+
+    region = self->region;
+
+    for (int i = 0; i < LAMB_SHM_SLOTS; i++) {
+        region->slots[i].sequence = i;
+    }
+
+    __atomic_store_n(&region->magic, LAMB_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return self;
+}
+
+lamb_shm_t *lamb_shm_attach(int port, int timeout) {
+    lamb_shm_t *self;
+
+    self = (lamb_shm_t *)calloc(1, sizeof(lamb_shm_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->port = port;
+    self->timeout = timeout;
+    pthread_mutex_init(&self->lock, NULL);
+
+    if (lamb_shm_map(self, O_RDWR) != 0) {
+        free(self);
+        return NULL;
+    }
+
+    if (lamb_shm_claim(self) != 0) {
+        munmap(self->region, sizeof(lamb_shm_region_t));
+        close(self->fd);
+        free(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+/* Take a free request slot of the ring, NULL when the ring is full */
+lamb_shm_slot_t *lamb_shm_reserve(lamb_shm_t *shm, size_t len) {
+    int diff;
+    unsigned int pos, seq;
+    lamb_shm_slot_t *slot;
+    lamb_shm_region_t *region;
+
+    if (len > LAMB_SHM_FRAME) {
+        return NULL;
+    }
+
+    region = shm->region;
+    pos = __atomic_load_n(&region->head, __ATOMIC_RELAXED);
+
+    while (true) {
+        slot = &region->slots[pos % LAMB_SHM_SLOTS];
+        seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (int)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&region->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            /* The daemon may be gone, a restarted one has a new region */
+            lamb_shm_renew(shm);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&region->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+/* Publish the frame written to slot and wake a worker of the daemon */
+void lamb_shm_commit(lamb_shm_t *shm, lamb_shm_slot_t *slot, size_t len) {
+    lamb_shm_client_t *client;
+    lamb_shm_region_t *region;
+
+    region = shm->region;
+    client = &region->clients[shm->client];
+
+    slot->client = shm->client;
+    slot->request = __atomic_add_fetch(&client->request, 1, __ATOMIC_RELEASE);
+    slot->len = len;
+
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&region->doorbell, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&region->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        lamb_futex_wake(&region->doorbell, 1);
+    }
+
+    return;
+}
+
+int lamb_shm_send(lamb_shm_t *shm, void *buf, size_t len) {
+    lamb_shm_slot_t *slot;
+
+    slot = lamb_shm_reserve(shm, len);
+
+    if (!slot) {
+        return -1;
+    }
+
+    memcpy(slot->frame, buf, len);
+    lamb_shm_commit(shm, slot, len);
+
+    return 0;
+}
+
+/*
+ * Wait for the reply to the last request. The buffer belongs to the
+ * region and stays valid until the next request. Returns the reply
+ * length, 0 when the timeout expired first, -1 on error.
+ */
+
+int lamb_shm_wait(lamb_shm_t *shm, char **buf) {
+    int elapsed;
+    unsigned int request, answered;
+    unsigned long long start;
+    lamb_shm_client_t *client;
+
+    client = &shm->region->clients[shm->client];
+    request = __atomic_load_n(&client->request, __ATOMIC_RELAXED);
+    start = lamb_now_microsecond();
+
+    while (true) {
+        answered = __atomic_load_n(&client->answered, __ATOMIC_ACQUIRE);
+
+        if (answered == request) {
+            *buf = client->buf;
+            return client->len;
+        }
+
+        elapsed = (lamb_now_microsecond() - start) / 1000;
+
+        if (elapsed >= shm->timeout) {
+            return (lamb_shm_renew(shm) == 0) ? -1 : 0;
+        }
+
+        lamb_futex_wait(&client->answered, answered, shm->timeout - elapsed);
+    }
+
+    return -1;
+}
+
+/* The reply to the last request without waiting, 0 when it is not there yet */
+int lamb_shm_poll(lamb_shm_t *shm, char **buf) {
+    lamb_shm_client_t *client;
+
+    client = &shm->region->clients[shm->client];
+
+    if (__atomic_load_n(&client->answered, __ATOMIC_ACQUIRE) !=
+        __atomic_load_n(&client->request, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    *buf = client->buf;
+
+    return client->len;
+}
+
+/* Take the next request frame, NULL when none came within timeout */
+lamb_shm_slot_t *lamb_shm_recv(lamb_shm_t *shm, int timeout) {
+    int diff;
+    unsigned int pos, seq, bell;
+    lamb_shm_slot_t *slot;
+    lamb_shm_region_t *region;
+
+    region = shm->region;
+    pos = __atomic_load_n(&region->tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        slot = &region->slots[pos % LAMB_SHM_SLOTS];
+        seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (int)(seq - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&region->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            break;
+        } else {
+            pos = __atomic_load_n(&region->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Ring is empty, sleep until a producer rings the doorbell */
+    bell = __atomic_load_n(&region->doorbell, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&region->sleepers, 1, __ATOMIC_SEQ_CST);
+
+    slot = &region->slots[pos % LAMB_SHM_SLOTS];
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != pos + 1) {
+        lamb_futex_wait(&region->doorbell, bell, timeout);
+    }
+
+    __atomic_sub_fetch(&region->sleepers, 1, __ATOMIC_SEQ_CST);
+
+    return NULL;
+}
+
+/* Hand the slot back to the producers once the frame was handled */
+void lamb_shm_release(lamb_shm_t *shm, lamb_shm_slot_t *slot) {
+    __atomic_store_n(&slot->sequence, slot->sequence - 1 + LAMB_SHM_SLOTS, __ATOMIC_RELEASE);
+    return;
+}
+
+/* Answer request of a client, a reply to an abandoned request is dropped */
+int lamb_shm_reply(lamb_shm_t *shm, int client, unsigned int request, void *buf, size_t len) {
+    lamb_shm_client_t *self;
+
+    if (client < 0 || client >= LAMB_SHM_CLIENTS || len > LAMB_SHM_REPLY) {
+        return -1;
+    }
+
+    self = &shm->region->clients[client];
+
+    pthread_mutex_lock(&shm->lock);
+
+    if (__atomic_load_n(&self->request, __ATOMIC_ACQUIRE) != request) {
+        pthread_mutex_unlock(&shm->lock);
+        return -1;
+    }
+
+    memcpy(self->buf, buf, len);
+    self->len = len;
+    __atomic_store_n(&self->answered, request, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&shm->lock);
+
+    lamb_futex_wake(&self->answered, INT_MAX);
+
+    return 0;
+}
+
+void lamb_shm_close(lamb_shm_t *shm) {
+    char name[32];
+
+    if (shm->client < 0) {
+        snprintf(name, sizeof(name), "/lamb.%d", shm->port);
+        shm_unlink(name);
+    } else {
+        __atomic_store_n(&shm->region->clients[shm->client].pid, 0, __ATOMIC_RELEASE);
+    }
+
+    munmap(shm->region, sizeof(lamb_shm_region_t));
+    close(shm->fd);
+    pthread_mutex_destroy(&shm->lock);
+    free(shm);
+
+    return;
+}
+
+static int lamb_shm_map(lamb_shm_t *shm, int flags) {
+    int fd;
+    char name[32];
+    struct stat st;
+    void *region;
+
+    snprintf(name, sizeof(name), "/lamb.%d", shm->port);
+
+    fd = shm_open(name, flags, 0600);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (flags & O_CREAT) {
+        if (ftruncate(fd, sizeof(lamb_shm_region_t)) != 0) {
+            syslog(LOG_ERR, "can't resize shared memory %s", name);
+            close(fd);
+            shm_unlink(name);
+            return -1;
+        }
+    } else if (fstat(fd, &st) != 0 || st.st_size != sizeof(lamb_shm_region_t)) {
+        close(fd);
+        return -1;
+    }
+
+    region = mmap(NULL, sizeof(lamb_shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (region == MAP_FAILED) {
+        close(fd);
+        if (flags & O_CREAT) {
+            shm_unlink(name);
+        }
+        return -1;
+    }
+
+    /* Back the ring with huge pages where shmem allows it */
+    madvise(region, sizeof(lamb_shm_region_t), MADV_HUGEPAGE);
+
+    if (!(flags & O_CREAT) &&
+        __atomic_load_n(&((lamb_shm_region_t *)region)->magic, __ATOMIC_ACQUIRE) != LAMB_SHM_MAGIC) {
+        munmap(region, sizeof(lamb_shm_region_t));
+        close(fd);
+        return -1;
+    }
+
+    shm->fd = fd;
+    shm->region = (lamb_shm_region_t *)region;
+
+    return 0;
+}
+
+/* Own a free reply buffer, the one of a dead process is free too */
+static int lamb_shm_claim(lamb_shm_t *shm) {
+    int pid, self;
+    lamb_shm_client_t *client;
+
+    self = getpid();
+
+    for (int i = 0; i < LAMB_SHM_CLIENTS; i++) {
+        client = &shm->region->clients[i];
+        pid = __atomic_load_n(&client->pid, __ATOMIC_ACQUIRE);
+
+        if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&client->pid, &pid, self, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            /* Nothing is outstanding on the buffer */
+            __atomic_store_n(&client->answered, __atomic_load_n(&client->request, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELEASE);
+            shm->client = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Attach to the region of a restarted daemon, 0 when it was renewed */
+int lamb_shm_renew(lamb_shm_t *shm) {
+    struct stat st;
+    lamb_shm_t next;
+
+    if (fstat(shm->fd, &st) != 0 || st.st_nlink > 0) {
+        return -1;
+    }
+
+    memset(&next, 0, sizeof(next));
+    next.port = shm->port;
+
+    if (lamb_shm_map(&next, O_RDWR) != 0) {
+        return -1;
+    }
+
+    if (lamb_shm_claim(&next) != 0) {
+        munmap(next.region, sizeof(lamb_shm_region_t));
+        close(next.fd);
+        return -1;
+    }
+
+    __atomic_store_n(&shm->region->clients[shm->client].pid, 0, __ATOMIC_RELEASE);
+    munmap(shm->region, sizeof(lamb_shm_region_t));
+    close(shm->fd);
+
+    shm->fd = next.fd;
+    shm->client = next.client;
+    shm->region = next.region;
+
+    syslog(LOG_NOTICE, "local transport of port %d was renewed", shm->port);
+
+    return 0;
+}
+
+static int lamb_futex_wait(unsigned int *addr, unsigned int val, int timeout) {
+    struct timespec ts;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void lamb_futex_wake(unsigned int *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+    return;
+}
@@ -0,0 +1,70 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_SHM_H
+#define _LAMB_SHM_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "socket.h"
+
+#define LAMB_SHM_MAGIC   0x6c616d62
+#define LAMB_SHM_SLOTS   1024
+#define LAMB_SHM_FRAME   4096
+#define LAMB_SHM_CLIENTS 256
+#define LAMB_SHM_REPLY   (LAMB_MAX_BYTES + 4096)
+
+typedef struct {
+    unsigned int sequence;
+    int client;
+    unsigned int request;
+    int len;
+    char frame[LAMB_SHM_FRAME];
+} lamb_shm_slot_t;
+
+typedef struct {
+    int pid;
+    unsigned int request;
+    unsigned int answered;
+    int len;
+    char buf[LAMB_SHM_REPLY];
+} lamb_shm_client_t;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int doorbell;
+    int sleepers;
+    char pad1[52];
+    unsigned int head;
+    char pad2[60];
+    unsigned int tail;
+    char pad3[60];
+    lamb_shm_slot_t slots[LAMB_SHM_SLOTS];
+    lamb_shm_client_t clients[LAMB_SHM_CLIENTS];
+} lamb_shm_region_t;
+
+typedef struct {
+    int fd;
+    int port;
+    int client;
+    int timeout;
+    pthread_mutex_t lock;
+    lamb_shm_region_t *region;
+} lamb_shm_t;
+
+lamb_shm_t *lamb_shm_create(int port);
+lamb_shm_t *lamb_shm_attach(int port, int timeout);
+lamb_shm_slot_t *lamb_shm_reserve(lamb_shm_t *shm, size_t len);
+void lamb_shm_commit(lamb_shm_t *shm, lamb_shm_slot_t *slot, size_t len);
+int lamb_shm_send(lamb_shm_t *shm, void *buf, size_t len);
+int lamb_shm_wait(lamb_shm_t *shm, char **buf);
+int lamb_shm_poll(lamb_shm_t *shm, char **buf);
+int lamb_shm_renew(lamb_shm_t *shm);
+lamb_shm_slot_t *lamb_shm_recv(lamb_shm_t *shm, int timeout);
+void lamb_shm_release(lamb_shm_t *shm, lamb_shm_slot_t *slot);
+int lamb_shm_reply(lamb_shm_t *shm, int client, unsigned int request, void *buf, size_t len);
+void lamb_shm_close(lamb_shm_t *shm);
+
+#endif
@@ -0,0 +1,151 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+/*
+ * Every thread keeps one magazine of free objects per slab, allocation
+ * and free only touch that magazine. An empty magazine is exchanged for
+ * a full one from the depot and a full one is handed to the depot, so
+ * objects freed by another thread come back a magazine at a time under
+ * one lock. Only when the depot has nothing left is malloc called.
+ */
+
+static int slabs = 0;
+static __thread lamb_magazine_t *loaded[LAMB_SLAB_MAX];
+
+static lamb_magazine_t *lamb_magazine_empty(lamb_slab_t *slab);
+
+lamb_slab_t *lamb_slab_new(size_t size) {
+    int index;
+    lamb_slab_t *self;
+
+    index = __atomic_fetch_add(&slabs, 1, __ATOMIC_ACQ_REL);
+
+    if (index >= LAMB_SLAB_MAX) {
+        return NULL;
+    }
+
+    self = (lamb_slab_t *)calloc(1, sizeof(lamb_slab_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->index = index;
+    self->size = size;
+    pthread_mutex_init(&self->lock, NULL);
+
+    return self;
+}
+
+/* Returns a zeroed object, like calloc */
+void *lamb_slab_alloc(lamb_slab_t *slab) {
+    void *obj;
+    lamb_magazine_t *mag;
+
+    mag = loaded[slab->index];
+
+    if (!mag || mag->count == 0) {
+        pthread_mutex_lock(&slab->lock);
+
+        if (slab->full) {
+            if (mag) {
+                mag->next = slab->empty;
+                slab->empty = mag;
+            }
+
+            mag = slab->full;
+            slab->full = mag->next;
+            slab->depth--;
+            loaded[slab->index] = mag;
+        }
+
+        pthread_mutex_unlock(&slab->lock);
+
+        if (!mag || mag->count == 0) {
+            return calloc(1, slab->size);
+        }
+    }
+
+    obj = mag->objs[--mag->count];
+    memset(obj, 0, slab->size);
+
+    return obj;
+}
+
+void lamb_slab_free(lamb_slab_t *slab, void *obj) {
+    lamb_magazine_t *mag;
+
+    if (!obj) {
+        return;
+    }
+
+    mag = loaded[slab->index];
+
+    if (!mag) {
+        pthread_mutex_lock(&slab->lock);
+        mag = lamb_magazine_empty(slab);
+        pthread_mutex_unlock(&slab->lock);
+
+        if (!mag) {
+            free(obj);
+            return;
+        }
+
+        loaded[slab->index] = mag;
+    }
+
+    if (mag->count == LAMB_SLAB_MAGAZINE) {
+        pthread_mutex_lock(&slab->lock);
+
+        /* The depot is full, the objects go back to malloc */
+        if (slab->depth >= LAMB_SLAB_DEPOT) {
+            pthread_mutex_unlock(&slab->lock);
+            for (int i = 0; i < mag->count; i++) {
+                free(mag->objs[i]);
+            }
+            mag->count = 0;
+        } else {
+            mag->next = slab->full;
+            slab->full = mag;
+            slab->depth++;
+            mag = lamb_magazine_empty(slab);
+            pthread_mutex_unlock(&slab->lock);
+
+            loaded[slab->index] = mag;
+
+            if (!mag) {
+                free(obj);
+                return;
+            }
+        }
+    }
+
+    mag->objs[mag->count++] = obj;
+
+    return;
+}
+
+/* Take an empty magazine, the slab lock must be held */
+static lamb_magazine_t *lamb_magazine_empty(lamb_slab_t *slab) {
+    lamb_magazine_t *mag;
+
+    if (slab->empty) {
+        mag = slab->empty;
+        slab->empty = mag->next;
+        return mag;
+    }
+
+    mag = (lamb_magazine_t *)malloc(sizeof(lamb_magazine_t));
+
+    if (mag) {
+        mag->count = 0;
+        mag->next = NULL;
+    }
+
+    return mag;
+}
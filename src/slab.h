@@ -0,0 +1,36 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_SLAB_H
+#define _LAMB_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define LAMB_SLAB_MAX      8
+#define LAMB_SLAB_MAGAZINE 64
+#define LAMB_SLAB_DEPOT    256
+
+typedef struct lamb_magazine {
+    int count;
+    struct lamb_magazine *next;
+    void *objs[LAMB_SLAB_MAGAZINE];
+} lamb_magazine_t;
+
+/* Cache of free objects of one size, shared by all threads */
+typedef struct {
+    int index;
+    size_t size;
+    int depth;
+    lamb_magazine_t *full;
+    lamb_magazine_t *empty;
+    pthread_mutex_t lock;
+} lamb_slab_t;
+
+lamb_slab_t *lamb_slab_new(size_t size);
+void *lamb_slab_alloc(lamb_slab_t *slab);
+void lamb_slab_free(lamb_slab_t *slab, void *obj);
+
+#endif
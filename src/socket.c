@@ -90,6 +90,35 @@ int lamb_nn_pair(const char *host, int id, int timeout) {
     return fd;
 }
 
+int lamb_nn_stream(const char *host, int id, int timeout) {
+    int fd;
+    int err;
+    Response *resp;
+    Request req = REQUEST__INIT;
+
+    req.id = id;
+    req.type = LAMB_STREAM;
+    req.addr = "0.0.0.0";
+
+    resp = lamb_nn_request(host, &req, timeout);
+
+    if (!resp) {
+        return -1;
+    }
+
+    err = lamb_nn_connect(&fd, resp->host, NN_PAIR, timeout);
+
+    response__free_unpacked(resp, NULL);
+
+    if (err) {
+        return -1;
+    }
+
+    nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
+
+    return fd;
+}
+
 int lamb_nn_access(const char *host, int id, int type, int timeout) {
     int fd;
     int err;
@@ -121,46 +150,36 @@ Response *lamb_nn_request(const char *host, Request *req, int timeout) {
     int rc;
     int err;
     int sock;
-    void *pk;
     char *buf;
     Response *resp;
     unsigned int len;
 
     len = request__get_packed_size(req);
-    pk = malloc(len);
+    buf = lamb_frame_alloc(LAMB_REQUEST, HEAD, len);
 
-    if (!pk) {
+    if (!buf) {
         return NULL;
     }
 
-    request__pack(req, pk);
-    len = lamb_pack_assembly(&buf, LAMB_REQUEST, pk, len);
-    free(pk);
-
-    if (len < 1) {
-        return NULL;
-    }
+    request__pack(req, (uint8_t *)(buf + HEAD));
 
     err = lamb_nn_connect(&sock, host, NN_REQ, timeout);
     if (err) {
-        free(buf);
+        nn_freemsg(buf);
         return NULL;
     }
     
-    rc = nn_send(sock, buf, len, 0);
-
-    if (rc != len) {
-        free(buf);
+    if (lamb_frame_send(sock, buf, HEAD + len, 0) != 0) {
         nn_close(sock);
         return NULL;
     }
 
-    free(buf);
-    buf = NULL;
-
     rc = nn_recv(sock, &buf, NN_MSG, 0);
 
     if (rc < 4) {
+        if (rc > 0) {
+            nn_freemsg(buf);
+        }
         nn_close(sock);
         return NULL;
     }
@@ -168,7 +187,7 @@ Response *lamb_nn_request(const char *host, Request *req, int timeout) {
     nn_close(sock);
 
     if (CHECK_COMMAND(buf) != LAMB_RESPONSE) {
-        free(buf);
+        nn_freemsg(buf);
         return NULL;
     }
     
@@ -200,38 +219,203 @@ int lamb_nn_server(int *sock, const char *listen, unsigned short port, int proto
     return 0;
 }
 
-size_t lamb_pack_assembly(char **buf, int method, void *pk, size_t len) {
-    if (pk && len > 0) {
-        *buf = (char *)malloc(sizeof(int) + len);
-    } else {
-        *buf = (char *)malloc(sizeof(int));
+/*
+ * Zero-copy framing, the message is allocated by nanomsg with room for
+ * head bytes of header in front of the payload, the command is written
+ * in the first word and the caller packs the payload at buf + head.
+ * lamb_frame_send hands the buffer to nanomsg, it must not be touched
+ * or freed afterwards, whether the send succeeded or not.
+ */
+
+char *lamb_frame_alloc(int method, size_t head, size_t len) {
+    char *buf;
+
+    buf = (char *)nn_allocmsg(head + len, 0);
+
+    if (buf) {
+        *((int *)buf) = htonl(method);
     }
 
-    if (*buf) {
-        *((int *)(*buf)) = htonl(method);
-        if (pk && len > 0) {
-            memcpy(*buf + sizeof(int), pk, len);
-            return sizeof(int) + len;
-        }
+    return buf;
+}
 
-        return sizeof(int);
+int lamb_frame_send(int sock, char *buf, size_t len, int flags) {
+    int rc;
+
+    rc = nn_send(sock, &buf, NN_MSG, flags);
+
+    if (rc < 0) {
+        nn_freemsg(buf);
+        return -1;
     }
 
-    return 0;
+    return (rc == len) ? 0 : -1;
 }
 
 void lamb_nn_close(int sock) {
-    int len;
     char *bye;
 
-    len = lamb_pack_assembly(&bye, LAMB_BYE, NULL, 0);
+    bye = lamb_frame_alloc(LAMB_BYE, HEAD, 0);
 
-    if (len > 0) {
-        nn_send(sock, bye, len, NN_DONTWAIT);
-        free(bye);
+    if (bye) {
+        lamb_frame_send(sock, bye, HEAD, NN_DONTWAIT);
     }
 
     nn_close(sock);
 
     return;
 }
+
+/*
+ * Batch framing, a LAMB_BATCH request carries the count and bytes
+ * hint of the consumer, the reply carries the number of messages
+ * followed by one command, length and payload record per message.
+ * A LAMB_CREDIT grant has the same layout as the batch request, it
+ * lets a stream push up to count more messages to the consumer.
+ */
+
+static size_t lamb_hint_assembly(char **buf, int method, int count, int bytes) {
+    *buf = (char *)malloc(sizeof(int) * 3);
+
+    if (*buf) {
+        ((int *)(*buf))[0] = htonl(method);
+        ((int *)(*buf))[1] = htonl(count);
+        ((int *)(*buf))[2] = htonl(bytes);
+        return sizeof(int) * 3;
+    }
+
+    return 0;
+}
+
+size_t lamb_batch_request(char **buf, int count, int bytes) {
+    return lamb_hint_assembly(buf, LAMB_BATCH, count, bytes);
+}
+
+size_t lamb_credit_request(char **buf, int count, int bytes) {
+    return lamb_hint_assembly(buf, LAMB_CREDIT, count, bytes);
+}
+
+int lamb_batch_count(char *buf, size_t len) {
+    int val;
+
+    if (len < sizeof(int) * 2) {
+        return 0;
+    }
+
+    memcpy(&val, buf + sizeof(int), sizeof(int));
+
+    return ntohl(val);
+}
+
+void lamb_batch_hint(char *buf, size_t len, int *count, int *bytes) {
+    int val;
+
+    *count = LAMB_MAX_BATCH;
+    *bytes = LAMB_MAX_BYTES;
+
+    if (len >= sizeof(int) * 3) {
+        memcpy(&val, buf + sizeof(int), sizeof(int));
+        val = ntohl(val);
+        if (val > 0 && val <= LAMB_MAX_BATCH) {
+            *count = val;
+        }
+
+        memcpy(&val, buf + sizeof(int) * 2, sizeof(int));
+        val = ntohl(val);
+        if (val > 0 && val <= LAMB_MAX_BYTES) {
+            *bytes = val;
+        }
+    }
+
+    return;
+}
+
+/* The buffer is a nanomsg message so that the reply can be sent without a copy */
+int lamb_batch_init(lamb_batch_t *batch, size_t size) {
+    batch->count = 0;
+    batch->len = sizeof(int) * 2;
+    batch->size = (size > batch->len) ? size : 4096;
+    batch->buf = (char *)nn_allocmsg(batch->size, 0);
+
+    if (!batch->buf) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Append a record header and return where its len bytes payload goes */
+char *lamb_batch_reserve(lamb_batch_t *batch, int method, size_t len) {
+    int val;
+    char *buf;
+    size_t size;
+
+    size = batch->size;
+
+    while (batch->len + sizeof(int) * 2 + len > size) {
+        size *= 2;
+    }
+
+    if (size != batch->size) {
+        buf = (char *)nn_reallocmsg(batch->buf, size);
+        if (!buf) {
+            return NULL;
+        }
+        batch->buf = buf;
+        batch->size = size;
+    }
+
+    val = htonl(method);
+    memcpy(batch->buf + batch->len, &val, sizeof(int));
+    val = htonl(len);
+    memcpy(batch->buf + batch->len + sizeof(int), &val, sizeof(int));
+
+    buf = batch->buf + batch->len + sizeof(int) * 2;
+    batch->len += sizeof(int) * 2 + len;
+    batch->count++;
+
+    return buf;
+}
+
+size_t lamb_batch_finish(lamb_batch_t *batch) {
+    ((int *)batch->buf)[0] = htonl(LAMB_BATCH);
+    ((int *)batch->buf)[1] = htonl(batch->count);
+
+    return batch->len;
+}
+
+void lamb_batch_free(lamb_batch_t *batch) {
+    if (batch->buf) {
+        nn_freemsg(batch->buf);
+        batch->buf = NULL;
+    }
+
+    return;
+}
+
+/* Walk the records of a batch reply, -1 when no message remains */
+int lamb_batch_next(char *buf, size_t len, size_t *offset, int *method, char **pk, size_t *size) {
+    int val;
+
+    if (*offset < sizeof(int) * 2) {
+        *offset = sizeof(int) * 2;
+    }
+
+    if (*offset + sizeof(int) * 2 > len) {
+        return -1;
+    }
+
+    memcpy(&val, buf + *offset, sizeof(int));
+    *method = ntohl(val);
+    memcpy(&val, buf + *offset + sizeof(int), sizeof(int));
+    *size = ntohl(val);
+
+    if (*offset + sizeof(int) * 2 + *size > len) {
+        return -1;
+    }
+
+    *pk = buf + *offset + sizeof(int) * 2;
+    *offset += sizeof(int) * 2 + *size;
+
+    return 0;
+}
@@ -24,6 +24,12 @@
 #define LAMB_RESPONSE (1 << 11)
 #define LAMB_PING     (1 << 12)
 #define LAMB_TEST     (1 << 13)
+#define LAMB_BATCH    (1 << 14)
+#define LAMB_CREDIT   (1 << 15)
+#define LAMB_STREAM   (1 << 16)
+
+#define LAMB_MAX_BATCH 256
+#define LAMB_MAX_BYTES (256 * 1024)
 
 #define HEAD (signed int)sizeof(int)
 #define CHECK_COMMAND(val) ntohl(*((int *)(val)))
@@ -50,14 +56,31 @@ typedef struct {
 
 #pragma pack()
 
+typedef struct {
+    int count;
+    size_t len;
+    size_t size;
+    char *buf;
+} lamb_batch_t;
 
 int lamb_nn_connect(int *sock, const char *host, int protocol, int timeout);
 int lamb_nn_reqrep(const char *host, int id, int timeout);
 int lamb_nn_pair(const char *host, int id, int timeout);
+int lamb_nn_stream(const char *host, int id, int timeout);
 int lamb_nn_access(const char *host, int id, int type, int timeout);
 Response *lamb_nn_request(const char *host, Request *req, int timeout);
 int lamb_nn_server(int *sock, const char *listen, unsigned short port, int protocol);
-size_t lamb_pack_assembly(char **buf, int method, void *pk, size_t len);
+char *lamb_frame_alloc(int method, size_t head, size_t len);
+int lamb_frame_send(int sock, char *buf, size_t len, int flags);
 void lamb_nn_close(int sock);
+size_t lamb_batch_request(char **buf, int count, int bytes);
+size_t lamb_credit_request(char **buf, int count, int bytes);
+int lamb_batch_count(char *buf, size_t len);
+void lamb_batch_hint(char *buf, size_t len, int *count, int *bytes);
+int lamb_batch_init(lamb_batch_t *batch, size_t size);
+char *lamb_batch_reserve(lamb_batch_t *batch, int method, size_t len);
+size_t lamb_batch_finish(lamb_batch_t *batch);
+void lamb_batch_free(lamb_batch_t *batch);
+int lamb_batch_next(char *buf, size_t len, size_t *offset, int *method, char **pk, size_t *size);
 
 #endif
@@ -21,8 +21,13 @@
 #include "config.h"
 #include "queue.h"
 #include "socket.h"
+#include "slab.h"
+#include "arena.h"
+#include "lru.h"
+#include "mux.h"
 #include "message.h"
 #include "gateway.h"
+#include "codec.h"
 #include "log.h"
 #include "sp.h"
 
@@ -33,13 +38,15 @@ static lamb_db_t *db;
 static cmpp_sp_t cmpp;
 static lamb_cache_t *rdb;
 static lamb_caches_t cache;
-static lamb_list_t *storage;
+static lamb_ring_t *storage;
+static lamb_ring_t *acknowledged;
+static lamb_slab_t *acks;
+static lamb_slab_t *reports;
+static lamb_slab_t *delivers;
 static lamb_config_t config;
 static lamb_gateway_t *gateway;
-static pthread_cond_t cond;
-static pthread_mutex_t mutex;
+static lamb_window_t *window;
 static lamb_heartbeat_t heartbeat;
-static lamb_confirmed_t confirmed;
 static unsigned long long total;
 static lamb_status_t status;
 static lamb_statistical_t *statistical;
@@ -124,9 +131,7 @@ void lamb_event_loop(void) {
     heartbeat.count = 0;
 
     memset(&status, 0, sizeof(status));
-    pthread_cond_init(&cond, NULL);
-    pthread_mutex_init(&mutex, NULL);
-    
+
     err = lamb_component_initialization(&config);
     if (err) {
         lamb_lock_release(&lock);
@@ -155,9 +160,11 @@ void lamb_event_loop(void) {
 
 void *lamb_sender_loop(void *data) {
     int err;
-    char spcode[21];
-    long long delayed;
     unsigned int sequenceId;
+    unsigned long long now;
+    unsigned long long next;
+    unsigned long long delayed;
+    lamb_confirmed_t confirmed;
     
     int msgFmt;
     char *tocode;
@@ -176,14 +183,30 @@ void *lamb_sender_loop(void *data) {
         tocode = "GBK";
     }
 
-    int rc, len;
-    char *req, *buf;
+    int rc;
+    char *buf;
     Submit *message;
-    int length;
-    char content[256];
+    int blen;
+    int method;
+    size_t plen;
+    size_t offset;
+    char *payload;
+    char *batch = NULL;
+    int credit, asked;
+    bool pending;
+
+    /* Flow control, gateway concurrent is messages per second */
+    if (gateway->concurrent > 0 && gateway->concurrent < 1000000) {
+        delayed = 1000000 / gateway->concurrent;
+    } else {
+        delayed = 1;
+    }
 
-    memset(spcode, 0, sizeof(spcode));
-    len = lamb_pack_assembly(&req, LAMB_REQ, NULL, 0);
+    /* Never hold more messages than the window can take */
+    credit = window->size;
+    asked = 0;
+    pending = false;
+    next = lamb_now_microsecond();
 
     while (true) {
         if (!cmpp.ok) {
@@ -191,37 +214,61 @@ void *lamb_sender_loop(void *data) {
             continue;
         }
 
-        rc = nn_send(scheduler, req, len, NN_DONTWAIT);
+        /* Retransmit expired submit */
+        lamb_check_retransmit();
 
-        if (rc != len) {
-            lamb_sleep(1000);
+        /* Wait for a free window slot */
+        if (lamb_window_wait(window, 100) != 0) {
             continue;
         }
 
-        rc = nn_recv(scheduler, &buf, NN_MSG, 0);
+        /* Wait for the next batch once the current one is drained */
+        if (!batch || lamb_batch_next(batch, blen, &offset, &method, &payload, &plen) != 0) {
+            if (batch) {
+                credit += lamb_batch_count(batch, blen);
+                lamb_mux_release(scheduler, batch);
+                batch = NULL;
+            }
 
-        if (rc < HEAD) {
-            if (rc > 0) {
-                nn_freemsg(buf);
+            if (!pending) {
+                if (credit < 1) {
+                    continue;
+                }
+
+                asked = (credit < LAMB_MAX_BATCH) ? credit : LAMB_MAX_BATCH;
+                credit -= asked;
             }
-            lamb_sleep(1000);
-            continue;
-        }
-        
-        if (CHECK_COMMAND(buf) == LAMB_EMPTY) {
-            nn_freemsg(buf);
-            lamb_sleep(100);
+
+            /* The short receive timeout keeps the retransmit timer running */
+            rc = lamb_mux_fetch(scheduler, gid, asked, LAMB_MAX_BYTES, &pending, &buf);
+
+            if (pending) {
+                continue;
+            }
+
+            /* The part of the grant that was not used comes back */
+            credit += asked - ((rc > 0) ? lamb_batch_count(buf, rc) : 0);
+
+            if (rc < 1) {
+                /* Back off from an unreachable or busy scheduler */
+                if (rc < 0) {
+                    lamb_sleep(100);
+                }
+                continue;
+            }
+
+            batch = buf;
+            blen = rc;
+            offset = 0;
             continue;
         }
 
-        if (CHECK_COMMAND(buf) != LAMB_SUBMIT) {
-            nn_freemsg(buf);
+        if (method != LAMB_SUBMIT) {
             syslog(LOG_ERR, "only submit packets are allowed");
             continue;
         }
 
-        message = submit__unpack(NULL, rc - HEAD, (uint8_t *)(buf + HEAD));
-        nn_freemsg(buf);
+        message = submit__unpack(lamb_arena(), plen, (uint8_t *)payload);
 
         if (!message) {
             syslog(LOG_ERR, "can't unpack for submit message packets");
@@ -229,32 +276,36 @@ void *lamb_sender_loop(void *data) {
         }
 
         /* Caching message information */
+        memset(&confirmed, 0, sizeof(confirmed));
         confirmed.id = message->id;
         strncpy(confirmed.spcode, message->spcode, 20);
+        strncpy(confirmed.phone, message->phone, 20);
         confirmed.account = message->account;
         confirmed.company = message->company;
 
         /* Spcode processing */
         if (gateway->extended) {
-            snprintf(spcode, sizeof(spcode), "%s%s", gateway->spcode, message->spcode);
+            snprintf(confirmed.extended, 21, "%s%s", gateway->spcode, message->spcode);
         } else {
-            strcpy(spcode, gateway->spcode);
+            strncpy(confirmed.extended, gateway->spcode, 20);
         }
 
         /* Message encode convert */
-        memset(content, 0, sizeof(content));
-        err = lamb_encoded_convert((char *)message->content.data, message->length, content,
-                                   sizeof(content), "UTF-8", tocode, &length);
+        err = lamb_encoded_convert((char *)message->content.data, message->length, confirmed.content,
+                                   sizeof(confirmed.content), "UTF-8", tocode, &confirmed.length);
+        submit__free_unpacked(message, lamb_arena());
 
-        if (err || (length == 0)) {
+        if (err || (confirmed.length == 0)) {
             continue;
         }
 
+        /* Register in the window before the ack can arrive */
+        sequenceId = cmpp_sequence();
+        lamb_window_push(window, sequenceId, &confirmed);
+
         /* Send message to gateway */
-        sequenceId = confirmed.sequenceId = cmpp_sequence();
-        err = cmpp_submit(&cmpp.sock, sequenceId, gateway->spid, spcode, message->phone,
-                          content, length, msgFmt, NULL, true);
-        submit__free_unpacked(message, NULL);
+        err = cmpp_submit(&cmpp.sock, sequenceId, gateway->spid, confirmed.extended, confirmed.phone,
+                          confirmed.content, confirmed.length, msgFmt, NULL, true);
 
         /* Submit count statistical  */
         total++;
@@ -270,29 +321,62 @@ void *lamb_sender_loop(void *data) {
             continue;
         }
 
-        /* Wait for ACK confirmation */
-        err = lamb_wait_confirmation(&cond, &mutex, config.acknowledge_timeout);
-
-        if (err == ETIMEDOUT) {
-            status.timeo++;
-            syslog(LOG_ERR, "Wait for gateway Ack confirmation timeout");
-            lamb_sleep(config.interval * 1000);
-        }
-
         /* Flow control */
-        if (gateway->concurrent > 1000) {
-            delayed = 1000;
+        next += delayed;
+        now = lamb_now_microsecond();
+
+        if (next > now) {
+            lamb_msleep(next - now);
         } else {
-            delayed = 1000 / gateway->concurrent;
+            next = now;
         }
-
-        lamb_msleep(delayed);
     }
 
     pthread_exit(NULL);
 
 }
 
+void lamb_check_retransmit(void) {
+    int err;
+    int action;
+    int msgFmt;
+    unsigned int sequenceId;
+    lamb_confirmed_t confirmed;
+
+    msgFmt = gateway->encoding;
+
+    if (msgFmt != 0 && msgFmt != 8 && msgFmt != 11) {
+        msgFmt = 15;
+    }
+
+    while (true) {
+        action = lamb_window_expired(window, config.acknowledge_timeout, config.retry,
+                                     &sequenceId, &confirmed);
+
+        if (action == LAMB_WINDOW_NONE) {
+            break;
+        }
+
+        status.timeo++;
+
+        if (action == LAMB_WINDOW_DROP) {
+            syslog(LOG_ERR, "Wait for gateway Ack confirmation timeout, message %llu dropped", confirmed.id);
+            continue;
+        }
+
+        err = cmpp_submit(&cmpp.sock, sequenceId, gateway->spid, confirmed.extended, confirmed.phone,
+                          confirmed.content, confirmed.length, msgFmt, NULL, true);
+
+        if (err) {
+            status.err++;
+            syslog(LOG_ERR, "Retransmit message to gateway error");
+            break;
+        }
+    }
+
+    return;
+}
+
 void *lamb_deliver_loop(void *data) {
     int err;
     int result;
@@ -303,6 +387,8 @@ void *lamb_deliver_loop(void *data) {
     unsigned int sequenceId;
     unsigned long long msgId;
     char registered_delivery;
+    lamb_ack_t *ack;
+    lamb_confirmed_t confirmed;
     lamb_report_t *report;
     lamb_deliver_t *deliver;
 
@@ -334,7 +420,7 @@ void *lamb_deliver_loop(void *data) {
 
             //lamb_debug("message response id: %llu, msgId: %llu, result: %u\n", id, msgId, result);
             
-            if (confirmed.sequenceId != sequenceId) {
+            if (lamb_window_remove(window, sequenceId, &confirmed) != 0) {
                 status.err++;
                 syslog(LOG_ERR, "Ack sequenceId %u confirmed is incorrect", sequenceId);
                 break;
@@ -346,8 +432,22 @@ void *lamb_deliver_loop(void *data) {
                 break;
             }
 
-            pthread_cond_signal(&cond);
-            lamb_set_cache(&cache, msgId, confirmed.id, confirmed.account, confirmed.company, confirmed.spcode);
+            /* The work thread stores it with the next batch of reports */
+            ack = (lamb_ack_t *)lamb_slab_alloc(acks);
+            if (!ack) {
+                status.err++;
+                break;
+            }
+
+            ack->msgId = msgId;
+            ack->id = confirmed.id;
+            ack->account = confirmed.account;
+            ack->company = confirmed.company;
+            strncpy(ack->spcode, confirmed.spcode, sizeof(ack->spcode) - 1);
+
+            while (lamb_ring_push(acknowledged, ack) != 0) {
+                lamb_sleep(10);
+            }
             //lamb_debug("receive msgId: %llu message confirmation, result: %d\n", msgId, result);
 
             break;
@@ -357,7 +457,7 @@ void *lamb_deliver_loop(void *data) {
 
             if (registered_delivery == 1) {
                 status.rep++;
-                report = (lamb_report_t *)calloc(1, sizeof(lamb_report_t));
+                report = (lamb_report_t *)lamb_slab_alloc(reports);
 
                 if (!report) {
                     result = 9;
@@ -401,7 +501,9 @@ void *lamb_deliver_loop(void *data) {
                 }
 
                 report->type = LAMB_REPORT;
-                lamb_list_rpush(storage, lamb_node_new(report));
+                while (lamb_ring_push(storage, report) != 0) {
+                    lamb_sleep(10);
+                }
 
                 lamb_debug("receive msgId: %llu, phone: %s, stat: %s, submitTime: %s, doneTime: %s\n",
                            report->id, report->phone, stat, report->submittime, report->donetime);
@@ -410,7 +512,7 @@ void *lamb_deliver_loop(void *data) {
                 cmpp_deliver_resp(&cmpp.sock, sequenceId, report->id, result);
             } else {
                 status.delv++;
-                deliver = (lamb_deliver_t *)calloc(1, sizeof(lamb_deliver_t));
+                deliver = (lamb_deliver_t *)lamb_slab_alloc(delivers);
 
                 if (!deliver) {
                     result = 9;
@@ -440,7 +542,9 @@ void *lamb_deliver_loop(void *data) {
                                      deliver->length);
 
                 deliver->type = LAMB_DELIVER;
-                lamb_list_rpush(storage, lamb_node_new(deliver));
+                while (lamb_ring_push(storage, deliver) != 0) {
+                    lamb_sleep(10);
+                }
                 
                 lamb_debug("receive msgId: %llu, phone: %s, spcode: %s, msgFmt: %d, length: %d\n",
                            deliver->id, deliver->phone, deliver->spcode, deliver->msgfmt,
@@ -486,77 +590,83 @@ void *lamb_cmpp_keepalive(void *data) {
     pthread_exit(NULL);
 }
 
+/*
+ * Resolve reports against the acks of their submits. The storage queue
+ * is taken first and the acks queued before it are all taken after, so
+ * the ack of a report is always stored by the time it is looked up. A
+ * report whose ack is still not found, redis failed or the gateway was
+ * faster than the response, is tried again every LAMB_SP_RETRY.
+ */
+
 void *lamb_work_loop(void *data) {
-    int len;
-    void *pk;
-    char *buf;
-    void *message;
-    lamb_report_t *r;
+    int n, count, total;
+    int head, pending;
+    lamb_lru_t *lru;
     lamb_deliver_t *d;
-    lamb_node_t *node;
-
-    unsigned long long msgId;
-    char spcode[21];
-    int account;
-    int company;
+    unsigned long long now;
+    lamb_unresolved_t *unresolved, *u;
+    int tries[LAMB_SP_BATCH];
+    lamb_ack_t found[LAMB_SP_BATCH];
+    lamb_ack_t *confirmed[LAMB_SP_BATCH];
+    lamb_report_t *r[LAMB_SP_BATCH];
+    void *messages[LAMB_SP_BATCH];
 
     int slen = strlen(gateway->spcode);
     Report report = REPORT__INIT;
     Deliver deliver = DELIVER__INIT;
 
-    while (true) {
-        node = lamb_list_lpop(storage);
-
-        if (!node) {
-            lamb_sleep(10);
-            continue;
-        }
-
-        message = node->val;
+    /* Acks of the last minutes, most reports are resolved without a lookup */
+    lru = lamb_lru_new(LAMB_SP_RECENT, sizeof(lamb_ack_t));
+    if (!lru) {
+        syslog(LOG_ERR, "correlation cache initialization failed");
+        pthread_exit(NULL);
+    }
 
-        if (CHECK_TYPE(message) == LAMB_REPORT) {
-            r = (lamb_report_t *)message;
-            msgId = account = company = 0;
-            memset(spcode, 0, sizeof(spcode));
-            lamb_get_cache(&cache, r->id, &msgId, &account, &company, spcode, sizeof(spcode));
+    /* Unresolved reports in the order they failed, so the due ones are in front */
+    unresolved = (lamb_unresolved_t *)calloc(LAMB_SP_UNRESOLVED, sizeof(lamb_unresolved_t));
+    if (!unresolved) {
+        syslog(LOG_ERR, "the kernel can't allocate memory");
+        pthread_exit(NULL);
+    }
 
-            if (msgId > 0 && account > 0 && company > 0) {
-                lamb_del_cache(&cache, msgId);
-            } else {
-                goto done;
-            }
+    head = pending = 0;
 
-            /* Gateway state statistics */
-            pthread_mutex_lock(&statistical->lock);
-            lamb_check_statistical(r->status, statistical);
-            pthread_mutex_unlock(&statistical->lock);
+    while (true) {
+        count = 0;
+        now = lamb_now_microsecond();
+
+        /* Half of a batch at most, new reports keep flowing */
+        while (pending > 0 && count < LAMB_SP_BATCH / 2 && unresolved[head].deadline <= now) {
+            tries[count] = unresolved[head].tries;
+            r[count++] = unresolved[head].report;
+            head = (head + 1) % LAMB_SP_UNRESOLVED;
+            pending--;
+        }
 
-            report.id = msgId;
-            report.account = account;
-            report.company = company;
-            report.spcode = spcode;
-            report.phone = r->phone;
-            report.status = r->status;
-            report.submittime = r->submittime;
-            report.donetime = r->donetime;
+        total = lamb_ring_pop_bulk(storage, messages, LAMB_SP_BATCH - count);
 
-            len = report__get_packed_size(&report);
-            pk = malloc(len);
+        /* Every ack of a report taken above was queued before it */
+        while ((n = lamb_ring_pop_bulk(acknowledged, (void **)confirmed, LAMB_SP_BATCH)) == LAMB_SP_BATCH) {
+            lamb_correlate(lru, confirmed, n, r, 0, found);
 
-            if (!pk) {
-                goto done;
+            for (int i = 0; i < n; i++) {
+                lamb_slab_free(acks, confirmed[i]);
             }
+        }
 
-            report__pack(&report, pk);
-            len = lamb_pack_assembly(&buf, LAMB_REPORT, pk, len);
+        if (n == 0 && total == 0 && count == 0) {
+            lamb_sleep(10);
+            continue;
+        }
 
-            if (len > 0) {
-                nn_send(delivery, buf, len, 0);
-                free(buf);
+        for (int i = 0; i < total; i++) {
+            if (CHECK_TYPE(messages[i]) == LAMB_REPORT) {
+                tries[count] = 0;
+                r[count++] = (lamb_report_t *)messages[i];
+                continue;
             }
-            free(pk);
-        } else if (CHECK_TYPE(message) == LAMB_DELIVER) {
-            d = (lamb_deliver_t *)message;
+
+            d = (lamb_deliver_t *)messages[i];
 
             deliver.id = d->id;
             deliver.account = 0;
@@ -575,29 +685,61 @@ void *lamb_work_loop(void *data) {
             deliver.content.len = d->length;
             deliver.content.data = (void *)d->content;
 
-            len = deliver__get_packed_size(&deliver);
-            pk = malloc(len);
+            while (lamb_mux_message(delivery, LAMB_DELIVER, gid, &deliver.base) == LAMB_BUSY) {
+                lamb_sleep(10);
+            }
+
+            lamb_slab_free(delivers, d);
+        }
+
+        /* One round trip stores the acks and resolves the reports */
+        lamb_correlate(lru, confirmed, n, r, count, found);
+
+        for (int i = 0; i < n; i++) {
+            lamb_slab_free(acks, confirmed[i]);
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (found[i].id == 0 || found[i].account == 0 || found[i].company == 0) {
+                if (tries[i] + 1 >= LAMB_SP_TRIES || pending >= LAMB_SP_UNRESOLVED) {
+                    status.err++;
+                    syslog(LOG_WARNING, "no submit found for report %llu, dropped", r[i]->id);
+                    lamb_slab_free(reports, r[i]);
+                    continue;
+                }
 
-            if (!pk) {
-                goto done;
+                u = &unresolved[(head + pending) % LAMB_SP_UNRESOLVED];
+                u->report = r[i];
+                u->tries = tries[i] + 1;
+                u->deadline = now + LAMB_SP_RETRY * 1000ULL;
+                pending++;
+                continue;
             }
 
-            deliver__pack(&deliver, pk);
-            len = lamb_pack_assembly(&buf, LAMB_DELIVER, pk, len);
+            /* Gateway state statistics */
+            pthread_mutex_lock(&statistical->lock);
+            lamb_check_statistical(r[i]->status, statistical);
+            pthread_mutex_unlock(&statistical->lock);
 
-            if (len > 0) {
-                nn_send(delivery, buf, len, 0);
-                free(buf);
+            report.id = found[i].id;
+            report.account = found[i].account;
+            report.company = found[i].company;
+            report.spcode = found[i].spcode;
+            report.phone = r[i]->phone;
+            report.status = r[i]->status;
+            report.submittime = r[i]->submittime;
+            report.donetime = r[i]->donetime;
+
+            while (lamb_mux_message(delivery, LAMB_REPORT, gid, &report.base) == LAMB_BUSY) {
+                lamb_sleep(10);
             }
 
-            free(pk);
+            lamb_slab_free(reports, r[i]);
         }
-
-    done:
-        free(message);
-        free(node);
     }
 
+    free(unresolved);
+    lamb_lru_destroy(lru);
     pthread_exit(NULL);
 }
 
@@ -726,8 +868,8 @@ void *lamb_stat_loop(void *data) {
         }
 
 #ifdef _DEBUG
-        printf("queue: %u, sub: %llu, ack: %llu, rep: %llu, delv: %llu, timeo: %llu, err: %llu\n",
-               storage->len, status.sub, status.ack, status.rep, status.delv, status.timeo, status.err);
+        printf("queue: %zu, sub: %llu, ack: %llu, rep: %llu, delv: %llu, timeo: %llu, err: %llu\n",
+               lamb_ring_len(storage), status.sub, status.ack, status.rep, status.delv, status.timeo, status.err);
 #endif
 
         pthread_mutex_lock(&rdb->lock);
@@ -761,75 +903,109 @@ void lamb_clean_statistical(lamb_statistical_t *stat) {
     return;
 }
 
-int lamb_set_cache(lamb_caches_t *caches, unsigned long long msgId, unsigned long long id,
-                   int account, int company, char *spcode) {
-    int i;
-    redisReply *reply = NULL;
-    
-    i = (msgId % caches->len);
+/*
+ * Store a batch of acks and resolve a batch of reports in one pipelined
+ * round trip. A report whose ack is still in the recent cache or in
+ * this batch is resolved locally, the rest are read and deleted by a
+ * script. found[i] is left zeroed for a report nobody knows.
+ */
 
-    pthread_mutex_lock(&caches->nodes[i]->lock);
-    reply = redisCommand(caches->nodes[i]->handle, "HMSET %llu id %llu account %d company %d spcode %s",
-                         msgId, id, account, company, spcode);
-    pthread_mutex_unlock(&caches->nodes[i]->lock);
+void lamb_correlate(lamb_lru_t *lru, lamb_ack_t **confirmed, int n, lamb_report_t **r, int count,
+                    lamb_ack_t *found) {
+    int k, len;
+    lamb_ack_t *ack;
+    bool resolved[LAMB_SP_BATCH];
+    int owners[LAMB_SP_BATCH * 3];
+    int lens[LAMB_SP_BATCH * 3];
+    char *cmds[LAMB_SP_BATCH * 3];
+    unsigned long keys[LAMB_SP_BATCH * 3];
+    redisReply *replies[LAMB_SP_BATCH * 3];
+
+    k = 0;
+    memset(found, 0, sizeof(lamb_ack_t) * count);
+    memset(resolved, 0, sizeof(resolved));
+
+    for (int i = 0; i < count; i++) {
+        len = -1;
+        ack = (lamb_ack_t *)lamb_lru_get(lru, r[i]->id);
+
+        if (ack) {
+            /* Stored by an earlier batch, only the key is left to delete */
+            memcpy(&found[i], ack, sizeof(lamb_ack_t));
+            lamb_lru_del(lru, r[i]->id);
+            len = redisFormatCommand(&cmds[k], "DEL %llu", r[i]->id);
+            owners[k] = -1;
+        } else {
+            for (int j = 0; j < n; j++) {
+                if (!resolved[j] && confirmed[j]->msgId == r[i]->id) {
+                    memcpy(&found[i], confirmed[j], sizeof(lamb_ack_t));
+                    resolved[j] = true;
+                    break;
+                }
+            }
 
-    if (reply != NULL) {
-        freeReplyObject(reply);
-        return 0;
-    }
+            if (found[i].msgId == 0) {
+                len = redisFormatCommand(&cmds[k], "EVAL %s 1 %llu", LAMB_SP_TAKE, r[i]->id);
+                owners[k] = i;
+            }
+        }
 
-    return -1;
-}
+        if (len > 0) {
+            lens[k] = len;
+            keys[k] = r[i]->id;
+            k++;
+        }
+    }
 
-int lamb_get_cache(lamb_caches_t *caches, unsigned long long id, unsigned long long *msgId,
-                   int *account, int *company, char *spcode, size_t size) {
-    int i;
-    redisReply *reply = NULL;
+    /* Acks whose report came in the same batch are never written */
+    for (int j = 0; j < n; j++) {
+        if (resolved[j]) {
+            continue;
+        }
 
-    i = (id % caches->len);
+        ack = confirmed[j];
+        len = redisFormatCommand(&cmds[k], "HMSET %llu id %llu account %d company %d spcode %s",
+                                 ack->msgId, ack->id, ack->account, ack->company, ack->spcode);
+        if (len > 0) {
+            lens[k] = len;
+            keys[k] = ack->msgId;
+            owners[k++] = -1;
+        }
 
-    pthread_mutex_lock(&caches->nodes[i]->lock);
-    reply = redisCommand(caches->nodes[i]->handle, "HMGET %llu id account company spcode", id);
-    pthread_mutex_unlock(&caches->nodes[i]->lock);
+        len = redisFormatCommand(&cmds[k], "EXPIRE %llu %d", ack->msgId, LAMB_SP_EXPIRE);
+        if (len > 0) {
+            lens[k] = len;
+            keys[k] = ack->msgId;
+            owners[k++] = -1;
+        }
 
-    if (!reply) {
-        return -1;
+        memcpy(lamb_lru_put(lru, ack->msgId), ack, sizeof(lamb_ack_t));
     }
 
-    if (reply->type == REDIS_REPLY_ARRAY) {
-        if (reply->elements == 4) {
-            *msgId = (reply->element[0]->len > 0) ? strtoull(reply->element[0]->str, NULL, 10) : 0;
-            *account = (reply->element[1]->len > 0) ? atoi(reply->element[1]->str) : 0;
-            *company = (reply->element[2]->len > 0) ? atoi(reply->element[2]->str) : 0;
-            if (reply->element[3]->len >= size) {
-                memcpy(spcode, reply->element[3]->str, size - 1);
-            } else {
-                memcpy(spcode, reply->element[3]->str, reply->element[3]->len);
+    lamb_nodes_replies(&cache, k, keys, cmds, lens, replies);
+
+    for (int i = 0; i < k; i++) {
+        if (owners[i] >= 0 && replies[i] && replies[i]->type == REDIS_REPLY_ARRAY && replies[i]->elements == 4) {
+            ack = &found[owners[i]];
+            ack->msgId = keys[i];
+            ack->id = (replies[i]->element[0]->len > 0) ? strtoull(replies[i]->element[0]->str, NULL, 10) : 0;
+            ack->account = (replies[i]->element[1]->len > 0) ? atoi(replies[i]->element[1]->str) : 0;
+            ack->company = (replies[i]->element[2]->len > 0) ? atoi(replies[i]->element[2]->str) : 0;
+            if (replies[i]->element[3]->len > 0) {
+                len = replies[i]->element[3]->len;
+                memcpy(ack->spcode, replies[i]->element[3]->str,
+                       (len < sizeof(ack->spcode)) ? len : sizeof(ack->spcode) - 1);
             }
         }
-    }
-
-    freeReplyObject(reply);
-
-    return 0;
-}
 
-int lamb_del_cache(lamb_caches_t *caches, unsigned long long msgId) {
-    int i;
-    redisReply *reply = NULL;
-
-    i = (msgId % caches->len);
+        if (replies[i]) {
+            freeReplyObject(replies[i]);
+        }
 
-    pthread_mutex_lock(&caches->nodes[i]->lock);
-    reply = redisCommand(caches->nodes[i]->handle, "DEL %llu", msgId);
-    pthread_mutex_unlock(&caches->nodes[i]->lock);
-    
-    if (reply != NULL) {
-        freeReplyObject(reply);
-        return 0;
+        free(cmds[i]);
     }
 
-    return -1;
+    return;
 }
 
 int lamb_write_statistical(lamb_db_t *db, lamb_statistical_t *stat) {
@@ -918,8 +1094,8 @@ void lamb_clear_signal(lamb_cache_t *cache, int id) {
 void lamb_exit_cleanup(void) {
     cmpp_terminate(&cmpp.sock, cmpp_sequence());
     lamb_sleep(3000);
-    lamb_nn_close(scheduler);
-    lamb_nn_close(delivery);
+    lamb_mux_close(scheduler);
+    lamb_mux_close(delivery);
     lamb_db_close(db);
     lamb_cache_close(rdb);
     lamb_lock_release(&lock);
@@ -935,12 +1111,33 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     }
 
 /* Storage Initialization */
-    storage = lamb_list_new();
+    storage = lamb_ring_new(LAMB_QUEUE_SIZE);
     if (!storage) {
         syslog(LOG_ERR, "storage queue initialization failed");
         return -1;
     }
 
+    acknowledged = lamb_ring_new(LAMB_QUEUE_SIZE);
+    if (!acknowledged) {
+        syslog(LOG_ERR, "acknowledge queue initialization failed");
+        return -1;
+    }
+
+    acks = lamb_slab_new(sizeof(lamb_ack_t));
+    reports = lamb_slab_new(sizeof(lamb_report_t));
+    delivers = lamb_slab_new(sizeof(lamb_deliver_t));
+    if (!acks || !reports || !delivers) {
+        syslog(LOG_ERR, "message slab initialization failed");
+        return -1;
+    }
+
+    /* Submit window initialization */
+    window = lamb_window_new(cfg->window, sizeof(lamb_confirmed_t));
+    if (!window) {
+        syslog(LOG_ERR, "submit window initialization failed");
+        return -1;
+    }
+
     statistical = (lamb_statistical_t *)calloc(1, sizeof(lamb_statistical_t));
     if (!statistical) {
         syslog(LOG_ERR, "The kernel can't allocate memory");
@@ -1009,16 +1206,19 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     lamb_debug("connect to cache cluster successfull\n");
 
     /* Connect to scheduler server */
-    scheduler = lamb_nn_reqrep(cfg->scheduler, gid, cfg->timeout);
+    scheduler = lamb_mux_connect(cfg->scheduler, cfg->timeout);
     if (scheduler < 0) {
         syslog(LOG_ERR, "can't connect to scheduler %s", cfg->scheduler);
         return -1;
     }
 
+    /* Keep the retransmit timer running while the stream is idle */
+    lamb_mux_timeout(scheduler, 100);
+
     lamb_debug("connect to scheduler server successfull\n");
 
     /* Connect to delivery server */
-    delivery = lamb_nn_pair(cfg->delivery, gid, cfg->timeout);
+    delivery = lamb_mux_connect(cfg->delivery, cfg->timeout);
     if (delivery < 0) {
         syslog(LOG_ERR, "can't connect to delivery %s", cfg->delivery);
         return -1;
@@ -1095,6 +1295,17 @@ int lamb_read_config(lamb_config_t *conf, const char *file) {
         goto error;
     }
 
+    /* Window, optional for the configurations written before it */
+    if (lamb_get_int(&cfg, "Window", &conf->window) != 0) {
+        conf->window = LAMB_SP_WINDOW;
+    }
+
+    /* Check window validity */
+    if (conf->window < 1 || conf->window > 1024) {
+        fprintf(stderr, "Invalid submit window size\n");
+        goto error;
+    }
+
     /* RedisHost */
     if (lamb_get_string(&cfg, "RedisHost", conf->redis_host, 16) != 0) {
         fprintf(stderr, "Can't read config 'RedisHost' parameter\n");
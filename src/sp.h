@@ -11,6 +11,20 @@
 #include "common.h"
 #include "db.h"
 #include "cache.h"
+#include "window.h"
+#include "lru.h"
+
+#define LAMB_SP_BATCH  64
+#define LAMB_SP_RECENT 65536
+#define LAMB_SP_EXPIRE 259200
+#define LAMB_SP_WINDOW 16
+#define LAMB_SP_RETRY  1000
+#define LAMB_SP_TRIES  30
+#define LAMB_SP_UNRESOLVED 8192
+
+/* Read the fields of an ack and delete it in the same call */
+#define LAMB_SP_TAKE "local v = redis.call('HMGET', KEYS[1], 'id', 'account', 'company', 'spcode') " \
+    "redis.call('DEL', KEYS[1]) return v"
 
 typedef struct {
     int id;
@@ -23,6 +37,7 @@ typedef struct {
     long acknowledge_timeout;
     bool extended;
     int concurrent;
+    int window;
     char backfile[128];
     char logfile[128];
     char ac[128];
@@ -66,8 +81,11 @@ typedef struct {
     int account;
     int company;
     char spcode[24];
-    unsigned int sequenceId;
     unsigned long long id;
+    char phone[24];
+    char extended[24];
+    int length;
+    char content[256];
 } lamb_confirmed_t;
 
 typedef struct {
@@ -75,9 +93,26 @@ typedef struct {
     unsigned int sequenceId;
 } lamb_heartbeat_t;
 
+/* What the gateway msg id of an accepted submit stands for */
+typedef struct {
+    unsigned long long msgId;
+    unsigned long long id;
+    int account;
+    int company;
+    char spcode[24];
+} lamb_ack_t;
+
+/* A report whose ack was not found, it is resolved again later */
+typedef struct {
+    lamb_report_t *report;
+    int tries;
+    unsigned long long deadline;
+} lamb_unresolved_t;
+
 void lamb_event_loop(void);
 void *lamb_sender_loop(void *data);
 void *lamb_deliver_loop(void *data);
+void lamb_check_retransmit(void);
 void *lamb_work_loop(void *data);
 void *lamb_cmpp_keepalive(void *data);
 void lamb_cmpp_reconnect(cmpp_sp_t *cmpp, lamb_config_t *config);
@@ -87,9 +122,7 @@ void *lamb_online_loop(void *arg);
 int lamb_state_renewal(lamb_cache_t *cache, int id);
 void lamb_clean_statistical(lamb_statistical_t *stat);
 int lamb_read_config(lamb_config_t *conf, const char *file);
-int lamb_set_cache(lamb_caches_t *caches, unsigned long long msgId, unsigned long long id, int account, int company, char *spcode);
-int lamb_get_cache(lamb_caches_t *caches, unsigned long long id, unsigned long long *msgId, int *account, int *company, char *spcode, size_t size);
-int lamb_del_cache(lamb_caches_t *caches, unsigned long long msgId);
+void lamb_correlate(lamb_lru_t *lru, lamb_ack_t **confirmed, int n, lamb_report_t **r, int count, lamb_ack_t *found);
 void lamb_check_statistical(int status, lamb_statistical_t *stat);
 int lamb_write_statistical(lamb_db_t *db, lamb_statistical_t *stat);
 int lamb_check_signal(lamb_cache_t *cache, int id);
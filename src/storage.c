@@ -0,0 +1,321 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+#include "storage.h"
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} lamb_copy_t;
+
+typedef int (*lamb_store_func)(lamb_db_t *db, void **items, int count);
+
+static int lamb_copy_init(lamb_copy_t *copy, size_t size);
+static int lamb_copy_reserve(lamb_copy_t *copy, size_t len);
+static void lamb_copy_put16(lamb_copy_t *copy, int16_t val);
+static void lamb_copy_put32(lamb_copy_t *copy, int32_t val);
+static void lamb_copy_int32(lamb_copy_t *copy, int32_t val);
+static void lamb_copy_int64(lamb_copy_t *copy, int64_t val);
+static void lamb_copy_text(lamb_copy_t *copy, const char *val, size_t max);
+static int lamb_copy_send(lamb_db_t *db, const char *sql, lamb_copy_t *copy);
+static int lamb_copy_message(lamb_db_t *db, void **items, int count);
+static int lamb_copy_deliver(lamb_db_t *db, void **items, int count);
+static int lamb_update_report(lamb_db_t *db, void **items, int count);
+
+/*
+ * Write one batch of rows of the same type. A failed batch is retried
+ * once after a broken connection has been reset, then split into
+ * single rows so that one bad row does not lose the whole batch.
+ * Returns -1 when some rows could not be written.
+ */
+
+int lamb_store_write(lamb_db_t *db, int type, void **items, int count) {
+    int err, lost;
+    lamb_store_func func;
+
+    if (count < 1) {
+        return 0;
+    }
+
+    switch (type) {
+    case LAMB_SUBMIT:
+        func = lamb_copy_message;
+        break;
+    case LAMB_REPORT:
+        func = lamb_update_report;
+        break;
+    case LAMB_DELIVER:
+        func = lamb_copy_deliver;
+        break;
+    default:
+        return -1;
+    }
+
+    err = func(db, items, count);
+
+    if (err && PQstatus(db->conn) != CONNECTION_OK) {
+        PQreset(db->conn);
+        err = func(db, items, count);
+    }
+
+    if (!err) {
+        return 0;
+    }
+
+    if (count == 1) {
+        return -1;
+    }
+
+    lost = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (func(db, &items[i], 1) != 0) {
+            lost++;
+        }
+    }
+
+    if (lost > 0) {
+        syslog(LOG_ERR, "storage batch lost %d of %d rows", lost, count);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int lamb_copy_message(lamb_db_t *db, void **items, int count) {
+    int err;
+    lamb_copy_t copy;
+    lamb_submit_t *message;
+
+    if (lamb_copy_init(&copy, count * 256) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        message = (lamb_submit_t *)items[i];
+        if (lamb_copy_reserve(&copy, 512) != 0) {
+            free(copy.buf);
+            return -1;
+        }
+        lamb_copy_put16(&copy, 8);
+        lamb_copy_int64(&copy, (int64_t)message->id);
+        lamb_copy_text(&copy, message->spid, sizeof(message->spid));
+        lamb_copy_text(&copy, message->spcode, sizeof(message->spcode));
+        lamb_copy_text(&copy, message->phone, sizeof(message->phone));
+        lamb_copy_text(&copy, message->content, sizeof(message->content));
+        lamb_copy_int32(&copy, 0);
+        lamb_copy_int32(&copy, message->account);
+        lamb_copy_int32(&copy, message->company);
+    }
+
+    err = lamb_copy_send(db, "COPY message(id, spid, spcode, phone, content, status, account, company) "
+                         "FROM STDIN (FORMAT binary)", &copy);
+    free(copy.buf);
+
+    return err;
+}
+
+static int lamb_copy_deliver(lamb_db_t *db, void **items, int count) {
+    int err;
+    lamb_copy_t copy;
+    lamb_deliver_t *message;
+
+    if (lamb_copy_init(&copy, count * 256) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        message = (lamb_deliver_t *)items[i];
+        if (lamb_copy_reserve(&copy, 512) != 0) {
+            free(copy.buf);
+            return -1;
+        }
+        lamb_copy_put16(&copy, 6);
+        lamb_copy_int64(&copy, (int64_t)message->id);
+        lamb_copy_text(&copy, message->spcode, sizeof(message->spcode));
+        lamb_copy_text(&copy, message->phone, sizeof(message->phone));
+        lamb_copy_text(&copy, message->content, sizeof(message->content));
+        lamb_copy_int32(&copy, message->account);
+        lamb_copy_int32(&copy, message->company);
+    }
+
+    err = lamb_copy_send(db, "COPY delivery(id, spcode, phone, content, account, company) "
+                         "FROM STDIN (FORMAT binary)", &copy);
+    free(copy.buf);
+
+    return err;
+}
+
+/* All status changes of the batch in a single UPDATE joined on unnest() */
+static int lamb_update_report(lamb_db_t *db, void **items, int count) {
+    int err;
+    char *ids, *sts;
+    size_t ilen, slen;
+    const char *values[2];
+    lamb_report_t *report;
+    PGresult *res = NULL;
+
+    ids = (char *)malloc(count * 24 + 2);
+    sts = (char *)malloc(count * 12 + 2);
+
+    if (!ids || !sts) {
+        free(ids);
+        free(sts);
+        return -1;
+    }
+
+    ilen = slen = 0;
+    ids[ilen++] = '{';
+    sts[slen++] = '{';
+
+    for (int i = 0; i < count; i++) {
+        report = (lamb_report_t *)items[i];
+        ilen += sprintf(ids + ilen, "%s%lld", i ? "," : "", (long long)report->id);
+        slen += sprintf(sts + slen, "%s%d", i ? "," : "", report->status);
+    }
+
+    strcpy(ids + ilen, "}");
+    strcpy(sts + slen, "}");
+
+    values[0] = ids;
+    values[1] = sts;
+
+    res = PQexecParams(db->conn, "UPDATE message SET status = v.status "
+                       "FROM unnest($1::bigint[], $2::int[]) AS v(id, status) "
+                       "WHERE message.id = v.id", 2, NULL, values, NULL, NULL, 0);
+
+    err = 0;
+
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        syslog(LOG_ERR, "storage update report: %s", PQresultErrorMessage(res));
+        err = -1;
+    }
+
+    PQclear(res);
+    free(ids);
+    free(sts);
+
+    return err;
+}
+
+static int lamb_copy_send(lamb_db_t *db, const char *sql, lamb_copy_t *copy) {
+    int err;
+    PGresult *res = NULL;
+
+    /* File trailer */
+    if (lamb_copy_reserve(copy, 2) != 0) {
+        return -1;
+    }
+
+    lamb_copy_put16(copy, -1);
+
+    res = PQexec(db->conn, sql);
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        syslog(LOG_ERR, "storage copy: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return -1;
+    }
+
+    PQclear(res);
+    err = 0;
+
+    if (PQputCopyData(db->conn, copy->buf, copy->len) != 1) {
+        PQputCopyEnd(db->conn, "copy data failed");
+        err = -1;
+    } else if (PQputCopyEnd(db->conn, NULL) != 1) {
+        err = -1;
+    }
+
+    while ((res = PQgetResult(db->conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            syslog(LOG_ERR, "storage copy: %s", PQresultErrorMessage(res));
+            err = -1;
+        }
+        PQclear(res);
+    }
+
+    return err;
+}
+
+/* Binary COPY header: signature, flags and header extension length */
+static int lamb_copy_init(lamb_copy_t *copy, size_t size) {
+    copy->buf = (char *)malloc(size + 32);
+    if (!copy->buf) {
+        return -1;
+    }
+
+    copy->size = size + 32;
+    memcpy(copy->buf, "PGCOPY\n\377\r\n\0", 11);
+    copy->len = 11;
+    lamb_copy_put32(copy, 0);
+    lamb_copy_put32(copy, 0);
+
+    return 0;
+}
+
+static int lamb_copy_reserve(lamb_copy_t *copy, size_t len) {
+    char *buf;
+
+    if (copy->len + len <= copy->size) {
+        return 0;
+    }
+
+    buf = (char *)realloc(copy->buf, copy->size * 2 + len);
+    if (!buf) {
+        return -1;
+    }
+
+    copy->buf = buf;
+    copy->size = copy->size * 2 + len;
+
+    return 0;
+}
+
+static void lamb_copy_put16(lamb_copy_t *copy, int16_t val) {
+    uint16_t v = htons((uint16_t)val);
+    memcpy(copy->buf + copy->len, &v, 2);
+    copy->len += 2;
+    return;
+}
+
+static void lamb_copy_put32(lamb_copy_t *copy, int32_t val) {
+    uint32_t v = htonl((uint32_t)val);
+    memcpy(copy->buf + copy->len, &v, 4);
+    copy->len += 4;
+    return;
+}
+
+/* Each field is its byte length followed by the value in network order */
+static void lamb_copy_int32(lamb_copy_t *copy, int32_t val) {
+    lamb_copy_put32(copy, 4);
+    lamb_copy_put32(copy, val);
+    return;
+}
+
+static void lamb_copy_int64(lamb_copy_t *copy, int64_t val) {
+    lamb_copy_put32(copy, 8);
+    lamb_copy_put32(copy, (int32_t)((uint64_t)val >> 32));
+    lamb_copy_put32(copy, (int32_t)((uint64_t)val & 0xffffffff));
+    return;
+}
+
+/* Text fields are sent as raw bytes, up to the first NUL or max */
+static void lamb_copy_text(lamb_copy_t *copy, const char *val, size_t max) {
+    size_t len;
+
+    len = strnlen(val, max);
+    lamb_copy_put32(copy, (int32_t)len);
+    memcpy(copy->buf + copy->len, val, len);
+    copy->len += len;
+
+    return;
+}
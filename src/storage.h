@@ -0,0 +1,16 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_STORAGE_H
+#define _LAMB_STORAGE_H
+
+#include "db.h"
+#include "common.h"
+
+#define LAMB_STORE_BATCH 1024
+
+int lamb_store_write(lamb_db_t *db, int type, void **items, int count);
+
+#endif
@@ -4,11 +4,19 @@
  * Copyright (C) 2017 typefo <typefo@qq.com>
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
 #include "template.h"
 
+#define LAMB_SIGN_OPEN  "【"
+#define LAMB_SIGN_CLOSE "】"
+#define LAMB_SIGN_LEN   (sizeof(LAMB_SIGN_OPEN) - 1)
+
+static unsigned int lamb_template_hash(const char *key, int len);
+static bool lamb_template_literal(const char *name);
+
 int lamb_get_templates(lamb_db_t *db, lamb_list_t *templates) {
     int rows;
     char *column;
@@ -41,7 +49,7 @@ int lamb_get_templates(lamb_db_t *db, lamb_list_t *templates) {
     return 0;
 }
 
-int lamb_get_template(lamb_db_t *db, int acc, lamb_list_t *templates) {
+int lamb_get_template(lamb_db_t *db, int acc, lamb_templates_t *templates) {
     int rows;
     char *column;
     char sql[256];
@@ -66,10 +74,185 @@ int lamb_get_template(lamb_db_t *db, int acc, lamb_list_t *templates) {
             t->acc = atoi(PQgetvalue(res, i, 1));
             strncpy(t->name, PQgetvalue(res, i, 2), 63);
             strncpy(t->content, PQgetvalue(res, i, 3), 511);
-            lamb_list_rpush(templates, lamb_node_new(t));
+            if (lamb_templates_add(templates, t) != 0) {
+                lamb_template_free(t);
+            }
         }
     }
 
     PQclear(res);
     return 0;
 }
+
+/* Compile and study the template pattern with the JIT enabled */
+int lamb_template_compile(lamb_template_t *template) {
+    int erroffset;
+    const char *error;
+    char pattern[640];
+
+    snprintf(pattern, sizeof(pattern), "^%s%s%s%s$", LAMB_SIGN_OPEN, template->name,
+             LAMB_SIGN_CLOSE, template->content);
+
+    template->re = pcre_compile(pattern, 0, &error, &erroffset, NULL);
+    if (!template->re) {
+        return -1;
+    }
+
+    /* A NULL study result without error only means nothing to optimize */
+    template->extra = pcre_study(template->re, PCRE_STUDY_JIT_COMPILE, &error);
+
+    return 0;
+}
+
+void lamb_template_free(void *template) {
+    lamb_template_t *t;
+
+    t = (lamb_template_t *)template;
+
+    if (t) {
+        if (t->extra) {
+            pcre_free_study(t->extra);
+        }
+        if (t->re) {
+            pcre_free(t->re);
+        }
+        free(t);
+    }
+
+    return;
+}
+
+lamb_templates_t *lamb_templates_new(void) {
+    lamb_templates_t *self;
+
+    self = (lamb_templates_t *)calloc(1, sizeof(lamb_templates_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->generic = lamb_list_new();
+    if (!self->generic) {
+        free(self);
+        return NULL;
+    }
+
+    self->generic->free = lamb_template_free;
+
+    return self;
+}
+
+/* Compile the template and file it under its signature */
+int lamb_templates_add(lamb_templates_t *templates, lamb_template_t *template) {
+    unsigned int i;
+    lamb_list_t *list;
+
+    if (lamb_template_compile(template) != 0) {
+        return -1;
+    }
+
+    if (lamb_template_literal(template->name)) {
+        i = lamb_template_hash(template->name, strlen(template->name)) % LAMB_TEMPLATE_BUCKETS;
+        if (!templates->buckets[i]) {
+            templates->buckets[i] = lamb_list_new();
+            if (!templates->buckets[i]) {
+                return -1;
+            }
+            templates->buckets[i]->free = lamb_template_free;
+        }
+        list = templates->buckets[i];
+    } else {
+        list = templates->generic;
+    }
+
+    if (!lamb_list_rpush(list, lamb_node_new(template))) {
+        return -1;
+    }
+
+    templates->count++;
+
+    return 0;
+}
+
+/*
+ * The index is read only once built, so the lists are walked
+ * directly instead of allocating an iterator per message.
+ */
+
+bool lamb_templates_match(lamb_templates_t *templates, char *content, int len) {
+    int rc, slen;
+    char *sign, *end;
+    lamb_node_t *node;
+    lamb_template_t *t;
+    int ovector[30];
+
+    if (len > LAMB_SIGN_LEN && memcmp(content, LAMB_SIGN_OPEN, LAMB_SIGN_LEN) == 0) {
+        sign = content + LAMB_SIGN_LEN;
+        end = memmem(sign, len - LAMB_SIGN_LEN, LAMB_SIGN_CLOSE, LAMB_SIGN_LEN);
+
+        if (end && (end - sign) < 64) {
+            slen = end - sign;
+            lamb_list_t *list = templates->buckets[lamb_template_hash(sign, slen) % LAMB_TEMPLATE_BUCKETS];
+
+            for (node = list ? list->head : NULL; node; node = node->next) {
+                t = (lamb_template_t *)node->val;
+                if (strncmp(t->name, sign, slen) != 0 || t->name[slen] != '\0') {
+                    continue;
+                }
+
+                rc = pcre_exec(t->re, t->extra, content, len, 0, 0, ovector, 30);
+                if (rc >= 0) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    for (node = templates->generic->head; node; node = node->next) {
+        t = (lamb_template_t *)node->val;
+        rc = pcre_exec(t->re, t->extra, content, len, 0, 0, ovector, 30);
+        if (rc >= 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void lamb_templates_destroy(lamb_templates_t *templates) {
+    if (templates) {
+        for (int i = 0; i < LAMB_TEMPLATE_BUCKETS; i++) {
+            if (templates->buckets[i]) {
+                lamb_list_destroy(templates->buckets[i]);
+            }
+        }
+        lamb_list_destroy(templates->generic);
+        free(templates);
+    }
+
+    return;
+}
+
+/* FNV-1a */
+static unsigned int lamb_template_hash(const char *key, int len) {
+    unsigned int hash = 2166136261U;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/* A signature without metacharacters can only match itself */
+static bool lamb_template_literal(const char *name) {
+    if (strpbrk(name, "\\^$.[]|()?*+{}") != NULL) {
+        return false;
+    }
+
+    if (strstr(name, LAMB_SIGN_CLOSE) != NULL) {
+        return false;
+    }
+
+    return true;
+}
@@ -7,17 +7,42 @@
 #ifndef _LAMB_TEMPLATE_H
 #define _LAMB_TEMPLATE_H
 
+#include <stdbool.h>
+#include <pcre.h>
 #include "db.h"
 #include "list.h"
 
+#define LAMB_TEMPLATE_BUCKETS 256
+
 typedef struct {
     int id;
     int acc;
     char name[64];
     char content[512];
+    pcre *re;
+    pcre_extra *extra;
 } lamb_template_t;
 
+/*
+ * Compiled templates indexed by signature. A message that starts
+ * with 【signature】 is only checked against the bucket holding that
+ * signature, templates whose name is itself a regular expression
+ * are kept in the generic list and tried for every message.
+ */
+
+typedef struct {
+    int count;
+    lamb_list_t *generic;
+    lamb_list_t *buckets[LAMB_TEMPLATE_BUCKETS];
+} lamb_templates_t;
+
 int lamb_get_templates(lamb_db_t *db, lamb_list_t *templates);
-int lamb_get_template(lamb_db_t *db, int acc, lamb_list_t *templates);
+int lamb_get_template(lamb_db_t *db, int acc, lamb_templates_t *templates);
+int lamb_template_compile(lamb_template_t *template);
+void lamb_template_free(void *template);
+lamb_templates_t *lamb_templates_new(void);
+int lamb_templates_add(lamb_templates_t *templates, lamb_template_t *template);
+bool lamb_templates_match(lamb_templates_t *templates, char *content, int len);
+void lamb_templates_destroy(lamb_templates_t *templates);
 
 #endif
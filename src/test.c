@@ -23,6 +23,7 @@
 #include <nanomsg/reqrep.h>
 #include <syslog.h>
 #include "socket.h"
+#include "mux.h"
 #include "log.h"
 #include "test.h"
 
@@ -103,9 +104,6 @@ void lamb_event_loop(void) {
         return;
     }
 
-    int len;
-    void *pk;
-    char *buf;
     int status;
     int channel;
     lamb_submit_t submit;
@@ -129,40 +127,26 @@ void lamb_event_loop(void) {
         message.spcode = submit.spcode;
         message.channel = channel;
 
-        len = message__get_packed_size(&message);
-        pk = malloc(len);
+        /* Send message to schduler */
+        status = lamb_mux_message(scheduler, LAMB_MESSAGE, config->id, &message.base);
 
-        if (!pk) {
-            syslog(LOG_ERR, "The kernel can't allocate memory");
-            continue;
-        }
+        /* Check state response */
+        status = lamb_check_response(status);
 
-        message__pack(&message, pk);
-        len = lamb_pack_assembly(&buf, LAMB_MESSAGE, pk, len);
-        if (len > 0) {
-            /* Send message to schduler */
-            nn_send(scheduler, buf, len, 0);
-
-            /* Check state response */
-            status = lamb_check_response(scheduler);
-
-            switch (status) {
-            case 1:
-                syslog(LOG_NOTICE, "message %"PRId64" response state successfull", message.id);
-                break;
-            case 2:
-                syslog(LOG_NOTICE, "message %"PRId64" response state no channel", message.id);
-                break;
-            default:
-                syslog(LOG_NOTICE, "message %"PRId64" response state unknown error", message.id);
-                break;
-            }
-
-            /* Update message status */
-            lamb_update_message(db, submit.id, status);
-            free(buf);
+        switch (status) {
+        case 1:
+            syslog(LOG_NOTICE, "message %"PRId64" response state successfull", message.id);
+            break;
+        case 2:
+            syslog(LOG_NOTICE, "message %"PRId64" response state no channel", message.id);
+            break;
+        default:
+            syslog(LOG_NOTICE, "message %"PRId64" response state unknown error", message.id);
+            break;
         }
-        free(pk);
+
+        /* Update message status */
+        lamb_update_message(db, submit.id, status);
     }
 
     return;
@@ -195,28 +179,15 @@ int lamb_fetch_message(lamb_db_t *db, int *channel, lamb_submit_t *message) {
     return 0;
 }
 
-int lamb_check_response(int sock) {
-    int rc;
-    char *buf;
+int lamb_check_response(int method) {
     int stat = -1;
 
-    rc = nn_recv(sock, &buf, NN_MSG, 0);
-    if (rc < HEAD) {
-        if (rc > 0) {
-            nn_freemsg(buf);
-        }
-
-        return stat;
-    }
-
-    if (CHECK_COMMAND(buf) == LAMB_OK) {
+    if (method == LAMB_OK) {
         stat = 1;
-    } else if (CHECK_COMMAND(buf) == LAMB_NOROUTE) {
+    } else if (method == LAMB_NOROUTE) {
         stat = 2;
     }
 
-    nn_freemsg(buf);
-
     return stat;
 }
 
@@ -235,33 +206,6 @@ int lamb_update_message(lamb_db_t *db, unsigned long long id, int status) {
     return 0;
 }
 
-int lamb_nn_testsched(const char *host, int id, int timeout) {
-    int fd;
-    int err;
-    Response *resp;
-    Request req = REQUEST__INIT;
-
-    req.id = id;
-    req.type = LAMB_TEST;
-    req.addr = "0.0.0.0";
-
-    resp = lamb_nn_request(host, &req, timeout);
-
-    if (!resp) {
-        return -1;
-    }
-
-    err = lamb_nn_connect(&fd, resp->host, NN_PAIR, timeout);
-
-    response__free_unpacked(resp, NULL);
-
-    if (err) {
-        return -1;
-    }
-
-    return fd;
-}
-
 int lamb_component_initialization(lamb_config_t *cfg) {
     int err;
 
@@ -288,7 +232,7 @@ int lamb_component_initialization(lamb_config_t *cfg) {
     lamb_debug("connect to postgresql %s successfull\n", cfg->db_host);
     
     /* Connect to Scheduler server */
-    scheduler = lamb_nn_testsched(cfg->scheduler, cfg->id, cfg->timeout);
+    scheduler = lamb_mux_connect(cfg->scheduler, cfg->timeout);
 
     if (scheduler < 0) {
         syslog(LOG_ERR, "can't connect to scheduler %s", cfg->scheduler);
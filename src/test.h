@@ -27,9 +27,8 @@ typedef struct {
 
 void lamb_event_loop(void);
 int lamb_fetch_message(lamb_db_t *db, int *channel, lamb_submit_t *message);
-int lamb_check_response(int sock);
+int lamb_check_response(int method);
 int lamb_update_message(lamb_db_t *db, unsigned long long id, int status);
-int lamb_nn_testsched(const char *host, int id, int timeout);
 int lamb_component_initialization(lamb_config_t *cfg);
 int lamb_read_config(lamb_config_t *conf, const char *file);
 
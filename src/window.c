@@ -0,0 +1,189 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "common.h"
+#include "window.h"
+
+/* Allocate a window of size slots, each holding a len bytes copy */
+lamb_window_t *lamb_window_new(int size, size_t len) {
+    char *data;
+    lamb_window_t *self;
+
+    if (size < 1) {
+        return NULL;
+    }
+
+    self = (lamb_window_t *)calloc(1, sizeof(lamb_window_t));
+    if (!self) {
+        return NULL;
+    }
+
+    self->slots = (lamb_slot_t *)calloc(size, sizeof(lamb_slot_t));
+    data = (char *)calloc(size, len);
+
+    if (!self->slots || !data) {
+        free(self->slots);
+        free(data);
+        free(self);
+        return NULL;
+    }
+
+    for (int i = 0; i < size; i++) {
+        self->slots[i].val = data + (i * len);
+    }
+
+    self->size = size;
+    self->count = 0;
+    self->len = len;
+    pthread_cond_init(&self->cond, NULL);
+    pthread_mutex_init(&self->lock, NULL);
+
+    return self;
+}
+
+/* Wait until a free slot is available, ETIMEDOUT on timeout */
+int lamb_window_wait(lamb_window_t *window, long milliseconds) {
+    int err = 0;
+    struct timeval now;
+    struct timespec timeout;
+
+    gettimeofday(&now, NULL);
+    timeout.tv_sec = now.tv_sec + (milliseconds / 1000);
+    timeout.tv_nsec = (now.tv_usec * 1000) + (milliseconds % 1000) * 1000 * 1000;
+    timeout.tv_sec += timeout.tv_nsec / (1000 * 1000 * 1000);
+    timeout.tv_nsec %= 1000 * 1000 * 1000;
+
+    pthread_mutex_lock(&window->lock);
+
+    while (window->count >= window->size && err == 0) {
+        err = pthread_cond_timedwait(&window->cond, &window->lock, &timeout);
+    }
+
+    if (window->count < window->size) {
+        err = 0;
+    }
+
+    pthread_mutex_unlock(&window->lock);
+
+    return err;
+}
+
+/* Store a copy of val under sequenceId, -1 when the window is full */
+int lamb_window_push(lamb_window_t *window, unsigned int sequenceId, void *val) {
+    int err = -1;
+    lamb_slot_t *slot;
+
+    pthread_mutex_lock(&window->lock);
+
+    for (int i = 0; i < window->size; i++) {
+        slot = &window->slots[i];
+        if (!slot->used) {
+            slot->used = true;
+            slot->retry = 0;
+            slot->sequenceId = sequenceId;
+            slot->timestamp = lamb_now_microsecond();
+            memcpy(slot->val, val, window->len);
+            window->count++;
+            err = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&window->lock);
+
+    return err;
+}
+
+/* Release the slot matching sequenceId, copying its data to val */
+int lamb_window_remove(lamb_window_t *window, unsigned int sequenceId, void *val) {
+    int err = -1;
+    lamb_slot_t *slot;
+
+    pthread_mutex_lock(&window->lock);
+
+    for (int i = 0; i < window->size; i++) {
+        slot = &window->slots[i];
+        if (slot->used && slot->sequenceId == sequenceId) {
+            if (val) {
+                memcpy(val, slot->val, window->len);
+            }
+            slot->used = false;
+            window->count--;
+            pthread_cond_signal(&window->cond);
+            err = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&window->lock);
+
+    return err;
+}
+
+/*
+ * Find one entry older than milliseconds. An entry that has already
+ * been retried retry times is released and LAMB_WINDOW_DROP returned,
+ * otherwise its timer is restarted and LAMB_WINDOW_RETRY returned so
+ * that the caller can retransmit it. In both cases the entry data is
+ * copied to val. LAMB_WINDOW_NONE when nothing has expired.
+ */
+
+int lamb_window_expired(lamb_window_t *window, long milliseconds, int retry,
+                        unsigned int *sequenceId, void *val) {
+    int action;
+    lamb_slot_t *slot;
+    unsigned long long now;
+
+    action = LAMB_WINDOW_NONE;
+    now = lamb_now_microsecond();
+
+    pthread_mutex_lock(&window->lock);
+
+    for (int i = 0; i < window->size; i++) {
+        slot = &window->slots[i];
+        if (!slot->used || (now - slot->timestamp) < (milliseconds * 1000ULL)) {
+            continue;
+        }
+
+        *sequenceId = slot->sequenceId;
+        memcpy(val, slot->val, window->len);
+
+        if (slot->retry < retry) {
+            slot->retry++;
+            slot->timestamp = now;
+            action = LAMB_WINDOW_RETRY;
+        } else {
+            slot->used = false;
+            window->count--;
+            pthread_cond_signal(&window->cond);
+            action = LAMB_WINDOW_DROP;
+        }
+
+        break;
+    }
+
+    pthread_mutex_unlock(&window->lock);
+
+    return action;
+}
+
+void lamb_window_destroy(lamb_window_t *window) {
+    if (window) {
+        if (window->slots) {
+            free(window->slots[0].val);
+            free(window->slots);
+        }
+        pthread_cond_destroy(&window->cond);
+        pthread_mutex_destroy(&window->lock);
+        free(window);
+    }
+
+    return;
+}
@@ -0,0 +1,40 @@
+/* 
+ * Lamb Gateway Platform
+ * Copyright (C) 2017 typefo <typefo@qq.com>
+ */
+
+#ifndef _LAMB_WINDOW_H
+#define _LAMB_WINDOW_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#define LAMB_WINDOW_NONE  0
+#define LAMB_WINDOW_RETRY 1
+#define LAMB_WINDOW_DROP  2
+
+typedef struct {
+    bool used;
+    int retry;
+    unsigned int sequenceId;
+    unsigned long long timestamp;
+    void *val;
+} lamb_slot_t;
+
+typedef struct {
+    int size;
+    int count;
+    size_t len;
+    lamb_slot_t *slots;
+    pthread_cond_t cond;
+    pthread_mutex_t lock;
+} lamb_window_t;
+
+lamb_window_t *lamb_window_new(int size, size_t len);
+int lamb_window_wait(lamb_window_t *window, long milliseconds);
+int lamb_window_push(lamb_window_t *window, unsigned int sequenceId, void *val);
+int lamb_window_remove(lamb_window_t *window, unsigned int sequenceId, void *val);
+int lamb_window_expired(lamb_window_t *window, long milliseconds, int retry, unsigned int *sequenceId, void *val);
+void lamb_window_destroy(lamb_window_t *window);
+
+#endif